@@ -0,0 +1,124 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * arena.c
+ *     - Bump allocator for everything belonging to one loaded configuration.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include "arena.h"
+#include "main.h"
+#include "log.h"
+
+//Returns the new (empty) arena, or NULL on error.
+struct arena *arena_create(int generation)
+	{
+	struct arena *arena;
+	
+	if((arena = (struct arena *)calloc(1, sizeof(struct arena))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return NULL;
+		}
+	arena->generation = generation;
+	return arena;
+	}
+
+void arena_destroy(struct arena *arena)
+	{
+	struct arena_block *block, *next;
+	
+	if(arena == NULL)
+		return;
+	for(block = arena->blocks; block != NULL; block = next)
+		{
+		next = block->next;
+		free(block);
+		}
+	free(arena);
+	}
+
+//Hands out size bytes, aligned to alignment. (Which must be a power of two, no bigger than ARENA_ALIGNMENT.)
+//Returns a pointer to the bytes, or NULL on error.
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment)
+	{
+	struct arena_block *block = arena->blocks;
+	size_t offset;
+	
+	if(block != NULL)
+		{
+		offset = (block->used + alignment - 1) & ~(alignment - 1);
+		if(offset + size <= block->size)
+			{
+			arena->used = arena->used + (offset + size - block->used);
+			block->used = offset + size;
+			return block->data + offset;
+			}
+		}
+	
+	//Big requests get a block of their own, which goes behind the current one so that its free space isn't wasted.
+	if((block = (struct arena_block *)malloc(sizeof(struct arena_block) + (size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return NULL;
+		}
+	block->size = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+	block->used = size;
+	if(size > ARENA_BLOCK_SIZE / 4 && arena->blocks != NULL)
+		{
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+		}
+	else
+		{
+		block->next = arena->blocks;
+		arena->blocks = block;
+		}
+	arena->block_count++;
+	arena->allocated = arena->allocated + block->size;
+	arena->used = arena->used + size;
+	return block->data;
+	}
+
+//Returns a copy of string which lives as long as the arena, or NULL on error.
+char *arena_strdup(struct arena *arena, const char *string)
+	{
+	char *copy;
+	size_t len = strlen(string) + 1;
+	
+	if((copy = (char *)arena_alloc(arena, len, 1)) == NULL)
+		return NULL;
+	memcpy(copy, string, len);
+	return copy;
+	}
+
+//Copies the first count pointers of list into the arena, with a NULL on the end. (The strings themselves aren't copied.)
+//Returns the copy, or NULL on error.
+char **arena_list(struct arena *arena, char **list, int count)
+	{
+	char **copy;
+	
+	if((copy = (char **)arena_alloc(arena, (count + 1) * sizeof(char *), ARENA_ALIGNMENT)) == NULL)
+		return NULL;
+	if(count > 0)
+		memcpy(copy, list, count * sizeof(char *));
+	copy[count] = NULL;
+	return copy;
+	}
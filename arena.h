@@ -0,0 +1,59 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * arena.h
+ *     - Bump allocator for everything belonging to one loaded configuration.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGNMENT sizeof(void *) //Good enough for pointer arrays, which are all we put in here besides strings.
+
+//Everything in a configuration generation (argument strings, environment strings, and the arrays pointing at them) is
+//carved out of big blocks one after the other, and never freed on its own. The whole generation goes in one arena_destroy().
+struct arena_block
+	{
+	struct arena_block *next;
+	size_t size, used;
+	char data[];
+	};
+
+struct arena
+	{
+	struct arena_block *blocks; //Allocations come from the first block. The rest are full (or were allocated for one big request).
+	int generation;
+	int block_count;
+	size_t used; //Bytes handed out, including alignment padding.
+	size_t allocated; //Bytes in all blocks.
+	};
+
+struct arena *arena_create(int generation);
+void arena_destroy(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size, size_t alignment);
+char *arena_strdup(struct arena *arena, const char *string);
+char **arena_list(struct arena *arena, char **list, int count);
+
+#define __SSHTUNNELS_ARENA_H
+#endif
@@ -0,0 +1,122 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * backoff.c
+ *     - Relaunch backoff policies.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <math.h>
+
+#include "backoff.h"
+#include "main.h"
+
+void backoff_options_default(struct backoff_options *options)
+	{
+	options->policy = BACKOFF_POLICY_DEFAULT;
+	options->min = (int64_t)BACKOFF_MIN_DEFAULT * 1000;
+	options->max = (int64_t)BACKOFF_MAX_DEFAULT * 1000;
+	options->decay = (int64_t)BACKOFF_DECAY_DEFAULT * 1000;
+	}
+
+//Parses a BackoffPolicy setting. Returns one of the BACKOFF_* policies, or -1 if it isn't recognized.
+int backoff_policy(const char *policy)
+	{
+	if(strcasecmp(policy, "exponential") == 0)
+		return BACKOFF_EXPONENTIAL;
+	if(strcasecmp(policy, "damping") == 0)
+		return BACKOFF_DAMPING;
+	if(strcasecmp(policy, "fixed") == 0)
+		return BACKOFF_FIXED;
+	return -1;
+	}
+
+//Forgets every earlier failure.
+void backoff_reset(struct backoff *b, struct backoff_options *options)
+	{
+	b->delay = options->min;
+	b->penalty = 0;
+	b->penalty_updated = 0;
+	b->suppressed = FALSE;
+	}
+
+//The process has stayed up for options->decay milliseconds. The damping penalty takes care of itself, but the other policies start over.
+void backoff_stable(struct backoff *b, struct backoff_options *options)
+	{
+	if(options->policy != BACKOFF_DAMPING)
+		backoff_reset(b, options);
+	}
+
+//Records a failure and returns how many milliseconds to wait before relaunching.
+int64_t backoff_failure(struct backoff *b, struct backoff_options *options, int64_t now)
+	{
+	double upper, ceiling, wait;
+	int64_t delay;
+	
+	switch(options->policy)
+		{
+		case BACKOFF_EXPONENTIAL:
+			//Tunnels which fail together draw different delays, so they don't all come back together.
+			upper = (double)b->delay * 3.0;
+			if(upper > (double)options->max)
+				upper = (double)options->max;
+			delay = options->min + (int64_t)(((double)rand() / ((double)RAND_MAX + 1.0)) * (upper - (double)options->min));
+			if(delay < options->min)
+				delay = options->min;
+			b->delay = delay;
+			return delay;
+		
+		case BACKOFF_DAMPING:
+			//Don't let the penalty get so high that it would take much longer than options->max to decay back under the reuse threshold.
+			//It does have to be able to pass the suppress threshold though, even when options->max is short compared to options->decay.
+			b->penalty = backoff_penalty(b, options, now);
+			if(b->penalty < BACKOFF_REUSE)
+				b->suppressed = FALSE;
+			b->penalty = b->penalty + BACKOFF_PENALTY;
+			b->penalty_updated = now;
+			ceiling = BACKOFF_REUSE * pow(2.0, (double)options->max / (double)options->decay);
+			if(ceiling < BACKOFF_SUPPRESS + BACKOFF_PENALTY)
+				ceiling = BACKOFF_SUPPRESS + BACKOFF_PENALTY;
+			if(b->penalty > ceiling)
+				b->penalty = ceiling;
+			if(b->penalty > BACKOFF_SUPPRESS)
+				b->suppressed = TRUE;
+			if(!b->suppressed)
+				return options->min;
+			
+			//Wait for the penalty to decay under the reuse threshold.
+			wait = (double)options->decay * log2(b->penalty / BACKOFF_REUSE);
+			if(wait < (double)options->min)
+				return options->min;
+			if(wait > (double)options->max)
+				return options->max;
+			return (int64_t)wait;
+		
+		default:
+			return options->min;
+		}
+	}
+
+//The damping penalty as of "now", after decaying with a half-life of options->decay.
+double backoff_penalty(struct backoff *b, struct backoff_options *options, int64_t now)
+	{
+	if(b->penalty <= 0 || options->decay <= 0)
+		return 0;
+	return b->penalty * pow(0.5, (double)(now - b->penalty_updated) / (double)options->decay);
+	}
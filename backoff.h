@@ -0,0 +1,71 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * backoff.h
+ *     - Relaunch backoff policies.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_BACKOFF_H
+
+#include <stdint.h>
+
+//Ways of deciding how long to wait before relaunching a tunnel which went down.
+enum
+	{
+	BACKOFF_EXPONENTIAL = 1, //Decorrelated jitter: each delay is random, between the minimum and three times the last delay.
+	BACKOFF_DAMPING, //Flap damping: each failure adds to a penalty which decays over time. Past a threshold, relaunches are held back until it decays.
+	BACKOFF_FIXED //Always wait the minimum.
+	};
+
+#define BACKOFF_POLICY_DEFAULT BACKOFF_EXPONENTIAL
+#define BACKOFF_MIN_DEFAULT 2 //Seconds.
+#define BACKOFF_MAX_DEFAULT 256 //Seconds.
+#define BACKOFF_DECAY_DEFAULT 300 //Seconds. How long a process has to stay up to be forgiven, or for damping, the penalty's half-life.
+#define BACKOFF_SECONDS_MAXIMUM 86400 //Largest BackoffMin, BackoffMax or BackoffDecay we accept.
+
+//Flap damping thresholds, in the style of BGP route flap damping.
+#define BACKOFF_PENALTY 1000.0 //Added for each failure.
+#define BACKOFF_SUPPRESS 2000.0 //Relaunches are held back once the penalty goes over this...
+#define BACKOFF_REUSE 750.0 //...until it decays back under this.
+
+struct backoff_options
+	{
+	int policy;
+	int64_t min, max, decay; //Milliseconds.
+	};
+
+struct backoff
+	{
+	int64_t delay; //The last delay. (Exponential.)
+	double penalty; //(Damping.)
+	int64_t penalty_updated; //Milliseconds. (Monotonic clock.)
+	int suppressed;
+	};
+
+void backoff_options_default(struct backoff_options *options);
+int backoff_policy(const char *policy);
+void backoff_reset(struct backoff *b, struct backoff_options *options);
+void backoff_stable(struct backoff *b, struct backoff_options *options);
+int64_t backoff_failure(struct backoff *b, struct backoff_options *options, int64_t now);
+double backoff_penalty(struct backoff *b, struct backoff_options *options, int64_t now);
+
+#define __SSHTUNNELS_BACKOFF_H
+#endif
@@ -0,0 +1,183 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * backoff.c
+ *     - Simulates the reconnect load each backoff policy produces when many tunnels fail together.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backoff.h"
+#include "main.h"
+
+//Usage: backoff [tunnels] [outage seconds] [flap uptime seconds]
+//No processes are run. The clock is simulated, and each policy's delays come straight from backoff_failure().
+//Correlated failure: every tunnel goes down at the same moment, and every launch attempt fails for the length of the outage. After
+//that, every attempt succeeds. We count the launches, the most launches in any one second, and how long after the outage ended
+//the last tunnel came back up.
+//Flapping: one tunnel fails after every so many seconds of uptime, for an hour. We count its launches.
+
+#define BACKOFF_BENCH_TUNNELS_DEFAULT 200
+#define BACKOFF_BENCH_OUTAGE_DEFAULT 120 //Seconds.
+#define BACKOFF_BENCH_FLAP_DEFAULT 60 //Seconds.
+#define BACKOFF_BENCH_ATTEMPT 1000 //Milliseconds a failing launch attempt takes to give up. (About an SSH connection timing out.)
+#define BACKOFF_BENCH_HORIZON 3600 //Seconds after the outage ends that we give every tunnel to come back up, and how long we watch flapping.
+#define BACKOFF_BENCH_NEVER INT64_MAX
+
+int backoff_bench_policies[] = { BACKOFF_EXPONENTIAL, BACKOFF_DAMPING, BACKOFF_FIXED, -1 };
+const char *backoff_bench_names[] = { "exponential", "damping", "fixed" };
+
+void backoff_bench_outage(int policy, int tunnels, int64_t outage, long *launches, int *peak, int64_t *recovered);
+long backoff_bench_flap(int policy, int64_t uptime);
+
+int main(int argc, char **argv)
+	{
+	int tunnels = BACKOFF_BENCH_TUNNELS_DEFAULT, outage = BACKOFF_BENCH_OUTAGE_DEFAULT, flap = BACKOFF_BENCH_FLAP_DEFAULT, i, peak;
+	int64_t recovered;
+	long launches;
+	
+	if(argc > 1)
+		tunnels = atoi(argv[1]);
+	if(argc > 2)
+		outage = atoi(argv[2]);
+	if(argc > 3)
+		flap = atoi(argv[3]);
+	if(tunnels < 1 || outage < 0 || flap < 1)
+		{
+		fprintf(stderr, "Usage: %s [tunnels] [outage seconds] [flap uptime seconds]\n", argv[0]);
+		return 1;
+		}
+	
+	printf("%d tunnels fail together, and every launch fails for %d seconds. (Default BackoffMin, BackoffMax and BackoffDecay.)\n", tunnels, outage);
+	for(i = 0; backoff_bench_policies[i] >= 0; i++)
+		{
+		//The same random delays every run, so runs can be compared.
+		srand(1);
+		backoff_bench_outage(backoff_bench_policies[i], tunnels, (int64_t)outage * 1000, &launches, &peak, &recovered);
+		if(recovered == BACKOFF_BENCH_NEVER)
+			printf("  %-12s %6ld launches, peak %4d/s, not all up within %d s of recovery\n", backoff_bench_names[i], launches, peak, BACKOFF_BENCH_HORIZON);
+		else
+			printf("  %-12s %6ld launches, peak %4d/s, all up %4.0f s after recovery\n", backoff_bench_names[i], launches, peak, (double)recovered / 1000.0);
+		}
+	
+	printf("One tunnel fails after every %d seconds of uptime.\n", flap);
+	for(i = 0; backoff_bench_policies[i] >= 0; i++)
+		{
+		srand(1);
+		printf("  %-12s %6ld launches per hour\n", backoff_bench_names[i], backoff_bench_flap(backoff_bench_policies[i], (int64_t)flap * 1000));
+		}
+	return 0;
+	}
+
+//Every time is in milliseconds since the tunnels went down. recovered is how long after the outage the last tunnel came back up, or
+//BACKOFF_BENCH_NEVER.
+void backoff_bench_outage(int policy, int tunnels, int64_t outage, long *launches, int *peak, int64_t *recovered)
+	{
+	struct backoff_options options;
+	struct backoff *backoffs;
+	int64_t *next, now, last_up = 0;
+	int *per_second, seconds = (int)(outage / 1000) + BACKOFF_BENCH_HORIZON + 1, i, up = 0;
+	
+	*launches = 0;
+	*peak = 0;
+	*recovered = BACKOFF_BENCH_NEVER;
+	backoff_options_default(&options);
+	options.policy = policy;
+	backoffs = (struct backoff *)calloc(tunnels, sizeof(struct backoff));
+	next = (int64_t *)calloc(tunnels, sizeof(int64_t));
+	per_second = (int *)calloc(seconds, sizeof(int));
+	if(backoffs == NULL || next == NULL || per_second == NULL)
+		{
+		free(backoffs);
+		free(next);
+		free(per_second);
+		return;
+		}
+	
+	//Everything goes down at once.
+	for(i = 0; i < tunnels; i++)
+		{
+		backoff_reset(&backoffs[i], &options);
+		next[i] = backoff_failure(&backoffs[i], &options, 0);
+		}
+	
+	while(up < tunnels)
+		{
+		//The next tunnel due to launch. A plain search is plenty for a few hundred tunnels.
+		for(i = 1, now = next[0]; i < tunnels; i++)
+			{
+			if(next[i] < now)
+				now = next[i];
+			}
+		if(now / 1000 >= seconds)
+			break;
+		for(i = 0; i < tunnels; i++)
+			{
+			if(next[i] != now)
+				continue;
+			(*launches)++;
+			per_second[now / 1000]++;
+			if(now >= outage)
+				{
+				next[i] = BACKOFF_BENCH_NEVER;
+				last_up = now;
+				up++;
+				continue;
+				}
+			next[i] = now + BACKOFF_BENCH_ATTEMPT + backoff_failure(&backoffs[i], &options, now + BACKOFF_BENCH_ATTEMPT);
+			}
+		}
+	
+	for(i = 0; i < seconds; i++)
+		{
+		if(per_second[i] > *peak)
+			*peak = per_second[i];
+		}
+	if(up == tunnels)
+		*recovered = last_up - outage;
+	free(backoffs);
+	free(next);
+	free(per_second);
+	}
+
+//Returns the number of launches in BACKOFF_BENCH_HORIZON seconds.
+long backoff_bench_flap(int policy, int64_t uptime)
+	{
+	struct backoff_options options;
+	struct backoff b;
+	int64_t now = 0;
+	long launches = 0;
+	
+	backoff_options_default(&options);
+	options.policy = policy;
+	backoff_reset(&b, &options);
+	while(now < (int64_t)BACKOFF_BENCH_HORIZON * 1000)
+		{
+		launches++;
+		now = now + uptime;
+		if(uptime >= options.decay)
+			backoff_stable(&b, &options);
+		now = now + backoff_failure(&b, &options, now);
+		}
+	return launches;
+	}
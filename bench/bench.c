@@ -0,0 +1,172 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * bench.c
+ *     - Shared helpers for the benchmark programs.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "main.h"
+#include "util.h"
+
+//Returns the monotonic clock in nanoseconds. It's the same clock in every process, so a child can stamp a line with it and we can
+//work out how long the line took to get back to us.
+int64_t bench_now_ns(void)
+	{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+void bench_alarm_handler(int signum)
+	{
+	//Nothing to do. Arriving is enough to interrupt fgets().
+	}
+
+//Writes config into a new scratch directory and starts binary there, so it finds SSHTunnels_config.xml in its working directory.
+//Returns TRUE on success or FALSE on error.
+int bench_daemon_start(struct bench_daemon *daemon, const char *binary, const char *config)
+	{
+	char binary_path[BENCH_PATH_SIZE];
+	struct sigaction sigact;
+	int log_pipe[2];
+	FILE *out;
+	
+	daemon->pid = -1;
+	daemon->log = NULL;
+	if(realpath(binary, binary_path) == NULL)
+		{
+		fprintf(stderr, "Can't find %s! (%s)\n", binary, strerror(errno));
+		return FALSE;
+		}
+	strcpy(daemon->dir, BENCH_DIR_TEMPLATE);
+	if(mkdtemp(daemon->dir) == NULL)
+		{
+		fprintf(stderr, "mkdtemp() failed! (%s)\n", strerror(errno));
+		return FALSE;
+		}
+	snprintf(daemon->config, sizeof(daemon->config), "%s/" CONFIG_FILENAME, daemon->dir);
+	if((out = fopen(daemon->config, "w")) == NULL || fputs(config, out) == EOF || fclose(out) != 0)
+		{
+		fprintf(stderr, "Couldn't write %s! (%s)\n", daemon->config, strerror(errno));
+		return FALSE;
+		}
+	
+	//A timeout on reading the log is an alarm which interrupts fgets(), so SA_RESTART must be off.
+	sigact.sa_handler = bench_alarm_handler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGALRM, &sigact, NULL);
+	
+	if(pipe(log_pipe) < 0)
+		{
+		fprintf(stderr, "pipe() failed! (%s)\n", strerror(errno));
+		return FALSE;
+		}
+	if((daemon->pid = fork()) < 0)
+		{
+		fprintf(stderr, "fork() failed! (%s)\n", strerror(errno));
+		return FALSE;
+		}
+	if(daemon->pid == 0)
+		{
+		close(log_pipe[PIPE_READ]);
+		dup2(log_pipe[PIPE_WRITE], STDERR_FILENO);
+		close(log_pipe[PIPE_WRITE]);
+		if(chdir(daemon->dir) < 0)
+			_exit(1);
+		execl(binary_path, binary_path, (char *)NULL);
+		_exit(1);
+		}
+	close(log_pipe[PIPE_WRITE]);
+	if((daemon->log = fdopen(log_pipe[PIPE_READ], "r")) == NULL)
+		return FALSE;
+	return TRUE;
+	}
+
+//Reads the next line SSHTunnels logs, waiting at most timeout seconds.
+//Returns the line, or NULL at end of file or on timeout.
+char *bench_daemon_line(struct bench_daemon *daemon, char *line, int line_size, int timeout)
+	{
+	char *ret;
+	
+	alarm(timeout);
+	ret = fgets(line, line_size, daemon->log);
+	alarm(0);
+	return ret;
+	}
+
+//Asks SSHTunnels to shut down. Its last log lines can still be read until bench_daemon_line() returns NULL.
+//Returns TRUE on success or FALSE on error.
+int bench_daemon_stop(struct bench_daemon *daemon)
+	{
+	if(daemon->pid > 0 && kill(daemon->pid, SIGINT) < 0)
+		{
+		fprintf(stderr, "kill() failed! (%s)\n", strerror(errno));
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Waits for SSHTunnels to exit, and removes the scratch directory. Anything else the benchmark put in there must be gone already.
+//Returns TRUE if SSHTunnels exited cleanly, or FALSE otherwise.
+int bench_daemon_finish(struct bench_daemon *daemon)
+	{
+	int status = 0;
+	
+	if(daemon->log != NULL)
+		fclose(daemon->log);
+	daemon->log = NULL;
+	if(daemon->pid > 0)
+		waitpid(daemon->pid, &status, 0);
+	daemon->pid = -1;
+	unlink(daemon->config);
+	rmdir(daemon->dir);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	}
+
+int bench_compare_double(const void *a, const void *b)
+	{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+	}
+
+//Prints the spread of a set of measurements. The samples are sorted in place.
+void bench_report(const char *name, double *samples, int count, const char *unit)
+	{
+	if(count == 0)
+		{
+		printf("%-24s no samples\n", name);
+		return;
+		}
+	qsort(samples, count, sizeof(double), bench_compare_double);
+	printf("%-24s n=%-6d p50 %9.2f %s   p90 %9.2f %s   p99 %9.2f %s   max %9.2f %s\n", name, count,
+		samples[count / 2], unit, samples[(count * 9) / 10], unit, samples[(count * 99) / 100], unit, samples[count - 1], unit);
+	}
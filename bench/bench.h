@@ -0,0 +1,56 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * bench.h
+ *     - Shared helpers for the benchmark programs.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BENCH_DIR_TEMPLATE "/tmp/sshtunnels-bench-XXXXXX"
+#define BENCH_DIR_SIZE 64 //Plenty for BENCH_DIR_TEMPLATE.
+#define BENCH_PATH_SIZE 4096
+#define BENCH_CONFIG_SIZE 65536
+#define BENCH_LINE_SIZE 4096
+
+//An SSHTunnels process started by a benchmark, in a scratch directory holding its configuration.
+struct bench_daemon
+	{
+	pid_t pid;
+	FILE *log; //SSHTunnels' STDERR, where it logs to.
+	char dir[BENCH_DIR_SIZE], config[BENCH_PATH_SIZE];
+	};
+
+int64_t bench_now_ns(void);
+int bench_daemon_start(struct bench_daemon *daemon, const char *binary, const char *config);
+char *bench_daemon_line(struct bench_daemon *daemon, char *line, int line_size, int timeout);
+int bench_daemon_stop(struct bench_daemon *daemon);
+int bench_daemon_finish(struct bench_daemon *daemon);
+void bench_alarm_handler(int signum);
+void bench_report(const char *name, double *samples, int count, const char *unit);
+int bench_compare_double(const void *a, const void *b);
+
+#define __SSHTUNNELS_BENCH_H
+#endif
@@ -0,0 +1,174 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * log.c
+ *     - Measures how many lines per second stl() can log, with and without the async writer.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "log.h"
+#include "main.h"
+
+//Usage: log [lines] [log file | slow]
+//Logs the lines as fast as possible to the file (a scratch file by default, deleted afterwards), first synchronously and then
+//through the async writer. Prints lines per second as the caller sees them, how long each stl() call took, and how many lines
+//made it into the file. "slow" logs into a pipe instead, which a child process reads at LOG_BENCH_SLOW_RATE, like a stalled disk.
+
+#define LOG_BENCH_LINES_DEFAULT 200000
+#define LOG_BENCH_FILE_TEMPLATE "/tmp/sshtunnels-bench-log-XXXXXX"
+#define LOG_BENCH_SLOW_READ 4096 //The slow reader takes this many bytes...
+#define LOG_BENCH_SLOW_INTERVAL 10 //...every this many milliseconds.
+
+int log_bench_run(const char *path, int lines, int async, double *samples);
+FILE *log_bench_slow(pid_t *reader);
+long log_bench_count(const char *path);
+
+int main(int argc, char **argv)
+	{
+	char path[BENCH_PATH_SIZE];
+	int lines = LOG_BENCH_LINES_DEFAULT, fd = -1;
+	double *samples;
+	
+	if(argc > 1)
+		lines = atoi(argv[1]);
+	if(lines < 1)
+		{
+		fprintf(stderr, "Usage: %s [lines] [log file]\n", argv[0]);
+		return 1;
+		}
+	if(argc > 2)
+		snprintf(path, sizeof(path), "%s", argv[2]);
+	else
+		{
+		strcpy(path, LOG_BENCH_FILE_TEMPLATE);
+		if((fd = mkstemp(path)) < 0)
+			return 1;
+		close(fd);
+		}
+	if((samples = (double *)calloc(lines, sizeof(double))) == NULL)
+		return 1;
+	
+	stl_loginit("bench");
+	if(!log_bench_run(path, lines, FALSE, samples) || !log_bench_run(path, lines, TRUE, samples))
+		return 1;
+	
+	if(fd >= 0)
+		unlink(path);
+	free(samples);
+	return 0;
+	}
+
+//Logs the lines to the end of the file, and prints the results.
+//Returns TRUE on success or FALSE on error.
+int log_bench_run(const char *path, int lines, int async, double *samples)
+	{
+	FILE *out;
+	pid_t reader = -1;
+	long before, after;
+	int64_t started, call, elapsed, drained;
+	int i;
+	
+	before = log_bench_count(path);
+	if(strcmp(path, "slow") == 0)
+		out = log_bench_slow(&reader);
+	else
+		out = fopen(path, "ab");
+	if(out == NULL)
+		{
+		fprintf(stderr, "Can't open %s!\n", path);
+		return FALSE;
+		}
+	stl_logoutput(FALSE, out);
+	if(async && !stl_logasync(TRUE))
+		return FALSE;
+	
+	started = bench_now_ns();
+	for(i = 0; i < lines; i++)
+		{
+		call = bench_now_ns();
+		stl(STL_INFO, "Tunnel %d: STDERR: debug3: receive packet: type 94, channel %d, window %d bytes left", i % 1000, i % 16, i);
+		samples[i] = (double)(bench_now_ns() - call) / 1000.0;
+		}
+	elapsed = bench_now_ns() - started;
+	
+	//Wait for the writer to catch up, so the line count below is complete.
+	stl_logasync(FALSE);
+	drained = bench_now_ns() - started;
+	stl_logoutput(FALSE, stderr);
+	fclose(out);
+	if(reader > 0)
+		waitpid(reader, NULL, 0);
+	after = log_bench_count(path);
+	
+	printf("%s: %.0f lines/s seen by the caller.", async ? "Async" : "Synchronous", (double)lines / ((double)elapsed / 1e9));
+	if(before >= 0 && after >= 0)
+		printf(" %.0f lines/s written. %ld lines written, %ld dropped.", (double)(after - before) / ((double)drained / 1e9), after - before, lines - (after - before));
+	printf("\n");
+	bench_report(async ? "  stl() call, async" : "  stl() call, sync", samples, lines, "us");
+	return TRUE;
+	}
+
+//Starts a child process which reads from a pipe slowly.
+//Returns the write end of the pipe, or NULL on error.
+FILE *log_bench_slow(pid_t *reader)
+	{
+	char buffer[LOG_BENCH_SLOW_READ];
+	int fds[2];
+	
+	if(pipe(fds) < 0 || (*reader = fork()) < 0)
+		return NULL;
+	if(*reader == 0)
+		{
+		close(fds[1]);
+		while(read(fds[0], buffer, sizeof(buffer)) > 0)
+			usleep(LOG_BENCH_SLOW_INTERVAL * 1000);
+		_exit(0);
+		}
+	close(fds[0]);
+	return fdopen(fds[1], "wb");
+	}
+
+//Returns the number of lines in the file, or -1 if it isn't a regular file. (Like /dev/null.)
+long log_bench_count(const char *path)
+	{
+	char buffer[65536];
+	struct stat st;
+	size_t got, i;
+	long count = 0;
+	FILE *in;
+	
+	if(stat(path, &st) < 0 || !S_ISREG(st.st_mode) || (in = fopen(path, "rb")) == NULL)
+		return -1;
+	while((got = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		{
+		for(i = 0; i < got; i++)
+			count += (buffer[i] == '\n');
+		}
+	fclose(in);
+	return count;
+	}
@@ -0,0 +1,244 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * magic.c
+ *     - Compares magic word matching before and after the Aho-Corasick matcher, on verbose ssh output.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bench.h"
+#include "magic.h"
+#include "log.h"
+#include "main.h"
+
+//Usage: magic [megabytes | log file]
+//Lines come from the log file, or are made up to look like ssh -vvv output. Every line is checked by the nested loops SSHTunnels
+//used to have, and by the compiled matcher, with the two built-in magic words and with ten words.
+
+#define MAGIC_BENCH_MEGABYTES_DEFAULT 8
+#define MAGIC_BENCH_SECONDS 1 //Each run goes over the lines again until at least this long has passed.
+
+struct magic_bench_lines
+	{
+	char *data; //Every line, each null-terminated.
+	char **lines;
+	int count;
+	size_t bytes;
+	};
+
+int magic_bench_generate(struct magic_bench_lines *lines, int megabytes);
+int magic_bench_load(struct magic_bench_lines *lines, const char *path);
+int magic_bench_index(struct magic_bench_lines *lines);
+int magic_bench_old_line(const char *line, char **words);
+void magic_bench_hit(struct magic_word *word, void *data);
+void magic_bench_run(struct magic_bench_lines *lines, struct magic_word *words, int words_len);
+
+//Ten words, including the two built-in ones.
+struct magic_word magic_bench_words[] =
+	{
+	{ "port forwarding failed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "combat check failed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "connection reset by peer", MAGIC_ACTION_LOG, STL_WARNING, 0, 0 },
+	{ "broken pipe", MAGIC_ACTION_LOG, STL_WARNING, 0, 0 },
+	{ "host key verification failed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "permission denied", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "timeout, server", MAGIC_ACTION_COUNT, STL_INFO, 0, 0 },
+	{ "no route to host", MAGIC_ACTION_COUNT, STL_INFO, 0, 0 },
+	{ "remote host identification has changed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "administratively prohibited", MAGIC_ACTION_LOG, STL_WARNING, 0, 0 }
+	};
+
+int main(int argc, char **argv)
+	{
+	struct magic_bench_lines lines;
+	int megabytes = MAGIC_BENCH_MEGABYTES_DEFAULT, ok;
+	
+	stl_loginit("magic");
+	if(argc > 1 && atoi(argv[1]) == 0)
+		ok = magic_bench_load(&lines, argv[1]);
+	else
+		{
+		if(argc > 1)
+			megabytes = atoi(argv[1]);
+		ok = magic_bench_generate(&lines, megabytes);
+		}
+	if(!ok || !magic_bench_index(&lines))
+		return 1;
+	printf("%d lines, %.1f MB, average %.0f bytes per line.\n", lines.count, (double)lines.bytes / 1048576.0, (double)lines.bytes / lines.count);
+	
+	magic_bench_run(&lines, magic_words_default, magic_words_default_len);
+	magic_bench_run(&lines, magic_bench_words, sizeof(magic_bench_words) / sizeof(struct magic_word));
+	
+	free(lines.lines);
+	free(lines.data);
+	return 0;
+	}
+
+//Makes up roughly the given number of megabytes of ssh -vvv output, with the occasional magic word.
+//Returns TRUE on success or FALSE on error.
+int magic_bench_generate(struct magic_bench_lines *lines, int megabytes)
+	{
+	size_t size = (size_t)megabytes * 1048576, pos = 0;
+	int i = 0;
+	
+	if(megabytes < 1 || (lines->data = (char *)malloc(size + BENCH_LINE_SIZE)) == NULL)
+		return FALSE;
+	srand(1);
+	while(pos < size)
+		{
+		switch(rand() % 20)
+			{
+			case 0:
+				//Algorithm lists make for the long lines.
+				pos += sprintf(lines->data + pos, "debug2: KEX algorithms: curve25519-sha256,curve25519-sha256@libssh.org,ecdh-sha2-nistp256,ecdh-sha2-nistp384,ecdh-sha2-nistp521,diffie-hellman-group-exchange-sha256,diffie-hellman-group16-sha512,diffie-hellman-group18-sha512,diffie-hellman-group14-sha256,ext-info-c,kex-strict-c-v00@openssh.com\n");
+				break;
+			case 1:
+				pos += sprintf(lines->data + pos, "debug2: ciphers ctos: chacha20-poly1305@openssh.com,aes128-ctr,aes192-ctr,aes256-ctr,aes128-gcm@openssh.com,aes256-gcm@openssh.com\n");
+				break;
+			case 2:
+				pos += sprintf(lines->data + pos, "debug1: client_input_global_request: rtype keepalive@openssh.com want_reply 1\n");
+				break;
+			case 3:
+				if(i % 5000 == 0)
+					pos += sprintf(lines->data + pos, "Warning: remote port forwarding failed for listen port %d\n", 10000 + i % 1000);
+				else
+					pos += sprintf(lines->data + pos, "debug1: remote forward success for: listen %d, connect localhost:22\n", 10000 + i % 1000);
+				break;
+			default:
+				pos += sprintf(lines->data + pos, "debug3: receive packet: type 94, channel %d, window %d bytes left\n", i % 16, rand() % 2097152);
+				break;
+			}
+		i++;
+		}
+	lines->bytes = pos;
+	lines->data[pos] = '\0';
+	return TRUE;
+	}
+
+//Reads a whole log file.
+//Returns TRUE on success or FALSE on error.
+int magic_bench_load(struct magic_bench_lines *lines, const char *path)
+	{
+	FILE *in;
+	long size;
+	
+	if((in = fopen(path, "rb")) == NULL || fseek(in, 0, SEEK_END) != 0 || (size = ftell(in)) <= 0 || fseek(in, 0, SEEK_SET) != 0)
+		{
+		fprintf(stderr, "Can't read %s!\n", path);
+		return FALSE;
+		}
+	if((lines->data = (char *)malloc(size + 1)) == NULL || fread(lines->data, 1, size, in) != (size_t)size)
+		return FALSE;
+	fclose(in);
+	lines->data[size] = '\0';
+	lines->bytes = size;
+	return TRUE;
+	}
+
+//Splits the data into lines, in place.
+//Returns TRUE on success or FALSE on error.
+int magic_bench_index(struct magic_bench_lines *lines)
+	{
+	char *p, *newline;
+	int len = 0;
+	
+	lines->lines = NULL;
+	lines->count = 0;
+	for(p = lines->data; *p; p = newline + 1)
+		{
+		if((newline = strchr(p, '\n')) == NULL)
+			newline = p + strlen(p) - 1;
+		if(lines->count >= len)
+			{
+			len = len ? len * 2 : 65536;
+			if((lines->lines = (char **)realloc(lines->lines, len * sizeof(char *))) == NULL)
+				return FALSE;
+			}
+		lines->lines[lines->count++] = p;
+		if(*newline == '\n')
+			*newline = '\0';
+		}
+	return lines->count > 0;
+	}
+
+//What tunnel_check_magic_words() used to do. Returns the number of words found.
+int magic_bench_old_line(const char *line, char **words)
+	{
+	int i, j, len, found = 0;
+	
+	for(i = 0; words[i]; i++)
+		{
+		len = strlen(words[i]);
+		for(j = 0; line[j]; j++)
+			{
+			if(strlen(line + j) >= len && strncasecmp(line + j, words[i], len) == 0)
+				found++;
+			}
+		}
+	return found;
+	}
+
+void magic_bench_hit(struct magic_word *word, void *data)
+	{
+	(*(int *)data)++;
+	}
+
+//Times both ways of checking every line for the words, and prints lines per second.
+void magic_bench_run(struct magic_bench_lines *lines, struct magic_word *words, int words_len)
+	{
+	struct magic_matcher *m;
+	char *old_words[sizeof(magic_bench_words) / sizeof(struct magic_word) + 1];
+	int64_t started, elapsed;
+	int i, rounds, old_found = 0, new_found = 0;
+	double old_rate, new_rate;
+	
+	for(i = 0; i < words_len; i++)
+		old_words[i] = words[i].pattern;
+	old_words[words_len] = NULL;
+	if((m = magic_compile(words, words_len, NULL, 0)) == NULL)
+		return;
+	
+	started = bench_now_ns();
+	for(rounds = 0; (elapsed = bench_now_ns() - started) < (int64_t)MAGIC_BENCH_SECONDS * 1000000000; rounds++)
+		{
+		for(i = 0; i < lines->count; i++)
+			old_found += magic_bench_old_line(lines->lines[i], old_words);
+		}
+	old_rate = (double)lines->count * rounds / ((double)elapsed / 1e9);
+	old_found /= rounds;
+	
+	started = bench_now_ns();
+	for(rounds = 0; (elapsed = bench_now_ns() - started) < (int64_t)MAGIC_BENCH_SECONDS * 1000000000; rounds++)
+		{
+		for(i = 0; i < lines->count; i++)
+			magic_scan(m, lines->lines[i], magic_bench_hit, &new_found);
+		}
+	new_rate = (double)lines->count * rounds / ((double)elapsed / 1e9);
+	new_found /= rounds;
+	
+	printf("%2d words: nested loops %10.0f lines/s, compiled matcher %10.0f lines/s (%.1fx). Words found: %d and %d.\n",
+		words_len, old_rate, new_rate, new_rate / old_rate, old_found, new_found);
+	magic_destroy(m);
+	}
@@ -0,0 +1,157 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * reaction.c
+ *     - Measures how long SSHTunnels takes to notice a line of tunnel output, or a tunnel process exiting.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "main.h"
+
+//Usage: reaction [SSHTunnels binary] [cycles] [lines per cycle]
+//The tunnel process is this program again, run as "reaction child <lines> <file>". It writes lines stamped with the monotonic clock
+//to its STDERR at random intervals, then stamps <file> and exits. We read SSHTunnels' log and time how long each line and each exit
+//took to show up in it. Point it at an older SSHTunnels binary to compare. (Only attributes every version understands are used.)
+
+#define REACTION_CYCLES_DEFAULT 3
+#define REACTION_LINES_DEFAULT 20
+#define REACTION_GAP_MIN 100 //Milliseconds between lines, and before exiting.
+#define REACTION_GAP_RANDOM 400
+#define REACTION_TIMEOUT 60 //Seconds we wait for SSHTunnels to log anything, before giving up.
+#define REACTION_LINE_MARK "bench-line "
+#define REACTION_EXIT_FILE "exit-stamp"
+
+int reaction_child(int lines, const char *stamp_path);
+void reaction_gap(void);
+
+int main(int argc, char **argv)
+	{
+	struct bench_daemon daemon;
+	char self[BENCH_PATH_SIZE], stamp_path[BENCH_PATH_SIZE], config[BENCH_CONFIG_SIZE], line[BENCH_LINE_SIZE], *mark;
+	const char *binary = "./SSHTunnels";
+	int cycles = REACTION_CYCLES_DEFAULT, lines = REACTION_LINES_DEFAULT, exits = 0, line_samples_pos = 0, exit_samples_pos = 0;
+	double *line_samples, *exit_samples;
+	int64_t now, stamp;
+	FILE *in;
+	
+	if(argc == 4 && strcmp(argv[1], "child") == 0)
+		return reaction_child(atoi(argv[2]), argv[3]);
+	
+	if(argc > 1)
+		binary = argv[1];
+	if(argc > 2)
+		cycles = atoi(argv[2]);
+	if(argc > 3)
+		lines = atoi(argv[3]);
+	if(cycles < 1 || lines < 1 || realpath(argv[0], self) == NULL)
+		{
+		fprintf(stderr, "Usage: %s [SSHTunnels binary] [cycles] [lines per cycle]\n", argv[0]);
+		return 1;
+		}
+	if((line_samples = (double *)calloc(cycles * lines, sizeof(double))) == NULL || (exit_samples = (double *)calloc(cycles, sizeof(double))) == NULL)
+		return 1;
+	
+	//The stamp file's path depends on the scratch directory, which doesn't exist yet, so the child is told a relative path.
+	//SSHTunnels runs it in its own working directory.
+	snprintf(config, sizeof(config),
+		"<SSHTunnels LogOutput=\"stderr\">\n"
+		"\t<Tunnel UpTokenEnabled=\"false\">\n"
+		"\t\t<ProgramArgument v=\"%s\" />\n"
+		"\t\t<ProgramArgument v=\"child\" />\n"
+		"\t\t<ProgramArgument v=\"%d\" />\n"
+		"\t\t<ProgramArgument v=\"" REACTION_EXIT_FILE "\" />\n"
+		"\t</Tunnel>\n"
+		"</SSHTunnels>\n", self, lines);
+	if(!bench_daemon_start(&daemon, binary, config))
+		return 1;
+	snprintf(stamp_path, sizeof(stamp_path), "%s/" REACTION_EXIT_FILE, daemon.dir);
+	printf("Timing %d lines and %d exits with %s...\n", cycles * lines, cycles, binary);
+	
+	while(exits < cycles && bench_daemon_line(&daemon, line, sizeof(line), REACTION_TIMEOUT) != NULL)
+		{
+		now = bench_now_ns();
+		if((mark = strstr(line, REACTION_LINE_MARK)) != NULL)
+			{
+			stamp = strtoll(mark + strlen(REACTION_LINE_MARK), NULL, 10);
+			if(line_samples_pos < cycles * lines)
+				line_samples[line_samples_pos++] = (double)(now - stamp) / 1000000.0;
+			}
+		else if(strstr(line, "exited with status") != NULL)
+			{
+			exits++;
+			if((in = fopen(stamp_path, "r")) == NULL)
+				continue;
+			if(fscanf(in, "%lld", (long long *)&stamp) == 1)
+				exit_samples[exit_samples_pos++] = (double)(now - stamp) / 1000000.0;
+			fclose(in);
+			unlink(stamp_path);
+			}
+		}
+	if(exits < cycles)
+		fprintf(stderr, "SSHTunnels went quiet for %d seconds. Giving up.\n", REACTION_TIMEOUT);
+	
+	bench_daemon_stop(&daemon);
+	while(bench_daemon_line(&daemon, line, sizeof(line), REACTION_TIMEOUT) != NULL);
+	unlink(stamp_path);
+	bench_daemon_finish(&daemon);
+	
+	bench_report("Line to log", line_samples, line_samples_pos, "ms");
+	bench_report("Exit to log", exit_samples, exit_samples_pos, "ms");
+	free(line_samples);
+	free(exit_samples);
+	return exits < cycles;
+	}
+
+//The stand-in tunnel process.
+int reaction_child(int lines, const char *stamp_path)
+	{
+	char line[64];
+	int i, fd, len;
+	
+	srand((unsigned int)getpid());
+	for(i = 0; i < lines; i++)
+		{
+		reaction_gap();
+		len = snprintf(line, sizeof(line), REACTION_LINE_MARK "%lld\n", (long long)bench_now_ns());
+		if(write(STDERR_FILENO, line, len) != len)
+			return 1;
+		}
+	reaction_gap();
+	
+	//Stamp the file as late as possible, so the measurement covers the exit and nothing else.
+	if((fd = open(stamp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return 1;
+	len = snprintf(line, sizeof(line), "%lld\n", (long long)bench_now_ns());
+	if(write(fd, line, len) != len)
+		return 1;
+	close(fd);
+	return 0;
+	}
+
+void reaction_gap(void)
+	{
+	usleep((REACTION_GAP_MIN + rand() % REACTION_GAP_RANDOM) * 1000);
+	}
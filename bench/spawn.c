@@ -0,0 +1,192 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * spawn.c
+ *     - Compares the cost of launching a tunnel process with fork() and with posix_spawn(), as the number of live tunnels grows.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+//For pipe2().
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+#include "main.h"
+#include "util.h"
+
+//Usage: spawn [launches] [program]
+//For each number of live tunnels, holds that many tunnels' worth of pipes and memory open, then launches the program (/bin/true
+//by default) over and over: once the way SSHTunnels used to, with plain pipes and fork(), and once the way it does now, with
+//close-on-exec pipes and posix_spawn(). Prints how long the launch held up the supervisor, and how long until the child had run
+//and been reaped.
+
+#define SPAWN_BENCH_LAUNCHES_DEFAULT 200
+#define SPAWN_BENCH_TUNNEL_MEMORY 10240 //Bytes standing in for each live tunnel's struct and line buffers.
+
+int spawn_bench_live[] = { 0, 100, 1000, 3000, -1 };
+
+int spawn_bench_hold(int live, int cloexec, int **fds, char **memory);
+void spawn_bench_release(int live, int *fds, char *memory);
+int spawn_bench_launch(char **argv, int cloexec, double *blocked, double *total);
+void spawn_bench_run(int live, int launches, char **argv, int cloexec, double *blocked, double *total);
+extern char **environ;
+
+int main(int argc, char **argv)
+	{
+	char *child_argv[2] = { "/bin/true", NULL };
+	int launches = SPAWN_BENCH_LAUNCHES_DEFAULT, i;
+	double *blocked, *total;
+	
+	if(argc > 1)
+		launches = atoi(argv[1]);
+	if(argc > 2)
+		child_argv[0] = argv[2];
+	if(launches < 1)
+		{
+		fprintf(stderr, "Usage: %s [launches] [program]\n", argv[0]);
+		return 1;
+		}
+	if((blocked = (double *)calloc(launches, sizeof(double))) == NULL || (total = (double *)calloc(launches, sizeof(double))) == NULL)
+		return 1;
+	fd_limit_raise();
+	fd_cloexec_inherited();
+	
+	for(i = 0; spawn_bench_live[i] >= 0; i++)
+		{
+		printf("%d live tunnels:\n", spawn_bench_live[i]);
+		spawn_bench_run(spawn_bench_live[i], launches, child_argv, FALSE, blocked, total);
+		spawn_bench_run(spawn_bench_live[i], launches, child_argv, TRUE, blocked, total);
+		}
+	free(blocked);
+	free(total);
+	return 0;
+	}
+
+void spawn_bench_run(int live, int launches, char **argv, int cloexec, double *blocked, double *total)
+	{
+	int *fds, i;
+	char *memory;
+	
+	if(!spawn_bench_hold(live, cloexec, &fds, &memory))
+		{
+		printf("  Couldn't hold %d tunnels open. (Raise the descriptor limit.)\n", live);
+		return;
+		}
+	for(i = 0; i < launches; i++)
+		{
+		if(!spawn_bench_launch(argv, cloexec, &blocked[i], &total[i]))
+			break;
+		}
+	bench_report(cloexec ? "  posix_spawn() blocked" : "  fork() blocked", blocked, i, "us");
+	bench_report(cloexec ? "  posix_spawn() to reap" : "  fork() to reap", total, i, "us");
+	spawn_bench_release(live, fds, memory);
+	}
+
+//Opens the three pipe ends each live tunnel keeps, and fills in its memory.
+//Returns TRUE on success or FALSE on error.
+int spawn_bench_hold(int live, int cloexec, int **fds, char **memory)
+	{
+	int i, pipes[2];
+	
+	*fds = NULL;
+	if((*memory = (char *)malloc((size_t)live * SPAWN_BENCH_TUNNEL_MEMORY + 1)) == NULL || (*fds = (int *)malloc((live * 3 + 1) * sizeof(int))) == NULL)
+		return FALSE;
+	memset(*memory, 1, (size_t)live * SPAWN_BENCH_TUNNEL_MEMORY + 1);
+	for(i = 0; i < live * 3; i++)
+		{
+		if((cloexec ? pipe_cloexec(pipes) : pipe(pipes)) < 0)
+			{
+			spawn_bench_release(i, *fds, *memory);
+			return FALSE;
+			}
+		close(pipes[PIPE_WRITE]); //The far end belongs to the child.
+		(*fds)[i] = pipes[PIPE_READ];
+		}
+	return TRUE;
+	}
+
+void spawn_bench_release(int count, int *fds, char *memory)
+	{
+	int i;
+	
+	for(i = 0; fds != NULL && i < count; i++)
+		close(fds[i]);
+	free(fds);
+	free(memory);
+	}
+
+//Launches one child with its standard I/O on fresh pipes, and waits for it.
+//Returns TRUE on success or FALSE on error.
+int spawn_bench_launch(char **argv, int cloexec, double *blocked, double *total)
+	{
+	int pipe_stdin[2], pipe_stdout[2], pipe_stderr[2], error;
+	posix_spawn_file_actions_t actions;
+	int64_t started, returned;
+	pid_t pid;
+	
+	started = bench_now_ns();
+	if(!cloexec)
+		{
+		//What tunnel_process_launch() used to do.
+		if(pipe(pipe_stdin) < 0 || pipe(pipe_stdout) < 0 || pipe(pipe_stderr) < 0 || (pid = fork()) < 0)
+			return FALSE;
+		if(pid == 0)
+			{
+			close(pipe_stdin[PIPE_WRITE]);
+			close(pipe_stdout[PIPE_READ]);
+			close(pipe_stderr[PIPE_READ]);
+			dup2(pipe_stdin[PIPE_READ], STDIN_FILENO);
+			dup2(pipe_stdout[PIPE_WRITE], STDOUT_FILENO);
+			dup2(pipe_stderr[PIPE_WRITE], STDERR_FILENO);
+			execve(argv[0], argv, environ);
+			_exit(1);
+			}
+		}
+	else
+		{
+		//What tunnel_process_spawn() does now.
+		if(!stdpipes_create(pipe_stdin, pipe_stdout, pipe_stderr) || posix_spawn_file_actions_init(&actions) != 0)
+			return FALSE;
+		if(!stdpipes_spawn_actions(&actions, pipe_stdin, pipe_stdout, pipe_stderr))
+			return FALSE;
+		error = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+		posix_spawn_file_actions_destroy(&actions);
+		if(error != 0)
+			{
+			fprintf(stderr, "posix_spawn() failed! (%s)\n", strerror(error));
+			return FALSE;
+			}
+		}
+	returned = bench_now_ns();
+	stdpipes_close_far_end_parent(pipe_stdin, pipe_stdout, pipe_stderr);
+	waitpid(pid, NULL, 0);
+	*blocked = (double)(returned - started) / 1000.0;
+	*total = (double)(bench_now_ns() - started) / 1000.0;
+	stdpipes_close_remaining(pipe_stdin, pipe_stdout, pipe_stderr);
+	return TRUE;
+	}
@@ -0,0 +1,270 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * tunnels.c
+ *     - Measures how much CPU and memory SSHTunnels needs to supervise a large number of tunnels, and how quickly their uptokens come back.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "main.h"
+
+//Usage: tunnels [SSHTunnels binary] [tunnels] [seconds] [uptoken interval] [worker threads] [noisy tunnels]
+//Runs SSHTunnels with that many tunnels, each one the UpTokenReceiver next to the SSHTunnels binary (or /bin/cat, which echoes
+//uptokens straight back just the same). Once every tunnel process is running, and has had a few seconds to settle down, we watch the
+//supervisor for the given number of seconds and print the CPU time it used and how much memory it holds. At shutdown, each tunnel logs its uptoken round trip times,
+//and we print the spread of those across tunnels.
+//Noisy tunnels run "yes" into their STDERR, so SSHTunnels has a flood of output to log while it's keeping up with everything else.
+//UpTokenInterval and WorkerThreads are only set when they're asked for, so an older binary can be measured the same way.
+//(Linux only.)
+
+#define TUNNELS_COUNT_DEFAULT 1000
+#define TUNNELS_SECONDS_DEFAULT 60
+#define TUNNELS_STARTUP_MAX 300 //Seconds we wait for every tunnel process to be running, before measuring anyway.
+#define TUNNELS_WARMUP 10 //Seconds the tunnels get to settle down, once they're all running, before we start measuring.
+#define TUNNELS_TIMEOUT 60 //Seconds we wait for SSHTunnels to finish shutting down, before giving up.
+#define TUNNELS_CONFIG_PER_TUNNEL (BENCH_PATH_SIZE + 256) //Bytes of configuration each tunnel takes, with room to spare.
+#define TUNNELS_RTT_MARK "uptoken round trip times over"
+
+int tunnels_drain(struct bench_daemon *daemon, int seconds);
+int tunnels_cpu(pid_t pid, double *seconds);
+long tunnels_memory(pid_t pid, const char *field);
+int tunnels_children(pid_t pid);
+int tunnels_rtt(const char *line, int count, double *p50, double *p99);
+
+int main(int argc, char **argv)
+	{
+	struct bench_daemon daemon;
+	const char *binary = "./SSHTunnels", *program = "/bin/cat";
+	int count = TUNNELS_COUNT_DEFAULT, seconds = TUNNELS_SECONDS_DEFAULT, workers = 0, noisy = 0, i, running, rtt_count = 0;
+	size_t config_size, config_pos;
+	int64_t started;
+	double cpu_start, cpu_end, startup, interval = 0, *p50, *p99;
+	char line[BENCH_LINE_SIZE], receiver[BENCH_PATH_SIZE], attributes[BENCH_LINE_SIZE] = "", *config, *slash;
+	
+	if(argc > 1)
+		binary = argv[1];
+	if(argc > 2)
+		count = atoi(argv[2]);
+	if(argc > 3)
+		seconds = atoi(argv[3]);
+	if(argc > 4)
+		interval = atof(argv[4]);
+	if(argc > 5)
+		workers = atoi(argv[5]);
+	if(argc > 6)
+		noisy = atoi(argv[6]);
+	if(count < 1 || seconds < 1 || interval < 0 || workers < 0 || noisy < 0)
+		{
+		fprintf(stderr, "Usage: %s [SSHTunnels binary] [tunnels] [seconds] [uptoken interval] [worker threads] [noisy tunnels]\n", argv[0]);
+		return 1;
+		}
+	if((p50 = (double *)calloc(count, sizeof(double))) == NULL || (p99 = (double *)calloc(count, sizeof(double))) == NULL)
+		return 1;
+	
+	//Use the UpTokenReceiver built alongside SSHTunnels, if there is one.
+	if(realpath(binary, receiver) != NULL && (slash = strrchr(receiver, '/')) != NULL && (size_t)(slash + 1 - receiver) + strlen("UpTokenReceiver") < sizeof(receiver))
+		{
+		strcpy(slash + 1, "UpTokenReceiver");
+		if(access(receiver, X_OK) == 0)
+			program = receiver;
+		}
+	if(interval > 0)
+		snprintf(attributes, sizeof(attributes), " UpTokenInterval=\"%g\"", interval);
+	
+	config_size = (size_t)(count + noisy) * TUNNELS_CONFIG_PER_TUNNEL + BENCH_LINE_SIZE;
+	if((config = (char *)malloc(config_size)) == NULL)
+		return 1;
+	config_pos = snprintf(config, config_size, "<SSHTunnels LogOutput=\"stderr\"");
+	if(workers > 0)
+		config_pos += snprintf(config + config_pos, config_size - config_pos, " WorkerThreads=\"%d\"", workers);
+	config_pos += snprintf(config + config_pos, config_size - config_pos, ">\n");
+	for(i = 0; i < count; i++)
+		config_pos += snprintf(config + config_pos, config_size - config_pos, "\t<Tunnel UpTokenEnabled=\"true\"%s><ProgramArgument v=\"%s\" /></Tunnel>\n", attributes, program);
+	for(i = 0; i < noisy; i++)
+		config_pos += snprintf(config + config_pos, config_size - config_pos, "\t<Tunnel UpTokenEnabled=\"false\"><ProgramArgument v=\"/bin/sh\" /><ProgramArgument v=\"-c\" /><ProgramArgument v=\"yes &gt;&amp;2\" /></Tunnel>\n");
+	snprintf(config + config_pos, config_size - config_pos, "</SSHTunnels>\n");
+	started = bench_now_ns();
+	if(!bench_daemon_start(&daemon, binary, config))
+		return 1;
+	free(config);
+	printf("Supervising %d tunnels (%s) and %d noisy ones with %s and %d worker threads for %d seconds...\n", count, program, noisy, binary, workers, seconds);
+	
+	//The launch queue spreads the tunnels' first launches out, so with a lot of tunnels they take a while to all be running.
+	for(i = 0; i < TUNNELS_STARTUP_MAX && tunnels_children(daemon.pid) < count + noisy; i++)
+		{
+		if(!tunnels_drain(&daemon, 1))
+			break;
+		}
+	startup = (double)(bench_now_ns() - started) / 1000000000.0;
+	
+	if(!tunnels_drain(&daemon, TUNNELS_WARMUP) || !tunnels_cpu(daemon.pid, &cpu_start) || !tunnels_drain(&daemon, seconds) || !tunnels_cpu(daemon.pid, &cpu_end))
+		{
+		fprintf(stderr, "SSHTunnels went away!\n");
+		bench_daemon_finish(&daemon);
+		return 1;
+		}
+	running = tunnels_children(daemon.pid);
+	printf("Tunnel processes running   %d (all started after %.0f s)\n", running, startup);
+	printf("Supervisor CPU             %.2f s per minute\n", (cpu_end - cpu_start) * 60.0 / seconds);
+	printf("Supervisor RSS             %.1f MB (peak %.1f MB)\n", tunnels_memory(daemon.pid, "VmRSS:") / 1024.0, tunnels_memory(daemon.pid, "VmHWM:") / 1024.0);
+	
+	//Noisy tunnels come after the others, and don't send uptokens, so every report is from one of the first count tunnels.
+	for(i = 0; i < count; i++)
+		p50[i] = -1;
+	bench_daemon_stop(&daemon);
+	while(bench_daemon_line(&daemon, line, sizeof(line), TUNNELS_TIMEOUT) != NULL)
+		tunnels_rtt(line, count, p50, p99);
+	bench_daemon_finish(&daemon);
+	
+	//A tunnel may have reported more than once. Only its last report counts.
+	for(i = 0; i < count; i++)
+		{
+		if(p50[i] < 0)
+			continue;
+		p50[rtt_count] = p50[i];
+		p99[rtt_count] = p99[i];
+		rtt_count++;
+		}
+	bench_report("RTT p50 per tunnel", p50, rtt_count, "ms");
+	bench_report("RTT p99 per tunnel", p99, rtt_count, "ms");
+	free(p50);
+	free(p99);
+	return running < count + noisy;
+	}
+
+//Picks the uptoken round trip times out of a tunnel's report, if that's what the line is.
+//Returns TRUE if it was, or FALSE otherwise.
+int tunnels_rtt(const char *line, int count, double *p50, double *p99)
+	{
+	const char *tunnel, *mark;
+	unsigned int median, tail;
+	int id;
+	
+	if((mark = strstr(line, TUNNELS_RTT_MARK)) == NULL || (tunnel = strstr(line, "Tunnel ")) == NULL)
+		return FALSE;
+	if(sscanf(tunnel, "Tunnel %d:", &id) != 1 || id < 1 || id > count)
+		return FALSE;
+	if(sscanf(mark, TUNNELS_RTT_MARK " %*u uptokens: p50 %u ms, p99 %u ms", &median, &tail) != 2)
+		return FALSE;
+	p50[id - 1] = median;
+	p99[id - 1] = tail;
+	return TRUE;
+	}
+
+//Reads (and ignores) SSHTunnels' log for the given number of seconds, so it never blocks writing to us.
+//Returns TRUE on success or FALSE if SSHTunnels went away.
+int tunnels_drain(struct bench_daemon *daemon, int seconds)
+	{
+	char line[BENCH_LINE_SIZE];
+	int64_t deadline = bench_now_ns() + (int64_t)seconds * 1000000000;
+	
+	while(bench_now_ns() < deadline)
+		{
+		if(bench_daemon_line(daemon, line, sizeof(line), 1) != NULL)
+			continue;
+		if(feof(daemon->log))
+			return FALSE;
+		clearerr(daemon->log); //Just the timeout.
+		}
+	return TRUE;
+	}
+
+//Reads the user and system CPU time the process has used so far, from /proc/<pid>/stat.
+//Returns TRUE on success or FALSE on error.
+int tunnels_cpu(pid_t pid, double *seconds)
+	{
+	char path[BENCH_PATH_SIZE], stat[BENCH_LINE_SIZE], *fields;
+	unsigned long utime, stime;
+	FILE *in;
+	int ok;
+	
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((in = fopen(path, "r")) == NULL)
+		return FALSE;
+	ok = fgets(stat, sizeof(stat), in) != NULL;
+	fclose(in);
+	
+	//The command name is in parentheses and may contain spaces, so the fields are counted from the last ')'. utime and stime are
+	//the 14th and 15th fields, and the state after the ')' is the 3rd.
+	if(!ok || (fields = strrchr(stat, ')')) == NULL)
+		return FALSE;
+	if(sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return FALSE;
+	*seconds = (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+	return TRUE;
+	}
+
+//Reads one of the kB figures from /proc/<pid>/status, such as "VmRSS:".
+//Returns the figure in kB, or -1 on error.
+long tunnels_memory(pid_t pid, const char *field)
+	{
+	char path[BENCH_PATH_SIZE], line[BENCH_LINE_SIZE];
+	long kb = -1;
+	FILE *in;
+	
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if((in = fopen(path, "r")) == NULL)
+		return -1;
+	while(fgets(line, sizeof(line), in) != NULL)
+		{
+		if(strncmp(line, field, strlen(field)) == 0)
+			{
+			kb = strtol(line + strlen(field), NULL, 10);
+			break;
+			}
+		}
+	fclose(in);
+	return kb;
+	}
+
+//Counts the process's children. Each thread's children are listed separately, in /proc/<pid>/task/<tid>/children.
+//Returns the count, or -1 on error.
+int tunnels_children(pid_t pid)
+	{
+	char path[BENCH_PATH_SIZE];
+	struct dirent *entry;
+	int count = 0, child;
+	DIR *tasks;
+	FILE *in;
+	
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+	if((tasks = opendir(path)) == NULL)
+		return -1;
+	while((entry = readdir(tasks)) != NULL)
+		{
+		if(entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/task/%s/children", (int)pid, entry->d_name);
+		if((in = fopen(path, "r")) == NULL)
+			continue;
+		while(fscanf(in, "%d", &child) == 1)
+			count++;
+		fclose(in);
+		}
+	closedir(tasks);
+	return count;
+	}
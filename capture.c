@@ -0,0 +1,172 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * capture.c
+ *     - Archives raw tunnel output to a file, without copying it through our own buffers where the system allows.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//For splice() and tee().
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+
+#include "capture.h"
+#include "main.h"
+#include "util.h"
+
+void capture_init(struct capture *capture)
+	{
+	int i;
+	
+	capture->fd = -1;
+	for(i = 0; i < CAPTURE_STREAMS; i++)
+		{
+		capture->scan_pipes[i][PIPE_READ] = -1;
+		capture->scan_pipes[i][PIPE_WRITE] = -1;
+		}
+	capture->copy = FALSE;
+	capture->bytes = 0;
+	}
+
+//Opens the file to add to the end of it, and if scan is TRUE, the pipes which carry a copy of each stream to be checked for magic words.
+//splice() refuses files opened with O_APPEND, so instead we seek to the end once, here. Anything else writing to (or truncating) the
+//file while it's open will be written over.
+//Returns TRUE on success or FALSE (with errno set) on error.
+int capture_open(struct capture *capture, const char *path, int scan)
+	{
+	int i, saved_errno;
+	
+	if((capture->fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return FALSE;
+	capture->copy = FALSE;
+	if(lseek(capture->fd, 0, SEEK_END) < 0)
+		{
+		saved_errno = errno;
+		capture_close(capture);
+		errno = saved_errno;
+		return FALSE;
+		}
+	
+	for(i = 0; scan && i < CAPTURE_STREAMS; i++)
+		{
+		if(pipe_cloexec(capture->scan_pipes[i]) < 0 || !fd_set_nonblock(capture->scan_pipes[i][PIPE_READ]) || !fd_set_nonblock(capture->scan_pipes[i][PIPE_WRITE]))
+			{
+			saved_errno = errno;
+			capture_close(capture);
+			errno = saved_errno;
+			return FALSE;
+			}
+		}
+	return TRUE;
+	}
+
+//Moves whatever is waiting in fd (one of the child's output pipes) to the file. With a scan pipe, the same bytes are copied into it
+//too, and the caller must read all of them back out before calling again.
+//Returns the number of bytes moved, 0 at end of file, or -1 (with errno set, EAGAIN when there's nothing to move) on error.
+ssize_t capture_move(struct capture *capture, int stream, int fd)
+	{
+	int scan_fd = capture->scan_pipes[stream][PIPE_WRITE];
+	#ifdef CAPTURE_USE_SPLICE
+	ssize_t teed, moved, total = 0;
+	
+	if(!capture->copy)
+		{
+		if(scan_fd < 0)
+			{
+			if((moved = splice(fd, NULL, capture->fd, NULL, CAPTURE_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0)
+				capture->bytes += moved;
+			if(moved >= 0 || errno != EINVAL)
+				return moved;
+			//EINVAL means the file's filesystem can't take splice(). Nothing has been moved, so just copy instead.
+			capture->copy = TRUE;
+			}
+		else
+			{
+			//tee() leaves the bytes in the pipe, so splice() moves exactly what was copied.
+			if((teed = tee(fd, scan_fd, CAPTURE_SPLICE_SIZE, SPLICE_F_NONBLOCK)) <= 0)
+				return teed;
+			while(total < teed)
+				{
+				if((moved = splice(fd, NULL, capture->fd, NULL, teed - total, SPLICE_F_MOVE)) <= 0)
+					break;
+				total += moved;
+				capture->bytes += moved;
+				}
+			if(total < teed && moved < 0 && errno == EINVAL)
+				{
+				//Copy the rest of what was teed. It's already in the scan pipe.
+				capture->copy = TRUE;
+				while(total < teed)
+					{
+					if((moved = capture_copy(capture, fd, teed - total, -1)) <= 0)
+						return -1;
+					total += moved;
+					}
+				}
+			if(total < teed)
+				{
+				if(moved == 0)
+					errno = EIO;
+				return -1;
+				}
+			return total;
+			}
+		}
+	#endif
+	
+	return capture_copy(capture, fd, CAPTURE_COPY_SIZE, scan_fd);
+	}
+
+//Reads up to count bytes from fd and writes them to the file, and to scan_fd unless it's -1.
+//Returns the number of bytes copied, 0 at end of file, or -1 (with errno set) on error.
+ssize_t capture_copy(struct capture *capture, int fd, size_t count, int scan_fd)
+	{
+	char buffer[CAPTURE_COPY_SIZE];
+	ssize_t readret;
+	
+	if((readret = read(fd, buffer, count < sizeof(buffer) ? count : sizeof(buffer))) <= 0)
+		return readret;
+	if(write_all(capture->fd, buffer, readret) < 0)
+		return -1;
+	capture->bytes += readret;
+	if(scan_fd >= 0 && write_all(scan_fd, buffer, readret) < 0)
+		return -1;
+	return readret;
+	}
+
+void capture_close(struct capture *capture)
+	{
+	int i, j;
+	
+	if(capture->fd >= 0)
+		close(capture->fd);
+	capture->fd = -1;
+	for(i = 0; i < CAPTURE_STREAMS; i++)
+		{
+		for(j = 0; j < 2; j++)
+			{
+			if(capture->scan_pipes[i][j] >= 0)
+				close(capture->scan_pipes[i][j]);
+			capture->scan_pipes[i][j] = -1;
+			}
+		}
+	}
@@ -0,0 +1,59 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ * 
+ * capture.h
+ *     - Archives raw tunnel output to a file, without copying it through our own buffers where the system allows.
+ * 
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_CAPTURE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//On Linux, splice() moves output from the pipe to the file inside the kernel, and tee() makes the copy we scan for magic words.
+//Everywhere else (iOS), we read the output and write it out again.
+#ifdef __linux__
+#define CAPTURE_USE_SPLICE
+#endif
+
+#define CAPTURE_STDERR 0
+#define CAPTURE_STDOUT 1
+#define CAPTURE_STREAMS 2
+#define CAPTURE_SPLICE_SIZE 65536 //Most bytes moved by one splice() or tee().
+#define CAPTURE_COPY_SIZE 4096 //Most bytes copied at once without splice(). No more than PIPE_BUF, so a scan pipe with room takes all of it.
+
+//A tunnel's OutputFile, while a child process is running.
+struct capture
+	{
+	int fd; //Positioned at the end of the file, or -1.
+	int scan_pipes[CAPTURE_STREAMS][2]; //With OutputScan, a copy of each stream comes out of here to be checked for magic words. (Otherwise -1.)
+	int copy; //splice() doesn't work with this file, so we copy instead.
+	uint64_t bytes; //Written to the file since the last report.
+	};
+
+void capture_init(struct capture *capture);
+int capture_open(struct capture *capture, const char *path, int scan);
+ssize_t capture_move(struct capture *capture, int stream, int fd);
+ssize_t capture_copy(struct capture *capture, int fd, size_t count, int scan_fd);
+void capture_close(struct capture *capture);
+
+#define __SSHTUNNELS_CAPTURE_H
+#endif
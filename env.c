@@ -0,0 +1,159 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * env.c
+ *     - Environments for tunnel processes. One shared base, plus a small overlay per tunnel.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "env.h"
+#include "main.h"
+#include "log.h"
+
+//Builds the shared base environment from envp. If a variable appears more than once, the last value wins, but it keeps the first position.
+//Returns the new base, or NULL on error.
+struct env_base *env_base_create(char **envp)
+	{
+	struct env_base *base;
+	int count = 0, i, pos;
+	uint32_t slot;
+	size_t len;
+	
+	for(count = 0; envp != NULL && envp[count]; count++);
+	
+	if((base = (struct env_base *)calloc(1, sizeof(struct env_base))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return NULL;
+		}
+	
+	//Keep the table at most half full.
+	for(base->index_len = 16; base->index_len < count * 2; base->index_len = base->index_len * 2);
+	if((base->vars = (char **)calloc(count + 1, sizeof(char *))) == NULL || (base->index = (int *)malloc(base->index_len * sizeof(int))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		env_base_destroy(base);
+		return NULL;
+		}
+	for(i = 0; i < base->index_len; i++)
+		base->index[i] = -1;
+	
+	for(i = 0; i < count; i++)
+		{
+		len = env_name_length(envp[i]);
+		for(slot = env_name_hash(envp[i], len) & (base->index_len - 1); (pos = base->index[slot]) != -1; slot = (slot + 1) & (base->index_len - 1))
+			{
+			if(strncmp(base->vars[pos], envp[i], len) == 0 && env_name_length(base->vars[pos]) == len)
+				break;
+			}
+		if(pos == -1)
+			{
+			pos = base->vars_len++;
+			base->index[slot] = pos;
+			}
+		free(base->vars[pos]);
+		if((base->vars[pos] = strdup(envp[i])) == NULL)
+			{
+			stl(STL_ERROR, "Out of memory!");
+			env_base_destroy(base);
+			return NULL;
+			}
+		}
+	
+	return base;
+	}
+
+void env_base_destroy(struct env_base *base)
+	{
+	int i;
+	
+	if(base == NULL)
+		return;
+	if(base->vars != NULL)
+		{
+		for(i = 0; i < base->vars_len; i++)
+			free(base->vars[i]);
+		free(base->vars);
+		}
+	free(base->index);
+	free(base);
+	}
+
+//Returns the position in base->vars of the variable with the same name as "var", or -1 if there isn't one.
+int env_base_find(struct env_base *base, const char *var)
+	{
+	size_t len = env_name_length(var);
+	uint32_t slot;
+	int pos;
+	
+	for(slot = env_name_hash(var, len) & (base->index_len - 1); (pos = base->index[slot]) != -1; slot = (slot + 1) & (base->index_len - 1))
+		{
+		if(strncmp(base->vars[pos], var, len) == 0 && env_name_length(base->vars[pos]) == len)
+			return pos;
+		}
+	return -1;
+	}
+
+//Merges a tunnel's overlay (NULL-terminated, possibly NULL itself) into the base. Overlay variables replace base variables of the same name in place,
+//and the rest go on the end, just as if they had been added to a full copy of the base one at a time.
+//The result is a freshly allocated, NULL-terminated array, but the strings in it still belong to the base and the overlay.
+//Returns the array, or NULL on error.
+char **env_materialize(struct env_base *base, char **overlay)
+	{
+	char **envp;
+	int overlay_len, pos, i, end = base->vars_len;
+	
+	for(overlay_len = 0; overlay != NULL && overlay[overlay_len]; overlay_len++);
+	if((envp = (char **)malloc((base->vars_len + overlay_len + 1) * sizeof(char *))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return NULL;
+		}
+	memcpy(envp, base->vars, base->vars_len * sizeof(char *));
+	
+	for(i = 0; i < overlay_len; i++)
+		{
+		if((pos = env_base_find(base, overlay[i])) >= 0)
+			envp[pos] = overlay[i];
+		else
+			envp[end++] = overlay[i];
+		}
+	envp[end] = NULL;
+	return envp;
+	}
+
+//The name part of a variable is everything up to and including the first equals sign. (Or the whole thing, if there isn't one.)
+size_t env_name_length(const char *var)
+	{
+	const char *equals = strchr(var, '=');
+	
+	if(equals == NULL)
+		return strlen(var);
+	return (size_t)(equals - var) + 1;
+	}
+
+uint32_t env_name_hash(const char *var, size_t len)
+	{
+	uint32_t hash = 2166136261U; //FNV-1a
+	size_t i;
+	
+	for(i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)var[i]) * 16777619U;
+	return hash;
+	}
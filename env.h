@@ -0,0 +1,49 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * env.h
+ *     - Environments for tunnel processes. One shared base, plus a small overlay per tunnel.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_ENV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Every tunnel starts out with a copy of our own environment. Rather than actually copying it for each tunnel, it's indexed once and shared.
+//Each tunnel only keeps its own <ProgramEnvironment> variables, and the two are merged when the tunnel is first launched.
+struct env_base
+	{
+	char **vars; //NULL-terminated. The strings themselves are copies, owned by the base.
+	int vars_len;
+	int *index; //Open addressing hash table of positions in vars, keyed by variable name. -1 marks an empty slot.
+	int index_len; //A power of two.
+	};
+
+struct env_base *env_base_create(char **envp);
+void env_base_destroy(struct env_base *base);
+int env_base_find(struct env_base *base, const char *var);
+char **env_materialize(struct env_base *base, char **overlay);
+size_t env_name_length(const char *var);
+uint32_t env_name_hash(const char *var, size_t len);
+
+#define __SSHTUNNELS_ENV_H
+#endif
@@ -0,0 +1,499 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * event.c
+ *     - Event loop. Waits on file descriptors and dispatches them to handlers.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "event.h"
+#include "main.h"
+#include "log.h"
+#include "util.h"
+
+#include <limits.h>
+
+#ifdef EVENT_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+void event_timer_sift_up(struct event_loop *loop, int i);
+void event_timer_sift_down(struct event_loop *loop, int i);
+
+struct event_loop *event_loop_create(void)
+	{
+	struct event_loop *loop;
+	
+	if((loop = (struct event_loop *)calloc(1, sizeof(struct event_loop))) == NULL)
+		{
+		stl(STL_ERROR, "event_loop_create: out of memory!");
+		return NULL;
+		}
+	
+	loop->epoll_fd = -1;
+	loop->regs = NULL;
+	loop->regs_len = 0;
+	loop->pollfds = NULL;
+	loop->pollfds_len = 0;
+	loop->pollfds_pos = 0;
+	loop->timers = NULL;
+	loop->timers_len = 0;
+	loop->timers_pos = 0;
+	loop->thread = pthread_self();
+	loop->calls = NULL;
+	loop->calls_running = NULL;
+	loop->calls_len = 0;
+	loop->calls_pos = 0;
+	loop->calls_running_len = 0;
+	loop->wakeup_pipe[PIPE_READ] = -1;
+	loop->wakeup_pipe[PIPE_WRITE] = -1;
+	pthread_mutex_init(&loop->calls_lock, NULL);
+	
+	#ifdef EVENT_USE_EPOLL
+	if((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		{
+		stl(STL_ERROR, "event_loop_create: Call to epoll_create1() failed! (%s)", strerror(errno));
+		event_loop_destroy(loop);
+		return NULL;
+		}
+	#endif
+	
+	//Other threads wake the loop up through this pipe when they leave it a call to run.
+	if(pipe_cloexec(loop->wakeup_pipe) < 0)
+		{
+		stl(STL_ERROR, "event_loop_create: Call to pipe() failed! (%s)", strerror(errno));
+		event_loop_destroy(loop);
+		return NULL;
+		}
+	if(!fd_set_nonblock(loop->wakeup_pipe[PIPE_READ]) || !fd_set_nonblock(loop->wakeup_pipe[PIPE_WRITE]) || !event_add(loop, loop->wakeup_pipe[PIPE_READ], event_calls_run, NULL))
+		{
+		event_loop_destroy(loop);
+		return NULL;
+		}
+	
+	return loop;
+	}
+
+void event_loop_destroy(struct event_loop *loop)
+	{
+	if(loop == NULL)
+		return;
+	
+	if(loop->epoll_fd != -1)
+		close(loop->epoll_fd);
+	if(loop->wakeup_pipe[PIPE_READ] != -1)
+		close(loop->wakeup_pipe[PIPE_READ]);
+	if(loop->wakeup_pipe[PIPE_WRITE] != -1)
+		close(loop->wakeup_pipe[PIPE_WRITE]);
+	pthread_mutex_destroy(&loop->calls_lock);
+	free(loop->calls);
+	free(loop->calls_running);
+	free(loop->regs);
+	free(loop->pollfds);
+	free(loop->timers);
+	free(loop);
+	}
+
+//The calling thread takes over the loop. (Every loop starts out belonging to the thread which created it.)
+//The previous owner must have stopped touching the loop, and something like pthread_join() has to stand between the two.
+void event_loop_adopt(struct event_loop *loop)
+	{
+	loop->thread = pthread_self();
+	}
+
+//Calls handler(loop, data, value) on the loop's own thread. If that's us, it happens right away.
+//Otherwise the call is queued, and the loop's thread runs it (in order) the next time around.
+//Returns TRUE on success or FALSE on error. (For a queued call, that's whether it was queued, not what the handler returned.)
+int event_call(struct event_loop *loop, event_call_handler handler, void *data, int64_t value)
+	{
+	struct event_call call;
+	unsigned char wakeup = 0;
+	int ok = TRUE;
+	
+	if(pthread_equal(loop->thread, pthread_self()))
+		return handler(loop, data, value);
+	
+	call.handler = handler;
+	call.data = data;
+	call.value = value;
+	pthread_mutex_lock(&loop->calls_lock);
+	if((loop->calls = list_grow_insert(loop->calls, &call, sizeof(struct event_call), &loop->calls_len, &loop->calls_pos)) == NULL)
+		{
+		stl(STL_ERROR, "event_call: out of memory!");
+		loop->calls_len = 0;
+		loop->calls_pos = 0;
+		ok = FALSE;
+		}
+	//Only the first call in the queue needs to wake the loop up. The rest get picked up along with it.
+	else if(loop->calls_pos == 1 && write(loop->wakeup_pipe[PIPE_WRITE], &wakeup, 1) < 0 && errno != EAGAIN)
+		{
+		stl(STL_ERROR, "event_call: Call to write() failed! (%s)", strerror(errno));
+		ok = FALSE;
+		}
+	pthread_mutex_unlock(&loop->calls_lock);
+	return ok;
+	}
+
+//Event loop handler for the wakeup pipe. Runs every call which has been queued by another thread.
+//The queue is swapped out before running anything, so that calls queued in the meantime don't have to wait on us.
+int event_calls_run(struct event_loop *loop, int fd, int events, void *data)
+	{
+	unsigned char buf[64];
+	struct event_call *calls;
+	int i, count, len;
+	
+	while(read(fd, buf, sizeof(buf)) > 0);
+	
+	pthread_mutex_lock(&loop->calls_lock);
+	calls = loop->calls;
+	len = loop->calls_len;
+	count = loop->calls_pos;
+	loop->calls = loop->calls_running;
+	loop->calls_len = loop->calls_running_len;
+	loop->calls_pos = 0;
+	pthread_mutex_unlock(&loop->calls_lock);
+	loop->calls_running = calls;
+	loop->calls_running_len = len;
+	
+	for(i = 0; i < count; i++)
+		{
+		if(!calls[i].handler(loop, calls[i].data, calls[i].value))
+			return FALSE;
+		}
+	return TRUE;
+	}
+
+//Starts watching fd for input. The handler is also called when the far end hangs up or the descriptor reports an error.
+//Returns TRUE on success or FALSE on error.
+int event_add(struct event_loop *loop, int fd, event_handler handler, void *data)
+	{
+	int old_len;
+	struct event_registration *regs;
+	#ifdef EVENT_USE_EPOLL
+	struct epoll_event ev;
+	#else
+	struct pollfd pfd;
+	#endif
+	
+	if(fd < 0)
+		{
+		stl(STL_ERROR, "event_add: Invalid file descriptor %d!", fd);
+		return FALSE;
+		}
+	
+	//The registration table is indexed by file descriptor, so it grows to cover the largest one we've seen.
+	if(fd >= loop->regs_len)
+		{
+		old_len = loop->regs_len;
+		while(fd >= loop->regs_len)
+			loop->regs_len = loop->regs_len + LIST_GROW_STEP;
+		if((regs = realloc(loop->regs, loop->regs_len * sizeof(struct event_registration))) == NULL)
+			{
+			stl(STL_ERROR, "event_add: out of memory!");
+			loop->regs_len = old_len;
+			return FALSE;
+			}
+		memset(regs + old_len, 0, (loop->regs_len - old_len) * sizeof(struct event_registration));
+		loop->regs = regs;
+		}
+	
+	if(loop->regs[fd].registered)
+		{
+		stl(STL_ERROR, "event_add: File descriptor %d is already registered!", fd);
+		return FALSE;
+		}
+	
+	#ifdef EVENT_USE_EPOLL
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+		stl(STL_ERROR, "event_add: Call to epoll_ctl() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	loop->regs[fd].poll_index = -1;
+	#else
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if((loop->pollfds = list_grow_insert(loop->pollfds, &pfd, sizeof(struct pollfd), &loop->pollfds_len, &loop->pollfds_pos)) == NULL)
+		{
+		stl(STL_ERROR, "event_add: out of memory!");
+		loop->pollfds_len = 0;
+		loop->pollfds_pos = 0;
+		return FALSE;
+		}
+	loop->regs[fd].poll_index = loop->pollfds_pos - 1;
+	#endif
+	
+	loop->regs[fd].handler = handler;
+	loop->regs[fd].data = data;
+	loop->regs[fd].registered = TRUE;
+	return TRUE;
+	}
+
+//Stops watching fd. This must be called before fd is closed.
+//Removing a file descriptor that isn't registered is harmless.
+//Returns TRUE on success or FALSE on error.
+int event_remove(struct event_loop *loop, int fd)
+	{
+	#ifndef EVENT_USE_EPOLL
+	int i, last;
+	#endif
+	
+	if(fd < 0 || fd >= loop->regs_len || !loop->regs[fd].registered)
+		return TRUE;
+	
+	loop->regs[fd].registered = FALSE;
+	loop->regs[fd].handler = NULL;
+	loop->regs[fd].data = NULL;
+	
+	#ifdef EVENT_USE_EPOLL
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+		{
+		stl(STL_ERROR, "event_remove: Call to epoll_ctl() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	#else
+	//Move the last pollfd into the vacated slot.
+	i = loop->regs[fd].poll_index;
+	last = loop->pollfds_pos - 1;
+	if(i != last)
+		{
+		loop->pollfds[i] = loop->pollfds[last];
+		loop->regs[loop->pollfds[i].fd].poll_index = i;
+		}
+	loop->pollfds_pos = last;
+	loop->pollfds[last].fd = -1;
+	#endif
+	
+	loop->regs[fd].poll_index = -1;
+	return TRUE;
+	}
+
+//Waits up to timeout_ms milliseconds (or forever if timeout_ms is negative), but never past the next scheduled timer.
+//Calls the handler of every ready file descriptor, then runs every timer that has come due.
+//Returns the number of file descriptors dispatched, or -1 if the wait or a handler failed.
+int event_dispatch(struct event_loop *loop, int timeout_ms)
+	{
+	int i, ready_count = 0, fd;
+	int64_t until_timer;
+	struct event_registration *reg;
+	#ifdef EVENT_USE_EPOLL
+	struct epoll_event evs[EVENT_BATCH_SIZE];
+	#else
+	int pollret;
+	#endif
+	
+	//Don't sleep through the next timer.
+	if(loop->timers_pos > 0)
+		{
+		until_timer = loop->timers[0]->when - time_monotonic_ms();
+		if(until_timer < 0)
+			until_timer = 0;
+		if(until_timer > INT_MAX)
+			until_timer = INT_MAX;
+		if(timeout_ms < 0 || until_timer < timeout_ms)
+			timeout_ms = (int)until_timer;
+		}
+	
+	#ifdef EVENT_USE_EPOLL
+	if((ready_count = epoll_wait(loop->epoll_fd, evs, EVENT_BATCH_SIZE, timeout_ms)) < 0)
+		{
+		if(errno != EINTR)
+			{
+			stl(STL_ERROR, "event_dispatch: Call to epoll_wait() failed! (%s)", strerror(errno));
+			return -1;
+			}
+		ready_count = 0;
+		}
+	for(i = 0; i < ready_count; i++)
+		{
+		loop->ready[i].fd = evs[i].data.fd;
+		loop->ready[i].events = 0;
+		if(evs[i].events & EPOLLIN) loop->ready[i].events |= EVENT_READ;
+		if(evs[i].events & EPOLLHUP) loop->ready[i].events |= EVENT_HANGUP;
+		if(evs[i].events & EPOLLERR) loop->ready[i].events |= EVENT_ERROR;
+		}
+	#else
+	if((pollret = poll(loop->pollfds, loop->pollfds_pos, timeout_ms)) < 0)
+		{
+		if(errno != EINTR)
+			{
+			stl(STL_ERROR, "event_dispatch: Call to poll() failed! (%s)", strerror(errno));
+			return -1;
+			}
+		pollret = 0;
+		}
+	for(i = 0; i < loop->pollfds_pos && pollret > 0 && ready_count < EVENT_BATCH_SIZE; i++)
+		{
+		if(loop->pollfds[i].revents == 0)
+			continue;
+		loop->ready[ready_count].fd = loop->pollfds[i].fd;
+		loop->ready[ready_count].events = 0;
+		if(loop->pollfds[i].revents & POLLIN) loop->ready[ready_count].events |= EVENT_READ;
+		if(loop->pollfds[i].revents & POLLHUP) loop->ready[ready_count].events |= EVENT_HANGUP;
+		if(loop->pollfds[i].revents & (POLLERR | POLLNVAL)) loop->ready[ready_count].events |= EVENT_ERROR;
+		ready_count++;
+		pollret--;
+		}
+	#endif
+	
+	//Dispatch. A handler may remove other descriptors from the loop, so look each one up again right before calling it.
+	for(i = 0; i < ready_count; i++)
+		{
+		fd = loop->ready[i].fd;
+		if(fd >= loop->regs_len || !loop->regs[fd].registered)
+			continue;
+		reg = &loop->regs[fd];
+		if(!reg->handler(loop, fd, loop->ready[i].events, reg->data))
+			return -1;
+		}
+	
+	if(!event_timers_run(loop))
+		return -1;
+	
+	return ready_count;
+	}
+
+void event_timer_init(struct event_timer *timer, event_timer_handler handler, void *data)
+	{
+	timer->when = 0;
+	timer->heap_index = -1;
+	timer->handler = handler;
+	timer->data = data;
+	}
+
+//Schedules (or reschedules) a timer to fire at "when".
+//Returns TRUE on success or FALSE on error.
+int event_timer_schedule(struct event_loop *loop, struct event_timer *timer, int64_t when)
+	{
+	struct event_timer **timers;
+	int64_t old_when = timer->when;
+	
+	timer->when = when;
+	
+	//Already scheduled? Just move it to its new place in the heap.
+	if(timer->heap_index >= 0)
+		{
+		if(when < old_when)
+			event_timer_sift_up(loop, timer->heap_index);
+		else
+			event_timer_sift_down(loop, timer->heap_index);
+		return TRUE;
+		}
+	
+	if(loop->timers_pos >= loop->timers_len)
+		{
+		//Double the heap each time so that thousands of tunnels don't mean thousands of reallocs.
+		if((timers = realloc(loop->timers, (loop->timers_len ? loop->timers_len * 2 : LIST_GROW_STEP) * sizeof(struct event_timer *))) == NULL)
+			{
+			stl(STL_ERROR, "event_timer_schedule: out of memory!");
+			return FALSE;
+			}
+		loop->timers = timers;
+		loop->timers_len = loop->timers_len ? loop->timers_len * 2 : LIST_GROW_STEP;
+		}
+	
+	timer->heap_index = loop->timers_pos;
+	loop->timers[loop->timers_pos] = timer;
+	loop->timers_pos++;
+	event_timer_sift_up(loop, timer->heap_index);
+	return TRUE;
+	}
+
+//Unschedules a timer. Cancelling a timer which isn't scheduled is harmless.
+void event_timer_cancel(struct event_loop *loop, struct event_timer *timer)
+	{
+	int i = timer->heap_index, last = loop->timers_pos - 1;
+	
+	if(i < 0)
+		return;
+	
+	timer->heap_index = -1;
+	loop->timers_pos = last;
+	if(i == last)
+		return;
+	
+	//Fill the hole with the last timer in the heap and put that one back where it belongs.
+	loop->timers[i] = loop->timers[last];
+	loop->timers[i]->heap_index = i;
+	event_timer_sift_up(loop, i);
+	event_timer_sift_down(loop, loop->timers[i]->heap_index);
+	}
+
+int event_timer_pending(struct event_timer *timer)
+	{
+	return timer->heap_index >= 0;
+	}
+
+//Runs every timer which has come due. A timer is unscheduled before its handler runs, so the handler is free to schedule it again.
+//Returns TRUE on success or FALSE if a handler failed.
+int event_timers_run(struct event_loop *loop)
+	{
+	int64_t now = time_monotonic_ms();
+	struct event_timer *timer;
+	
+	while(loop->timers_pos > 0 && loop->timers[0]->when <= now)
+		{
+		timer = loop->timers[0];
+		event_timer_cancel(loop, timer);
+		if(!timer->handler(loop, timer, timer->data))
+			return FALSE;
+		}
+	return TRUE;
+	}
+
+void event_timer_sift_up(struct event_loop *loop, int i)
+	{
+	int parent;
+	struct event_timer *timer = loop->timers[i];
+	
+	while(i > 0)
+		{
+		parent = (i - 1) / 2;
+		if(loop->timers[parent]->when <= timer->when)
+			break;
+		loop->timers[i] = loop->timers[parent];
+		loop->timers[i]->heap_index = i;
+		i = parent;
+		}
+	loop->timers[i] = timer;
+	timer->heap_index = i;
+	}
+
+void event_timer_sift_down(struct event_loop *loop, int i)
+	{
+	int child;
+	struct event_timer *timer = loop->timers[i];
+	
+	while((child = (2 * i) + 1) < loop->timers_pos)
+		{
+		if(child + 1 < loop->timers_pos && loop->timers[child + 1]->when < loop->timers[child]->when)
+			child++;
+		if(timer->when <= loop->timers[child]->when)
+			break;
+		loop->timers[i] = loop->timers[child];
+		loop->timers[i]->heap_index = i;
+		i = child;
+		}
+	loop->timers[i] = timer;
+	timer->heap_index = i;
+	}
@@ -0,0 +1,118 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * event.h
+ *     - Event loop. Waits on file descriptors and dispatches them to handlers.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_EVENT_H
+
+#include <poll.h>
+
+//On Linux we use epoll. Everywhere else (iOS) we fall back to poll().
+#ifdef __linux__
+#define EVENT_USE_EPOLL
+#endif
+
+//Event flags passed to handlers.
+#define EVENT_READ 0x01
+#define EVENT_HANGUP 0x02
+#define EVENT_ERROR 0x04
+
+//How many ready file descriptors we will collect per call to event_dispatch().
+#define EVENT_BATCH_SIZE 64
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct event_loop;
+struct event_timer;
+
+//Handlers return TRUE on success or FALSE on a fatal error, which is passed back up through event_dispatch().
+typedef int (*event_handler)(struct event_loop *loop, int fd, int events, void *data);
+typedef int (*event_timer_handler)(struct event_loop *loop, struct event_timer *timer, void *data);
+typedef int (*event_call_handler)(struct event_loop *loop, void *data, int64_t value);
+
+//Timers are owned by the caller (usually embedded in another struct) and are kept in a min-heap on the event loop while scheduled.
+//"when" is in milliseconds on the monotonic clock. (See time_monotonic_ms())
+struct event_timer
+	{
+	int64_t when;
+	int heap_index; //-1 while not scheduled.
+	event_timer_handler handler;
+	void *data;
+	};
+
+struct event_registration
+	{
+	event_handler handler;
+	void *data;
+	int registered;
+	int poll_index;
+	};
+
+struct event_ready
+	{
+	int fd, events;
+	};
+
+//A function call waiting to be run on the loop's own thread. (See event_call().)
+struct event_call
+	{
+	event_call_handler handler;
+	void *data;
+	int64_t value;
+	};
+
+struct event_loop
+	{
+	int epoll_fd;
+	struct event_registration *regs;
+	int regs_len;
+	struct pollfd *pollfds;
+	int pollfds_len, pollfds_pos;
+	struct event_ready ready[EVENT_BATCH_SIZE];
+	struct event_timer **timers;
+	int timers_len, timers_pos;
+	pthread_t thread; //Only this thread may touch the loop. Everyone else goes through event_call().
+	pthread_mutex_t calls_lock;
+	struct event_call *calls, *calls_running;
+	int calls_len, calls_pos, calls_running_len;
+	int wakeup_pipe[2];
+	};
+
+struct event_loop *event_loop_create(void);
+void event_loop_destroy(struct event_loop *loop);
+void event_loop_adopt(struct event_loop *loop);
+int event_call(struct event_loop *loop, event_call_handler handler, void *data, int64_t value);
+int event_calls_run(struct event_loop *loop, int fd, int events, void *data);
+int event_add(struct event_loop *loop, int fd, event_handler handler, void *data);
+int event_remove(struct event_loop *loop, int fd);
+int event_dispatch(struct event_loop *loop, int timeout_ms);
+void event_timer_init(struct event_timer *timer, event_timer_handler handler, void *data);
+int event_timer_schedule(struct event_loop *loop, struct event_timer *timer, int64_t when);
+void event_timer_cancel(struct event_loop *loop, struct event_timer *timer);
+int event_timer_pending(struct event_timer *timer);
+int event_timers_run(struct event_loop *loop);
+
+#define __SSHTUNNELS_EVENT_H
+#endif
+
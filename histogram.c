@@ -0,0 +1,96 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * histogram.c
+ *     - Fixed-size, log-bucketed histograms for latency measurements.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "histogram.h"
+#include "main.h"
+
+int histogram_bucket(uint32_t value);
+uint32_t histogram_bucket_top(int bucket);
+
+void histogram_reset(struct histogram *h)
+	{
+	memset(h, 0, sizeof(struct histogram));
+	}
+
+void histogram_record(struct histogram *h, uint32_t value)
+	{
+	h->buckets[histogram_bucket(value)]++;
+	h->count++;
+	if(value > h->max)
+		h->max = value;
+	}
+
+//Returns an upper bound for the given percentile (0-100) of all recorded values, or 0 if nothing has been recorded.
+uint32_t histogram_percentile(struct histogram *h, int percentile)
+	{
+	uint64_t rank, seen = 0;
+	int i;
+	
+	if(h->count == 0)
+		return 0;
+	
+	//Rank of the value we're looking for, rounded up, 1-based.
+	rank = (((uint64_t)h->count * (uint64_t)percentile) + 99) / 100;
+	if(rank < 1)
+		rank = 1;
+	
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+		seen = seen + h->buckets[i];
+		if(seen >= rank)
+			{
+			//Never report more than the largest value we've actually seen.
+			return histogram_bucket_top(i) < h->max ? histogram_bucket_top(i) : h->max;
+			}
+		}
+	return h->max;
+	}
+
+//Small values get a bucket each. Above that, the bucket is picked by the position of the highest set bit plus the next HISTOGRAM_SUBBUCKET_BITS bits.
+int histogram_bucket(uint32_t value)
+	{
+	int msb = 31;
+	
+	if(value < HISTOGRAM_SUBBUCKETS)
+		return (int)value;
+	
+	while(!(value & ((uint32_t)1 << msb)))
+		msb--;
+	return ((msb - HISTOGRAM_SUBBUCKET_BITS + 1) * HISTOGRAM_SUBBUCKETS) + (int)((value >> (msb - HISTOGRAM_SUBBUCKET_BITS)) & (HISTOGRAM_SUBBUCKETS - 1));
+	}
+
+//Returns the largest value which lands in the given bucket.
+uint32_t histogram_bucket_top(int bucket)
+	{
+	int msb;
+	uint64_t base, width;
+	
+	if(bucket < HISTOGRAM_SUBBUCKETS)
+		return (uint32_t)bucket;
+	
+	msb = (bucket / HISTOGRAM_SUBBUCKETS) + HISTOGRAM_SUBBUCKET_BITS - 1;
+	width = (uint64_t)1 << (msb - HISTOGRAM_SUBBUCKET_BITS);
+	base = ((uint64_t)1 << msb) + ((uint64_t)(bucket % HISTOGRAM_SUBBUCKETS) * width);
+	return (uint32_t)(base + width - 1);
+	}
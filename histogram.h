@@ -0,0 +1,48 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * histogram.h
+ *     - Fixed-size, log-bucketed histograms for latency measurements.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_HISTOGRAM_H
+
+#include <stdint.h>
+
+//Values are bucketed by power of two, with each power of two split into HISTOGRAM_SUBBUCKETS linear sub-buckets.
+//That keeps the relative error of any reported value under 25% while covering the full range of a uint32_t in a fixed amount of memory.
+#define HISTOGRAM_SUBBUCKET_BITS 2
+#define HISTOGRAM_SUBBUCKETS (1 << HISTOGRAM_SUBBUCKET_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUBBUCKETS * (32 - HISTOGRAM_SUBBUCKET_BITS + 1))
+
+struct histogram
+	{
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+	uint32_t count, max;
+	};
+
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint32_t value);
+uint32_t histogram_percentile(struct histogram *h, int percentile);
+
+#define __SSHTUNNELS_HISTOGRAM_H
+#endif
+
@@ -0,0 +1,285 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * launch.c
+ *     - Launch admission control. Keeps tunnels from all reconnecting at once.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <math.h>
+
+#include "launch.h"
+#include "main.h"
+#include "log.h"
+#include "util.h"
+
+//When the network changes, every tunnel tends to fail (and come due for relaunch) at the same moment.
+//Rather than launching them all together, due tunnels queue up here and are let through by priority,
+//no faster than the launch rate, and only while fewer than "concurrency" tunnels are still starting up.
+//The queue belongs to the central loop's thread. Tunnels on worker threads reach it through event_call().
+struct launch_queue launch_queue = { LAUNCH_CONCURRENCY_DEFAULT, 0, LAUNCH_RATE_DEFAULT, LAUNCH_BURST_DEFAULT, LAUNCH_BURST_DEFAULT, 0, NULL, 0, 0, 0, NULL };
+
+//Limits which weren't configured (LAUNCH_SCALED) are scaled to the number of tunnels, so that starting up (or a network change which
+//takes every tunnel down) is spread over about LAUNCH_SPREAD_TIME seconds, however many tunnels there are. A small configuration
+//gets the plain defaults.
+void launch_configure(struct event_loop *loop, int concurrency, double rate, double burst, int tunnels)
+	{
+	int scaled = (concurrency == LAUNCH_SCALED || rate == LAUNCH_SCALED || burst == LAUNCH_SCALED);
+	double default_rate = (double)tunnels / LAUNCH_SPREAD_TIME;
+	
+	if(default_rate < LAUNCH_RATE_DEFAULT)
+		default_rate = LAUNCH_RATE_DEFAULT;
+	if(rate == LAUNCH_SCALED)
+		rate = default_rate;
+	if(burst == LAUNCH_SCALED)
+		burst = default_rate > LAUNCH_BURST_DEFAULT ? default_rate : LAUNCH_BURST_DEFAULT;
+	if(concurrency == LAUNCH_SCALED)
+		{
+		concurrency = (int)ceil(default_rate * LAUNCH_CONCURRENCY_SECONDS);
+		if(concurrency < LAUNCH_CONCURRENCY_DEFAULT)
+			concurrency = LAUNCH_CONCURRENCY_DEFAULT;
+		}
+	if(scaled)
+		stl(STL_INFO, "Launching at most %g tunnel(s) per second (in bursts of up to %g), with up to %d starting up at once.", rate, burst, concurrency);
+	
+	launch_queue.loop = loop;
+	launch_queue.concurrency = concurrency;
+	launch_queue.rate = rate;
+	launch_queue.burst = burst;
+	launch_queue.tokens = burst;
+	event_timer_init(&launch_queue.timer, launch_timer, NULL);
+	}
+
+//Frees the queue. Every tunnel should already have been destroyed.
+void launch_destroy(void)
+	{
+	if(launch_queue.loop != NULL)
+		event_timer_cancel(launch_queue.loop, &launch_queue.timer);
+	free(launch_queue.heap);
+	launch_queue.heap = NULL;
+	launch_queue.heap_len = 0;
+	launch_queue.heap_pos = 0;
+	}
+
+//Called when a tunnel is due to (re)launch. It goes into the queue, and is launched as soon as there's room.
+//Returns TRUE on success or FALSE on error.
+int launch_request(struct tunnel *tun)
+	{
+	return event_call(launch_queue.loop, launch_request_call, tun, 0);
+	}
+
+int launch_request_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	struct tunnel **heap;
+	
+	if(tun->launch_heap_index >= 0)
+		return TRUE;
+	
+	if(launch_queue.heap_pos >= launch_queue.heap_len)
+		{
+		if((heap = realloc(launch_queue.heap, (launch_queue.heap_len ? launch_queue.heap_len * 2 : LIST_GROW_STEP) * sizeof(struct tunnel *))) == NULL)
+			{
+			stl(STL_ERROR, TUNNEL_MODULE "out of memory!", tun->id);
+			return FALSE;
+			}
+		launch_queue.heap = heap;
+		launch_queue.heap_len = launch_queue.heap_len ? launch_queue.heap_len * 2 : LIST_GROW_STEP;
+		}
+	
+	tun->launch_sequence = launch_queue.sequence++;
+	tun->launch_heap_index = launch_queue.heap_pos;
+	launch_queue.heap[launch_queue.heap_pos] = tun;
+	launch_queue.heap_pos++;
+	launch_sift_up(tun->launch_heap_index);
+	
+	if(launch_queue.concurrency > 0 && launch_queue.starting >= launch_queue.concurrency)
+		stl(STL_INFO, TUNNEL_MODULE "Waiting to launch. %d tunnel(s) are still starting up.", tun->id, launch_queue.starting);
+	return launch_run();
+	}
+
+//Launches queued tunnels for as long as the concurrency limit and the token bucket allow.
+//Returns TRUE on success or FALSE on error.
+int launch_run(void)
+	{
+	struct tunnel *tun;
+	int64_t now;
+	
+	while(launch_queue.heap_pos > 0)
+		{
+		//launch_release() will get us going again when a starting tunnel finishes one way or the other.
+		if(launch_queue.concurrency > 0 && launch_queue.starting >= launch_queue.concurrency)
+			return TRUE;
+		
+		now = time_monotonic_ms();
+		if(launch_queue.rate > 0)
+			{
+			launch_queue.tokens = launch_queue.tokens + ((double)(now - launch_queue.refilled) * launch_queue.rate / 1000.0);
+			if(launch_queue.tokens > launch_queue.burst)
+				launch_queue.tokens = launch_queue.burst;
+			launch_queue.refilled = now;
+			if(launch_queue.tokens < 1.0)
+				return event_timer_schedule(launch_queue.loop, &launch_queue.timer, now + (int64_t)ceil((1.0 - launch_queue.tokens) * 1000.0 / launch_queue.rate));
+			launch_queue.tokens = launch_queue.tokens - 1.0;
+			}
+		
+		tun = launch_queue.heap[0];
+		launch_cancel(tun);
+		
+		//The tunnel counts as starting until its first uptoken comes back. (Or, without UpToken, until it has stayed up for a little while.)
+		//If the launch fails, tunnel_schedule_relaunch() hands the slot straight back.
+		if(!tun->launch_starting)
+			{
+			tun->launch_starting = TRUE;
+			launch_queue.starting++;
+			}
+		tun->launch_granted = now;
+		if(!event_timer_schedule(launch_queue.loop, &tun->confirm_timer, now + ((int64_t)(tun->options.uptoken_enabled ? LAUNCH_CONFIRM_TIMEOUT : LAUNCH_SETTLE_TIME) * 1000)))
+			return FALSE;
+		
+		//The launch itself happens on the tunnel's own thread.
+		if(!event_call(tun->loop, tunnel_launch_call, tun, 0))
+			return FALSE;
+		}
+	return TRUE;
+	}
+
+//Timer handler: the token bucket has refilled (or a slot has opened up), so try the queue again.
+int launch_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	return launch_run();
+	}
+
+//Timer handler: a starting tunnel has either settled down or taken too long to confirm. Either way, it no longer holds up the queue.
+int launch_confirm_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(tun->options.uptoken_enabled)
+		stl(STL_WARNING, TUNNEL_MODULE "No uptoken has come back within %d seconds of launch. Letting other tunnels launch anyway.", tun->id, LAUNCH_CONFIRM_TIMEOUT);
+	return launch_release(tun);
+	}
+
+//The tunnel's first uptoken came back, so it's up.
+//Returns TRUE on success or FALSE on error.
+int launch_confirmed(struct tunnel *tun)
+	{
+	return event_call(launch_queue.loop, launch_confirmed_call, tun, 0);
+	}
+
+int launch_confirmed_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(!tun->launch_starting)
+		return TRUE;
+	stl(STL_INFO, TUNNEL_MODULE "Tunnel is up %d ms after launch.", tun->id, (int)(time_monotonic_ms() - tun->launch_granted));
+	return launch_release_call(loop, tun, 0);
+	}
+
+//The tunnel is no longer starting up. (It's confirmed, it gave up, or it's gone.) Let the next one through.
+//The queue itself is run from its timer, so this is safe to call from anywhere.
+//Returns TRUE on success or FALSE on error.
+int launch_release(struct tunnel *tun)
+	{
+	//Before the queue is configured, nothing can have been launched.
+	if(launch_queue.loop == NULL)
+		return TRUE;
+	return event_call(launch_queue.loop, launch_release_call, tun, 0);
+	}
+
+int launch_release_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(!tun->launch_starting)
+		return TRUE;
+	
+	tun->launch_starting = FALSE;
+	launch_queue.starting--;
+	event_timer_cancel(launch_queue.loop, &tun->confirm_timer);
+	if(launch_queue.heap_pos > 0)
+		return event_timer_schedule(launch_queue.loop, &launch_queue.timer, time_monotonic_ms());
+	return TRUE;
+	}
+
+//Takes a tunnel out of the queue, if it's in there.
+void launch_cancel(struct tunnel *tun)
+	{
+	int i = tun->launch_heap_index, last = launch_queue.heap_pos - 1;
+	
+	if(i < 0)
+		return;
+	
+	tun->launch_heap_index = -1;
+	launch_queue.heap_pos = last;
+	if(i == last)
+		return;
+	
+	launch_queue.heap[i] = launch_queue.heap[last];
+	launch_queue.heap[i]->launch_heap_index = i;
+	launch_sift_up(i);
+	launch_sift_down(launch_queue.heap[i]->launch_heap_index);
+	}
+
+//Higher priority tunnels go first. Within a priority, it's first come, first served.
+int launch_before(struct tunnel *a, struct tunnel *b)
+	{
+	if(a->options.launch_priority != b->options.launch_priority)
+		return a->options.launch_priority > b->options.launch_priority;
+	return (int32_t)(a->launch_sequence - b->launch_sequence) < 0;
+	}
+
+void launch_sift_up(int i)
+	{
+	int parent;
+	struct tunnel *tun = launch_queue.heap[i];
+	
+	while(i > 0)
+		{
+		parent = (i - 1) / 2;
+		if(!launch_before(tun, launch_queue.heap[parent]))
+			break;
+		launch_queue.heap[i] = launch_queue.heap[parent];
+		launch_queue.heap[i]->launch_heap_index = i;
+		i = parent;
+		}
+	launch_queue.heap[i] = tun;
+	tun->launch_heap_index = i;
+	}
+
+void launch_sift_down(int i)
+	{
+	int child;
+	struct tunnel *tun = launch_queue.heap[i];
+	
+	while((child = (2 * i) + 1) < launch_queue.heap_pos)
+		{
+		if(child + 1 < launch_queue.heap_pos && launch_before(launch_queue.heap[child + 1], launch_queue.heap[child]))
+			child++;
+		if(!launch_before(launch_queue.heap[child], tun))
+			break;
+		launch_queue.heap[i] = launch_queue.heap[child];
+		launch_queue.heap[i]->launch_heap_index = i;
+		i = child;
+		}
+	launch_queue.heap[i] = tun;
+	tun->launch_heap_index = i;
+	}
+
@@ -0,0 +1,71 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * launch.h
+ *     - Launch admission control. Keeps tunnels from all reconnecting at once.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_LAUNCH_H
+
+#include "tunnel.h"
+
+//The defaults grow with the number of tunnels. (See launch_configure().) These are the least they can be.
+#define LAUNCH_CONCURRENCY_DEFAULT 4 //Tunnels which may be starting up at once. (0 for no limit.)
+#define LAUNCH_RATE_DEFAULT 2 //Launches per second. (0 for no limit.)
+#define LAUNCH_BURST_DEFAULT 4
+#define LAUNCH_SCALED -1 //Stands in for a limit which wasn't configured, until launch_configure() works out its default.
+#define LAUNCH_SPREAD_TIME 60 //Seconds it takes the default LaunchRate to launch every tunnel.
+#define LAUNCH_CONCURRENCY_SECONDS 2 //The default LaunchConcurrency lets this many seconds' worth of launches be starting up at once.
+#define LAUNCH_SETTLE_TIME 5 //Seconds a tunnel without UpToken has to stay up before it counts as started.
+#define LAUNCH_CONFIRM_TIMEOUT 30 //Seconds after which a tunnel stops counting against the concurrency limit even if it never confirmed.
+
+//Tunnels which are due to launch wait here, in priority order, until there's room for them.
+struct launch_queue
+	{
+	int concurrency, starting;
+	double rate, burst, tokens;
+	int64_t refilled; //Milliseconds. (Monotonic clock.)
+	struct tunnel **heap;
+	int heap_len, heap_pos;
+	uint32_t sequence;
+	struct event_loop *loop;
+	struct event_timer timer;
+	};
+
+void launch_configure(struct event_loop *loop, int concurrency, double rate, double burst, int tunnels);
+void launch_destroy(void);
+int launch_request(struct tunnel *tun);
+int launch_request_call(struct event_loop *loop, void *data, int64_t value);
+int launch_run(void);
+int launch_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int launch_confirm_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int launch_confirmed(struct tunnel *tun);
+int launch_confirmed_call(struct event_loop *loop, void *data, int64_t value);
+int launch_release(struct tunnel *tun);
+int launch_release_call(struct event_loop *loop, void *data, int64_t value);
+void launch_cancel(struct tunnel *tun);
+int launch_before(struct tunnel *a, struct tunnel *b);
+void launch_sift_up(int i);
+void launch_sift_down(int i);
+
+#define __SSHTUNNELS_LAUNCH_H
+#endif
+
@@ -0,0 +1,132 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * linebuf.c
+ *     - Growable line reassembly buffer for reading child process output.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "linebuf.h"
+#include "main.h"
+
+void linebuf_init(struct linebuf *lb)
+	{
+	lb->data = NULL;
+	lb->size = 0;
+	linebuf_reset(lb);
+	}
+
+void linebuf_free(struct linebuf *lb)
+	{
+	free(lb->data);
+	linebuf_init(lb);
+	}
+
+//Forgets whatever is in the buffer, but keeps the memory.
+void linebuf_reset(struct linebuf *lb)
+	{
+	lb->start = 0;
+	lb->end = 0;
+	lb->scan = 0;
+	lb->full = FALSE;
+	}
+
+//Doubles the buffer, or allocates it to begin with.
+//Returns TRUE on success or FALSE on error.
+int linebuf_grow(struct linebuf *lb)
+	{
+	int size = lb->size ? lb->size * 2 : LINEBUF_INITIAL;
+	char *data;
+	
+	if(size > LINEBUF_SIZE)
+		size = LINEBUF_SIZE;
+	if((data = (char *)realloc(lb->data, size + 1)) == NULL)
+		return FALSE;
+	lb->data = data;
+	lb->size = size;
+	return TRUE;
+	}
+
+//Reads whatever is available from fd into the free space at the end of the buffer.
+//Returns the result of read(), so 0 means end of file and -1 means check errno.
+ssize_t linebuf_fill(struct linebuf *lb, int fd)
+	{
+	ssize_t readret;
+	
+	//Lines which have already been handed out are finished with, so move any partial line down to make room.
+	//(This keeps lb->full, so a busy stream still grows the buffer even though every line in it has been used up.)
+	if(lb->start > 0)
+		{
+		memmove(lb->data, lb->data + lb->start, lb->end - lb->start);
+		lb->end = lb->end - lb->start;
+		lb->scan = lb->scan - lb->start;
+		lb->start = 0;
+		}
+	
+	//Make room if there isn't any, or if the last read suggests the output is coming faster than the buffer can take it.
+	if((lb->end == lb->size || lb->full) && lb->size < LINEBUF_SIZE && !linebuf_grow(lb) && lb->end == lb->size)
+		{
+		errno = ENOMEM;
+		return -1;
+		}
+	
+	readret = read(fd, lb->data + lb->end, lb->size - lb->end);
+	lb->full = (readret == lb->size - lb->end);
+	if(readret > 0)
+		lb->end = lb->end + readret;
+	return readret;
+	}
+
+//Returns the next complete line in the buffer, or NULL if there isn't one.
+//If flush is TRUE, a trailing partial line is returned as well. (Use this at end of file.)
+//The line stays valid until the next call to linebuf_fill().
+char *linebuf_line(struct linebuf *lb, int flush)
+	{
+	char *line, *newline;
+	int len;
+	
+	if(lb->start == lb->end)
+		return NULL;
+	
+	line = lb->data + lb->start;
+	if((newline = memchr(lb->data + lb->scan, '\n', lb->end - lb->scan)) != NULL)
+		{
+		len = newline - line;
+		lb->start = lb->start + len + 1;
+		}
+	else if(flush || (lb->start == 0 && lb->end == LINEBUF_SIZE))
+		{
+		//Either there's nothing more coming, or the line is too long for the buffer. Hand back what we have.
+		len = lb->end - lb->start;
+		lb->start = lb->end;
+		}
+	else
+		{
+		//Only a partial line so far. Don't scan it again next time.
+		lb->scan = lb->end;
+		return NULL;
+		}
+	
+	lb->scan = lb->start;
+	if(len > 0 && line[len - 1] == '\r')
+		len--;
+	line[len] = '\0';
+	return line;
+	}
+
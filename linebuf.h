@@ -0,0 +1,54 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * linebuf.h
+ *     - Growable line reassembly buffer for reading child process output.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_LINEBUF_H
+
+#include <sys/types.h>
+
+//Longest line we will hand back in one piece. Anything longer is split.
+#define LINEBUF_SIZE 4096
+#define LINEBUF_INITIAL 128 //Where the buffer starts out, the first time anything is read. It doubles (up to LINEBUF_SIZE) when it fills up.
+
+//Bytes are read straight into data[], and complete lines are handed back in place (null-terminated, without the newline).
+//A partial line at the end of a read stays put until the rest of it arrives.
+//Most tunnels only ever send short uptoken replies, and some never write to STDERR at all, so the buffer is allocated on first use
+//and only grows for long lines or a lot of output at once.
+struct linebuf
+	{
+	char *data; //size + 1 bytes, so that a completely full buffer can still be null-terminated. (NULL until the first read.)
+	int size, start, end, scan;
+	int full; //The last read filled the buffer, so there's likely more waiting.
+	};
+
+void linebuf_init(struct linebuf *lb);
+void linebuf_free(struct linebuf *lb);
+void linebuf_reset(struct linebuf *lb);
+int linebuf_grow(struct linebuf *lb);
+ssize_t linebuf_fill(struct linebuf *lb, int fd);
+char *linebuf_line(struct linebuf *lb, int flush);
+
+#define __SSHTUNNELS_LINEBUF_H
+#endif
+
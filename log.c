@@ -25,10 +25,43 @@
 #include "main.h"
 #include "log.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
 #ifdef SYSLOG
 #include <syslog.h>
 #endif
 
+//One preformatted log line waiting in the async ring.
+//Each slot's sequence number says whose turn it is: producers may fill it when it equals their ticket, and the writer may drain it when it equals ticket + 1.
+struct stl_record
+	{
+	atomic_uint sequence;
+	int type, message_offset, len;
+	char text[STL_ASYNC_RECORD_SIZE];
+	};
+
+struct stl_async_state
+	{
+	struct stl_record records[STL_ASYNC_RECORDS];
+	atomic_uint enqueue_pos, dropped;
+	atomic_int running, stopping, writer_sleeping;
+	unsigned int dequeue_pos, dropped_reported;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	};
+
+static struct stl_async_state *stl_async = NULL;
+
+void stl_output(int type, char *message);
+void stl_write(FILE *outdest, int type, char *message);
+int stl_async_push(int type, char *message);
+void *stl_async_writer(void *data);
+int stl_async_drain(void);
+const char *stl_label(int type);
+
 FILE *stl_logoutput(int query, FILE *newdest)
 	{
 	static FILE *outdest;
@@ -73,11 +106,11 @@ void stl_loginit(char *name)
 	initialized = TRUE;
 	}
 
+
 void stl(int type, char *message_format, ...)
 	{
-	int loopa, loopb, freeable = 1, bufferlen = STL_BUFFERLEN_STEP, formatting, ret;
-	char *buffer = NULL, *buffer_temp = NULL;
-	FILE *outdest;
+	int loopa, loopb, ret;
+	char stack_buffer[STL_BUFFERLEN_STACK], *buffer = stack_buffer, *heap_buffer = NULL;
 	va_list arguments;
 
 	if(type == STL_INFO && STL_SUPRESS_ALL_INFO == TRUE) return;
@@ -88,61 +121,62 @@ void stl(int type, char *message_format, ...)
 		return;
 		}
 	
-	//We're going to try and grab some memory so we can do neat things.
-	if((buffer = malloc(bufferlen * sizeof(char))) == NULL)
+	//Almost every message fits in the stack buffer. If this one doesn't, vsnprintf() has told us exactly how much memory it needs.
+	va_start(arguments, message_format);
+	ret = vsnprintf(stack_buffer, STL_BUFFERLEN_STACK, message_format, arguments);
+	va_end(arguments);
+	if(ret >= STL_BUFFERLEN_STACK)
 		{
-		//We couldn't get any memory, so give up on that.
-		freeable = 0;
-		buffer = message_format;
-		stl(STL_ERROR, "Out Of Memory!");
-		}
-	else //We got our text buffer. Now we can populate it and perform a format conversion.
-		{
-		//Perform a format conversion, increasing the size of our buffer until we have enough.
-		formatting = 1;
-		while(formatting)
+		if((heap_buffer = malloc(ret + 1)) == NULL)
+			{
+			//We couldn't get enough memory, so settle for the truncated message.
+			stl(STL_ERROR, "Out Of Memory!");
+			}
+		else
 			{
-			//Format conversion.
 			va_start(arguments, message_format);
-			ret = vsnprintf(buffer, bufferlen, message_format, arguments);
+			vsnprintf(heap_buffer, ret + 1, message_format, arguments);
 			va_end(arguments);
-			
-			//Did the format conversion succeed? Did it fit in the buffer?
-			if(ret >= 0 && ret < bufferlen)
-				{
-				formatting = 0; //All done.
-				}
-			else //The formatting failed! Need more memory!
-				{
-				//We need to increase the size of the buffer.
-				bufferlen = bufferlen + STL_BUFFERLEN_STEP;
-				if((buffer_temp = realloc(buffer, bufferlen)) == NULL)
-					{
-					free(buffer);
-					//We couldn't get enough memory, so give up on that.
-					freeable = 0;
-					buffer = message_format;
-					stl(STL_ERROR, "Out Of Memory!");
-					formatting = 0;
-					}
-				else //We succeeded in reallocating.
-					buffer = buffer_temp;
-				}
+			buffer = heap_buffer;
 			}
-		
-		if(freeable) //Are we still working on our own buffer?
+		}
+	else if(ret < 0)
+		{
+		//The format conversion failed outright. Output the format string itself rather than nothing.
+		buffer = message_format;
+		}
+	
+	if(buffer != message_format)
+		{
+		loopb = 0;
+		for(loopa = 0; buffer[loopa]; loopa++)
 			{
-			loopb = 0;
-			for(loopa = 0; buffer[loopa]; loopa++)
+			if(buffer[loopa] >= 32 && buffer[loopa] <= 126) //Strip out ALL non-printable ASCII.
 				{
-				if(buffer[loopa] >= 32 && buffer[loopa] <= 126) //Strip out ALL non-printable ASCII.
-					{
-					if(loopa != loopb) buffer[loopb] = buffer[loopa];
-					loopb++;
-					}
+				if(loopa != loopb) buffer[loopb] = buffer[loopa];
+				loopb++;
 				}
-			buffer[loopb] = '\0';
 			}
+		buffer[loopb] = '\0';
+		}
+	
+	if(type < STL_ERROR || type >= STL_RESERVED)
+		stl(STL_WARNING, "Internal Program Error: Somebody sent a message without a valid message type! The errant message follows:");
+	stl_output(type, buffer);
+	
+	free(heap_buffer);
+	return;
+	}
+
+//Hands a finished message to the writer thread if async logging is running, or writes it out right away if not.
+void stl_output(int type, char *message)
+	{
+	FILE *outdest;
+	
+	if(stl_async != NULL && atomic_load(&stl_async->running))
+		{
+		stl_async_push(type, message);
+		return;
 		}
 	
 	//Check the output destination.
@@ -154,55 +188,273 @@ void stl(int type, char *message_format, ...)
 		outdest = stderr;
 	#endif
 	
-	//Actually output the log line.
-	if(buffer != NULL)
+	stl_write(outdest, type, message);
+	}
+
+const char *stl_label(int type)
+	{
+	switch(type)
+		{
+		case STL_INFO:
+			return "Info";
+		case STL_WARNING:
+			return "Warning";
+		case STL_ERROR:
+			return "Error";
+		default:
+			return "Unknown Notice";
+		}
+	}
+
+//Actually output the log line.
+void stl_write(FILE *outdest, int type, char *message)
+	{
+	#ifdef SYSLOG
+	if(outdest == STL_OUTPUT_SYSLOG)
 		{
 		switch(type)
 			{
 			case STL_INFO:
-				#ifdef SYSLOG
-				if(outdest == STL_OUTPUT_SYSLOG)
-					syslog(LOG_INFO, "%s", buffer);
-				#endif
-				
-				if(outdest != STL_OUTPUT_SYSLOG)
-					fprintf(outdest, "%s: Info: %s\n", stl_logname(NULL), buffer);
-				break;
-			case STL_WARNING:
-				#ifdef SYSLOG
-				if(outdest == STL_OUTPUT_SYSLOG)
-					syslog(LOG_WARNING, "%s", buffer);
-				#endif
-				
-				if(outdest != STL_OUTPUT_SYSLOG)
-					fprintf(outdest, "%s: Warning: %s\n", stl_logname(NULL), buffer);
+				syslog(LOG_INFO, "%s", message);
 				break;
 			case STL_ERROR:
-				#ifdef SYSLOG
-				if(outdest == STL_OUTPUT_SYSLOG)
-					syslog(LOG_ERR, "%s", buffer);
-				#endif
-				
-				if(outdest != STL_OUTPUT_SYSLOG)
-					fprintf(outdest, "%s: Error: %s\n", stl_logname(NULL), buffer);
+				syslog(LOG_ERR, "%s", message);
 				break;
 			default:
-				stl(STL_WARNING, "Internal Program Error: Somebody sent a message without a valid message type! The errant message follows:");
-				
-				#ifdef SYSLOG
-				if(outdest == STL_OUTPUT_SYSLOG)
-					syslog(LOG_WARNING, "%s", buffer);
-				#endif
-				
-				if(outdest != STL_OUTPUT_SYSLOG)
-					fprintf(outdest, "%s: Unknown Notice: %s\n", stl_logname(NULL), buffer);
+				syslog(LOG_WARNING, "%s", message);
 				break;
 			}
-		if(outdest != STL_OUTPUT_SYSLOG)
-			fflush(NULL);
+		return;
 		}
+	#endif
 	
-	if(freeable) free(buffer);
-	return;
+	//Worker threads log too. Hold the stream across the write and the flush, so that lines from different threads never interleave.
+	flockfile(outdest);
+	fprintf(outdest, "%s: %s: %s\n", stl_logname(NULL), stl_label(type), message);
+	fflush(outdest); //Only our own stream. Flushing every stream in the process is needlessly expensive.
+	funlockfile(outdest);
 	}
 
+//Starts (enable is TRUE) or stops (enable is FALSE) asynchronous logging.
+//While it's running, stl() only formats the message into a ring buffer, and a writer thread takes care of the actual output.
+//Stopping waits for everything already queued to be written.
+//Returns TRUE on success or FALSE on error. (In which case logging stays synchronous.)
+int stl_logasync(int enable)
+	{
+	int i;
+	
+	if(!enable)
+		{
+		if(stl_async == NULL)
+			return TRUE;
+		if(atomic_load(&stl_async->running))
+			{
+			atomic_store(&stl_async->stopping, TRUE);
+			pthread_mutex_lock(&stl_async->lock);
+			pthread_cond_signal(&stl_async->wakeup);
+			pthread_mutex_unlock(&stl_async->lock);
+			pthread_join(stl_async->writer, NULL);
+			atomic_store(&stl_async->running, FALSE);
+			}
+		pthread_mutex_destroy(&stl_async->lock);
+		pthread_cond_destroy(&stl_async->wakeup);
+		free(stl_async);
+		stl_async = NULL;
+		return TRUE;
+		}
+	
+	if(stl_async != NULL)
+		return TRUE;
+	if((stl_async = calloc(1, sizeof(struct stl_async_state))) == NULL)
+		{
+		stl(STL_ERROR, "Out Of Memory!");
+		return FALSE;
+		}
+	for(i = 0; i < STL_ASYNC_RECORDS; i++)
+		atomic_init(&stl_async->records[i].sequence, i);
+	atomic_init(&stl_async->enqueue_pos, 0);
+	atomic_init(&stl_async->dropped, 0);
+	atomic_init(&stl_async->stopping, FALSE);
+	atomic_init(&stl_async->writer_sleeping, FALSE);
+	pthread_mutex_init(&stl_async->lock, NULL);
+	pthread_cond_init(&stl_async->wakeup, NULL);
+	
+	//Set running first, so that the writer thread doesn't see itself as already stopped.
+	atomic_init(&stl_async->running, TRUE);
+	if((i = pthread_create(&stl_async->writer, NULL, stl_async_writer, NULL)) != 0)
+		{
+		atomic_store(&stl_async->running, FALSE);
+		stl(STL_ERROR, "Failed starting the log writer thread! (%s)", strerror(i));
+		pthread_mutex_destroy(&stl_async->lock);
+		pthread_cond_destroy(&stl_async->wakeup);
+		free(stl_async);
+		stl_async = NULL;
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Copies a message into the next free slot of the ring. Never blocks. If the ring is full, the message is dropped and counted.
+//Returns TRUE if the message was queued or FALSE if it was dropped.
+int stl_async_push(int type, char *message)
+	{
+	struct stl_record *record;
+	unsigned int pos, sequence;
+	int len;
+	
+	pos = atomic_load_explicit(&stl_async->enqueue_pos, memory_order_relaxed);
+	for(;;)
+		{
+		record = &stl_async->records[pos % STL_ASYNC_RECORDS];
+		sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+		if(sequence == pos)
+			{
+			//This slot is free. Claim it, unless another thread beat us to it.
+			if(atomic_compare_exchange_weak_explicit(&stl_async->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+			}
+		else if((int)(sequence - pos) < 0)
+			{
+			//The writer hasn't drained this slot from the last time around yet, so the ring is full.
+			atomic_fetch_add_explicit(&stl_async->dropped, 1, memory_order_relaxed);
+			return FALSE;
+			}
+		else
+			pos = atomic_load_explicit(&stl_async->enqueue_pos, memory_order_relaxed);
+		}
+	
+	//Preformat the whole line now, so that the writer can hand it straight to writev(). Anything which doesn't fit is cut short.
+	record->type = type;
+	len = snprintf(record->text, STL_ASYNC_RECORD_SIZE, "%s: %s: ", stl_logname(NULL), stl_label(type));
+	if(len < 0 || len >= STL_ASYNC_RECORD_SIZE - 5)
+		len = 0;
+	record->message_offset = len;
+	len = len + snprintf(record->text + len, STL_ASYNC_RECORD_SIZE - len - 1, "%s", message);
+	if(len >= STL_ASYNC_RECORD_SIZE - 1)
+		{
+		len = STL_ASYNC_RECORD_SIZE - 1;
+		memcpy(record->text + len - 3, "...", 3);
+		}
+	record->text[len] = '\n';
+	record->len = len + 1;
+	atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+	
+	//Only bother the writer if it's asleep. The fence keeps the load from being done before the store above. Otherwise we could
+	//miss the writer going to sleep while it misses our record, and the record would wait for the next stl() call. (See stl_async_writer().)
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load(&stl_async->writer_sleeping))
+		{
+		pthread_mutex_lock(&stl_async->lock);
+		pthread_cond_signal(&stl_async->wakeup);
+		pthread_mutex_unlock(&stl_async->lock);
+		}
+	return TRUE;
+	}
+
+//The writer thread. Drains the ring in batches until logging is stopped, and then drains whatever is left.
+void *stl_async_writer(void *data)
+	{
+	for(;;)
+		{
+		if(stl_async_drain() > 0)
+			continue;
+		if(atomic_load(&stl_async->stopping))
+			break;
+		
+		//Nothing to do. Sleep until a producer wakes us up, checking once more for records which arrived just before we said we were asleep.
+		pthread_mutex_lock(&stl_async->lock);
+		atomic_store(&stl_async->writer_sleeping, TRUE);
+		atomic_thread_fence(memory_order_seq_cst); //Pairs with the fence in stl_async_push().
+		if(atomic_load_explicit(&stl_async->records[stl_async->dequeue_pos % STL_ASYNC_RECORDS].sequence, memory_order_acquire) != stl_async->dequeue_pos + 1 && !atomic_load(&stl_async->stopping))
+			pthread_cond_wait(&stl_async->wakeup, &stl_async->lock);
+		atomic_store(&stl_async->writer_sleeping, FALSE);
+		pthread_mutex_unlock(&stl_async->lock);
+		}
+	return NULL;
+	}
+
+//Writes out up to STL_ASYNC_BATCH queued records with a single writev(), then releases their slots.
+//Returns the number of records written.
+int stl_async_drain(void)
+	{
+	struct iovec iov[STL_ASYNC_BATCH];
+	struct stl_record *record;
+	unsigned int dropped;
+	char notice[128];
+	FILE *outdest;
+	int count = 0, i, done, fd;
+	ssize_t wrote;
+	
+	while(count < STL_ASYNC_BATCH)
+		{
+		record = &stl_async->records[(stl_async->dequeue_pos + count) % STL_ASYNC_RECORDS];
+		if(atomic_load_explicit(&record->sequence, memory_order_acquire) != stl_async->dequeue_pos + count + 1)
+			break;
+		iov[count].iov_base = record->text;
+		iov[count].iov_len = record->len;
+		count++;
+		}
+	
+	outdest = stl_logoutput(TRUE, NULL);
+	#ifndef SYSLOG
+	if(outdest == STL_OUTPUT_SYSLOG)
+		outdest = stderr;
+	#endif
+	
+	if(count > 0)
+		{
+		#ifdef SYSLOG
+		if(outdest == STL_OUTPUT_SYSLOG)
+			{
+			for(i = 0; i < count; i++)
+				{
+				record = &stl_async->records[(stl_async->dequeue_pos + i) % STL_ASYNC_RECORDS];
+				record->text[record->len - 1] = '\0';
+				stl_write(outdest, record->type, record->text + record->message_offset);
+				}
+			}
+		else
+		#endif
+			{
+			//writev() may stop short, so pick up wherever it left off. If the output is broken there's nothing more we can do.
+			fd = fileno(outdest);
+			for(i = 0, done = FALSE; i < count && !done;)
+				{
+				if((wrote = writev(fd, iov + i, count - i)) < 0)
+					{
+					if(errno != EINTR)
+						done = TRUE;
+					continue;
+					}
+				while(i < count && wrote >= (ssize_t)iov[i].iov_len)
+					{
+					wrote = wrote - iov[i].iov_len;
+					i++;
+					}
+				if(i < count)
+					{
+					iov[i].iov_base = (char *)iov[i].iov_base + wrote;
+					iov[i].iov_len = iov[i].iov_len - wrote;
+					}
+				}
+			}
+		
+		//Hand the slots back to the producers for their next time around the ring.
+		for(i = 0; i < count; i++)
+			{
+			record = &stl_async->records[(stl_async->dequeue_pos + i) % STL_ASYNC_RECORDS];
+			atomic_store_explicit(&record->sequence, stl_async->dequeue_pos + i + STL_ASYNC_RECORDS, memory_order_release);
+			}
+		stl_async->dequeue_pos = stl_async->dequeue_pos + count;
+		}
+	
+	//Own up to anything which was dropped.
+	dropped = atomic_load_explicit(&stl_async->dropped, memory_order_relaxed);
+	if(dropped != stl_async->dropped_reported)
+		{
+		snprintf(notice, sizeof(notice), "%u log message(s) dropped because the log writer fell behind.", dropped - stl_async->dropped_reported);
+		stl_async->dropped_reported = dropped;
+		stl_write(outdest, STL_WARNING, notice);
+		}
+	return count;
+	}
@@ -48,12 +48,18 @@ enum
 //direct messages to stderr by default
 #define STL_OUTPUT_DEFAULT stderr
 
-//Message formatting buffer size incrementation.
-#define STL_BUFFERLEN_STEP 128
+//Messages shorter than this are formatted on the stack. Longer ones get exactly as much heap as they need.
+#define STL_BUFFERLEN_STACK 512
+
+//Async logging ring buffer. (See stl_logasync())
+#define STL_ASYNC_RECORDS 1024 //Must be a power of two.
+#define STL_ASYNC_RECORD_SIZE 512 //Longer lines are cut short.
+#define STL_ASYNC_BATCH 64 //Most records written by a single writev().
 
 FILE *stl_logoutput(int query, FILE *newdest);
 void stl_loginit(char *name);
 void stl(int status, char *message_format, ...); //Now supports printf() format conversion.
+int stl_logasync(int enable);
 
 #define __SSHTUNNELS_LOG_H
 #endif
@@ -0,0 +1,288 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * magic.c
+ *     - Matches "magic words" in tunnel output against a compiled set of patterns.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <ctype.h>
+
+#include "magic.h"
+#include "main.h"
+#include "log.h"
+
+//Used when the configuration doesn't declare any global <MagicWord> tags.
+struct magic_word magic_words_default[] =
+	{
+	{ "port forwarding failed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 },
+	{ "combat check failed", MAGIC_ACTION_CONDEMN, STL_ERROR, 0, 0 }
+	};
+int magic_words_default_len = sizeof(magic_words_default) / sizeof(struct magic_word);
+
+int magic_insert(struct magic_automaton *a, int word);
+int magic_link(struct magic_automaton *a);
+struct magic_matcher *magic_matcher_create(struct magic_automaton *a, struct magic_word *words, int words_len);
+void magic_automaton_destroy(struct magic_automaton *a, int patterns_len);
+
+//Returns the MAGIC_ACTION_* for an action name, or 0 if there's no such action.
+int magic_word_action(const char *name)
+	{
+	if(strcasecmp(name, "condemn") == 0)
+		return MAGIC_ACTION_CONDEMN;
+	if(strcasecmp(name, "log") == 0)
+		return MAGIC_ACTION_LOG;
+	if(strcasecmp(name, "count") == 0)
+		return MAGIC_ACTION_COUNT;
+	return 0;
+	}
+
+//Builds a matcher for the global words followed by the per-tunnel words. The matcher keeps its own copies of everything, and its
+//automaton can be shared with other matchers for the same words. (See magic_share().)
+//Returns NULL on error.
+struct magic_matcher *magic_compile(struct magic_word *global_words, int global_words_len, struct magic_word *words, int words_len)
+	{
+	struct magic_automaton *a;
+	struct magic_word *all = NULL;
+	struct magic_matcher *m;
+	int i, j, states_max = 1, all_len = global_words_len + words_len;
+	unsigned char c;
+	
+	if((a = calloc(1, sizeof(struct magic_automaton))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return NULL;
+		}
+	if(all_len > 0 && ((all = calloc(all_len, sizeof(struct magic_word))) == NULL || (a->patterns = calloc(all_len, sizeof(char *))) == NULL))
+		{
+		stl(STL_ERROR, "Out of memory!");
+		free(all);
+		magic_automaton_destroy(a, 0);
+		return NULL;
+		}
+	for(i = 0; i < all_len; i++)
+		{
+		all[i] = (i < global_words_len) ? global_words[i] : words[i - global_words_len];
+		if((a->patterns[i] = strdup(all[i].pattern)) == NULL)
+			{
+			stl(STL_ERROR, "Out of memory!");
+			free(all);
+			magic_automaton_destroy(a, all_len);
+			return NULL;
+			}
+		all[i].pattern = a->patterns[i];
+		states_max = states_max + strlen(a->patterns[i]);
+		}
+	
+	//Class 0 is every byte which doesn't appear in any pattern. Upper and lower case share a class.
+	a->classes_len = 1;
+	for(i = 0; i < all_len; i++)
+		{
+		for(j = 0; a->patterns[i][j]; j++)
+			{
+			c = (unsigned char)tolower((unsigned char)a->patterns[i][j]);
+			if(a->classes[c] == 0)
+				{
+				a->classes[c] = a->classes_len;
+				a->classes[toupper(c)] = a->classes_len;
+				a->classes_len++;
+				}
+			}
+		}
+	
+	if((a->delta = malloc(states_max * a->classes_len * sizeof(int))) == NULL || (a->output = malloc(states_max * sizeof(int))) == NULL || (a->output_next = malloc(states_max * sizeof(int))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		free(all);
+		magic_automaton_destroy(a, all_len);
+		return NULL;
+		}
+	for(i = 0; i < states_max * a->classes_len; i++)
+		a->delta[i] = -1;
+	
+	//Build the trie, then turn it into a full automaton.
+	a->states_len = 1;
+	a->output[0] = -1;
+	for(i = 0; i < all_len; i++)
+		magic_insert(a, i);
+	if(!magic_link(a) || (m = magic_matcher_create(a, all, all_len)) == NULL)
+		{
+		free(all);
+		magic_automaton_destroy(a, all_len);
+		return NULL;
+		}
+	free(all);
+	return m;
+	}
+
+//Returns a new matcher for the same words as m, sharing its automaton, with its own counts. It must be destroyed separately.
+//Returns NULL on error.
+struct magic_matcher *magic_share(struct magic_matcher *m)
+	{
+	return magic_matcher_create(m->automaton, m->words, m->words_len);
+	}
+
+//Makes a matcher using the automaton a, with its own copy of the words (but not their patterns, which belong to a).
+//Returns NULL on error.
+struct magic_matcher *magic_matcher_create(struct magic_automaton *a, struct magic_word *words, int words_len)
+	{
+	struct magic_matcher *m;
+	int i;
+	
+	if((m = calloc(1, sizeof(struct magic_matcher))) == NULL || (words_len > 0 && (m->words = calloc(words_len, sizeof(struct magic_word))) == NULL))
+		{
+		stl(STL_ERROR, "Out of memory!");
+		free(m);
+		return NULL;
+		}
+	m->words_len = words_len;
+	for(i = 0; i < words_len; i++)
+		{
+		m->words[i] = words[i];
+		m->words[i].count = 0;
+		m->words[i].seen_line = 0;
+		}
+	m->automaton = a;
+	a->refs++;
+	return m;
+	}
+
+//Adds one word to the trie.
+int magic_insert(struct magic_automaton *a, int word)
+	{
+	int state = 0, class, j;
+	char *pattern = a->patterns[word];
+	
+	for(j = 0; pattern[j]; j++)
+		{
+		class = a->classes[(unsigned char)pattern[j]];
+		if(a->delta[state * a->classes_len + class] == -1)
+			{
+			a->output[a->states_len] = -1;
+			a->delta[state * a->classes_len + class] = a->states_len;
+			a->states_len++;
+			}
+		state = a->delta[state * a->classes_len + class];
+		}
+	a->output[state] = word;
+	return state;
+	}
+
+//Works out the failure links breadth-first and fills in every missing transition from them,
+//so that scanning never has to backtrack.
+int magic_link(struct magic_automaton *a)
+	{
+	int *queue, *fail, head = 0, tail = 0, state, next, class;
+	
+	if((queue = malloc(a->states_len * sizeof(int))) == NULL || (fail = malloc(a->states_len * sizeof(int))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		free(queue);
+		return FALSE;
+		}
+	
+	fail[0] = 0;
+	a->output_next[0] = -1;
+	for(class = 0; class < a->classes_len; class++)
+		{
+		next = a->delta[class];
+		if(next == -1)
+			a->delta[class] = 0;
+		else
+			{
+			fail[next] = 0;
+			a->output_next[next] = -1;
+			queue[tail++] = next;
+			}
+		}
+	
+	while(head < tail)
+		{
+		state = queue[head++];
+		for(class = 0; class < a->classes_len; class++)
+			{
+			next = a->delta[state * a->classes_len + class];
+			if(next == -1)
+				{
+				a->delta[state * a->classes_len + class] = a->delta[fail[state] * a->classes_len + class];
+				continue;
+				}
+			fail[next] = a->delta[fail[state] * a->classes_len + class];
+			a->output_next[next] = (a->output[fail[next]] != -1) ? fail[next] : a->output_next[fail[next]];
+			queue[tail++] = next;
+			}
+		}
+	
+	free(queue);
+	free(fail);
+	return TRUE;
+	}
+
+//Runs handler once for each word which appears anywhere in line.
+void magic_scan(struct magic_matcher *m, const char *line, magic_handler handler, void *data)
+	{
+	struct magic_automaton *a;
+	const unsigned char *p;
+	int state = 0, found;
+	
+	if(m == NULL || m->words_len == 0)
+		return;
+	a = m->automaton;
+	
+	if(++m->line == 0) //seen_line starts out at zero, so skip it when we wrap around.
+		m->line = 1;
+	for(p = (const unsigned char *)line; *p; p++)
+		{
+		state = a->delta[state * a->classes_len + a->classes[*p]];
+		for(found = (a->output[state] != -1) ? state : a->output_next[state]; found != -1; found = a->output_next[found])
+			{
+			//Only report each word once per line, however many times it shows up.
+			if(m->words[a->output[found]].seen_line == m->line)
+				continue;
+			m->words[a->output[found]].seen_line = m->line;
+			handler(&m->words[a->output[found]], data);
+			}
+		}
+	}
+
+void magic_destroy(struct magic_matcher *m)
+	{
+	if(m == NULL)
+		return;
+	if(m->automaton != NULL && --m->automaton->refs == 0)
+		magic_automaton_destroy(m->automaton, m->words_len);
+	free(m->words);
+	free(m);
+	}
+
+void magic_automaton_destroy(struct magic_automaton *a, int patterns_len)
+	{
+	int i;
+	
+	if(a->patterns)
+		{
+		for(i = 0; i < patterns_len; i++)
+			free(a->patterns[i]);
+		free(a->patterns);
+		}
+	free(a->delta);
+	free(a->output);
+	free(a->output_next);
+	free(a);
+	}
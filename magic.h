@@ -0,0 +1,77 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * magic.h
+ *     - Matches "magic words" in tunnel output against a compiled set of patterns.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_MAGIC_H
+
+#include <stdint.h>
+
+//What to do when a magic word turns up in tunnel output.
+#define MAGIC_ACTION_CONDEMN 1 //Log it and kill the tunnel process so that it gets relaunched.
+#define MAGIC_ACTION_LOG 2 //Just log it.
+#define MAGIC_ACTION_COUNT 3 //Count it quietly. Counts are logged with the other periodic tunnel statistics.
+
+struct magic_word
+	{
+	char *pattern;
+	int action, severity; //Severity is one of the STL_* log levels.
+	uint32_t count, seen_line;
+	};
+
+//The patterns are compiled into a case-insensitive Aho-Corasick automaton, which finds every pattern in a line in one pass.
+//Bytes are first mapped to a small alphabet of the characters which actually appear in the patterns, which keeps the transition table tiny.
+//The automaton never changes once it's built, so tunnels with the same words share one. (See magic_share().)
+struct magic_automaton
+	{
+	char **patterns; //Copies, which the words point to.
+	unsigned char classes[256];
+	int classes_len, states_len;
+	int *delta; //states_len * classes_len transitions.
+	int *output, *output_next; //The word ending at each state (or -1), and the next state down the failure chain which ends a word.
+	int refs; //Matchers sharing the automaton. They're all created and destroyed on the main thread.
+	};
+
+//Each tunnel's own matcher, which keeps its own counts.
+struct magic_matcher
+	{
+	struct magic_word *words;
+	int words_len;
+	struct magic_automaton *automaton;
+	uint32_t line;
+	};
+
+typedef void (*magic_handler)(struct magic_word *word, void *data);
+
+extern struct magic_word magic_words_default[];
+extern int magic_words_default_len;
+
+int magic_word_action(const char *name);
+struct magic_matcher *magic_compile(struct magic_word *global_words, int global_words_len, struct magic_word *words, int words_len);
+struct magic_matcher *magic_share(struct magic_matcher *m);
+void magic_scan(struct magic_matcher *m, const char *line, magic_handler handler, void *data);
+void magic_destroy(struct magic_matcher *m);
+
+#define __SSHTUNNELS_MAGIC_H
+#endif
+
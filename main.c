@@ -27,46 +27,111 @@
 #include "util.h"
 #include "tunnel.h"
 #include "log.h"
+#include "event.h"
+#include "launch.h"
+#include "netwatch.h"
+#include "env.h"
+#include "arena.h"
+#include "shard.h"
+#include "standby.h"
 
 #include <expat.h>
 
+//A <TunnelTemplate> holds everything a <Tunnel> can, plus default values for its parameters.
+//Its argument, environment and parameter lists live in the config arena.
+struct config_template
+	{
+	char *name;
+	struct tunnel_options options;
+	char **argv, **env;
+	int argv_pos, env_pos;
+	struct magic_word *words;
+	int words_len, words_pos;
+	struct config_parameter *parameters;
+	int parameters_pos;
+	};
+
+//Parameters fill in ${Name} placeholders when a tunnel is expanded from a template.
+struct config_parameter
+	{
+	char *name, *value;
+	};
+
 struct sshtunnels_configstate
 	{
 	int failed;
 	int in_sshtunnels, seen_sshtunnels;
-	int in_tunnel, seen_tunnel;
+	int in_tunnel, seen_tunnel, in_template;
 	int in_programargument, count_programargument;
 	int in_programenvironment, count_programenvironment;
-	char **newargv, **newenvp, **defenvp;
+	int in_magicword, seen_global_magicword;
+	struct magic_matcher *global_matcher; //Compiled once, and shared by every tunnel without magic words of its own.
+	int launch_concurrency;
+	double launch_rate, launch_burst;
+	int netwatch_action;
+	int64_t netwatch_timeout;
+	int worker_threads;
+	char **newargv, **newenvp;
 	int newargv_len, newargv_pos, newenvp_len, newenvp_pos;
-	int uptoken_enabled;
-	time_t uptoken_interval;
+	struct tunnel_options options;
+	struct magic_word *global_words, *tunnel_words;
+	int global_words_len, global_words_pos, tunnel_words_len, tunnel_words_pos;
+	char *template_name, *ports;
+	int template_index;
+	struct config_template *templates;
+	int templates_len, templates_pos;
+	struct config_parameter *parameters;
+	int parameters_len, parameters_pos;
+	char **expandargv, **expandenvp;
+	int expandargv_len, expandargv_pos, expandenvp_len, expandenvp_pos;
 	};
 
 int main_finished = FALSE;
-time_t main_sleep_seconds = MAIN_SLEEP_SECONDS_DEFAULT;
 FILE *log_output_file = NULL;
 int log_syslog_enabled = FALSE, log_syslog_force = FALSE;
-struct tunnel **main_tunnels = NULL;
-int main_tunnels_len = 0, main_tunnels_pos = 0;
+struct event_loop *main_loop = NULL;
+int main_signal_pipe[2] = { -1, -1 };
+struct env_base *main_env_base = NULL;
+int main_netwatch_action = NETWATCH_ACTION_DEFAULT;
+int64_t main_netwatch_timeout = (int64_t)NETWATCH_TIMEOUT_DEFAULT * 1000;
 
-void termination_handler(int signum);
-void brokenpipe_handler(int signum);
+//Every string and list the config parser keeps (including each tunnel's argv and env) lives in this arena, and goes away with it.
+//Tunnels don't own any of it, which lets tunnels expanded from one template share their constant strings.
+struct arena *main_config = NULL;
+int main_config_generation = 0;
+
+void signal_handler(int signum);
+int signal_event(struct event_loop *loop, int fd, int events, void *data);
+int signal_setup(void);
 int read_configuration(char **defenvp);
 void tagstart(void *data, const char *name, const char **attributes);
 void tagend(void *data, const char *name);
-char *insert_new_environment_variable(char ***newenvp, int *newenvp_len, int *newenvp_pos, char *new);
-void destroy_tunnel_argvenvp(struct tunnel *tun);
-void destroy_arglist(char **list);
+int config_integer(XML_Parser parser, const char *name, const char *value, int minimum, int maximum, int *result);
+int config_seconds(XML_Parser parser, const char *name, const char *value, double minimum, double maximum, int64_t *result);
+int config_number(XML_Parser parser, const char *name, const char *value, double minimum, double maximum, double *result);
+int config_tunnel_option(XML_Parser parser, const char *name, const char *value, struct tunnel_options *options);
+int config_magic_word(XML_Parser parser, const char **attributes, struct magic_word **words, int *words_len, int *words_pos);
+void destroy_magic_words(struct magic_word *words, int words_pos);
+void config_element_begin(struct sshtunnels_configstate *state);
+void config_element_end(struct sshtunnels_configstate *state);
+int config_parameter(struct sshtunnels_configstate *state, const char *name, const char *value);
+const char *config_parameter_value(struct sshtunnels_configstate *state, const char *name, size_t length, const char *port);
+int config_template_find(struct sshtunnels_configstate *state, const char *name);
+int config_template_apply(XML_Parser parser, struct sshtunnels_configstate *state, const char *name);
+int config_template_finish(XML_Parser parser, struct sshtunnels_configstate *state);
+int config_tunnel_expand(XML_Parser parser, struct sshtunnels_configstate *state);
+int config_tunnel_create(XML_Parser parser, struct sshtunnels_configstate *state, const char *port);
+int config_expand_list(XML_Parser parser, struct sshtunnels_configstate *state, const char *port, char **from, int from_pos, char ***to, int *to_len, int *to_pos, int environment);
+char *config_expand(XML_Parser parser, struct sshtunnels_configstate *state, char *string, const char *port);
+void destroy_configstate(struct sshtunnels_configstate *state);
+int insert_new_environment_variable(char ***newenvp, int *newenvp_len, int *newenvp_pos, char *new);
 void destroy_alltunnels(void);
 void usage(void);
 
 int main(int argc, char **argv, char **envp)
 	{
-	time_t wakeup;
 	int error = FALSE;
 	int i;
-	struct sigaction sigact;
 	
 	//Log initialization.
 	stl_loginit("SSHTunnels");
@@ -88,62 +153,164 @@ int main(int argc, char **argv, char **envp)
 			}
 		}
 	
+	//Every running tunnel holds three pipes open, so large configurations need more descriptors than the usual soft limit.
+	fd_limit_raise();
+	
+	//Anything left open by whoever started us shouldn't be passed on to the tunnel processes.
+	fd_cloexec_inherited();
+	
+	//The event loop watches tunnel output and signals. Tunnels register with it as they are created.
+	if((main_loop = event_loop_create()) == NULL)
+		return 1;
+	
 	//Read in the configuration or die.
 	if(!read_configuration(envp))
 		{
 		destroy_alltunnels();
+		event_loop_destroy(main_loop);
+		stl_logasync(FALSE);
 		return 1;
 		}
 	
 	//Set up signal handling and teardown.
-	sigact.sa_handler = termination_handler;
-	sigemptyset(&sigact.sa_mask);
-	sigact.sa_flags = 0;
-	if(sigaction(SIGINT, &sigact, NULL) != 0)
-		stl(STL_WARNING, "Registering of SIGINT signal handler failed. (%s)", strerror(errno));
-	if(sigaction(SIGHUP, &sigact, NULL) != 0)
-		stl(STL_WARNING, "Registering of SIGHUP signal handler failed. (%s)", strerror(errno));
-	if(sigaction(SIGTERM, &sigact, NULL) != 0)
-		stl(STL_WARNING, "Registering of SIGTERM signal handler failed. (%s)", strerror(errno));
-	sigact.sa_handler = brokenpipe_handler;
-	if(sigaction(SIGPIPE, &sigact, NULL) != 0)
-		stl(STL_WARNING, "Registering of SIGPIPE signal handler failed. (%s)", strerror(errno));
+	if(!signal_setup())
+		{
+		destroy_alltunnels();
+		event_loop_destroy(main_loop);
+		stl_logasync(FALSE);
+		return 1;
+		}
+	
+	//Listen for network changes, if we've been asked to.
+	if(!netwatch_start(main_loop, main_netwatch_action, main_netwatch_timeout))
+		{
+		stl(STL_ERROR, "FATAL! netwatch_start() returned with an error.");
+		main_finished = TRUE;
+		error = TRUE;
+		}
+	
+	//Start all of our tunnels.
+	for(i = 1; i <= tunnel_count(); i++)
+		{
+		if(!tunnel_start(tunnel_by_id(i)))
+			{
+			stl(STL_ERROR, "FATAL! tunnel_start() returned with an error.");
+			main_finished = TRUE;
+			error = TRUE;
+			}
+		}
+	
+	//Hand the tunnels over to the worker threads, if there are any. The main thread keeps the signals, launch queue and network watcher.
+	if(!main_finished && !shard_run())
+		{
+		stl(STL_ERROR, "FATAL! shard_run() returned with an error.");
+		main_finished = TRUE;
+		error = TRUE;
+		}
 	
+	//From here on, everything happens in response to tunnel output, timers, and signals.
 	while(!main_finished)
 		{
-		//Perform maintenance on all of our tunnels.
-		for(i = 0; main_tunnels[i] && !main_finished; i++)
+		if(event_dispatch(main_loop, -1) < 0)
 			{
-			if(!tunnel_maintenance(main_tunnels[i]))
-				{
-				stl(STL_ERROR, "FATAL! tunnel_maintenance() returned with an error.");
-				main_finished = TRUE;
-				error = TRUE;
-				}
+			stl(STL_ERROR, "FATAL! event_dispatch() returned with an error.");
+			main_finished = TRUE;
+			error = TRUE;
 			}
-		
-		//Make sure we sleep for at least main_sleep_seconds seconds unless we catch a signal.
-		wakeup = time(NULL) + main_sleep_seconds;
-		while(!main_finished && time(NULL) < wakeup)
-			sleep(1);
 		}
 	
 	//Tear down all of our tunnels.
+	if(!shard_stop())
+		error = TRUE;
+	netwatch_stop();
 	destroy_alltunnels();
+	event_loop_destroy(main_loop);
 	
+	//Make sure every queued log line has been written before the log file goes away.
+	stl_logasync(FALSE);
 	if(log_output_file) fclose(log_output_file);
 	return error;
 	}
 
-void termination_handler(int signum)
+//Signal handlers can't safely do much of anything, so we just pass the signal number through a pipe to the event loop. (The classic self-pipe trick.)
+void signal_handler(int signum)
 	{
-	stl(STL_INFO, "Caught signal %d.", signum);
-	main_finished = TRUE;
+	int saved_errno = errno;
+	unsigned char signum_byte = (unsigned char)signum;
+	if(write(main_signal_pipe[PIPE_WRITE], &signum_byte, 1) < 0)
+		{
+		//The pipe is full, which means the event loop already has plenty of signals to look at.
+		}
+	errno = saved_errno;
 	}
 
-void brokenpipe_handler(int signum)
+//Event loop handler for the read end of the signal pipe.
+int signal_event(struct event_loop *loop, int fd, int events, void *data)
 	{
-	stl(STL_WARNING, "Caught SIGPIPE (%d). Ignoring...", signum);
+	unsigned char signums[64];
+	ssize_t readret;
+	int i;
+	
+	while((readret = read(fd, signums, sizeof(signums))) > 0)
+		{
+		for(i = 0; i < readret; i++)
+			{
+			if(signums[i] == SIGCHLD)
+				{
+				//One or more child processes exited. Reap all of them.
+				if(!tunnel_reap_children())
+					return FALSE;
+				}
+			else if(signums[i] == SIGPIPE)
+				{
+				stl(STL_WARNING, "Caught SIGPIPE (%d). Ignoring...", (int)signums[i]);
+				}
+			else
+				{
+				stl(STL_INFO, "Caught signal %d.", (int)signums[i]);
+				main_finished = TRUE;
+				}
+			}
+		}
+	
+	return TRUE;
+	}
+
+//Creates the signal pipe, registers it with the event loop, and installs our signal handlers.
+//Returns TRUE on success or FALSE on error.
+int signal_setup(void)
+	{
+	struct sigaction sigact;
+	
+	if(pipe_cloexec(main_signal_pipe) < 0)
+		{
+		stl(STL_ERROR, "Call to pipe() for signal handling failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	if(!fd_set_nonblock(main_signal_pipe[PIPE_READ]) || !fd_set_nonblock(main_signal_pipe[PIPE_WRITE]))
+		return FALSE;
+	if(!event_add(main_loop, main_signal_pipe[PIPE_READ], signal_event, NULL))
+		return FALSE;
+	
+	sigact.sa_handler = signal_handler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = SA_RESTART;
+	if(sigaction(SIGINT, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGINT signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGHUP, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGHUP signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGTERM, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGTERM signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGPIPE, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGPIPE signal handler failed. (%s)", strerror(errno));
+	sigact.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	if(sigaction(SIGCHLD, &sigact, NULL) != 0)
+		{
+		stl(STL_ERROR, "Registering of SIGCHLD signal handler failed. (%s)", strerror(errno));
+		return FALSE;
+		}
+	
+	return TRUE;
 	}
 
 int read_configuration(char **defenvp)
@@ -161,6 +328,7 @@ int read_configuration(char **defenvp)
 	state.seen_sshtunnels = FALSE;
 	state.in_tunnel = FALSE;
 	state.seen_tunnel = FALSE;
+	state.in_template = FALSE;
 	state.in_programargument = FALSE;
 	state.count_programargument = 0;
 	state.in_programenvironment = FALSE;
@@ -171,9 +339,45 @@ int read_configuration(char **defenvp)
 	state.newenvp = NULL;
 	state.newenvp_len = 0;
 	state.newenvp_pos = 0;
-	state.defenvp = defenvp;
-	state.uptoken_enabled = UPTOKEN_ENABLED_DEFAULT;
-	state.uptoken_interval = UPTOKEN_INTERVAL_DEFAULT;
+	tunnel_options_default(&state.options);
+	state.in_magicword = FALSE;
+	state.seen_global_magicword = FALSE;
+	state.global_matcher = NULL;
+	state.global_words = NULL;
+	state.global_words_len = 0;
+	state.global_words_pos = 0;
+	state.tunnel_words = NULL;
+	state.tunnel_words_len = 0;
+	state.tunnel_words_pos = 0;
+	state.launch_concurrency = LAUNCH_SCALED;
+	state.launch_rate = LAUNCH_SCALED;
+	state.launch_burst = LAUNCH_SCALED;
+	state.netwatch_action = NETWATCH_ACTION_DEFAULT;
+	state.netwatch_timeout = (int64_t)NETWATCH_TIMEOUT_DEFAULT * 1000;
+	state.worker_threads = SHARD_WORKERS_DEFAULT;
+	state.template_name = NULL;
+	state.ports = NULL;
+	state.template_index = -1;
+	state.templates = NULL;
+	state.templates_len = 0;
+	state.templates_pos = 0;
+	state.parameters = NULL;
+	state.parameters_len = 0;
+	state.parameters_pos = 0;
+	state.expandargv = NULL;
+	state.expandargv_len = 0;
+	state.expandargv_pos = 0;
+	state.expandenvp = NULL;
+	state.expandenvp_len = 0;
+	state.expandenvp_pos = 0;
+	
+	//Each configuration that gets loaded is a new generation, with its own arena.
+	if((main_config = arena_create(++main_config_generation)) == NULL)
+		return FALSE;
+	
+	//Every tunnel starts out with our own environment.
+	if((main_env_base = env_base_create(defenvp)) == NULL)
+		return FALSE;
 	
 	//Set up XML parser for configuration
 	if(!(parser = XML_ParserCreate(NULL)))
@@ -207,6 +411,8 @@ int read_configuration(char **defenvp)
 		if(XML_Parse(parser, filebuffer, length, done) == 0)
 			{
 			stl(STL_ERROR, XMLPARSER "Failed at line %d: %s", (int)XML_GetCurrentLineNumber(parser), XML_ErrorString(XML_GetErrorCode(parser)));
+			destroy_configstate(&state);
+			XML_ParserFree(parser);
 			fclose(in);
 			return FALSE;
 			}
@@ -219,6 +425,12 @@ int read_configuration(char **defenvp)
 		state.failed = TRUE;
 		}
 	
+	launch_configure(main_loop, state.launch_concurrency, state.launch_rate, state.launch_burst, tunnel_count());
+	main_netwatch_action = state.netwatch_action;
+	main_netwatch_timeout = state.netwatch_timeout;
+	
+	stl(STL_INFO, "Configuration generation %d uses %lu bytes for strings and lists, in %d block(s) totalling %lu bytes.", main_config->generation, (unsigned long)main_config->used, main_config->block_count, (unsigned long)main_config->allocated);
+	destroy_configstate(&state);
 	XML_ParserFree(parser);
 	fclose(in);
 	return state.failed ? FALSE : TRUE;
@@ -226,7 +438,7 @@ int read_configuration(char **defenvp)
 
 void tagstart(void *data, const char *name, const char **attributes)
 	{
-	int i, j, seenv;
+	int i, seenv, result;
 	char *buf;
 	XML_Parser parser = (XML_Parser)data;
 	struct sshtunnels_configstate *state = (struct sshtunnels_configstate *)XML_GetUserData(parser);
@@ -266,28 +478,88 @@ void tagstart(void *data, const char *name, const char **attributes)
 									state->failed = TRUE;
 									return;
 									}
+								fd_set_cloexec(fileno(log_output_file));
 								stl_logoutput(FALSE, log_output_file);
 								stl(STL_INFO, "Opened log file (%s).", attributes[i+1]);
 								}
 							}
 						}
+					if(strcmp(attributes[i], "LogAsync") == 0)
+						{
+						if(strcasecmp(attributes[i+1], "true") == 0)
+							{
+							if(!stl_logasync(TRUE))
+								stl(STL_WARNING, XMLPARSER "Asynchronous logging is unavailable. Logging synchronously instead.");
+							}
+						else if(strcasecmp(attributes[i+1], "false") != 0)
+							{
+							stl(STL_ERROR, XMLPARSER "LogAsync must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+							state->failed = TRUE;
+							return;
+							}
+						}
 					if(strcmp(attributes[i], "SleepTimer") == 0)
 						{
-						if(sscanf(attributes[i+1], "%d", &j) != 1)
+						//Tunnel timers are all scheduled individually now, so there is no main loop sleep to configure.
+						stl(STL_WARNING, XMLPARSER "SleepTimer is obsolete and will be ignored. Line: %d", (int)XML_GetCurrentLineNumber(parser));
+						}
+					if(strcmp(attributes[i], "LaunchConcurrency") == 0)
+						{
+						if(!config_integer(parser, attributes[i], attributes[i+1], 0, 1000000, &state->launch_concurrency))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
+					if(strcmp(attributes[i], "LaunchRate") == 0)
+						{
+						if(!config_number(parser, attributes[i], attributes[i+1], 0, 1000000, &state->launch_rate))
 							{
-							stl(STL_ERROR, XMLPARSER "SleepTimer must be an integer! Line: %d", (int)XML_GetCurrentLineNumber(parser));
 							state->failed = TRUE;
 							return;
 							}
-						if(j < 1 || j > 60)
+						}
+					if(strcmp(attributes[i], "LaunchBurst") == 0)
+						{
+						if(!config_number(parser, attributes[i], attributes[i+1], 1, 1000000, &state->launch_burst))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
+					if(strcmp(attributes[i], "NetworkWatch") == 0)
+						{
+						if((state->netwatch_action = netwatch_action(attributes[i+1])) < 0)
+							{
+							stl(STL_ERROR, XMLPARSER "NetworkWatch must be off, probe or condemn! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+							state->failed = TRUE;
+							return;
+							}
+						}
+					if(strcmp(attributes[i], "NetworkWatchTimeout") == 0)
+						{
+						if(!config_seconds(parser, attributes[i], attributes[i+1], UPTOKEN_INTERVAL_MINIMUM, UPTOKEN_INTERVAL_MAXIMUM, &state->netwatch_timeout))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
+					if(strcmp(attributes[i], "WorkerThreads") == 0)
+						{
+						if(!config_integer(parser, attributes[i], attributes[i+1], 0, SHARD_WORKERS_MAXIMUM, &state->worker_threads))
 							{
-							stl(STL_ERROR, XMLPARSER "SleepTimer must be a positive integer between 1 and 60. Line: %d", (int)XML_GetCurrentLineNumber(parser));
 							state->failed = TRUE;
 							return;
 							}
-						main_sleep_seconds = (time_t)j;
 						}
 					}
+				
+				//Tunnels are handed their event loop as they're created, so the worker loops have to exist before the first <Tunnel>.
+				if(!shard_create(main_loop, state->worker_threads))
+					{
+					state->failed = TRUE;
+					return;
+					}
 				}
 			else
 				{
@@ -298,68 +570,116 @@ void tagstart(void *data, const char *name, const char **attributes)
 			}
 		else //We're in <SSHTunnels>
 			{
-			if(!state->in_tunnel)
+			if(state->in_magicword)
+				{
+				stl(STL_ERROR, XMLPARSER "No tags are allowed inside <MagicWord>. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+				state->failed = TRUE;
+				return;
+				}
+			else if(!state->in_tunnel)
 				{
-				if(strcmp(name, "Tunnel") == 0)
+				if(strcmp(name, "MagicWord") == 0)
+					{
+					//Tunnels are created as soon as they have been parsed, so they can only pick up global magic words declared before them.
+					if(state->seen_tunnel)
+						{
+						stl(STL_ERROR, XMLPARSER "Global <MagicWord> tags must come before the first <Tunnel> tag. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+						state->failed = TRUE;
+						return;
+						}
+					state->in_magicword = TRUE;
+					state->seen_global_magicword = TRUE;
+					if(!config_magic_word(parser, attributes, &state->global_words, &state->global_words_len, &state->global_words_pos))
+						{
+						state->failed = TRUE;
+						return;
+						}
+					}
+				else if(strcmp(name, "Tunnel") == 0)
 					{
 					state->in_tunnel = TRUE;
 					state->seen_tunnel = TRUE;
-					state->uptoken_enabled = UPTOKEN_ENABLED_DEFAULT;
-					state->uptoken_interval = UPTOKEN_INTERVAL_DEFAULT;
-					state->newargv = NULL;
-					state->newargv_len = 0;
-					state->newargv_pos = 0;
-					state->newenvp = NULL;
-					state->newenvp_len = 0;
-					state->newenvp_pos = 0;
+					config_element_begin(state);
 					
-					//Initialize envp using values from defenvp.
-					for(i = 0; state->defenvp[i]; i++)
+					//A template supplies the defaults, so it has to be applied before anything else on the tag.
+					for(i = 0; attributes[i]; i = i + 2)
 						{
-						if((insert_new_environment_variable(&state->newenvp, &state->newenvp_len, &state->newenvp_pos, state->defenvp[i])) == NULL)
+						if(strcmp(attributes[i], "Template") == 0 && !config_template_apply(parser, state, attributes[i+1]))
 							{
 							state->failed = TRUE;
 							return;
 							}
 						}
 					
-					//Scan through all attributes.
+					//Scan through all attributes. Anything that isn't a tunnel option is a template parameter.
 					for(i = 0; attributes[i]; i = i + 2)
 						{
-						if(strcmp(attributes[i], "UpTokenEnabled") == 0)
+						if(strcmp(attributes[i], "Template") == 0)
+							continue;
+						else if(strcmp(attributes[i], "Ports") == 0)
 							{
-							if(strcasecmp(attributes[i+1], "true") == 0)
-								state->uptoken_enabled = TRUE;
-							else if(strcasecmp(attributes[i+1], "false") == 0)
-								state->uptoken_enabled = FALSE;
-							else
+							if((state->ports = arena_strdup(main_config, attributes[i+1])) == NULL)
 								{
-								stl(STL_ERROR, XMLPARSER "UpTokenEnabled must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
 								state->failed = TRUE;
 								return;
 								}
 							}
-						else if(strcmp(attributes[i], "UpTokenInterval") == 0)
+						else if((result = config_tunnel_option(parser, attributes[i], attributes[i+1], &state->options)) == FALSE)
+							{
+							state->failed = TRUE;
+							return;
+							}
+						else if(result == CONFIG_UNHANDLED && !config_parameter(state, attributes[i], attributes[i+1]))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
+					}
+				else if(strcmp(name, "TunnelTemplate") == 0)
+					{
+					state->in_tunnel = TRUE;
+					state->in_template = TRUE;
+					config_element_begin(state);
+					
+					//Scan through all attributes. Anything that isn't a tunnel option is a default parameter value.
+					for(i = 0; attributes[i]; i = i + 2)
+						{
+						if(strcmp(attributes[i], "Name") == 0)
 							{
-							if(sscanf(attributes[i+1], "%d", &j) != 1)
+							if(config_template_find(state, attributes[i+1]) >= 0)
 								{
-								stl(STL_ERROR, XMLPARSER "UpTokenInterval must be an integer! Line: %d", (int)XML_GetCurrentLineNumber(parser));
+								stl(STL_ERROR, XMLPARSER "There is already a <TunnelTemplate> named \"%s\". Line: %d.", attributes[i+1], (int)XML_GetCurrentLineNumber(parser));
 								state->failed = TRUE;
 								return;
 								}
-							if(j < 1 || j > 60)
+							if((state->template_name = arena_strdup(main_config, attributes[i+1])) == NULL)
 								{
-								stl(STL_ERROR, XMLPARSER "UpTokenInterval must be a positive integer between 1 and 60. Line: %d", (int)XML_GetCurrentLineNumber(parser));
 								state->failed = TRUE;
 								return;
 								}
-							state->uptoken_interval = (time_t)j;
 							}
+						else if((result = config_tunnel_option(parser, attributes[i], attributes[i+1], &state->options)) == FALSE)
+							{
+							state->failed = TRUE;
+							return;
+							}
+						else if(result == CONFIG_UNHANDLED && !config_parameter(state, attributes[i], attributes[i+1]))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
+					if(state->template_name == NULL)
+						{
+						stl(STL_ERROR, XMLPARSER "<TunnelTemplate> tag requires \"Name\" attribute. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+						state->failed = TRUE;
+						return;
 						}
 					}
 				else
 					{
-					stl(STL_ERROR, XMLPARSER "Only <Tunnel> tags allowed within <SSHTunnels> tag. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+					stl(STL_ERROR, XMLPARSER "Only <Tunnel>, <TunnelTemplate> or <MagicWord> tags allowed within <SSHTunnels> tag. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
 					state->failed = TRUE;
 					return;
 					}
@@ -380,18 +700,15 @@ void tagstart(void *data, const char *name, const char **attributes)
 							if(strcmp(attributes[i], "v") == 0)
 								{
 								seenv = TRUE;
-								if((buf = calloc(strlen(attributes[i+1]) + 1, sizeof(char))) == NULL)
+								if((buf = arena_strdup(main_config, attributes[i+1])) == NULL)
 									{
-									stl(STL_ERROR, "Out of memory!");
 									state->failed = TRUE;
 									return;
 									}
-								strcpy(buf, attributes[i+1]);
 								if((state->newargv = list_grow_insert(state->newargv, &buf, sizeof(char *), &state->newargv_len, &state->newargv_pos)) == NULL)
 									{
 									stl(STL_ERROR, "Out of memory!");
 									state->failed = TRUE;
-									free(buf);
 									return;
 									}
 								}
@@ -415,7 +732,12 @@ void tagstart(void *data, const char *name, const char **attributes)
 							if(strcmp(attributes[i], "v") == 0)
 								{
 								seenv = TRUE;
-								if((insert_new_environment_variable(&state->newenvp, &state->newenvp_len, &state->newenvp_pos, (char *)attributes[i+1])) == NULL)
+								if((buf = arena_strdup(main_config, attributes[i+1])) == NULL)
+									{
+									state->failed = TRUE;
+									return;
+									}
+								if(!insert_new_environment_variable(&state->newenvp, &state->newenvp_len, &state->newenvp_pos, buf))
 									{
 									state->failed = TRUE;
 									return;
@@ -429,9 +751,18 @@ void tagstart(void *data, const char *name, const char **attributes)
 							return;
 							}
 						}
+					else if(strcmp(name, "MagicWord") == 0)
+						{
+						state->in_magicword = TRUE;
+						if(!config_magic_word(parser, attributes, &state->tunnel_words, &state->tunnel_words_len, &state->tunnel_words_pos))
+							{
+							state->failed = TRUE;
+							return;
+							}
+						}
 					else
 						{
-						stl(STL_ERROR, XMLPARSER "Only <ProgramArgument> or <ProgramEnvironment> tags allowed within <Tunnel> tag. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+						stl(STL_ERROR, XMLPARSER "Only <ProgramArgument>, <ProgramEnvironment> or <MagicWord> tags allowed within <Tunnel> tag. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
 						state->failed = TRUE;
 						return;
 						}
@@ -449,10 +780,8 @@ void tagstart(void *data, const char *name, const char **attributes)
 
 void tagend(void *data, const char *name)
 	{
-	time_t interval;
 	XML_Parser parser = (XML_Parser)data;
 	struct sshtunnels_configstate *state = (struct sshtunnels_configstate *)XML_GetUserData(parser);
-	struct tunnel *mytun;
 	
 	if(!state->failed)
 		{
@@ -469,42 +798,33 @@ void tagend(void *data, const char *name)
 		else if(strcmp(name, "Tunnel") == 0)
 			{
 			state->in_tunnel = FALSE;
-			if(state->count_programargument < 1)
+			if(state->newargv_pos + (state->template_index >= 0 ? state->templates[state->template_index].argv_pos : 0) < 1)
 				{
 				stl(STL_ERROR, XMLPARSER "At least one <ProgramArgument> required within <Tunnel>. Line: %d", (int)XML_GetCurrentLineNumber(parser));
 				state->failed = TRUE;
 				return;
 				}
 			
-			stl(STL_INFO, XMLPARSER "Parsed <Tunnel> declaration with %d <ProgramArgument> tag(s) and %d <ProgramEnvironment> tag(s).", state->count_programargument, state->count_programenvironment);
-			
-			//Normalize interval.
-			if(state->uptoken_interval % main_sleep_seconds != 0)
-				{
-				interval = ((state->uptoken_interval / main_sleep_seconds) + 1) * main_sleep_seconds;
-				if(interval > 60)
-					interval = main_sleep_seconds;
-				stl(STL_WARNING, "UpToken Interval of %d is not evenly divisible by the main Sleep Timer, which is set to %d. Using UpToken Interval of %d instead.", (int)state->uptoken_interval, (int)main_sleep_seconds, (int)interval);
-				state->uptoken_interval = interval;
-				}
+			stl(STL_INFO, XMLPARSER "Parsed <Tunnel> declaration with %d <ProgramArgument> tag(s), %d <ProgramEnvironment> tag(s) and %d <MagicWord> tag(s).", state->count_programargument, state->count_programenvironment, state->tunnel_words_pos);
 			
 			//Handle tunnel object creation.
-			if((mytun = tunnel_create(state->newargv, state->newenvp, state->uptoken_enabled, state->uptoken_interval)) == NULL)
-				{
-				stl(STL_ERROR, "Tunnel object creation failed!");
+			if(!config_tunnel_expand(parser, state))
 				state->failed = TRUE;
-				destroy_arglist(state->newargv);
-				destroy_arglist(state->newenvp);
-				return;
-				}
-			if((main_tunnels = list_grow_insert(main_tunnels, &mytun, sizeof(struct tunnel *), &main_tunnels_len, &main_tunnels_pos)) == NULL)
+			config_element_end(state);
+			}
+		else if(strcmp(name, "TunnelTemplate") == 0)
+			{
+			state->in_tunnel = FALSE;
+			state->in_template = FALSE;
+			if(state->count_programargument < 1)
 				{
-				stl(STL_ERROR, "Out of memory!");
+				stl(STL_ERROR, XMLPARSER "At least one <ProgramArgument> required within <TunnelTemplate>. Line: %d", (int)XML_GetCurrentLineNumber(parser));
 				state->failed = TRUE;
-				destroy_tunnel_argvenvp(mytun);
-				tunnel_destroy(mytun);
 				return;
 				}
+			if(!config_template_finish(parser, state))
+				state->failed = TRUE;
+			config_element_end(state);
 			}
 		else if(strcmp(name, "ProgramArgument") == 0)
 			{
@@ -514,98 +834,753 @@ void tagend(void *data, const char *name)
 			{
 			state->in_programenvironment = FALSE;
 			}
+		else if(strcmp(name, "MagicWord") == 0)
+			{
+			state->in_magicword = FALSE;
+			}
 		}
 	}
 
-//Envp should be populated with non-duplicate entries. So we'll check for dupes before inserting each entry.
-//Will return a pointer a freshly-allocated, \0-terminated string copy of "new", or NULL on failure.
-char *insert_new_environment_variable(char ***newenvp, int *newenvp_len, int *newenvp_pos, char *new)
+//Parses one <Tunnel> (or <TunnelTemplate>) attribute into options.
+//Returns TRUE on success, FALSE (after reporting the problem) on error, or CONFIG_UNHANDLED if name isn't a tunnel option.
+int config_tunnel_option(XML_Parser parser, const char *name, const char *value, struct tunnel_options *options)
 	{
-	int i, equalspos;
-	char *mynew;
-	char **myenvp = *newenvp; //I'm not gonna lie. This is pretty Inceptionesque.
+	if(strcmp(name, "UpTokenEnabled") == 0)
+		{
+		if(strcasecmp(value, "true") == 0)
+			options->uptoken_enabled = TRUE;
+		else if(strcasecmp(value, "false") == 0)
+			options->uptoken_enabled = FALSE;
+		else
+			{
+			stl(STL_ERROR, XMLPARSER "UpTokenEnabled must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "UpTokenInterval") == 0)
+		{
+		if(!config_seconds(parser, name, value, UPTOKEN_INTERVAL_MINIMUM, UPTOKEN_INTERVAL_MAXIMUM, &options->uptoken_interval))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenProtocol") == 0)
+		{
+		if(!config_integer(parser, name, value, 1, UPTOKEN_PROTOCOL_MAXIMUM, &options->uptoken_protocol))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenTimeout") == 0)
+		{
+		if(!config_seconds(parser, name, value, UPTOKEN_INTERVAL_MINIMUM, UPTOKEN_INTERVAL_MAXIMUM * UPTOKEN_PROBES_INFLIGHT, &options->uptoken_timeout))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenAdaptive") == 0)
+		{
+		if(strcasecmp(value, "true") == 0)
+			options->uptoken_adaptive = TRUE;
+		else if(strcasecmp(value, "false") == 0)
+			options->uptoken_adaptive = FALSE;
+		else
+			{
+			stl(STL_ERROR, XMLPARSER "UpTokenAdaptive must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "UpTokenTimeoutMin") == 0)
+		{
+		if(!config_seconds(parser, name, value, UPTOKEN_INTERVAL_MINIMUM, UPTOKEN_INTERVAL_MAXIMUM * UPTOKEN_PROBES_INFLIGHT, &options->uptoken_timeout_min))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenTimeoutMax") == 0)
+		{
+		if(!config_seconds(parser, name, value, UPTOKEN_INTERVAL_MINIMUM, UPTOKEN_INTERVAL_MAXIMUM * UPTOKEN_PROBES_INFLIGHT, &options->uptoken_timeout_max))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenLossThreshold") == 0)
+		{
+		if(!config_integer(parser, name, value, 1, UPTOKEN_LOSS_WINDOW, &options->uptoken_loss_threshold))
+			return FALSE;
+		}
+	else if(strcmp(name, "OutputCollapseRepeats") == 0)
+		{
+		if(strcasecmp(value, "true") == 0)
+			options->output_collapse = TRUE;
+		else if(strcasecmp(value, "false") == 0)
+			options->output_collapse = FALSE;
+		else
+			{
+			stl(STL_ERROR, XMLPARSER "OutputCollapseRepeats must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "OutputFile") == 0)
+		{
+		if(value[0] == '\0')
+			options->output_file = NULL;
+		else if((options->output_file = arena_strdup(main_config, value)) == NULL)
+			return FALSE;
+		}
+	else if(strcmp(name, "OutputScan") == 0)
+		{
+		if(strcasecmp(value, "true") == 0)
+			options->output_scan = TRUE;
+		else if(strcasecmp(value, "false") == 0)
+			options->output_scan = FALSE;
+		else
+			{
+			stl(STL_ERROR, XMLPARSER "OutputScan must be TRUE or FALSE! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "OutputRateLimit") == 0)
+		{
+		if(!config_number(parser, name, value, 0, 1000000, &options->output_rate))
+			return FALSE;
+		}
+	else if(strcmp(name, "OutputRateBurst") == 0)
+		{
+		if(!config_number(parser, name, value, 1, 1000000, &options->output_burst))
+			return FALSE;
+		}
+	else if(strcmp(name, "BackoffPolicy") == 0)
+		{
+		if((options->backoff.policy = backoff_policy(value)) < 0)
+			{
+			stl(STL_ERROR, XMLPARSER "BackoffPolicy must be exponential, damping or fixed! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "BackoffMin") == 0)
+		{
+		if(!config_seconds(parser, name, value, 0, BACKOFF_SECONDS_MAXIMUM, &options->backoff.min))
+			return FALSE;
+		}
+	else if(strcmp(name, "BackoffMax") == 0)
+		{
+		if(!config_seconds(parser, name, value, 0, BACKOFF_SECONDS_MAXIMUM, &options->backoff.max))
+			return FALSE;
+		}
+	else if(strcmp(name, "BackoffDecay") == 0)
+		{
+		if(!config_seconds(parser, name, value, 1, BACKOFF_SECONDS_MAXIMUM, &options->backoff.decay))
+			return FALSE;
+		}
+	else if(strcmp(name, "LaunchPriority") == 0)
+		{
+		if(!config_integer(parser, name, value, -1000000, 1000000, &options->launch_priority))
+			return FALSE;
+		}
+	else if(strcmp(name, "UpTokenMaxLatency") == 0)
+		{
+		if(!config_seconds(parser, name, value, 0, UPTOKEN_INTERVAL_MAXIMUM * UPTOKEN_PROBES_INFLIGHT, &options->uptoken_max_latency))
+			return FALSE;
+		}
+	else if(strcmp(name, "Standby") == 0)
+		{
+		if((options->standby = standby_mode(value)) < 0)
+			{
+			stl(STL_ERROR, XMLPARSER "Standby must be off, warm or degraded! Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+			return FALSE;
+			}
+		}
+	else if(strcmp(name, "StandbyLatency") == 0)
+		{
+		if(!config_seconds(parser, name, value, 0, UPTOKEN_INTERVAL_MAXIMUM * UPTOKEN_PROBES_INFLIGHT, &options->standby_latency))
+			return FALSE;
+		}
+	else if(strcmp(name, "StandbyHandoff") == 0)
+		{
+		if(value[0] == '\0')
+			options->standby_handoff = NULL;
+		else if((options->standby_handoff = arena_strdup(main_config, value)) == NULL)
+			return FALSE;
+		}
+	else if(strcmp(name, "ShutdownGrace") == 0)
+		{
+		if(!config_seconds(parser, name, value, 0, TUNNEL_SHUTDOWN_GRACE_MAXIMUM, &options->shutdown_grace))
+			return FALSE;
+		}
+	else
+		return CONFIG_UNHANDLED;
+	return TRUE;
+	}
+
+//Parses an integer attribute, which must be between minimum and maximum.
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_integer(XML_Parser parser, const char *name, const char *value, int minimum, int maximum, int *result)
+	{
+	int j;
+	if(sscanf(value, "%d", &j) != 1)
+		{
+		stl(STL_ERROR, XMLPARSER "%s must be an integer! Line: %d", name, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	if(j < minimum || j > maximum)
+		{
+		stl(STL_ERROR, XMLPARSER "%s must be an integer between %d and %d. Line: %d", name, minimum, maximum, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	*result = j;
+	return TRUE;
+	}
+
+//Parses an attribute holding a (possibly fractional) number of seconds, which must be between minimum and maximum.
+//The result is in milliseconds.
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_seconds(XML_Parser parser, const char *name, const char *value, double minimum, double maximum, int64_t *result)
+	{
+	double seconds;
+	if(sscanf(value, "%lf", &seconds) != 1)
+		{
+		stl(STL_ERROR, XMLPARSER "%s must be a number! Line: %d", name, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	if(!isfinite(seconds) || seconds < minimum || seconds > maximum)
+		{
+		stl(STL_ERROR, XMLPARSER "%s must be a number of seconds between %g and %g. Line: %d", name, minimum, maximum, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	*result = (int64_t)((seconds * 1000.0) + 0.5);
+	return TRUE;
+	}
+
+//Parses the attributes of a <MagicWord> tag and adds it to a list of words.
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_magic_word(XML_Parser parser, const char **attributes, struct magic_word **words, int *words_len, int *words_pos)
+	{
+	int i, severity_set = FALSE;
+	struct magic_word word;
+	
+	word.pattern = NULL;
+	word.action = MAGIC_ACTION_CONDEMN;
+	word.severity = STL_ERROR;
+	word.count = 0;
+	word.seen_line = 0;
+	
+	//Scan through all attributes.
+	for(i = 0; attributes[i]; i = i + 2)
+		{
+		if(strcmp(attributes[i], "Pattern") == 0)
+			word.pattern = (char *)attributes[i+1];
+		else if(strcmp(attributes[i], "Action") == 0)
+			{
+			if((word.action = magic_word_action(attributes[i+1])) == 0)
+				{
+				stl(STL_ERROR, XMLPARSER "MagicWord Action must be condemn, log or count. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+				return FALSE;
+				}
+			}
+		else if(strcmp(attributes[i], "Severity") == 0)
+			{
+			severity_set = TRUE;
+			if(strcasecmp(attributes[i+1], "error") == 0)
+				word.severity = STL_ERROR;
+			else if(strcasecmp(attributes[i+1], "warning") == 0)
+				word.severity = STL_WARNING;
+			else if(strcasecmp(attributes[i+1], "info") == 0)
+				word.severity = STL_INFO;
+			else
+				{
+				stl(STL_ERROR, XMLPARSER "MagicWord Severity must be error, warning or info. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+				return FALSE;
+				}
+			}
+		}
+	if(word.pattern == NULL || word.pattern[0] == '\0')
+		{
+		stl(STL_ERROR, XMLPARSER "<MagicWord> tag requires a non-empty \"Pattern\" attribute. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	if(!severity_set && word.action == MAGIC_ACTION_LOG)
+		word.severity = STL_WARNING;
 	
-	if((mynew = calloc(strlen(new) + 1, sizeof(char))) == NULL)
+	if((word.pattern = strdup(word.pattern)) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return FALSE;
+		}
+	if((*words = list_grow_insert(*words, &word, sizeof(struct magic_word), words_len, words_pos)) == NULL)
 		{
 		stl(STL_ERROR, "Out of memory!");
-		return NULL;
+		free(word.pattern);
+		return FALSE;
 		}
-	strcpy(mynew, new);
+	return TRUE;
+	}
+
+void destroy_magic_words(struct magic_word *words, int words_pos)
+	{
+	int i;
 	
-	//Find the first equals sign within the new variable.
-	equalspos = strlen(mynew) - 1; //Default to last byte of the string.
-	for(i = 0; mynew[i]; i++)
+	if(words == NULL)
+		return;
+	for(i = 0; i < words_pos; i++)
+		free(words[i].pattern);
+	free(words);
+	}
+
+//Resets the parser state for a new <Tunnel> or <TunnelTemplate>.
+void config_element_begin(struct sshtunnels_configstate *state)
+	{
+	tunnel_options_default(&state->options);
+	state->count_programargument = 0;
+	state->count_programenvironment = 0;
+	state->newargv_pos = 0;
+	state->newenvp_pos = 0;
+	state->parameters_pos = 0;
+	state->template_name = NULL;
+	state->ports = NULL;
+	state->template_index = -1;
+	}
+
+//Frees whatever the last <Tunnel> or <TunnelTemplate> left behind. (Anything a template took over has already been cleared out of the state.)
+//The argument, environment and parameter lists are only scratch space, and get reused by the next one.
+void config_element_end(struct sshtunnels_configstate *state)
+	{
+	destroy_magic_words(state->tunnel_words, state->tunnel_words_pos);
+	state->tunnel_words = NULL;
+	state->tunnel_words_len = 0;
+	state->tunnel_words_pos = 0;
+	}
+
+//Records a parameter for the current <Tunnel> or <TunnelTemplate>.
+//Returns TRUE on success or FALSE on error.
+int config_parameter(struct sshtunnels_configstate *state, const char *name, const char *value)
+	{
+	struct config_parameter parameter;
+	
+	if((parameter.name = arena_strdup(main_config, name)) == NULL || (parameter.value = arena_strdup(main_config, value)) == NULL)
+		return FALSE;
+	if((state->parameters = list_grow_insert(state->parameters, &parameter, sizeof(struct config_parameter), &state->parameters_len, &state->parameters_pos)) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Looks up the value of a placeholder. The expanded port wins, then the tunnel's own parameters, then the template's defaults.
+//Returns the value, or NULL if there is no such parameter.
+const char *config_parameter_value(struct sshtunnels_configstate *state, const char *name, size_t length, const char *port)
+	{
+	int i;
+	struct config_template *template;
+	
+	if(port != NULL && length == 4 && strncmp(name, "Port", length) == 0)
+		return port;
+	for(i = 0; i < state->parameters_pos; i++)
+		{
+		if(strlen(state->parameters[i].name) == length && strncmp(state->parameters[i].name, name, length) == 0)
+			return state->parameters[i].value;
+		}
+	if(state->template_index >= 0)
 		{
-		if(mynew[i] == '=')
+		template = &state->templates[state->template_index];
+		for(i = 0; i < template->parameters_pos; i++)
 			{
-			equalspos = i;
-			break;
+			if(strlen(template->parameters[i].name) == length && strncmp(template->parameters[i].name, name, length) == 0)
+				return template->parameters[i].value;
 			}
 		}
+	return NULL;
+	}
+
+//Returns the index of the named template, or -1 if there isn't one.
+int config_template_find(struct sshtunnels_configstate *state, const char *name)
+	{
+	int i;
 	
-	//Scan through envp, looking for dupes.
-	if(myenvp != NULL)
+	for(i = 0; i < state->templates_pos; i++)
 		{
-		for(i = 0; myenvp[i]; i++)
+		if(strcmp(state->templates[i].name, name) == 0)
+			return i;
+		}
+	return -1;
+	}
+
+//Starts a <Tunnel> off with the options and magic words of the named template. (Its arguments and environment are expanded later.)
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_template_apply(XML_Parser parser, struct sshtunnels_configstate *state, const char *name)
+	{
+	int i;
+	struct magic_word word;
+	struct config_template *template;
+	
+	if((state->template_index = config_template_find(state, name)) < 0)
+		{
+		stl(STL_ERROR, XMLPARSER "There is no <TunnelTemplate> named \"%s\". (Templates must be declared before they are used.) Line: %d.", name, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	template = &state->templates[state->template_index];
+	state->options = template->options;
+	
+	for(i = 0; i < template->words_pos; i++)
+		{
+		word = template->words[i];
+		if((word.pattern = strdup(word.pattern)) == NULL)
 			{
-			//Does the portion before the equals sign match?
-			if(strncmp(myenvp[i], mynew, equalspos + 1) == 0)
-				{
-				//We are replacing this variable, instead of adding one to the end of the list.
-				free(myenvp[i]);
-				myenvp[i] = mynew;
-				return mynew;
-				}
+			stl(STL_ERROR, "Out of memory!");
+			return FALSE;
+			}
+		if((state->tunnel_words = list_grow_insert(state->tunnel_words, &word, sizeof(struct magic_word), &state->tunnel_words_len, &state->tunnel_words_pos)) == NULL)
+			{
+			stl(STL_ERROR, "Out of memory!");
+			free(word.pattern);
+			return FALSE;
 			}
 		}
+	return TRUE;
+	}
+
+//Turns the <TunnelTemplate> that was just parsed into a template. Its lists are copied into the config arena, except for the magic words, which move out of the parser state.
+//Returns TRUE on success or FALSE on error.
+int config_template_finish(XML_Parser parser, struct sshtunnels_configstate *state)
+	{
+	struct config_template template;
 	
-	//No duplicates. mynew needs to go onto the end of the list.
-	if((*newenvp = list_grow_insert(myenvp, &mynew, sizeof(char *), newenvp_len, newenvp_pos)) == NULL)
+	template.name = state->template_name;
+	template.options = state->options;
+	template.argv_pos = state->newargv_pos;
+	template.env_pos = state->newenvp_pos;
+	template.parameters_pos = state->parameters_pos;
+	if((template.argv = arena_list(main_config, state->newargv, state->newargv_pos)) == NULL ||
+		(template.env = arena_list(main_config, state->newenvp, state->newenvp_pos)) == NULL ||
+		(template.parameters = (struct config_parameter *)arena_alloc(main_config, state->parameters_pos * sizeof(struct config_parameter), ARENA_ALIGNMENT)) == NULL)
+		return FALSE;
+	if(state->parameters_pos > 0)
+		memcpy(template.parameters, state->parameters, state->parameters_pos * sizeof(struct config_parameter));
+	template.words = state->tunnel_words;
+	template.words_len = state->tunnel_words_len;
+	template.words_pos = state->tunnel_words_pos;
+	if((state->templates = list_grow_insert(state->templates, &template, sizeof(struct config_template), &state->templates_len, &state->templates_pos)) == NULL)
 		{
 		stl(STL_ERROR, "Out of memory!");
-		free(mynew);
-		return NULL;
+		return FALSE;
 		}
+	state->tunnel_words = NULL;
+	state->tunnel_words_pos = 0;
 	
-	return mynew;
+	stl(STL_INFO, XMLPARSER "Parsed <TunnelTemplate> \"%s\" with %d <ProgramArgument> tag(s), %d <ProgramEnvironment> tag(s) and %d <MagicWord> tag(s).", template.name, template.argv_pos, template.env_pos, template.words_pos);
+	return TRUE;
 	}
 
-//Tunnel module doesn't allocate or populate argv and envp, we do. So tunnel_destroy() isn't responsible for tearing them down either.
-void destroy_tunnel_argvenvp(struct tunnel *tun)
+//Creates the tunnel(s) for the <Tunnel> that was just parsed. With a Ports attribute, that's one tunnel per port.
+//Ports is a comma-separated list of ports and port ranges, like "22,10000-10999".
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_tunnel_expand(XML_Parser parser, struct sshtunnels_configstate *state)
 	{
-	if(tun == NULL)
-		return;
+	int first, last, port, length, count = 0;
+	char *p, buf[16];
+	
+	if(state->ports == NULL)
+		return config_tunnel_create(parser, state, NULL);
+	
+	for(p = state->ports; *p; )
+		{
+		if(sscanf(p, "%d%n", &first, &length) != 1)
+			break;
+		p = p + length;
+		last = first;
+		if(*p == '-')
+			{
+			p++;
+			if(sscanf(p, "%d%n", &last, &length) != 1)
+				break;
+			p = p + length;
+			}
+		if(first < 1 || last > 65535 || first > last)
+			break;
+		while(*p == ' ')
+			p++;
+		if(*p == ',')
+			p++;
+		else if(*p != '\0')
+			break;
+		
+		for(port = first; port <= last; port++)
+			{
+			snprintf(buf, sizeof(buf), "%d", port);
+			if(!config_tunnel_create(parser, state, buf))
+				return FALSE;
+			count++;
+			}
+		}
+	if(*p != '\0' || count == 0)
+		{
+		stl(STL_ERROR, XMLPARSER "Ports must be a comma-separated list of ports or port ranges between 1 and 65535, like \"22,10000-10999\". Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	
+	stl(STL_INFO, XMLPARSER "Expanded <Tunnel> into %d tunnels.", count);
+	return TRUE;
+	}
+
+//Creates one tunnel from the parser state, expanding any placeholders for the given port. (Which may be NULL.)
+//Returns TRUE on success or FALSE on error.
+int config_tunnel_create(XML_Parser parser, struct sshtunnels_configstate *state, const char *port)
+	{
+	char **argv, **env = NULL, *variable, buf[sizeof(STANDBY_INSTANCE_VARIABLE) + 8];
+	struct config_template *template = NULL;
+	struct tunnel_options options = state->options;
+	struct tunnel *instances[2];
+	struct event_loop *loop;
+	int i, count = 1;
+	
+	//The template's arguments and environment come first, followed by the tunnel's own. They're put together in scratch lists, then copied into the arena.
+	state->expandargv_pos = 0;
+	state->expandenvp_pos = 0;
+	if(state->template_index >= 0)
+		{
+		template = &state->templates[state->template_index];
+		if(!config_expand_list(parser, state, port, template->argv, template->argv_pos, &state->expandargv, &state->expandargv_len, &state->expandargv_pos, FALSE) ||
+			!config_expand_list(parser, state, port, template->env, template->env_pos, &state->expandenvp, &state->expandenvp_len, &state->expandenvp_pos, TRUE))
+			return FALSE;
+		}
+	if(!config_expand_list(parser, state, port, state->newargv, state->newargv_pos, &state->expandargv, &state->expandargv_len, &state->expandargv_pos, FALSE) ||
+		!config_expand_list(parser, state, port, state->newenvp, state->newenvp_pos, &state->expandenvp, &state->expandenvp_len, &state->expandenvp_pos, TRUE))
+		return FALSE;
+	if((argv = arena_list(main_config, state->expandargv, state->expandargv_pos)) == NULL)
+		return FALSE;
+	
+	//Only an uptoken can tell us that a standby instance is up.
+	if(options.standby != STANDBY_OFF && !options.uptoken_enabled)
+		{
+		stl(STL_WARNING, XMLPARSER "Standby requires UpToken. Ignoring it. Line: %d.", (int)XML_GetCurrentLineNumber(parser));
+		options.standby = STANDBY_OFF;
+		}
+	if(options.standby != STANDBY_OFF)
+		count = 2;
 	
-	destroy_arglist(tun->argv);
-	tun->argv = NULL;
-	destroy_arglist(tun->envp);
-	tun->envp = NULL;
+	//A tunnel with a standby is two tunnels on the same loop, which are told apart by STANDBY_INSTANCE_VARIABLE.
+	loop = shard_assign();
+	for(i = 0; i < count; i++)
+		{
+		if(count > 1)
+			{
+			snprintf(buf, sizeof(buf), STANDBY_INSTANCE_VARIABLE "=%d", i + 1);
+			if((variable = arena_strdup(main_config, buf)) == NULL || !insert_new_environment_variable(&state->expandenvp, &state->expandenvp_len, &state->expandenvp_pos, variable))
+				return FALSE;
+			}
+		if(state->expandenvp_pos > 0 && (env = arena_list(main_config, state->expandenvp, state->expandenvp_pos)) == NULL)
+			return FALSE;
+		
+		//Compile this tunnel's magic words. Without any global ones, the built-in defaults apply.
+		//Most tunnels only have the global words, so those are compiled once and shared. Each tunnel still keeps its own counts.
+		if(state->tunnel_words_pos == 0 && state->global_matcher != NULL)
+			options.magic_words = magic_share(state->global_matcher);
+		else if(state->seen_global_magicword)
+			options.magic_words = magic_compile(state->global_words, state->global_words_pos, state->tunnel_words, state->tunnel_words_pos);
+		else
+			options.magic_words = magic_compile(magic_words_default, magic_words_default_len, state->tunnel_words, state->tunnel_words_pos);
+		if(options.magic_words == NULL)
+			return FALSE;
+		if(state->tunnel_words_pos == 0 && state->global_matcher == NULL && (state->global_matcher = magic_share(options.magic_words)) == NULL)
+			{
+			magic_destroy(options.magic_words);
+			return FALSE;
+			}
+		
+		if((instances[i] = tunnel_create(argv, env, main_env_base, &options, loop)) == NULL)
+			{
+			stl(STL_ERROR, "Tunnel object creation failed!");
+			magic_destroy(options.magic_words);
+			return FALSE;
+			}
+		}
+	if(count > 1)
+		standby_pair(instances[0], instances[1]);
+	return TRUE;
 	}
 
-void destroy_arglist(char **list)
+//Expands each string in "from" and adds it to the end of "to". (Environment variables replace any earlier ones with the same name.)
+//Returns TRUE on success or FALSE on error.
+int config_expand_list(XML_Parser parser, struct sshtunnels_configstate *state, const char *port, char **from, int from_pos, char ***to, int *to_len, int *to_pos, int environment)
 	{
 	int i;
-	if(list == NULL)
-		return;
+	char *string;
 	
-	for(i = 0; list[i]; i++)
-		free(list[i]);
-	free(list);
+	for(i = 0; i < from_pos; i++)
+		{
+		if((string = config_expand(parser, state, from[i], port)) == NULL)
+			return FALSE;
+		if(environment)
+			{
+			if(!insert_new_environment_variable(to, to_len, to_pos, string))
+				return FALSE;
+			}
+		else if((*to = list_grow_insert(*to, &string, sizeof(char *), to_len, to_pos)) == NULL)
+			{
+			stl(STL_ERROR, "Out of memory!");
+			return FALSE;
+			}
+		}
+	return TRUE;
 	}
 
-void destroy_alltunnels(void)
+//Substitutes ${Name} placeholders in a string belonging to a templated (or Ports) tunnel. "$${" stands for a literal "${".
+//Plain tunnels are left alone, and so are strings without placeholders, which every tunnel using them shares.
+//Returns the expanded string, or NULL (after reporting the problem) on error.
+char *config_expand(XML_Parser parser, struct sshtunnels_configstate *state, char *string, const char *port)
+	{
+	int pass;
+	size_t length = 0, n;
+	char *expanded = NULL, *p, *end;
+	const char *value;
+	
+	if((state->template_index < 0 && state->ports == NULL) || strstr(string, "${") == NULL)
+		return string;
+	
+	//The first pass measures, and the second one copies.
+	for(pass = 0; pass < 2; pass++)
+		{
+		length = 0;
+		for(p = string; *p; )
+			{
+			if(p[0] == '$' && p[1] == '$' && p[2] == '{')
+				{
+				value = p + 1;
+				n = 2;
+				p = p + 3;
+				}
+			else if(p[0] == '$' && p[1] == '{')
+				{
+				if((end = strchr(p + 2, '}')) == NULL)
+					{
+					stl(STL_ERROR, XMLPARSER "Unterminated placeholder in \"%s\". Line: %d.", string, (int)XML_GetCurrentLineNumber(parser));
+					return NULL;
+					}
+				if((value = config_parameter_value(state, p + 2, end - (p + 2), port)) == NULL)
+					{
+					stl(STL_ERROR, XMLPARSER "Unknown parameter %.*s in \"%s\". Line: %d.", (int)(end + 1 - p), p, string, (int)XML_GetCurrentLineNumber(parser));
+					return NULL;
+					}
+				n = strlen(value);
+				p = end + 1;
+				}
+			else
+				{
+				value = p;
+				n = 1;
+				p++;
+				}
+			if(expanded != NULL)
+				memcpy(expanded + length, value, n);
+			length = length + n;
+			}
+		if(expanded == NULL && (expanded = arena_alloc(main_config, length + 1, 1)) == NULL)
+			return NULL;
+		}
+	expanded[length] = '\0';
+	return expanded;
+	}
+
+//Frees everything the parser built up that didn't end up belonging to a tunnel.
+void destroy_configstate(struct sshtunnels_configstate *state)
 	{
 	int i;
-	if(main_tunnels)
+	
+	config_element_end(state);
+	free(state->newargv);
+	state->newargv = NULL;
+	free(state->newenvp);
+	state->newenvp = NULL;
+	free(state->parameters);
+	state->parameters = NULL;
+	free(state->expandargv);
+	state->expandargv = NULL;
+	free(state->expandenvp);
+	state->expandenvp = NULL;
+	destroy_magic_words(state->global_words, state->global_words_pos);
+	state->global_words = NULL;
+	state->global_words_pos = 0;
+	if(state->global_matcher != NULL)
+		magic_destroy(state->global_matcher);
+	state->global_matcher = NULL;
+	for(i = 0; i < state->templates_pos; i++)
+		destroy_magic_words(state->templates[i].words, state->templates[i].words_pos);
+	free(state->templates);
+	state->templates = NULL;
+	state->templates_pos = 0;
+	}
+
+//Parses a (possibly fractional) number attribute, which must be between minimum and maximum.
+//Returns TRUE on success or FALSE (after reporting the problem) on error.
+int config_number(XML_Parser parser, const char *name, const char *value, double minimum, double maximum, double *result)
+	{
+	double number;
+	if(sscanf(value, "%lf", &number) != 1)
 		{
-		for(i = 0; main_tunnels[i]; i++)
+		stl(STL_ERROR, XMLPARSER "%s must be a number! Line: %d", name, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	if(!isfinite(number) || number < minimum || number > maximum)
+		{
+		stl(STL_ERROR, XMLPARSER "%s must be a number between %g and %g. Line: %d", name, minimum, maximum, (int)XML_GetCurrentLineNumber(parser));
+		return FALSE;
+		}
+	*result = number;
+	return TRUE;
+	}
+
+//A tunnel's own environment variables should be non-duplicate entries. So we'll check for dupes before inserting each entry.
+//(There are only ever a few of these per tunnel. Our own environment is shared between tunnels. See env.c.)
+//The list just points at "new", which must live in the config arena. A later variable replaces an earlier one with the same name.
+//Returns TRUE on success or FALSE on error.
+int insert_new_environment_variable(char ***newenvp, int *newenvp_len, int *newenvp_pos, char *new)
+	{
+	int i, equalspos;
+	char **myenvp = *newenvp; //I'm not gonna lie. This is pretty Inceptionesque.
+	
+	//Find the first equals sign within the new variable.
+	equalspos = strlen(new) - 1; //Default to last byte of the string.
+	for(i = 0; new[i]; i++)
+		{
+		if(new[i] == '=')
 			{
-			destroy_tunnel_argvenvp(main_tunnels[i]);
-			tunnel_destroy(main_tunnels[i]);
+			equalspos = i;
+			break;
+			}
+		}
+	
+	//Scan through envp, looking for dupes.
+	if(myenvp != NULL)
+		{
+		for(i = 0; i < *newenvp_pos; i++)
+			{
+			//Does the portion before the equals sign match?
+			if(strncmp(myenvp[i], new, equalspos + 1) == 0)
+				{
+				//We are replacing this variable, instead of adding one to the end of the list.
+				myenvp[i] = new;
+				return TRUE;
+				}
 			}
-		free(main_tunnels);
-		main_tunnels = NULL;
 		}
+	
+	//No duplicates. new needs to go onto the end of the list.
+	if((*newenvp = list_grow_insert(myenvp, &new, sizeof(char *), newenvp_len, newenvp_pos)) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory!");
+		return FALSE;
+		}
+	
+	return TRUE;
+	}
+
+void destroy_alltunnels(void)
+	{
+	int i;
+	tunnel_stop_all(main_signal_pipe[PIPE_READ]);
+	for(i = 1; i <= tunnel_count(); i++)
+		tunnel_destroy(tunnel_by_id(i));
+	tunnel_table_free();
+	standby_destroy();
+	launch_destroy();
+	shard_destroy();
+	env_base_destroy(main_env_base);
+	main_env_base = NULL;
+	
+	//The tunnels were the last things pointing into the config arena.
+	arena_destroy(main_config);
+	main_config = NULL;
 	}
 
 void usage(void)
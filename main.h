@@ -37,18 +37,34 @@
 #define TRUE 1
 #define FALSE 0
 
-#define MAIN_SLEEP_SECONDS_DEFAULT 5
 #define UPTOKEN_ENABLED_DEFAULT TRUE
 #define UPTOKEN_INTERVAL_DEFAULT 15
+#define UPTOKEN_INTERVAL_MINIMUM 0.1
+#define UPTOKEN_INTERVAL_MAXIMUM 60
 #define UPTOKEN_INTERVAL_GRACEPERIOD 5
 #define UPTOKEN_BUFFER_SIZE 8 //Don't change this.
 #define UPTOKEN_HEADER_BUFFER_SIZE 128 //Don't change this.
 #define UPTOKEN_HEADER_VERSION 1
 #define UPTOKEN_HEADER_FORMAT "HeaderVersion: %d; UpToken Interval: %d;\n"
 
+//UpToken protocol 2 still sends a version 1 header, with extra fields tacked on the end. Version 1 receivers parse the
+//fields they know and ignore the rest, and since they echo everything verbatim, v2 probes work through them too.
+//A v2 receiver acknowledges the protocol by sending UPTOKEN_PROTOCOL_FIELD back before it starts echoing.
+#define UPTOKEN_PROTOCOL_DEFAULT 2
+#define UPTOKEN_PROTOCOL_MAXIMUM 2
+#define UPTOKEN_HEADER_FORMAT_V2 "HeaderVersion: %d; UpToken Interval: %d; UpToken Protocol: %d; UpToken Timeout: %d; UpToken Grace: %d;\n"
+#define UPTOKEN_PROTOCOL_FIELD "UpToken Protocol: %d;"
+#define UPTOKEN_TIMEOUT_FIELD "UpToken Timeout: %d;" //Milliseconds the receiver should go without input before giving up.
+#define UPTOKEN_GRACE_FIELD "UpToken Grace: %d;" //Milliseconds of slack on top of that. (UPTOKEN_INTERVAL_GRACEPERIOD if it isn't sent.)
+#define UPTOKEN_PROBE_FORMAT "#%u %lld\n" //Sequence number and send time in milliseconds.
+#define UPTOKEN_LOSS_THRESHOLD_DEFAULT 3
+#define UPTOKEN_ADAPTIVE_DEFAULT TRUE //Protocol 2 timeouts follow the measured round trip times.
+#define UPTOKEN_TIMEOUT_MIN_DEFAULT 1 //Seconds.
+
 #define XMLBUFFERSIZE 512
 #define LIST_GROW_STEP 8
 #define XMLPARSER "XML Config Parser: "
+#define CONFIG_UNHANDLED -1 //For attribute parsers: the attribute isn't one of theirs.
 #define CONFIG_FILENAME "SSHTunnels_config.xml"
 
 #ifndef PREFIX
@@ -0,0 +1,186 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * netwatch.c
+ *     - Network change watcher. Lets tunnels react to a new network right away.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "netwatch.h"
+#include "main.h"
+#include "log.h"
+#include "util.h"
+
+#ifdef NETWATCH_USE_NETLINK
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if.h>
+#endif
+
+//Without this, a roaming client only finds out that its tunnels are dead when their uptokens time out.
+struct netwatch netwatch = { -1, NETWATCH_OFF, 0, 0, NULL };
+
+//Parses a NetworkWatch setting. Returns one of the NETWATCH_* actions, or -1 if it isn't recognized.
+int netwatch_action(const char *action)
+	{
+	if(strcasecmp(action, "off") == 0)
+		return NETWATCH_OFF;
+	if(strcasecmp(action, "probe") == 0)
+		return NETWATCH_PROBE;
+	if(strcasecmp(action, "condemn") == 0)
+		return NETWATCH_CONDEMN;
+	return -1;
+	}
+
+//Starts listening for address, link and default route changes.
+//Returns TRUE on success or FALSE on error.
+int netwatch_start(struct event_loop *loop, int action, int64_t timeout)
+	{
+	#ifdef NETWATCH_USE_NETLINK
+	struct sockaddr_nl addr;
+	#endif
+	
+	if(action == NETWATCH_OFF)
+		return TRUE;
+	
+	netwatch.action = action;
+	netwatch.timeout = timeout;
+	netwatch.loop = loop;
+	event_timer_init(&netwatch.timer, netwatch_timer, NULL);
+	
+	#ifdef NETWATCH_USE_NETLINK
+	if((netwatch.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE)) < 0)
+		{
+		stl(STL_ERROR, "Network watcher: socket() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+	if(bind(netwatch.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+		stl(STL_ERROR, "Network watcher: bind() failed! (%s)", strerror(errno));
+		netwatch_stop();
+		return FALSE;
+		}
+	if(!event_add(loop, netwatch.fd, netwatch_event, NULL))
+		{
+		netwatch_stop();
+		return FALSE;
+		}
+	stl(STL_INFO, "Network watcher: Listening for network changes.");
+	#else
+	stl(STL_WARNING, "Network watcher: Not supported on this platform. Tunnels will only notice network changes through UpToken.");
+	#endif
+	
+	return TRUE;
+	}
+
+void netwatch_stop(void)
+	{
+	if(netwatch.loop != NULL)
+		event_timer_cancel(netwatch.loop, &netwatch.timer);
+	if(netwatch.fd != -1)
+		{
+		if(netwatch.loop != NULL)
+			event_remove(netwatch.loop, netwatch.fd);
+		close(netwatch.fd);
+		netwatch.fd = -1;
+		}
+	}
+
+//Event loop handler for the rtnetlink socket. Counts the messages which mean we might be on a different network now.
+int netwatch_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	#ifdef NETWATCH_USE_NETLINK
+	char buffer[NETWATCH_BUFFER_SIZE];
+	struct nlmsghdr *msg;
+	struct ifinfomsg *link;
+	struct rtmsg *route;
+	ssize_t readret;
+	unsigned int changes = netwatch.changes;
+	
+	while((readret = recv(fd, buffer, sizeof(buffer), 0)) != 0)
+		{
+		if(readret < 0)
+			{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			//The kernel dropped messages because we fell behind. Whatever they were, something changed.
+			if(errno == ENOBUFS)
+				{
+				netwatch.changes++;
+				continue;
+				}
+			stl(STL_ERROR, "Network watcher: recv() failed! (%s)", strerror(errno));
+			return FALSE;
+			}
+		
+		for(msg = (struct nlmsghdr *)buffer; NLMSG_OK(msg, readret); msg = NLMSG_NEXT(msg, readret))
+			{
+			switch(msg->nlmsg_type)
+				{
+				case RTM_NEWADDR:
+				case RTM_DELADDR:
+					netwatch.changes++;
+					break;
+				case RTM_NEWLINK:
+					//Links are re-announced for all sorts of reasons. We only care about them going up or down.
+					link = (struct ifinfomsg *)NLMSG_DATA(msg);
+					if(link->ifi_change & (IFF_UP | IFF_RUNNING | IFF_LOWER_UP))
+						netwatch.changes++;
+					break;
+				case RTM_DELLINK:
+					netwatch.changes++;
+					break;
+				case RTM_NEWROUTE:
+				case RTM_DELROUTE:
+					//Only the default route matters.
+					route = (struct rtmsg *)NLMSG_DATA(msg);
+					if(route->rtm_dst_len == 0 && route->rtm_table == RT_TABLE_MAIN)
+						netwatch.changes++;
+					break;
+				}
+			}
+		}
+	
+	if(netwatch.changes != changes && !event_timer_pending(&netwatch.timer))
+		return event_timer_schedule(loop, &netwatch.timer, time_monotonic_ms() + NETWATCH_SETTLE_TIME);
+	#endif
+	
+	return TRUE;
+	}
+
+//Timer handler: the network has settled down after a change. Let every tunnel know.
+int netwatch_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	int i;
+	
+	stl(STL_WARNING, "Network watcher: The network changed. (%u change(s).) %s tunnels...", netwatch.changes, netwatch.action == NETWATCH_CONDEMN ? "Relaunching" : "Checking");
+	netwatch.changes = 0;
+	for(i = 1; i <= tunnel_count(); i++)
+		{
+		if(!tunnel_notify_network_changed(tunnel_by_id(i), netwatch.action == NETWATCH_CONDEMN, netwatch.timeout))
+			return FALSE;
+		}
+	return TRUE;
+	}
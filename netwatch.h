@@ -0,0 +1,64 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * netwatch.h
+ *     - Network change watcher. Lets tunnels react to a new network right away.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_NETWATCH_H
+
+#include "tunnel.h"
+
+//On Linux we listen to rtnetlink. There's no equivalent everywhere else (iOS), so the watcher is unavailable there.
+#ifdef __linux__
+#define NETWATCH_USE_NETLINK
+#endif
+
+//What to do to running tunnels when the network changes.
+enum
+	{
+	NETWATCH_OFF,
+	NETWATCH_PROBE, //Send an uptoken right away, and condemn the tunnel if it doesn't come back quickly.
+	NETWATCH_CONDEMN //Condemn the tunnel straight away.
+	};
+
+#define NETWATCH_ACTION_DEFAULT NETWATCH_OFF
+#define NETWATCH_TIMEOUT_DEFAULT 1 //Seconds an out-of-cycle uptoken has to come back.
+#define NETWATCH_SETTLE_TIME 250 //Milliseconds. A network change arrives as a burst of messages, so wait for it to finish.
+#define NETWATCH_BUFFER_SIZE 8192
+
+struct netwatch
+	{
+	int fd, action;
+	int64_t timeout; //Milliseconds.
+	unsigned int changes;
+	struct event_loop *loop;
+	struct event_timer timer;
+	};
+
+int netwatch_action(const char *action);
+int netwatch_start(struct event_loop *loop, int action, int64_t timeout);
+void netwatch_stop(void);
+int netwatch_event(struct event_loop *loop, int fd, int events, void *data);
+int netwatch_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+
+#define __SSHTUNNELS_NETWATCH_H
+#endif
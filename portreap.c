@@ -0,0 +1,533 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * portreap.c
+ *     - Finds and terminates stale processes holding the listening ports a reconnecting client needs.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include "main.h"
+#include "util.h"
+#include "log.h"
+#include "portreap.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+int portreap_process_stat(pid_t pid, unsigned long long *start_time, pid_t *ppid, char *state, char *comm, size_t comm_size);
+int portreap_process_scan(struct portreap_index *index, struct portreap_process *process);
+struct portreap_process *portreap_process_find(struct portreap_index *index, pid_t pid);
+int portreap_table_rebuild(struct portreap_index *index);
+int portreap_listeners(const uint16_t *ports, int ports_count, uid_t uid, ino_t *inodes, uint16_t *inode_ports, int inodes_max);
+int portreap_ancestors(pid_t pid, pid_t *pids, int pids_max);
+int portreap_pid_compare(const void *a, const void *b);
+
+//Parses a comma-separated list of ports and port ranges, like "22,10000-10009".
+//Returns TRUE on success or FALSE on error.
+int portreap_parse_ports(const char *list, uint16_t *ports, int *ports_count)
+	{
+	const char *pos = list;
+	char *end;
+	long first, last, port;
+	
+	*ports_count = 0;
+	while(*pos != '\0')
+		{
+		first = strtol(pos, &end, 10);
+		if(end == pos || first < 1 || first > 65535)
+			return FALSE;
+		last = first;
+		pos = end;
+		if(*pos == '-')
+			{
+			last = strtol(pos + 1, &end, 10);
+			if(end == pos + 1 || last < first || last > 65535)
+				return FALSE;
+			pos = end;
+			}
+		for(port = first; port <= last; port++)
+			{
+			if(*ports_count >= PORTREAP_PORTS_MAXIMUM)
+				return FALSE;
+			ports[(*ports_count)++] = (uint16_t)port;
+			}
+		if(*pos == ',')
+			pos++;
+		else if(*pos != '\0')
+			return FALSE;
+		}
+	return *ports_count > 0;
+	}
+
+void portreap_index_init(struct portreap_index *index, const char *name)
+	{
+	memset(index, 0, sizeof(struct portreap_index));
+	index->uid = getuid();
+	snprintf(index->name, sizeof(index->name), "%s", name);
+	}
+
+void portreap_index_free(struct portreap_index *index)
+	{
+	int i;
+	
+	for(i = 0; i < index->processes_pos; i++)
+		free(index->processes[i].sockets);
+	free(index->processes);
+	free(index->table);
+	memset(index, 0, sizeof(struct portreap_index));
+	}
+
+//Reads the bits of /proc/<pid>/stat we care about. Any of the outputs may be NULL.
+//Returns TRUE on success or FALSE if the process is gone.
+int portreap_process_stat(pid_t pid, unsigned long long *start_time, pid_t *ppid, char *state, char *comm, size_t comm_size)
+	{
+	char path[64], buf[1024], *open_paren, *close_paren;
+	unsigned long long start;
+	int fd, parent;
+	ssize_t readret;
+	char st;
+	
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return FALSE;
+	readret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(readret <= 0)
+		return FALSE;
+	buf[readret] = '\0';
+	
+	//The name is in parentheses, and may contain anything (including parentheses), so it's found from both ends.
+	if((open_paren = strchr(buf, '(')) == NULL || (close_paren = strrchr(buf, ')')) == NULL || close_paren < open_paren)
+		return FALSE;
+	if(sscanf(close_paren + 1, " %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &st, &parent, &start) != 3)
+		return FALSE;
+	
+	if(start_time)
+		*start_time = start;
+	if(ppid)
+		*ppid = (pid_t)parent;
+	if(state)
+		*state = st;
+	if(comm)
+		snprintf(comm, comm_size, "%.*s", (int)(close_paren - open_paren - 1), open_paren + 1);
+	return TRUE;
+	}
+
+//Works out whether a process is a candidate, and if it is, which sockets it has open.
+//Returns TRUE on success or FALSE if the process is gone.
+int portreap_process_scan(struct portreap_index *index, struct portreap_process *process)
+	{
+	char path[64], link[64], comm[PORTREAP_NAME_SIZE];
+	struct portreap_socket socket;
+	struct dirent *entry;
+	unsigned long inode;
+	ssize_t len;
+	DIR *dir;
+	
+	process->sockets_pos = 0;
+	if(!portreap_process_stat(process->pid, &process->start_time, NULL, NULL, comm, sizeof(comm)))
+		return FALSE;
+	process->candidate = (strcmp(comm, index->name) == 0);
+	if(!process->candidate)
+		return TRUE;
+	
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)process->pid);
+	if((dir = opendir(path)) == NULL)
+		return FALSE;
+	index->processes_scanned++;
+	while((entry = readdir(dir)) != NULL)
+		{
+		if(!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+		index->fds_scanned++;
+		if((len = readlinkat(dirfd(dir), entry->d_name, link, sizeof(link) - 1)) < 0)
+			continue;
+		link[len] = '\0';
+		if(sscanf(link, "socket:[%lu]", &inode) != 1)
+			continue;
+		socket.inode = (ino_t)inode;
+		socket.pid = process->pid;
+		socket.fd = atoi(entry->d_name);
+		if((process->sockets = list_grow_insert(process->sockets, &socket, sizeof(struct portreap_socket), &process->sockets_len, &process->sockets_pos)) == NULL)
+			{
+			stl(STL_ERROR, PORTREAP_MODULE "list_grow_insert() failed!");
+			process->sockets_len = process->sockets_pos = 0;
+			closedir(dir);
+			return FALSE;
+			}
+		}
+	closedir(dir);
+	return TRUE;
+	}
+
+int portreap_pid_compare(const void *a, const void *b)
+	{
+	pid_t pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+	return (pa > pb) - (pa < pb);
+	}
+
+//Brings the index up to date with /proc. Processes which have gone away are dropped, and new ones are looked at. Processes we've
+//seen before are kept as they are, unless full is TRUE, in which case everything is looked at again.
+//Returns TRUE on success or FALSE on error.
+int portreap_refresh(struct portreap_index *index, int full)
+	{
+	struct portreap_process *processes, *old = index->processes;
+	pid_t *pids = NULL;
+	int pids_len = 0, pids_pos = 0, old_pos = index->processes_pos, i = 0, j, processes_pos = 0;
+	struct dirent *entry;
+	struct stat st;
+	pid_t pid;
+	DIR *proc;
+	
+	index->processes_scanned = 0;
+	index->fds_scanned = 0;
+	
+	//Only our own processes can be terminated, so nobody else's are worth looking at. (We couldn't read their fds anyway.)
+	if((proc = opendir("/proc")) == NULL)
+		{
+		stl(STL_ERROR, PORTREAP_MODULE "Couldn't open /proc! (%s)", strerror(errno));
+		return FALSE;
+		}
+	while((entry = readdir(proc)) != NULL)
+		{
+		if(!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+		if(fstatat(dirfd(proc), entry->d_name, &st, 0) != 0 || st.st_uid != index->uid)
+			continue;
+		pid = (pid_t)atoi(entry->d_name);
+		if((pids = list_grow_insert(pids, &pid, sizeof(pid_t), &pids_len, &pids_pos)) == NULL)
+			{
+			stl(STL_ERROR, PORTREAP_MODULE "list_grow_insert() failed!");
+			closedir(proc);
+			return FALSE;
+			}
+		}
+	closedir(proc);
+	if(pids_pos > 1)
+		qsort(pids, pids_pos, sizeof(pid_t), portreap_pid_compare);
+	
+	if((processes = calloc(pids_pos + 1, sizeof(struct portreap_process))) == NULL)
+		{
+		stl(STL_ERROR, PORTREAP_MODULE "calloc() failed!");
+		free(pids);
+		return FALSE;
+		}
+	
+	//Both lists are sorted by pid, so they can be merged in one pass.
+	for(j = 0; j < pids_pos; j++)
+		{
+		while(i < old_pos && old[i].pid < pids[j])
+			free(old[i++].sockets);
+		if(i < old_pos && old[i].pid == pids[j] && !full)
+			{
+			processes[processes_pos++] = old[i++];
+			continue;
+			}
+		if(i < old_pos && old[i].pid == pids[j])
+			{
+			//Rescanning. The socket list can be reused.
+			processes[processes_pos] = old[i++];
+			}
+		else
+			{
+			memset(&processes[processes_pos], 0, sizeof(struct portreap_process));
+			processes[processes_pos].pid = pids[j];
+			}
+		if(portreap_process_scan(index, &processes[processes_pos]))
+			processes_pos++;
+		else
+			free(processes[processes_pos].sockets);
+		}
+	while(i < old_pos)
+		free(old[i++].sockets);
+	
+	free(old);
+	free(pids);
+	index->processes = processes;
+	index->processes_pos = processes_pos;
+	return portreap_table_rebuild(index);
+	}
+
+//Rebuilds the inode lookup table from the processes' socket lists.
+//Returns TRUE on success or FALSE on error.
+int portreap_table_rebuild(struct portreap_index *index)
+	{
+	int i, k, count = 0, len = PORTREAP_SOCKETS_INITIAL, slot;
+	struct portreap_socket *socket;
+	
+	for(i = 0; i < index->processes_pos; i++)
+		count += index->processes[i].sockets_pos;
+	
+	//Keep the table at most half full.
+	while(count * 2 > len)
+		len = len * 2;
+	if(len != index->table_len)
+		{
+		free(index->table);
+		index->table_len = 0;
+		if((index->table = calloc(len, sizeof(struct portreap_socket))) == NULL)
+			{
+			stl(STL_ERROR, PORTREAP_MODULE "calloc() failed!");
+			return FALSE;
+			}
+		index->table_len = len;
+		}
+	else
+		memset(index->table, 0, sizeof(struct portreap_socket) * len);
+	
+	for(i = 0; i < index->processes_pos; i++)
+		{
+		for(k = 0; k < index->processes[i].sockets_pos; k++)
+			{
+			socket = &index->processes[i].sockets[k];
+			slot = (int)(socket->inode & (len - 1));
+			while(index->table[slot].inode != 0)
+				slot = (slot + 1) & (len - 1);
+			index->table[slot] = *socket;
+			}
+		}
+	return TRUE;
+	}
+
+struct portreap_process *portreap_process_find(struct portreap_index *index, pid_t pid)
+	{
+	return bsearch(&pid, index->processes, index->processes_pos, sizeof(struct portreap_process), portreap_pid_compare);
+	}
+
+//Looks up which processes have a socket open. Each one is checked against /proc first, since the index may be out of date.
+//Returns the number of pids found.
+int portreap_owners(struct portreap_index *index, ino_t inode, pid_t *pids, int pids_max)
+	{
+	char path[64], link[64], expect[64];
+	int slot, count = 0, i, duplicate;
+	ssize_t len;
+	
+	if(index->table_len == 0)
+		return 0;
+	
+	snprintf(expect, sizeof(expect), "socket:[%lu]", (unsigned long)inode);
+	for(slot = (int)(inode & (index->table_len - 1)); index->table[slot].inode != 0 && count < pids_max; slot = (slot + 1) & (index->table_len - 1))
+		{
+		if(index->table[slot].inode != inode)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)index->table[slot].pid, index->table[slot].fd);
+		if((len = readlink(path, link, sizeof(link) - 1)) < 0)
+			continue;
+		link[len] = '\0';
+		if(strcmp(link, expect) != 0)
+			continue;
+		for(i = 0, duplicate = FALSE; i < count; i++)
+			duplicate = duplicate || (pids[i] == index->table[slot].pid);
+		if(!duplicate)
+			pids[count++] = index->table[slot].pid;
+		}
+	return count;
+	}
+
+//Finds the listening TCP sockets (IPv4 and IPv6) belonging to uid on any of the ports.
+//Returns the number of sockets found, or -1 on error.
+int portreap_listeners(const uint16_t *ports, int ports_count, uid_t uid, ino_t *inodes, uint16_t *inode_ports, int inodes_max)
+	{
+	const char *tables[] = { "/proc/net/tcp", "/proc/net/tcp6" };
+	unsigned int port, state, owner;
+	unsigned long inode;
+	char line[512];
+	int t, i, count = 0;
+	FILE *file;
+	
+	for(t = 0; t < 2; t++)
+		{
+		if((file = fopen(tables[t], "re")) == NULL)
+			{
+			//No IPv6 is fine.
+			if(t == 0)
+				{
+				stl(STL_ERROR, PORTREAP_MODULE "Couldn't open %s! (%s)", tables[t], strerror(errno));
+				return -1;
+				}
+			continue;
+			}
+		while(fgets(line, sizeof(line), file) != NULL)
+			{
+			//sl local_address rem_address st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode
+			if(sscanf(line, " %*d: %*[0-9A-Fa-f]:%X %*[0-9A-Fa-f]:%*X %X %*X:%*X %*X:%*X %*X %u %*d %lu", &port, &state, &owner, &inode) != 4)
+				continue;
+			if(state != 0x0A || owner != uid || inode == 0) //0x0A is TCP_LISTEN.
+				continue;
+			for(i = 0; i < ports_count && count < inodes_max; i++)
+				{
+				if(ports[i] != port)
+					continue;
+				inodes[count] = (ino_t)inode;
+				inode_ports[count] = (uint16_t)port;
+				count++;
+				break;
+				}
+			}
+		fclose(file);
+		}
+	return count;
+	}
+
+//Lists pid and its ancestors, stopping before init.
+//Returns the number of pids listed.
+int portreap_ancestors(pid_t pid, pid_t *pids, int pids_max)
+	{
+	int count = 0;
+	
+	while(pid > 1 && count < pids_max)
+		{
+		pids[count++] = pid;
+		if(!portreap_process_stat(pid, NULL, &pid, NULL, NULL, 0))
+			break;
+		}
+	return count;
+	}
+
+//Sends SIGTERM to every process of ours with the index's name which is listening on one of the ports, except for the session's own
+//process and its ancestors. (They hold the ports because this session has them, which is exactly what we're trying to make possible.)
+//The processes which were sent SIGTERM are added to targets.
+//Returns TRUE on success or FALSE on error.
+int portreap_terminate(struct portreap_index *index, const uint16_t *ports, int ports_count, pid_t session, struct portreap_target *targets, int *targets_count)
+	{
+	#ifdef PORTREAP_USE_PROC
+	ino_t inodes[PORTREAP_PORTS_MAXIMUM * 2];
+	uint16_t inode_ports[PORTREAP_PORTS_MAXIMUM * 2];
+	pid_t excluded[PORTREAP_ANCESTORS_MAXIMUM + 1], owners[PORTREAP_TARGETS_MAXIMUM];
+	int listeners, excluded_count, owners_count, missing, pass, k, o, i, skip;
+	struct portreap_process *process;
+	int64_t now;
+	
+	if((listeners = portreap_listeners(ports, ports_count, index->uid, inodes, inode_ports, PORTREAP_PORTS_MAXIMUM * 2)) <= 0)
+		return listeners == 0;
+	
+	excluded[0] = getpid();
+	excluded_count = 1 + portreap_ancestors(session, excluded + 1, PORTREAP_ANCESTORS_MAXIMUM);
+	
+	//Usually the stale process was already around the last time we looked, and only new processes need a look. If a socket can't
+	//be found that way, it may have been opened since then by a process we already knew about, so everything gets another look.
+	for(pass = 0; pass < 2; pass++)
+		{
+		if(!portreap_refresh(index, pass > 0))
+			return FALSE;
+		for(k = 0, missing = FALSE; k < listeners && !missing; k++)
+			missing = (portreap_owners(index, inodes[k], owners, PORTREAP_TARGETS_MAXIMUM) == 0);
+		if(!missing)
+			break;
+		}
+	
+	now = time_monotonic_ms();
+	for(k = 0; k < listeners; k++)
+		{
+		if((owners_count = portreap_owners(index, inodes[k], owners, PORTREAP_TARGETS_MAXIMUM)) == 0)
+			{
+			stl(STL_INFO, PORTREAP_MODULE "Port %d is held by a process which isn't %s. Leaving it alone.", (int)inode_ports[k], index->name);
+			continue;
+			}
+		for(o = 0; o < owners_count; o++)
+			{
+			for(i = 0, skip = FALSE; i < excluded_count; i++)
+				skip = skip || (owners[o] == excluded[i]);
+			for(i = 0; i < *targets_count; i++)
+				skip = skip || (owners[o] == targets[i].pid);
+			if(skip || *targets_count >= PORTREAP_TARGETS_MAXIMUM || (process = portreap_process_find(index, owners[o])) == NULL)
+				continue;
+			
+			stl(STL_WARNING, PORTREAP_MODULE "Port %d is held by stale process %d. Sending SIGTERM...", (int)inode_ports[k], (int)owners[o]);
+			if(kill(owners[o], SIGTERM) == -1)
+				{
+				stl(STL_ERROR, PORTREAP_MODULE "kill(%d, SIGTERM) failed! (%s)", (int)owners[o], strerror(errno));
+				continue;
+				}
+			targets[*targets_count].pid = owners[o];
+			targets[*targets_count].start_time = process->start_time;
+			targets[*targets_count].deadline = now + PORTREAP_GRACE;
+			(*targets_count)++;
+			}
+		}
+	return TRUE;
+	#else
+	stl(STL_WARNING, PORTREAP_MODULE "Not available on this platform.");
+	return FALSE;
+	#endif
+	}
+
+//Returns TRUE if the process we sent SIGTERM to is still running. (Zombies don't count, since they've let go of their sockets.)
+int portreap_alive(struct portreap_target *target)
+	{
+	unsigned long long start_time;
+	char state;
+	
+	if(!portreap_process_stat(target->pid, &start_time, NULL, &state, NULL, 0))
+		return FALSE;
+	return start_time == target->start_time && state != 'Z' && state != 'X';
+	}
+
+//Sends SIGKILL to a target which is still running past its deadline.
+//Returns TRUE once the target needs no more attention, or FALSE if it still has time left.
+int portreap_escalate(struct portreap_target *target, int64_t now)
+	{
+	if(!portreap_alive(target))
+		return TRUE;
+	if(now < target->deadline)
+		return FALSE;
+	
+	stl(STL_WARNING, PORTREAP_MODULE "Stale process %d ignored SIGTERM. Sending SIGKILL...", (int)target->pid);
+	if(kill(target->pid, SIGKILL) == -1)
+		stl(STL_ERROR, PORTREAP_MODULE "kill(%d, SIGKILL) failed! (%s)", (int)target->pid, strerror(errno));
+	return TRUE;
+	}
+
+//Blocks until every target has exited or been sent SIGKILL.
+void portreap_wait(struct portreap_target *targets, int targets_count)
+	{
+	int i, waiting = TRUE;
+	
+	while(waiting)
+		{
+		waiting = FALSE;
+		for(i = 0; i < targets_count; i++)
+			{
+			if(targets[i].pid > 0 && portreap_escalate(&targets[i], time_monotonic_ms()))
+				targets[i].pid = 0;
+			waiting = waiting || targets[i].pid > 0;
+			}
+		if(waiting)
+			usleep(PORTREAP_POLL * 1000);
+		}
+	}
+
+//Terminates the stale holders of the ports once, and waits for them to go away. (For when there's no daemon with an index to keep.)
+//Returns TRUE on success or FALSE on error.
+int portreap_run(const char *name, const uint16_t *ports, int ports_count, pid_t session)
+	{
+	struct portreap_index index;
+	struct portreap_target targets[PORTREAP_TARGETS_MAXIMUM];
+	int targets_count = 0, result;
+	
+	portreap_index_init(&index, name);
+	result = portreap_terminate(&index, ports, ports_count, session, targets, &targets_count);
+	portreap_wait(targets, targets_count);
+	portreap_index_free(&index);
+	return result;
+	}
@@ -0,0 +1,98 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * portreap.h
+ *     - Finds and terminates stale processes holding the listening ports a reconnecting client needs.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_PORTREAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//Sockets are traced back to processes through /proc, which only Linux has. Everywhere else (iOS) the reaper is unavailable.
+#ifdef __linux__
+#define PORTREAP_USE_PROC
+#endif
+
+#define PORTREAP_MODULE "Port reaper: "
+#define PORTREAP_PORTS_MAXIMUM 64 //Most ports one session can ask for.
+#define PORTREAP_TARGETS_MAXIMUM 64 //Most processes terminated for one session.
+#define PORTREAP_NAME_DEFAULT "sshd" //Only processes with this name are ever terminated.
+#define PORTREAP_NAME_SIZE 16 //Same as the kernel's limit for process names.
+#define PORTREAP_ANCESTORS_MAXIMUM 32
+#define PORTREAP_GRACE 2000 //Milliseconds a stale process gets to exit after SIGTERM, before SIGKILL.
+#define PORTREAP_POLL 50 //Milliseconds between checks while waiting for a stale process to exit.
+#define PORTREAP_SOCKETS_INITIAL 256 //Must be a power of two.
+
+//A socket one of our processes had open, the last time we looked.
+struct portreap_socket
+	{
+	ino_t inode;
+	pid_t pid;
+	int fd;
+	};
+
+//One of our processes. Only candidates (those with the right name) have their file descriptors looked at.
+struct portreap_process
+	{
+	pid_t pid;
+	unsigned long long start_time; //Clock ticks after boot. Tells a process apart from a later one which got the same pid.
+	int candidate;
+	struct portreap_socket *sockets;
+	int sockets_len, sockets_pos;
+	};
+
+//Which of our processes holds which socket. Kept sorted by pid, so that a refresh is a merge with the current contents of /proc, and
+//only processes which weren't there last time have their file descriptors read.
+struct portreap_index
+	{
+	uid_t uid;
+	char name[PORTREAP_NAME_SIZE];
+	struct portreap_process *processes;
+	int processes_pos;
+	struct portreap_socket *table; //Open addressing by inode, rebuilt after every refresh. (inode 0 marks an empty slot.)
+	int table_len;
+	int processes_scanned, fds_scanned; //By the last refresh.
+	};
+
+//A process we sent SIGTERM to.
+struct portreap_target
+	{
+	pid_t pid;
+	unsigned long long start_time;
+	int64_t deadline; //Milliseconds. (Monotonic clock.) When it gets SIGKILL instead.
+	};
+
+int portreap_parse_ports(const char *list, uint16_t *ports, int *ports_count);
+void portreap_index_init(struct portreap_index *index, const char *name);
+void portreap_index_free(struct portreap_index *index);
+int portreap_refresh(struct portreap_index *index, int full);
+int portreap_owners(struct portreap_index *index, ino_t inode, pid_t *pids, int pids_max);
+int portreap_terminate(struct portreap_index *index, const uint16_t *ports, int ports_count, pid_t session, struct portreap_target *targets, int *targets_count);
+int portreap_alive(struct portreap_target *target);
+int portreap_escalate(struct portreap_target *target, int64_t now);
+void portreap_wait(struct portreap_target *targets, int targets_count);
+int portreap_run(const char *name, const uint16_t *ports, int ports_count, pid_t session);
+
+#define __SSHTUNNELS_PORTREAP_H
+#endif
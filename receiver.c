@@ -4,6 +4,8 @@
  * receiver.c
  *     - UpTokenReceiver runs at the far end of the tunnel, echoing UpTokens from STDIN to STDOUT.
  *     - Kills far end of the tunnel if the link goes down.
+ *     - Hands its session to the receiver daemon instead, if one is running. (See receiverd.c)
+ *     - Can terminate stale sshd processes still holding the ports the client is about to need. (See portreap.c)
  *
  * Copyright (C) 2015 Alex Markley
  * 
@@ -26,26 +28,75 @@
 #include "main.h"
 #include "util.h"
 #include "log.h"
+#include "event.h"
+#include "receiver.h"
+#include "portreap.h"
 
 #include <stdio.h>
 #include <time.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <strings.h>
 
-#define RECEIVER_SLEEP_SECONDS_DEFAULT 2
+void receiver_usage(void);
 
 int main(int argc, char **argv)
 	{
-	int i, up = TRUE, header_complete = FALSE, header_pos = 0, header_version, header_uptoken_interval;
-	time_t now, wakeup, last_uptoken = 0, uptoken_interval = UPTOKEN_INTERVAL_DEFAULT;
-	ssize_t readret, buf_pos;
-	pid_t ppid;
-	char buf[UPTOKEN_BUFFER_SIZE], header[UPTOKEN_HEADER_BUFFER_SIZE];
+	struct event_loop *loop;
+	struct receiver_session session;
+	char socket_path[RECEIVER_SOCKET_PATH_SIZE], *reap_name = PORTREAP_NAME_DEFAULT;
+	uint16_t reap_ports[PORTREAP_PORTS_MAXIMUM];
+	int daemon_mode = FALSE, standalone = FALSE, reap_only = FALSE, reap_ports_count = 0, shim, i;
 	
 	stl_loginit("UpTokenReceiver");
+	receiver_socket_path_default(socket_path, sizeof(socket_path));
+	
+	//Parse some command line options.
+	for(i = 1; i < argc; i++)
+		{
+		if(strcasecmp(argv[i], "--help") == 0)
+			receiver_usage();
+		else if(strcasecmp(argv[i], "--daemon") == 0)
+			daemon_mode = TRUE;
+		else if(strcasecmp(argv[i], "--standalone") == 0)
+			standalone = TRUE;
+		else if(strcasecmp(argv[i], "--socket") == 0 && (i + 1) < argc)
+			{
+			if(strlen(argv[++i]) >= sizeof(socket_path))
+				{
+				stl(STL_ERROR, "Socket path is too long! (%s)", argv[i]);
+				return 1;
+				}
+			strcpy(socket_path, argv[i]);
+			}
+		else if(strcasecmp(argv[i], "--reap-ports") == 0 && (i + 1) < argc)
+			{
+			if(!portreap_parse_ports(argv[++i], reap_ports, &reap_ports_count))
+				{
+				stl(STL_ERROR, "Couldn't parse port list %s! (At most %d ports, like 22,10000-10009.)", argv[i], PORTREAP_PORTS_MAXIMUM);
+				return 1;
+				}
+			}
+		else if(strcasecmp(argv[i], "--reap-name") == 0 && (i + 1) < argc)
+			reap_name = argv[++i];
+		else if(strcasecmp(argv[i], "--reap-only") == 0)
+			reap_only = TRUE;
+		else
+			stl(STL_WARNING, "Ignoring unknown option %s. (See --help.)", argv[i]);
+		}
 	
-	//Zero out header buffer.
-	memset(header, 0, UPTOKEN_HEADER_BUFFER_SIZE);
+	if(daemon_mode)
+		return receiver_daemon_main(socket_path, reap_name);
+	
+	if(reap_only)
+		{
+		if(reap_ports_count == 0)
+			{
+			stl(STL_ERROR, "--reap-only needs --reap-ports!");
+			return 1;
+			}
+		return portreap_run(reap_name, reap_ports, reap_ports_count, getppid()) ? 0 : 1;
+		}
 	
 	//Make sure we're not connected to a terminal.
 	//If we are, there's a good chance we'll kill the user's shell by accident.
@@ -59,130 +110,259 @@ int main(int argc, char **argv)
 	if(!fd_set_nonblock(STDIN_FILENO))
 		return 1;
 	
-	//Run forever. (Ideally)
-	while(up)
+	receiver_session_init(&session, STDIN_FILENO, STDOUT_FILENO, getppid());
+	
+	//If there's a receiver daemon, it can watch this session along with all the others, and we just wait.
+	shim = standalone ? RECEIVER_SHIM_UNAVAILABLE : receiver_shim(socket_path, &session, reap_ports, reap_ports_count);
+	if(shim == RECEIVER_SHIM_DONE)
+		return 1;
+	
+	//Without a daemon, we get rid of the stale processes ourselves. (A daemon which handed the session back already did.)
+	if(shim == RECEIVER_SHIM_UNAVAILABLE && reap_ports_count > 0)
+		portreap_run(reap_name, reap_ports, reap_ports_count, session.ppid);
+	
+	if((loop = event_loop_create()) == NULL)
+		return 1;
+	
+	if(!receiver_session_start(loop, &session))
+		return 1;
+	
+	//Run until the session goes down. (Ideally forever.) We only wake up when input arrives or the deadline passes.
+	while(session.up)
 		{
-		now = time(NULL);
-		if(last_uptoken == 0)
-			last_uptoken = now;
-		
-		//Read from STDIN.
-		readret = read_all(STDIN_FILENO, buf, UPTOKEN_BUFFER_SIZE);
-		if(readret > 0)
+		if(event_dispatch(loop, -1) < 0)
+			receiver_session_down(loop, &session, "event_dispatch() returned with an error.");
+		}
+	
+	event_loop_destroy(loop);
+	return 1; //There is no successful exit condition for this program.
+	}
+
+void receiver_session_init(struct receiver_session *session, int fd_in, int fd_out, pid_t ppid)
+	{
+	memset(session, 0, sizeof(struct receiver_session));
+	session->fd_in = fd_in;
+	session->fd_out = fd_out;
+	session->ppid = ppid;
+	session->up = TRUE;
+	session->header_complete = FALSE;
+	session->header_pos = 0;
+	session->protocol = 1;
+	session->uptoken_interval = (int64_t)UPTOKEN_INTERVAL_DEFAULT * 1000;
+	session->input_timeout = session->uptoken_interval;
+	session->input_grace = (int64_t)UPTOKEN_INTERVAL_GRACEPERIOD * 1000;
+	session->last_input = time_monotonic_ms();
+	session->fd_control = -1;
+	event_timer_init(&session->deadline_timer, receiver_deadline_timer, session);
+	}
+
+//Starts watching the session's input and arms its deadline.
+//Returns TRUE on success or FALSE on error.
+int receiver_session_start(struct event_loop *loop, struct receiver_session *session)
+	{
+	if(!event_add(loop, session->fd_in, receiver_input_event, session))
+		return FALSE;
+	return event_timer_schedule(loop, &session->deadline_timer, time_monotonic_ms() + session->input_timeout + session->input_grace);
+	}
+
+//Event loop handler for the session's input. Uptokens are echoed the moment they arrive.
+int receiver_input_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct receiver_session *session = (struct receiver_session *)data;
+	char buf[UPTOKEN_HEADER_BUFFER_SIZE];
+	ssize_t readret, buf_pos;
+	int i;
+	
+	while(session->up && (readret = read(fd, buf, sizeof(buf))) > 0)
+		{
+		i = 0;
+		if(!session->header_complete) //Header is NOT complete. We need to capture and parse it.
 			{
-			//Remember how many bytes are in buf.
-			buf_pos = readret;
-			
-			//Remember the last time we heard from the far end.
-			last_uptoken = now;
-			
-			if(!header_complete) //Header is NOT complete. We need to capture and parse it.
+			//Copy read bytes into header buffer.
+			for(i = 0; i < readret && !session->header_complete; i++)
 				{
-				//Copy read bytes into header buffer.
-				for(i = 0; i < readret && !header_complete; i++)
+				if(session->header_pos >= (UPTOKEN_HEADER_BUFFER_SIZE - 2))
 					{
-					if(header_pos >= (UPTOKEN_HEADER_BUFFER_SIZE - 2))
-						{
-						stl(STL_ERROR, "Error receiving header!");
-						return -1;
-						}
-					header[header_pos] = buf[i];
-					
-					//The first newline completes the header line.
-					if(buf[i] == '\n') header_complete = TRUE;
-					
-					header_pos++;
+					receiver_session_down(loop, session, "Error receiving header!");
+					return TRUE;
 					}
+				session->header[session->header_pos] = buf[i];
 				
-				//Do we still have more in our buffer? We need to be careful to retain it.
-				if(i < readret)
-					{
-					//Move the trailing contents of buf to the beginning of buf.
-					buf_pos = buf_pos - i;
-					memmove(buf, buf + i, buf_pos);
-					}
-				else
-					{
-					buf_pos = 0;
-					}
+				//The first newline completes the header line.
+				if(buf[i] == '\n') session->header_complete = TRUE;
 				
-				//Is the header buffer full yet?
-				if(header_complete)
-					{
-					//Check header version first.
-					if(sscanf(header, "HeaderVersion: %d;", &header_version) < 1)
-						{
-						stl(STL_ERROR, "Couldn't parse header version string! Unknown header format! Proceeding with defaults...");
-						}
-					else //Got a header version number.
-						{
-						if(header_version == 1)
-							{
-							if(sscanf(header, UPTOKEN_HEADER_FORMAT, &header_version, &header_uptoken_interval) < 2)
-								{
-								stl(STL_ERROR, "Couldn't parse header version string! Should be version 1, but unknown header format! Proceeding with defaults...");
-								}
-							else //We got everything.
-								{
-								stl(STL_INFO, "Received Header Version %d. Uptoken Interval is %d.", header_version, header_uptoken_interval);
-								uptoken_interval = (time_t)header_uptoken_interval;
-								}
-							}
-						else
-							{
-							stl(STL_ERROR, "Couldn't parse header version string! Unknown header version %d! Proceeding with defaults...", header_version);
-							}
-						}
-					stl(STL_INFO, "Header parsing finished. Listening for UpTokens...");
-					}
+				session->header_pos++;
 				}
 			
-			//Have we finished parsing the header yet? Is anything left in buf?
-			if(header_complete && buf_pos > 0)
+			if(session->header_complete)
 				{
-				//Echo all bytes from STDIN to STDOUT.
-				if(write_all(STDOUT_FILENO, buf, buf_pos) < 0)
+				receiver_parse_header(session);
+				
+				//Protocol 2 senders want to hear that we speak their language before the echoes start.
+				if(session->protocol >= 2)
 					{
-					stl(STL_ERROR, "failed writing to STDOUT! (%s)", strerror(errno));
-					up = FALSE;
+					snprintf(session->header, UPTOKEN_HEADER_BUFFER_SIZE, UPTOKEN_PROTOCOL_FIELD "\n", session->protocol);
+					if(write_all(session->fd_out, session->header, strlen(session->header)) < 0)
+						{
+						stl(STL_ERROR, "%sfailed writing to STDOUT! (%s)", session->name, strerror(errno));
+						receiver_session_down(loop, session, "Output failed!");
+						return TRUE;
+						}
 					}
 				}
 			}
-		else if(readret < 0)
+		
+		//Echo everything after the header from input to output.
+		buf_pos = readret - i;
+		if(session->header_complete && buf_pos > 0)
 			{
-			//Because read() returned an error code, we need to check errno.
-			if(errno != EAGAIN && errno != EWOULDBLOCK)
+			if(write_all(session->fd_out, buf + i, buf_pos) < 0)
 				{
-				stl(STL_ERROR, "failed reading from STDIN! (%s)", strerror(errno));
-				up = FALSE;
+				stl(STL_ERROR, "%sfailed writing to STDOUT! (%s)", session->name, strerror(errno));
+				receiver_session_down(loop, session, "Output failed!");
+				return TRUE;
 				}
-			//Zero bytes, but not an error.
 			}
 		
-		//Check the time. If it has been too long since we heard from the far end, we'll set up = FALSE;
-		if(now > (last_uptoken + uptoken_interval + UPTOKEN_INTERVAL_GRACEPERIOD))
+		//Remember the last time we heard from the far end. (The header may have just told us a new interval.)
+		session->last_input = time_monotonic_ms();
+		if(!event_timer_schedule(loop, &session->deadline_timer, session->last_input + session->input_timeout + session->input_grace))
+			return FALSE;
+		}
+	
+	if(!session->up)
+		return TRUE;
+	
+	if(readret == 0)
+		{
+		//End of file. Whoever was sending us uptokens is gone for good, so there's no point waiting for the deadline.
+		receiver_session_down(loop, session, "STDIN closed!");
+		}
+	else if(readret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+		//Because read() returned an error code, we need to check errno.
+		stl(STL_ERROR, "%sfailed reading from STDIN! (%s)", session->name, strerror(errno));
+		receiver_session_down(loop, session, "Input failed!");
+		}
+	else if(events & (EVENT_HANGUP | EVENT_ERROR))
+		{
+		receiver_session_down(loop, session, "STDIN hung up!");
+		}
+	
+	return TRUE;
+	}
+
+//Timer handler: it has been too long since we heard from the far end.
+int receiver_deadline_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	receiver_session_down(loop, (struct receiver_session *)data, "Timeout waiting for input!");
+	return TRUE;
+	}
+
+//The link is down. Clean up the session and get rid of the stale sshd.
+void receiver_session_down(struct event_loop *loop, struct receiver_session *session, char *reason)
+	{
+	if(!session->up)
+		return;
+	
+	stl(STL_ERROR, "%s%s", session->name, reason);
+	session->up = FALSE;
+	event_remove(loop, session->fd_in);
+	event_timer_cancel(loop, &session->deadline_timer);
+	receiver_kill_parent(session);
+	
+	if(session->daemon)
+		receiver_daemon_session_down(session);
+	}
+
+//In the case of an SSH Tunnel with forwarded ports, a stale sshd process will hold open the necessary ports for a VERY LONG TIME.
+//This mechanism sends SIGTERM to that process, killing it and guaranteeing that the ports are free.
+void receiver_kill_parent(struct receiver_session *session)
+	{
+	stl(STL_INFO, "%sSending SIGTERM to parent process. (%d)", session->name, session->ppid);
+	if(kill(session->ppid, SIGTERM) == -1)
+		stl(STL_ERROR, "%skill(%d, SIGTERM) failed! (%s)", session->name, session->ppid, strerror(errno));
+	}
+
+void receiver_parse_header(struct receiver_session *session)
+	{
+	int header_version, header_uptoken_interval;
+	
+	//Check header version first.
+	if(sscanf(session->header, "HeaderVersion: %d;", &header_version) < 1)
+		{
+		stl(STL_ERROR, "%sCouldn't parse header version string! Unknown header format! Proceeding with defaults...", session->name);
+		}
+	else //Got a header version number.
+		{
+		if(header_version == 1)
 			{
-			stl(STL_ERROR, "Timeout waiting for input!");
-			up = FALSE;
+			if(sscanf(session->header, UPTOKEN_HEADER_FORMAT, &header_version, &header_uptoken_interval) < 2)
+				{
+				stl(STL_ERROR, "%sCouldn't parse header version string! Should be version 1, but unknown header format! Proceeding with defaults...", session->name);
+				}
+			else //We got everything.
+				{
+				stl(STL_INFO, "%sReceived Header Version %d. Uptoken Interval is %d.", session->name, header_version, header_uptoken_interval);
+				session->uptoken_interval = (int64_t)header_uptoken_interval * 1000;
+				session->input_timeout = session->uptoken_interval;
+				receiver_parse_header_v2(session);
+				}
 			}
-		
-		//Only sleep if we are still up and there were no bytes waiting for us in STDIN.
-		//(If our buffer was too small, we need to continue reading right away.)
-		if(up && readret <= 0)
+		else
 			{
-			wakeup = now + RECEIVER_SLEEP_SECONDS_DEFAULT;
-			while(time(NULL) < wakeup)
-				sleep(1);
+			stl(STL_ERROR, "%sCouldn't parse header version string! Unknown header version %d! Proceeding with defaults...", session->name, header_version);
 			}
 		}
+	stl(STL_INFO, "%sHeader parsing finished. Listening for UpTokens...", session->name);
+	}
+
+//Protocol 2 adds optional fields to the end of the version 1 header.
+void receiver_parse_header_v2(struct receiver_session *session)
+	{
+	char *field;
+	int protocol, timeout, grace;
 	
-	//In the case of an SSH Tunnel with forwarded ports, a stale sshd process will hold open the necessary ports for a VERY LONG TIME.
-	//This mechanism sends SIGTERM to that process, killing it and guaranteeing that the ports are free.
-	ppid = getppid();
-	stl(STL_INFO, "Sending SIGTERM to parent process. (%d)", ppid);
-	if(kill(ppid, SIGTERM) == -1)
-		stl(STL_ERROR, "kill(%d, SIGTERM) failed! (%s)", ppid, strerror(errno));
+	if((field = strstr(session->header, "UpToken Protocol:")) == NULL || sscanf(field, UPTOKEN_PROTOCOL_FIELD, &protocol) != 1)
+		return;
 	
-	return 1; //There is no successful exit condition for this program.
+	//We speak every protocol up to UPTOKEN_PROTOCOL_MAXIMUM. Anything newer will have to make do with that.
+	session->protocol = protocol < UPTOKEN_PROTOCOL_MAXIMUM ? protocol : UPTOKEN_PROTOCOL_MAXIMUM;
+	stl(STL_INFO, "%sUsing UpToken protocol %d.", session->name, session->protocol);
+	
+	//The sender tolerates lost probes, so we should hang on for as long as it would.
+	if((field = strstr(session->header, "UpToken Timeout:")) != NULL && sscanf(field, UPTOKEN_TIMEOUT_FIELD, &timeout) == 1 && timeout > 0)
+		{
+		session->input_timeout = (int64_t)timeout;
+		stl(STL_INFO, "%sInput timeout is %d ms.", session->name, timeout);
+		}
+	
+	//A sender which has measured the link tells us how much slack it needs, rather than leaving us to guess.
+	if((field = strstr(session->header, "UpToken Grace:")) != NULL && sscanf(field, UPTOKEN_GRACE_FIELD, &grace) == 1 && grace > 0)
+		{
+		session->input_grace = (int64_t)grace;
+		stl(STL_INFO, "%sInput grace period is %d ms.", session->name, grace);
+		}
 	}
 
+void receiver_usage(void)
+	{
+	char socket_path[RECEIVER_SOCKET_PATH_SIZE];
+	
+	receiver_socket_path_default(socket_path, sizeof(socket_path));
+	stl(STL_INFO, "UpTokenReceiver - The far end of an SSHTunnels tunnel. Echoes uptokens back, and gets rid of the sshd if they stop coming.");
+	stl(STL_INFO, "https://github.com/alexmarkley/SSHTunnels");
+	stl(STL_INFO, "");
+	stl(STL_INFO, "Options:");
+	stl(STL_INFO, "  --daemon       Run as the receiver daemon, which watches the sessions of every UpTokenReceiver started after it.");
+	stl(STL_INFO, "                 Each of those just hands its STDIN and STDOUT to the daemon and waits. (Send SIGUSR1 for a list of sessions.)");
+	stl(STL_INFO, "  --socket PATH  Unix socket where the daemon listens. (Defaults to %s, which is per user.)", socket_path);
+	stl(STL_INFO, "  --standalone   Never hand the session to a daemon.");
+	stl(STL_INFO, "  --reap-ports LIST  Ports the client is about to listen on, like 22,10000-10009. Any other process of ours named");
+	stl(STL_INFO, "                 " PORTREAP_NAME_DEFAULT " which is still listening on them (a stale session) is sent SIGTERM, then SIGKILL. (Linux only.)");
+	stl(STL_INFO, "  --reap-name NAME   Process name to look for instead of " PORTREAP_NAME_DEFAULT ". (For the daemon, it's the daemon's own option that counts.)");
+	stl(STL_INFO, "  --reap-only    Just get rid of the stale processes, then exit.");
+	stl(STL_INFO, "");
+	stl(STL_INFO, "Without a daemon listening (or with one belonging to another user), UpTokenReceiver watches its own session.");
+	exit(0);
+	}
@@ -0,0 +1,129 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * receiver.h
+ *     - UpTokenReceiver sessions, and the daemon which can watch all of them at once.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_RECEIVER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "event.h"
+#include "main.h"
+#include "portreap.h"
+
+#define RECEIVER_SOCKET_FORMAT "/tmp/UpTokenReceiver-%d.sock" //Where the daemon listens unless told otherwise. (%d is the user id.)
+#define RECEIVER_SOCKET_PATH_SIZE 108 //Big enough for sun_path everywhere.
+#define RECEIVER_LISTEN_BACKLOG 128
+#define RECEIVER_REPORT_INTERVAL 300 //Seconds between the daemon's session summaries.
+#define RECEIVER_NAME_SIZE 32
+#define RECEIVER_MESSAGE_MAGIC 0x55545231 //"UTR1"
+#define RECEIVER_HANDOFF_ACK 'A'
+
+//What a shim makes of its attempt to hand its session to the daemon.
+#define RECEIVER_SHIM_UNAVAILABLE 0 //There's no daemon to take it. The shim runs the session itself.
+#define RECEIVER_SHIM_HANDBACK 1 //The daemon ran the session for a while, then gave it back. The shim carries on from there.
+#define RECEIVER_SHIM_DONE 2 //The session is over.
+
+//Sent by a shim along with its STDIN and STDOUT.
+struct receiver_handoff
+	{
+	uint32_t magic;
+	int32_t ppid;
+	int32_t ports_count;
+	uint16_t ports[PORTREAP_PORTS_MAXIMUM]; //Listening ports the client needs, whose stale holders should be terminated.
+	};
+
+//Sent by the daemon when it lets go of a session. Either the session is down, or the daemon is shutting down and the shim
+//gets everything it needs to carry on by itself.
+struct receiver_release
+	{
+	uint32_t magic;
+	int32_t down, protocol, header_complete, header_pos;
+	int64_t uptoken_interval, input_timeout, input_grace; //Milliseconds.
+	char header[UPTOKEN_HEADER_BUFFER_SIZE];
+	};
+
+struct receiver_daemon;
+
+struct receiver_session
+	{
+	int fd_in, fd_out;
+	pid_t ppid;
+	int up, header_complete, header_pos;
+	char header[UPTOKEN_HEADER_BUFFER_SIZE];
+	int protocol;
+	int64_t uptoken_interval, input_timeout, input_grace; //Milliseconds.
+	int64_t last_input; //Milliseconds. (Monotonic clock.)
+	struct event_timer deadline_timer;
+	char name[RECEIVER_NAME_SIZE]; //Prefix for log messages. Empty unless the daemon is running the session.
+	//Daemon mode only.
+	struct receiver_daemon *daemon;
+	int fd_control, id; //fd_control is the connection to the session's shim.
+	int64_t started; //Milliseconds. (Monotonic clock.)
+	};
+
+struct receiver_daemon
+	{
+	struct event_loop *loop;
+	int fd_listen;
+	char socket_path[RECEIVER_SOCKET_PATH_SIZE];
+	struct receiver_session **sessions;
+	int sessions_len, sessions_pos, next_id, finished;
+	uint32_t sessions_started, sessions_down; //Since the last report.
+	struct event_timer reap_timer, report_timer;
+	struct portreap_index portreap_index; //Kept up to date between sessions, so that finding a stale process stays cheap.
+	struct portreap_target *portreap_targets; //Stale processes which were sent SIGTERM, and might still need SIGKILL.
+	int portreap_targets_len, portreap_targets_pos;
+	struct event_timer portreap_timer;
+	};
+
+void receiver_session_init(struct receiver_session *session, int fd_in, int fd_out, pid_t ppid);
+int receiver_session_start(struct event_loop *loop, struct receiver_session *session);
+int receiver_input_event(struct event_loop *loop, int fd, int events, void *data);
+int receiver_deadline_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+void receiver_session_down(struct event_loop *loop, struct receiver_session *session, char *reason);
+void receiver_kill_parent(struct receiver_session *session);
+void receiver_parse_header(struct receiver_session *session);
+void receiver_parse_header_v2(struct receiver_session *session);
+void receiver_socket_path_default(char *path, size_t path_size);
+int receiver_shim(char *socket_path, struct receiver_session *session, uint16_t *ports, int ports_count);
+int receiver_daemon_main(char *socket_path, char *reap_name);
+int receiver_daemon_listen(struct receiver_daemon *daemon);
+void receiver_daemon_signal_handler(int signum);
+int receiver_daemon_signal_setup(struct receiver_daemon *daemon);
+int receiver_daemon_signal_event(struct event_loop *loop, int fd, int events, void *data);
+int receiver_daemon_accept_event(struct event_loop *loop, int fd, int events, void *data);
+int receiver_daemon_control_event(struct event_loop *loop, int fd, int events, void *data);
+int receiver_daemon_handoff(struct receiver_daemon *daemon, struct receiver_session *session);
+void receiver_daemon_session_down(struct receiver_session *session);
+int receiver_daemon_release(struct receiver_session *session, int down);
+int receiver_daemon_reap_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int receiver_daemon_portreap(struct receiver_daemon *daemon, struct receiver_session *session, uint16_t *ports, int ports_count);
+int receiver_daemon_portreap_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int receiver_daemon_report_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+void receiver_daemon_report(struct receiver_daemon *daemon, int detailed);
+void receiver_daemon_shutdown(struct receiver_daemon *daemon);
+
+#define __SSHTUNNELS_RECEIVER_H
+#endif
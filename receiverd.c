@@ -0,0 +1,641 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * receiverd.c
+ *     - UpTokenReceiver daemon mode. One long-lived daemon watches every session on the server in a single event loop.
+ *     - Each UpTokenReceiver started by sshd becomes a shim, which passes its STDIN and STDOUT to the daemon and waits.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+
+#include "main.h"
+#include "util.h"
+#include "log.h"
+#include "event.h"
+#include "receiver.h"
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+int receiver_signal_pipe[2] = { -1, -1 };
+
+//Every user gets their own daemon, since a daemon can only get rid of sshd processes belonging to its own user.
+void receiver_socket_path_default(char *path, size_t path_size)
+	{
+	snprintf(path, path_size, RECEIVER_SOCKET_FORMAT, (int)getuid());
+	}
+
+//Tries to hand the session over to the receiver daemon, then waits for the daemon to let go of it.
+//The daemon also takes care of any stale processes holding the ports.
+//Returns RECEIVER_SHIM_UNAVAILABLE, RECEIVER_SHIM_HANDBACK or RECEIVER_SHIM_DONE. (See receiver.h)
+int receiver_shim(char *socket_path, struct receiver_session *session, uint16_t *ports, int ports_count)
+	{
+	struct sockaddr_un addr;
+	struct receiver_handoff handoff;
+	struct receiver_release release;
+	int sock, fds[2];
+	uid_t uid;
+	char ack;
+	ssize_t readret;
+	
+	if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		{
+		stl(STL_WARNING, "Call to socket() failed! (%s) Watching the session ourselves.", strerror(errno));
+		return RECEIVER_SHIM_UNAVAILABLE;
+		}
+	fd_set_cloexec(sock);
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path) >= (int)sizeof(addr.sun_path))
+		{
+		stl(STL_WARNING, "Receiver daemon socket path %s is too long! Watching the session ourselves.", socket_path);
+		close(sock);
+		return RECEIVER_SHIM_UNAVAILABLE;
+		}
+	if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+		//Usually there just isn't a daemon running, which is fine.
+		if(errno != ENOENT && errno != ECONNREFUSED)
+			stl(STL_WARNING, "Couldn't connect to the receiver daemon at %s! (%s) Watching the session ourselves.", socket_path, strerror(errno));
+		close(sock);
+		return RECEIVER_SHIM_UNAVAILABLE;
+		}
+	
+	//Anybody could have put a socket there. The session is only handed to a daemon running as the same user.
+	if(!socket_peer_uid(sock, &uid) || uid != getuid())
+		{
+		stl(STL_WARNING, "The receiver daemon at %s isn't running as our user! Watching the session ourselves.", socket_path);
+		close(sock);
+		return RECEIVER_SHIM_UNAVAILABLE;
+		}
+	
+	memset(&handoff, 0, sizeof(handoff));
+	handoff.magic = RECEIVER_MESSAGE_MAGIC;
+	handoff.ppid = (int32_t)session->ppid;
+	handoff.ports_count = ports_count;
+	memcpy(handoff.ports, ports, sizeof(uint16_t) * ports_count);
+	fds[0] = session->fd_in;
+	fds[1] = session->fd_out;
+	if(fd_pass_send(sock, &handoff, sizeof(handoff), fds, 2) != sizeof(handoff) || read_all(sock, &ack, 1) != 1 || ack != RECEIVER_HANDOFF_ACK)
+		{
+		stl(STL_WARNING, "The receiver daemon at %s didn't take the session! Watching it ourselves.", socket_path);
+		close(sock);
+		return RECEIVER_SHIM_UNAVAILABLE;
+		}
+	stl(STL_INFO, "Handed the session to the receiver daemon at %s.", socket_path);
+	
+	//From here on we never wake up, until the daemon lets go of the session.
+	readret = read_all(sock, &release, sizeof(release));
+	close(sock);
+	if(readret != sizeof(release) || release.magic != RECEIVER_MESSAGE_MAGIC)
+		{
+		//The daemon died without a word, so nobody is watching the link any more. Do what we would do if it had gone down.
+		stl(STL_ERROR, "Lost the receiver daemon!");
+		if(getppid() == session->ppid)
+			receiver_kill_parent(session);
+		return RECEIVER_SHIM_DONE;
+		}
+	
+	//The daemon has already dealt with our parent.
+	if(release.down)
+		return RECEIVER_SHIM_DONE;
+	
+	//The daemon is shutting down, and has told us everything it knew about the session. We carry on where it left off.
+	session->protocol = release.protocol;
+	session->header_complete = release.header_complete;
+	session->header_pos = (release.header_pos >= 0 && release.header_pos < (UPTOKEN_HEADER_BUFFER_SIZE - 2)) ? release.header_pos : 0;
+	memcpy(session->header, release.header, sizeof(session->header));
+	session->uptoken_interval = release.uptoken_interval;
+	session->input_timeout = release.input_timeout;
+	session->input_grace = release.input_grace;
+	stl(STL_INFO, "The receiver daemon handed the session back. Watching it ourselves.");
+	return RECEIVER_SHIM_HANDBACK;
+	}
+
+//Runs the receiver daemon until it's told to stop.
+//Returns the exit code for the program.
+int receiver_daemon_main(char *socket_path, char *reap_name)
+	{
+	struct receiver_daemon daemon;
+	int error = FALSE;
+	
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.fd_listen = -1;
+	snprintf(daemon.socket_path, sizeof(daemon.socket_path), "%s", socket_path);
+	event_timer_init(&daemon.reap_timer, receiver_daemon_reap_timer, &daemon);
+	event_timer_init(&daemon.report_timer, receiver_daemon_report_timer, &daemon);
+	event_timer_init(&daemon.portreap_timer, receiver_daemon_portreap_timer, &daemon);
+	portreap_index_init(&daemon.portreap_index, reap_name);
+	
+	//Every session holds three file descriptors open.
+	fd_limit_raise();
+	
+	if((daemon.loop = event_loop_create()) == NULL)
+		return 1;
+	
+	if(!receiver_daemon_signal_setup(&daemon) || !receiver_daemon_listen(&daemon) || !event_timer_schedule(daemon.loop, &daemon.report_timer, time_monotonic_ms() + (RECEIVER_REPORT_INTERVAL * 1000)))
+		error = TRUE;
+	else
+		stl(STL_INFO, "Receiver daemon listening on %s.", daemon.socket_path);
+	
+	#ifdef PORTREAP_USE_PROC
+	//Look at everything now, so that only processes started later need a look when a session asks for its ports.
+	if(!error && portreap_refresh(&daemon.portreap_index, TRUE))
+		stl(STL_INFO, PORTREAP_MODULE "Indexed %d processes named %s.", daemon.portreap_index.processes_scanned, daemon.portreap_index.name);
+	#endif
+	
+	//Every session's input and deadline goes through this one loop.
+	while(!error && !daemon.finished)
+		{
+		if(event_dispatch(daemon.loop, -1) < 0)
+			error = TRUE;
+		}
+	
+	receiver_daemon_shutdown(&daemon);
+	return error ? 1 : 0;
+	}
+
+//Creates the daemon's socket and starts accepting shims.
+//Returns TRUE on success or FALSE on error.
+int receiver_daemon_listen(struct receiver_daemon *daemon)
+	{
+	struct sockaddr_un addr;
+	mode_t old_umask;
+	int fd, bound;
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", daemon->socket_path) >= (int)sizeof(addr.sun_path))
+		{
+		stl(STL_ERROR, "Socket path %s is too long!", daemon->socket_path);
+		return FALSE;
+		}
+	
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		{
+		stl(STL_ERROR, "Call to socket() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	
+	//A socket file left behind by a daemon which didn't exit cleanly is just in the way, but one with a daemon behind it isn't ours to take.
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		{
+		stl(STL_ERROR, "Another receiver daemon is already listening on %s!", daemon->socket_path);
+		close(fd);
+		return FALSE;
+		}
+	close(fd);
+	if(unlink(daemon->socket_path) != 0 && errno != ENOENT)
+		{
+		stl(STL_ERROR, "Couldn't remove stale socket %s! (%s)", daemon->socket_path, strerror(errno));
+		return FALSE;
+		}
+	
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		{
+		stl(STL_ERROR, "Call to socket() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	
+	//Only our own user may connect. (Shims are checked again once they have.)
+	old_umask = umask(0077);
+	bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(old_umask);
+	if(bound != 0)
+		{
+		stl(STL_ERROR, "Couldn't bind to %s! (%s)", daemon->socket_path, strerror(errno));
+		close(fd);
+		return FALSE;
+		}
+	daemon->fd_listen = fd;
+	
+	if(listen(fd, RECEIVER_LISTEN_BACKLOG) != 0)
+		{
+		stl(STL_ERROR, "Call to listen() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	if(!fd_set_cloexec(fd) || !fd_set_nonblock(fd))
+		return FALSE;
+	return event_add(daemon->loop, fd, receiver_daemon_accept_event, daemon);
+	}
+
+//Signal handlers can't safely do much of anything, so we just pass the signal number through a pipe to the event loop.
+void receiver_daemon_signal_handler(int signum)
+	{
+	int saved_errno = errno;
+	unsigned char signum_byte = (unsigned char)signum;
+	if(write(receiver_signal_pipe[PIPE_WRITE], &signum_byte, 1) < 0)
+		{
+		//The pipe is full, which means the event loop already has plenty of signals to look at.
+		}
+	errno = saved_errno;
+	}
+
+//Creates the signal pipe, registers it with the event loop, and installs our signal handlers.
+//Returns TRUE on success or FALSE on error.
+int receiver_daemon_signal_setup(struct receiver_daemon *daemon)
+	{
+	struct sigaction sigact;
+	
+	if(pipe_cloexec(receiver_signal_pipe) < 0)
+		{
+		stl(STL_ERROR, "Call to pipe() for signal handling failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	if(!fd_set_nonblock(receiver_signal_pipe[PIPE_READ]) || !fd_set_nonblock(receiver_signal_pipe[PIPE_WRITE]))
+		return FALSE;
+	if(!event_add(daemon->loop, receiver_signal_pipe[PIPE_READ], receiver_daemon_signal_event, daemon))
+		return FALSE;
+	
+	sigact.sa_handler = receiver_daemon_signal_handler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = SA_RESTART;
+	if(sigaction(SIGINT, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGINT signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGHUP, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGHUP signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGTERM, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGTERM signal handler failed. (%s)", strerror(errno));
+	if(sigaction(SIGUSR1, &sigact, NULL) != 0)
+		stl(STL_WARNING, "Registering of SIGUSR1 signal handler failed. (%s)", strerror(errno));
+	
+	//One session's sshd going away must not take every other session with it.
+	sigact.sa_handler = SIG_IGN;
+	if(sigaction(SIGPIPE, &sigact, NULL) != 0)
+		{
+		stl(STL_ERROR, "Ignoring SIGPIPE failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	
+	return TRUE;
+	}
+
+//Event loop handler for the read end of the signal pipe.
+int receiver_daemon_signal_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct receiver_daemon *daemon = (struct receiver_daemon *)data;
+	unsigned char signums[64];
+	ssize_t readret;
+	int i;
+	
+	while((readret = read(fd, signums, sizeof(signums))) > 0)
+		{
+		for(i = 0; i < readret; i++)
+			{
+			if(signums[i] == SIGUSR1)
+				receiver_daemon_report(daemon, TRUE);
+			else
+				{
+				stl(STL_INFO, "Caught signal %d.", (int)signums[i]);
+				daemon->finished = TRUE;
+				}
+			}
+		}
+	
+	return TRUE;
+	}
+
+//Event loop handler for the listening socket. Every shim which connects gets a session, which starts out waiting for the handoff.
+int receiver_daemon_accept_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct receiver_daemon *daemon = (struct receiver_daemon *)data;
+	struct receiver_session *session;
+	int fd_control;
+	uid_t uid;
+	
+	while((fd_control = accept(fd, NULL, NULL)) >= 0)
+		{
+		if(!fd_set_cloexec(fd_control) || !fd_set_nonblock(fd_control))
+			{
+			close(fd_control);
+			continue;
+			}
+		if(!socket_peer_uid(fd_control, &uid) || uid != getuid())
+			{
+			stl(STL_WARNING, "Turned away a connection from another user.");
+			close(fd_control);
+			continue;
+			}
+		
+		if((session = malloc(sizeof(struct receiver_session))) == NULL)
+			{
+			stl(STL_ERROR, "malloc() failed for a new session!");
+			close(fd_control);
+			return FALSE;
+			}
+		receiver_session_init(session, -1, -1, 0);
+		session->up = FALSE; //Not until the shim hands it over.
+		session->daemon = daemon;
+		session->fd_control = fd_control;
+		session->id = ++daemon->next_id;
+		snprintf(session->name, sizeof(session->name), "Session %d: ", session->id);
+		if((daemon->sessions = list_grow_insert(daemon->sessions, &session, sizeof(struct receiver_session *), &daemon->sessions_len, &daemon->sessions_pos)) == NULL)
+			{
+			stl(STL_ERROR, "list_grow_insert() failed for a new session!");
+			close(fd_control);
+			free(session);
+			return FALSE;
+			}
+		if(!event_add(loop, fd_control, receiver_daemon_control_event, session))
+			receiver_daemon_session_down(session);
+		}
+	
+	if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+		stl(STL_ERROR, "Call to accept() failed! (%s)", strerror(errno));
+	return TRUE;
+	}
+
+//Event loop handler for the connection to a session's shim.
+int receiver_daemon_control_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct receiver_session *session = (struct receiver_session *)data;
+	char buf[64];
+	ssize_t readret;
+	
+	if(session->fd_in < 0)
+		return receiver_daemon_handoff(session->daemon, session);
+	
+	//Shims don't say anything once they've handed their session over. All we can hear from them is that they've gone away.
+	readret = read(fd, buf, sizeof(buf));
+	if(readret == 0 || (readret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (events & (EVENT_HANGUP | EVENT_ERROR)))
+		receiver_session_down(loop, session, "Session shim went away!");
+	return TRUE;
+	}
+
+//Takes a session over from its shim.
+//Returns TRUE unless something went wrong with the daemon as a whole. (A shim which doesn't make sense is just dropped.)
+int receiver_daemon_handoff(struct receiver_daemon *daemon, struct receiver_session *session)
+	{
+	struct receiver_handoff handoff;
+	int fds[FD_PASS_MAXIMUM], fds_count = FD_PASS_MAXIMUM, i;
+	char ack = RECEIVER_HANDOFF_ACK;
+	ssize_t readret;
+	
+	readret = fd_pass_recv(session->fd_control, &handoff, sizeof(handoff), fds, &fds_count);
+	if(readret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return TRUE;
+	if(readret != sizeof(handoff) || handoff.magic != RECEIVER_MESSAGE_MAGIC || fds_count != 2 || handoff.ppid <= 1 || handoff.ports_count < 0 || handoff.ports_count > PORTREAP_PORTS_MAXIMUM)
+		{
+		if(readret != 0)
+			stl(STL_WARNING, "%sThe shim didn't hand over a session properly. Dropping it.", session->name);
+		for(i = 0; i < fds_count; i++)
+			close(fds[i]);
+		receiver_daemon_session_down(session);
+		return TRUE;
+		}
+	
+	session->fd_in = fds[0];
+	session->fd_out = fds[1];
+	session->ppid = (pid_t)handoff.ppid;
+	session->up = TRUE;
+	session->started = session->last_input = time_monotonic_ms();
+	
+	//Until the shim hears back from us, it can still watch the session itself, so that's what it does if anything goes wrong here.
+	if(!fd_set_nonblock(session->fd_in) || !receiver_session_start(daemon->loop, session) || write_all(session->fd_control, &ack, 1) != 1)
+		{
+		stl(STL_ERROR, "%sCouldn't take the session over from the shim!", session->name);
+		session->up = FALSE;
+		event_remove(daemon->loop, session->fd_in);
+		event_timer_cancel(daemon->loop, &session->deadline_timer);
+		close(session->fd_in);
+		close(session->fd_out);
+		session->fd_in = session->fd_out = -1;
+		receiver_daemon_session_down(session);
+		return TRUE;
+		}
+	
+	daemon->sessions_started++;
+	stl(STL_INFO, "%sWatching the session of parent process %d.", session->name, (int)session->ppid);
+	if(handoff.ports_count > 0)
+		return receiver_daemon_portreap(daemon, session, handoff.ports, handoff.ports_count);
+	return TRUE;
+	}
+
+//Terminates the stale processes holding a session's ports. Any which are still around after PORTREAP_GRACE get SIGKILL.
+//Returns TRUE unless something went wrong with the daemon as a whole.
+int receiver_daemon_portreap(struct receiver_daemon *daemon, struct receiver_session *session, uint16_t *ports, int ports_count)
+	{
+	struct portreap_target targets[PORTREAP_TARGETS_MAXIMUM];
+	int targets_count = 0, i;
+	
+	if(!portreap_terminate(&daemon->portreap_index, ports, ports_count, session->ppid, targets, &targets_count))
+		{
+		stl(STL_WARNING, "%sCouldn't check for stale processes holding the session's ports.", session->name);
+		return TRUE;
+		}
+	
+	for(i = 0; i < targets_count; i++)
+		{
+		if((daemon->portreap_targets = list_grow_insert(daemon->portreap_targets, &targets[i], sizeof(struct portreap_target), &daemon->portreap_targets_len, &daemon->portreap_targets_pos)) == NULL)
+			{
+			stl(STL_ERROR, "list_grow_insert() failed for a stale process!");
+			return FALSE;
+			}
+		}
+	//Processes which exit in time are only noticed at their deadline. There's no point waking up any earlier than that.
+	if(targets_count > 0 && !event_timer_pending(&daemon->portreap_timer))
+		return event_timer_schedule(daemon->loop, &daemon->portreap_timer, targets[0].deadline);
+	return TRUE;
+	}
+
+//Timer handler: sends SIGKILL to the stale processes which are still around after their grace period.
+int receiver_daemon_portreap_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct receiver_daemon *daemon = (struct receiver_daemon *)data;
+	int64_t now = time_monotonic_ms(), next = 0;
+	int i = 0;
+	
+	while(i < daemon->portreap_targets_pos)
+		{
+		if(!portreap_escalate(&daemon->portreap_targets[i], now))
+			{
+			if(next == 0 || daemon->portreap_targets[i].deadline < next)
+				next = daemon->portreap_targets[i].deadline;
+			i++;
+			continue;
+			}
+		//Move the last target into the vacated slot.
+		daemon->portreap_targets_pos--;
+		daemon->portreap_targets[i] = daemon->portreap_targets[daemon->portreap_targets_pos];
+		}
+	
+	if(next > 0)
+		return event_timer_schedule(loop, timer, next);
+	return TRUE;
+	}
+
+//The daemon is done with a session. (Its sshd, if it had one, has already been dealt with.)
+//Closes everything, tells the shim, and leaves the session to be freed once no handler can be using it any more.
+void receiver_daemon_session_down(struct receiver_session *session)
+	{
+	struct receiver_daemon *daemon = session->daemon;
+	
+	session->up = FALSE;
+	if(session->fd_in >= 0)
+		{
+		if(session->fd_control >= 0)
+			receiver_daemon_release(session, TRUE);
+		event_remove(daemon->loop, session->fd_in);
+		close(session->fd_in);
+		close(session->fd_out);
+		session->fd_in = session->fd_out = -1;
+		daemon->sessions_down++;
+		}
+	if(session->fd_control >= 0)
+		{
+		event_remove(daemon->loop, session->fd_control);
+		close(session->fd_control);
+		session->fd_control = -1;
+		}
+	
+	if(!event_timer_pending(&daemon->reap_timer))
+		event_timer_schedule(daemon->loop, &daemon->reap_timer, time_monotonic_ms());
+	}
+
+//Tells a session's shim that we're letting go of the session, and everything it needs to know to carry on if it isn't down.
+//Returns TRUE on success or FALSE on error.
+int receiver_daemon_release(struct receiver_session *session, int down)
+	{
+	struct receiver_release release;
+	
+	memset(&release, 0, sizeof(release));
+	release.magic = RECEIVER_MESSAGE_MAGIC;
+	release.down = down;
+	release.protocol = session->protocol;
+	release.header_complete = session->header_complete;
+	release.header_pos = session->header_pos;
+	memcpy(release.header, session->header, sizeof(release.header));
+	release.uptoken_interval = session->uptoken_interval;
+	release.input_timeout = session->input_timeout;
+	release.input_grace = session->input_grace;
+	if(write_all(session->fd_control, &release, sizeof(release)) != sizeof(release))
+		{
+		stl(STL_WARNING, "%sCouldn't tell the shim we're letting go of the session! (%s)", session->name, strerror(errno));
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Timer handler: frees the sessions which have gone down. (Sessions go down from inside their own handlers, so they can't be freed right away.)
+int receiver_daemon_reap_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct receiver_daemon *daemon = (struct receiver_daemon *)data;
+	struct receiver_session *session;
+	int i = 0;
+	
+	while(i < daemon->sessions_pos)
+		{
+		session = daemon->sessions[i];
+		if(session->fd_control >= 0 || session->fd_in >= 0)
+			{
+			i++;
+			continue;
+			}
+		
+		//Move the last session into the vacated slot.
+		daemon->sessions_pos--;
+		daemon->sessions[i] = daemon->sessions[daemon->sessions_pos];
+		daemon->sessions[daemon->sessions_pos] = NULL;
+		free(session);
+		}
+	
+	return TRUE;
+	}
+
+//Timer handler: periodic summary of the sessions we're watching.
+int receiver_daemon_report_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	receiver_daemon_report((struct receiver_daemon *)data, FALSE);
+	return event_timer_schedule(loop, timer, time_monotonic_ms() + (RECEIVER_REPORT_INTERVAL * 1000));
+	}
+
+//Logs how many sessions we're watching, and optionally the state of every one of them.
+void receiver_daemon_report(struct receiver_daemon *daemon, int detailed)
+	{
+	struct receiver_session *session;
+	int64_t now = time_monotonic_ms();
+	int i, up = 0;
+	
+	for(i = 0; i < daemon->sessions_pos; i++)
+		{
+		session = daemon->sessions[i];
+		if(!session->up)
+			continue;
+		up++;
+		if(detailed)
+			stl(STL_INFO, "%sParent process %d, protocol %d, up for %d s. Last heard from %d ms ago, gives up after %d ms.", session->name, (int)session->ppid, session->protocol, (int)((now - session->started) / 1000), (int)(now - session->last_input), (int)(session->input_timeout + session->input_grace));
+		}
+	
+	stl(STL_INFO, "Watching %d sessions. %u started and %u went down since the last report.", up, daemon->sessions_started, daemon->sessions_down);
+	daemon->sessions_started = 0;
+	daemon->sessions_down = 0;
+	}
+
+//Hands every session back to its shim, which carries on watching it by itself, so restarting the daemon doesn't disturb any tunnels.
+void receiver_daemon_shutdown(struct receiver_daemon *daemon)
+	{
+	struct receiver_session *session;
+	int i, handed_back = 0;
+	
+	for(i = 0; i < daemon->sessions_pos; i++)
+		{
+		session = daemon->sessions[i];
+		if(session->up)
+			{
+			event_remove(daemon->loop, session->fd_in);
+			event_timer_cancel(daemon->loop, &session->deadline_timer);
+			if(receiver_daemon_release(session, FALSE))
+				handed_back++;
+			}
+		if(session->fd_in >= 0)
+			{
+			close(session->fd_in);
+			close(session->fd_out);
+			}
+		if(session->fd_control >= 0)
+			{
+			event_remove(daemon->loop, session->fd_control);
+			close(session->fd_control);
+			}
+		free(session);
+		}
+	free(daemon->sessions);
+	free(daemon->portreap_targets);
+	portreap_index_free(&daemon->portreap_index);
+	if(handed_back > 0)
+		stl(STL_INFO, "Handed %d sessions back to their shims.", handed_back);
+	
+	if(daemon->fd_listen >= 0)
+		{
+		event_remove(daemon->loop, daemon->fd_listen);
+		close(daemon->fd_listen);
+		unlink(daemon->socket_path);
+		}
+	if(receiver_signal_pipe[PIPE_READ] >= 0)
+		{
+		event_remove(daemon->loop, receiver_signal_pipe[PIPE_READ]);
+		close(receiver_signal_pipe[PIPE_READ]);
+		close(receiver_signal_pipe[PIPE_WRITE]);
+		}
+	event_loop_destroy(daemon->loop);
+	}
@@ -0,0 +1,91 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * rto.c
+ *     - Adaptive uptoken timeouts, estimated from measured round trip times.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "rto.h"
+
+//Forgets every measurement. Until the first one comes in, the timeout is "initial".
+void rto_reset(struct rto *r, int64_t initial)
+	{
+	r->srtt = 0;
+	r->rttvar = 0;
+	r->timeout = initial;
+	r->samples = 0;
+	}
+
+//Folds a measured round trip time into the estimate, and works out the new timeout: the smoothed RTT plus four times its deviation.
+void rto_sample(struct rto *r, int64_t rtt, int64_t min, int64_t max)
+	{
+	int64_t error;
+	
+	if(rtt < 0)
+		rtt = 0;
+	
+	if(r->samples == 0)
+		{
+		//The first measurement stands in for the average, and half of it for the deviation.
+		r->srtt = rtt << RTO_SRTT_SHIFT;
+		r->rttvar = (rtt / 2) << RTO_RTTVAR_SHIFT;
+		}
+	else
+		{
+		error = rtt - (r->srtt >> RTO_SRTT_SHIFT);
+		r->srtt = r->srtt + error;
+		if(error < 0)
+			error = -error;
+		r->rttvar = r->rttvar + error - (r->rttvar >> RTO_RTTVAR_SHIFT);
+		}
+	r->samples++;
+	rto_settle(r, min, max);
+	}
+
+//Works the timeout out from the measurements. Without measurements, the timeout stays as it is.
+void rto_settle(struct rto *r, int64_t min, int64_t max)
+	{
+	int64_t slack;
+	
+	if(r->samples == 0)
+		return;
+	
+	//rttvar is already scaled by 4, which happens to be the multiplier we want.
+	slack = r->rttvar;
+	if(slack < RTO_GRANULARITY)
+		slack = RTO_GRANULARITY;
+	r->timeout = rto_srtt(r) + slack;
+	if(r->timeout < min)
+		r->timeout = min;
+	if(r->timeout > max)
+		r->timeout = max;
+	}
+
+//The smoothed round trip time, in milliseconds.
+int64_t rto_srtt(struct rto *r)
+	{
+	return r->srtt >> RTO_SRTT_SHIFT;
+	}
+
+//The round trip time's mean deviation, in milliseconds.
+int64_t rto_rttvar(struct rto *r)
+	{
+	return r->rttvar >> RTO_RTTVAR_SHIFT;
+	}
@@ -0,0 +1,51 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * rto.h
+ *     - Adaptive uptoken timeouts, estimated from measured round trip times.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_RTO_H
+
+#include <stdint.h>
+
+//The retransmission timeout estimator from TCP. (RFC 6298, after Jacobson.)
+//The smoothed RTT and its mean deviation are kept scaled up, by 8 and 4, so that integer arithmetic doesn't lose the fractions.
+#define RTO_SRTT_SHIFT 3 //Each sample moves the smoothed RTT 1/8 of the way.
+#define RTO_RTTVAR_SHIFT 2 //...and the deviation 1/4 of the way.
+#define RTO_GRANULARITY 10 //Milliseconds. The least slack allowed for variation, however steady the link is.
+
+struct rto
+	{
+	int64_t srtt, rttvar; //Milliseconds, scaled by 1 << RTO_SRTT_SHIFT and 1 << RTO_RTTVAR_SHIFT.
+	int64_t timeout; //Milliseconds.
+	uint32_t samples;
+	};
+
+void rto_reset(struct rto *r, int64_t initial);
+void rto_sample(struct rto *r, int64_t rtt, int64_t min, int64_t max);
+void rto_settle(struct rto *r, int64_t min, int64_t max);
+int64_t rto_srtt(struct rto *r);
+int64_t rto_rttvar(struct rto *r);
+
+#define __SSHTUNNELS_RTO_H
+#endif
+
@@ -0,0 +1,189 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * shard.c
+ *     - Spreads tunnels across worker threads, each with its own event loop.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "shard.h"
+#include "main.h"
+#include "log.h"
+
+#include <signal.h>
+
+//With enough tunnels, a single event loop spends long enough on each round that every tunnel's checks run late.
+//Instead, each worker thread runs its own loop for its share of the tunnels. The threads never touch each other's
+//tunnels. Anything that has to cross over (launch permission, child exits, network changes) goes through event_call().
+struct shard_pool shard_pool = { NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+//Creates "count" worker event loops. The threads themselves aren't started until shard_run(), so that the
+//main thread can set up every tunnel first. With a count of 0, every tunnel stays on the central loop.
+//Returns TRUE on success or FALSE on error.
+int shard_create(struct event_loop *central, int count)
+	{
+	int i;
+	
+	shard_pool.central = central;
+	if(count <= 0 || shard_pool.shards != NULL)
+		return TRUE;
+	
+	if((shard_pool.shards = (struct shard *)calloc(count, sizeof(struct shard))) == NULL)
+		{
+		stl(STL_ERROR, "shard_create: out of memory!");
+		return FALSE;
+		}
+	for(i = 0; i < count; i++)
+		{
+		shard_pool.shards[i].index = i;
+		if((shard_pool.shards[i].loop = event_loop_create()) == NULL)
+			{
+			shard_pool.count = i;
+			shard_destroy();
+			return FALSE;
+			}
+		}
+	shard_pool.count = count;
+	stl(STL_INFO, "Tunnels will be spread across %d worker thread(s).", count);
+	return TRUE;
+	}
+
+//Picks the event loop for a new tunnel. Tunnels are dealt out in turn, so every shard gets the same share.
+struct event_loop *shard_assign(void)
+	{
+	struct event_loop *loop;
+	
+	if(shard_pool.count == 0)
+		return shard_pool.central;
+	loop = shard_pool.shards[shard_pool.next].loop;
+	shard_pool.next = (shard_pool.next + 1) % shard_pool.count;
+	return loop;
+	}
+
+//Starts the worker threads, and waits until every one of them has taken over its loop.
+//Signals are blocked in the workers, so they all end up on the main thread's signal pipe.
+//Returns TRUE on success or FALSE on error.
+int shard_run(void)
+	{
+	sigset_t all, previous;
+	int i, error, ok = TRUE;
+	
+	if(shard_pool.count == 0)
+		return TRUE;
+	
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	for(i = 0; i < shard_pool.count; i++)
+		{
+		if((error = pthread_create(&shard_pool.shards[i].thread, NULL, shard_thread, &shard_pool.shards[i])) != 0)
+			{
+			stl(STL_ERROR, "Failed starting worker thread %d! (%s)", i, strerror(error));
+			ok = FALSE;
+			break;
+			}
+		shard_pool.shards[i].started = TRUE;
+		}
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	
+	//Until a worker has adopted its loop, event_call() would run things for it right here on the main thread.
+	pthread_mutex_lock(&shard_pool.lock);
+	while(shard_pool.ready < i)
+		pthread_cond_wait(&shard_pool.ready_cond, &shard_pool.lock);
+	pthread_mutex_unlock(&shard_pool.lock);
+	return ok;
+	}
+
+//Stops the worker threads and hands their loops (and tunnels) back to the main thread, ready to be torn down.
+//Returns FALSE if any of the workers failed, or TRUE otherwise.
+int shard_stop(void)
+	{
+	int i, ok = TRUE;
+	
+	for(i = 0; i < shard_pool.count; i++)
+		{
+		if(!shard_pool.shards[i].started)
+			continue;
+		if(!event_call(shard_pool.shards[i].loop, shard_stop_call, &shard_pool.shards[i], 0))
+			stl(STL_WARNING, "Couldn't ask worker thread %d to stop. Waiting for it anyway.", i);
+		}
+	for(i = 0; i < shard_pool.count; i++)
+		{
+		if(!shard_pool.shards[i].started)
+			continue;
+		pthread_join(shard_pool.shards[i].thread, NULL);
+		shard_pool.shards[i].started = FALSE;
+		event_loop_adopt(shard_pool.shards[i].loop);
+		if(shard_pool.shards[i].failed)
+			ok = FALSE;
+		}
+	shard_pool.ready = 0;
+	return ok;
+	}
+
+//Frees the worker loops. The threads must have been stopped, and every tunnel destroyed.
+void shard_destroy(void)
+	{
+	int i;
+	
+	for(i = 0; i < shard_pool.count; i++)
+		event_loop_destroy(shard_pool.shards[i].loop);
+	free(shard_pool.shards);
+	shard_pool.shards = NULL;
+	shard_pool.count = 0;
+	shard_pool.next = 0;
+	}
+
+//A worker thread. Runs its shard's event loop until it's told to stop.
+void *shard_thread(void *data)
+	{
+	struct shard *shard = (struct shard *)data;
+	
+	event_loop_adopt(shard->loop);
+	pthread_mutex_lock(&shard_pool.lock);
+	shard_pool.ready++;
+	pthread_cond_signal(&shard_pool.ready_cond);
+	pthread_mutex_unlock(&shard_pool.lock);
+	
+	while(!shard->stopping)
+		{
+		if(event_dispatch(shard->loop, -1) < 0)
+			{
+			stl(STL_ERROR, "FATAL! event_dispatch() returned with an error in worker thread %d.", shard->index);
+			shard->failed = TRUE;
+			event_call(shard_pool.central, shard_failed_call, shard, 0);
+			break;
+			}
+		}
+	return NULL;
+	}
+
+//Runs on the worker: time to stop.
+int shard_stop_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	struct shard *shard = (struct shard *)data;
+	
+	shard->stopping = TRUE;
+	return TRUE;
+	}
+
+//Runs on the main thread: a worker has given up. Failing here fails the main loop too, so the whole daemon shuts down.
+int shard_failed_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	return FALSE;
+	}
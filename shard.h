@@ -0,0 +1,65 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * shard.h
+ *     - Spreads tunnels across worker threads, each with its own event loop.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_SHARD_H
+
+#include <pthread.h>
+
+#include "event.h"
+
+#define SHARD_WORKERS_DEFAULT 0 //Everything runs on the main thread.
+#define SHARD_WORKERS_MAXIMUM 256
+
+//One worker thread, and the event loop it runs. Every tunnel assigned to the shard is watched, timed and launched from there.
+struct shard
+	{
+	int index;
+	struct event_loop *loop;
+	pthread_t thread;
+	int started, stopping, failed;
+	};
+
+//The main thread keeps signal handling, the launch queue and the network watcher. Tunnels are dealt out to the shards.
+struct shard_pool
+	{
+	struct event_loop *central;
+	struct shard *shards;
+	int count, next, ready;
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	};
+
+int shard_create(struct event_loop *central, int count);
+struct event_loop *shard_assign(void);
+int shard_run(void);
+int shard_stop(void);
+void shard_destroy(void);
+void *shard_thread(void *data);
+int shard_stop_call(struct event_loop *loop, void *data, int64_t value);
+int shard_failed_call(struct event_loop *loop, void *data, int64_t value);
+
+#define __SSHTUNNELS_SHARD_H
+#endif
+
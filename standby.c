@@ -0,0 +1,326 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * standby.c
+ *     - Standby instances, which take over from a tunnel before it is stopped.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include <stdio.h>
+#include <spawn.h>
+
+#include "standby.h"
+#include "main.h"
+#include "log.h"
+#include "util.h"
+
+//A tunnel with Standby is a pair of tunnels, created together and run on the same event loop. They take turns: one is in use,
+//and the other is its standby. When the one in use is condemned, its process isn't stopped until the standby has passed its
+//first uptoken, so a failover costs next to nothing instead of a full SSH handshake.
+//Two processes can't listen on the same forwarded port, though. The StandbyHandoff program runs once the old process is gone,
+//and can claim whatever it held for the new one. (With ssh -O forward on the new process's control socket, for instance.)
+
+//StandbyHandoff programs which are still running, so that tunnel_reap_children() knows whose they are. There are only ever a few.
+struct standby_hook *standby_hooks = NULL;
+int standby_hooks_len = 0, standby_hooks_pos = 0;
+pthread_mutex_t standby_hook_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Returns the STANDBY_* value for a Standby attribute, or -1 if there's no such mode.
+int standby_mode(const char *name)
+	{
+	if(strcasecmp(name, "off") == 0)
+		return STANDBY_OFF;
+	if(strcasecmp(name, "warm") == 0)
+		return STANDBY_WARM;
+	if(strcasecmp(name, "degraded") == 0)
+		return STANDBY_DEGRADED;
+	return -1;
+	}
+
+//Pairs a tunnel with the standby instance created right after it. Both must run on the same event loop.
+void standby_pair(struct tunnel *tun, struct tunnel *standby)
+	{
+	tun->partner = standby;
+	tun->standby = FALSE;
+	standby->partner = tun;
+	standby->standby = TRUE;
+	stl(STL_INFO, TUNNEL_MODULE "Standby instance for tunnel %d.", standby->id, tun->id);
+	}
+
+//Should this instance's process be running? The instance in use always should, and so should a warm standby.
+//Otherwise the standby only runs while the instance in use is waiting for it to take over.
+int standby_wanted(struct tunnel *tun)
+	{
+	if(tun->partner == NULL || !tun->standby || tun->options.standby == STANDBY_WARM)
+		return TRUE;
+	return tun->partner->handoff_waiting;
+	}
+
+//Is this instance's process up, and able to take over?
+int standby_ready(struct tunnel *tun)
+	{
+	return tun->pid && !tun->condemned && tun->uptoken_rtt.count > 0;
+	}
+
+//Called by tunnel_condemn(). If the standby is ready, it takes over right away, and the condemned process is stopped as usual.
+//If it isn't, the condemned process hangs on until it is, or for STANDBY_HANDOFF_TIMEOUT at most.
+//Returns TRUE if the condemned process should be kept for now, FALSE if it should be stopped.
+int standby_takeover(struct tunnel *tun)
+	{
+	struct tunnel *partner = tun->partner;
+	
+	if(partner == NULL || tun->standby)
+		return FALSE;
+	if(standby_ready(partner))
+		{
+		standby_promote(partner);
+		return FALSE;
+		}
+	
+	//Both of them are on their way out.
+	if(partner->pid && partner->condemned)
+		return FALSE;
+	
+	if(!standby_wait(tun))
+		return FALSE;
+	stl(STL_WARNING, TUNNEL_MODULE "Tunnel process %d condemned. Keeping it until the standby instance (tunnel %d) takes over.", tun->id, tun->pid, partner->id);
+	return TRUE;
+	}
+
+//An uptoken was lost, or took longer than StandbyLatency, but the instance in use is still up.
+//The standby takes over if it's ready. If it isn't, it's brought up, and takes over once it is.
+//Returns TRUE on success or FALSE on error.
+int standby_degraded(struct tunnel *tun)
+	{
+	struct tunnel *partner = tun->partner;
+	
+	//A process which hasn't passed its first uptoken yet is still starting up, not degraded.
+	if(partner == NULL || tun->standby || !standby_ready(tun) || tun->handoff_waiting)
+		return TRUE;
+	if(standby_ready(partner))
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "Tunnel is degraded. Switching to the standby instance (tunnel %d).", tun->id, partner->id);
+		standby_promote(partner);
+		return TRUE;
+		}
+	if(partner->pid && partner->condemned)
+		return TRUE;
+	
+	stl(STL_WARNING, TUNNEL_MODULE "Tunnel is degraded. Waiting for the standby instance (tunnel %d) to come up.", tun->id, partner->id);
+	return standby_wait(tun);
+	}
+
+//Waits for the standby to take over, starting it up if it isn't running. (Whatever is left of its relaunch delay is skipped.)
+//Returns TRUE on success or FALSE on error.
+int standby_wait(struct tunnel *tun)
+	{
+	struct tunnel *partner = tun->partner;
+	int64_t now = time_monotonic_ms();
+	
+	if(tun->handoff_waiting)
+		return TRUE;
+	tun->handoff_waiting = TRUE;
+	if(!event_timer_schedule(tun->loop, &tun->handoff_timer, now + ((int64_t)STANDBY_HANDOFF_TIMEOUT * 1000)))
+		return FALSE;
+	if(!partner->pid)
+		return event_timer_schedule(partner->loop, &partner->launch_timer, now);
+	return TRUE;
+	}
+
+//Puts the standby instance in use, and stops the other one. The StandbyHandoff program runs once the other process is gone.
+void standby_promote(struct tunnel *tun)
+	{
+	struct tunnel *old = tun->partner;
+	int kept = old->pid && old->condemned && old->handoff_waiting;
+	
+	stl(STL_INFO, TUNNEL_MODULE "Standby instance is taking over from tunnel %d.", tun->id, old->id);
+	tun->standby = FALSE;
+	tun->handoff_from = old->pid;
+	old->standby = TRUE;
+	old->handoff_waiting = FALSE;
+	event_timer_cancel(old->loop, &old->handoff_timer);
+	
+	if(!old->pid)
+		{
+		standby_handoff(tun);
+		return;
+		}
+	old->handoff_pending = TRUE;
+	if(kept)
+		{
+		stl(STL_INFO, TUNNEL_MODULE "Sending SIGTERM to condemned tunnel process %d...", old->id, old->pid);
+		tunnel_terminate(old);
+		}
+	else if(!old->condemned)
+		tunnel_condemn(old);
+	}
+
+//The standby instance has passed its first uptoken. It takes over, unless it's a warm standby and there's nothing to take over from.
+void standby_up(struct tunnel *tun)
+	{
+	struct tunnel *partner = tun->partner;
+	
+	if(partner == NULL || !tun->standby)
+		return;
+	if(tun->options.standby == STANDBY_WARM && partner->pid && !partner->handoff_waiting)
+		{
+		stl(STL_INFO, TUNNEL_MODULE "Standby instance for tunnel %d is ready.", tun->id, partner->id);
+		return;
+		}
+	standby_promote(tun);
+	}
+
+//Called once the relaunch of an instance whose process exited has been scheduled.
+void standby_exited(struct tunnel *tun)
+	{
+	struct tunnel *partner = tun->partner;
+	
+	if(partner == NULL)
+		return;
+	
+	//The standby took over from this process, which is now out of the way.
+	if(tun->handoff_pending)
+		{
+		tun->handoff_pending = FALSE;
+		if(!partner->standby)
+			standby_handoff(partner);
+		return;
+		}
+	
+	//The instance in use went down by itself. A ready standby takes over straight away.
+	if(!tun->standby && standby_ready(partner))
+		standby_promote(partner);
+	}
+
+//Timer handler: the standby didn't take over in time.
+int standby_handoff_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(!tun->handoff_waiting)
+		return TRUE;
+	tun->handoff_waiting = FALSE;
+	if(tun->pid && tun->condemned)
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "The standby instance (tunnel %d) didn't take over within %d seconds. Sending SIGTERM to tunnel process %d...", tun->id, tun->partner->id, STANDBY_HANDOFF_TIMEOUT, tun->pid);
+		tunnel_terminate(tun);
+		}
+	else
+		stl(STL_WARNING, TUNNEL_MODULE "The standby instance (tunnel %d) didn't come up within %d seconds. Carrying on without it.", tun->id, tun->partner->id, STANDBY_HANDOFF_TIMEOUT);
+	return TRUE;
+	}
+
+//Runs the StandbyHandoff program, if there is one, for the instance which just took over. Its arguments are the new process's PID,
+//and the PID of the process it took over from (or 0). It gets the same environment as the tunnel process.
+void standby_handoff(struct tunnel *tun)
+	{
+	posix_spawnattr_t attributes;
+	sigset_t sigmask;
+	struct standby_hook hook;
+	char new_pid[16], old_pid[16], *argv[4];
+	int error;
+	
+	if(tun->options.standby_handoff == NULL)
+		return;
+	if(!tun->pid || tun->condemned)
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "Tunnel process is already gone. Not running %s.", tun->id, tun->options.standby_handoff);
+		return;
+		}
+	
+	snprintf(new_pid, sizeof(new_pid), "%d", (int)tun->pid);
+	snprintf(old_pid, sizeof(old_pid), "%d", (int)tun->handoff_from);
+	argv[0] = tun->options.standby_handoff;
+	argv[1] = new_pid;
+	argv[2] = old_pid;
+	argv[3] = NULL;
+	
+	if((error = posix_spawnattr_init(&attributes)) != 0)
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "posix_spawnattr_init() failed! (%s)", tun->id, strerror(error));
+		return;
+		}
+	//Worker threads block every signal, and the program would inherit that.
+	sigemptyset(&sigmask);
+	if((error = posix_spawnattr_setsigmask(&attributes, &sigmask)) != 0 || (error = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK)) != 0)
+		stl(STL_WARNING, TUNNEL_MODULE "posix_spawnattr_setsigmask() failed! (%s)", tun->id, strerror(error));
+	
+	//Hold the list from the spawn until the new PID is in it, so the main thread can't reap the program before it knows whose it is.
+	pthread_mutex_lock(&standby_hook_lock);
+	if((error = posix_spawn(&hook.pid, argv[0], NULL, &attributes, argv, tun->envp)) != 0)
+		stl(STL_ERROR, TUNNEL_MODULE "Couldn't run %s! (%s)", tun->id, argv[0], strerror(error));
+	else
+		{
+		stl(STL_INFO, TUNNEL_MODULE "Running %s %s %s", tun->id, argv[0], argv[1], argv[2]);
+		hook.tun = tun;
+		if((standby_hooks = list_grow_insert(standby_hooks, &hook, sizeof(struct standby_hook), &standby_hooks_len, &standby_hooks_pos)) == NULL)
+			{
+			stl(STL_ERROR, TUNNEL_MODULE "list_grow_insert() failed!", tun->id);
+			standby_hooks_len = 0;
+			standby_hooks_pos = 0;
+			}
+		}
+	pthread_mutex_unlock(&standby_hook_lock);
+	posix_spawnattr_destroy(&attributes);
+	}
+
+//Called by tunnel_reap_children() for a child which isn't a tunnel process.
+//Returns the tunnel whose StandbyHandoff program it was, or NULL if it wasn't one.
+struct tunnel *standby_hook_reaped(pid_t pid)
+	{
+	struct tunnel *tun = NULL;
+	int i;
+	
+	pthread_mutex_lock(&standby_hook_lock);
+	for(i = 0; i < standby_hooks_pos; i++)
+		{
+		if(standby_hooks[i].pid == pid)
+			{
+			tun = standby_hooks[i].tun;
+			standby_hooks[i] = standby_hooks[standby_hooks_pos - 1];
+			standby_hooks_pos--;
+			break;
+			}
+		}
+	pthread_mutex_unlock(&standby_hook_lock);
+	return tun;
+	}
+
+//Runs on the tunnel's thread once its StandbyHandoff program has exited.
+int standby_hook_exited_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	int status = (int)value;
+	
+	if(WIFSIGNALED(status))
+		stl(STL_WARNING, TUNNEL_MODULE "%s was killed by signal %d!", tun->id, tun->options.standby_handoff, WTERMSIG(status));
+	else if(WEXITSTATUS(status) != 0)
+		stl(STL_WARNING, TUNNEL_MODULE "%s exited with status %d!", tun->id, tun->options.standby_handoff, WEXITSTATUS(status));
+	else
+		stl(STL_INFO, TUNNEL_MODULE "%s finished.", tun->id, tun->options.standby_handoff);
+	return TRUE;
+	}
+
+void standby_destroy(void)
+	{
+	free(standby_hooks);
+	standby_hooks = NULL;
+	standby_hooks_len = 0;
+	standby_hooks_pos = 0;
+	}
@@ -0,0 +1,69 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * standby.h
+ *     - Standby instances, which take over from a tunnel before it is stopped.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_STANDBY_H
+
+#include <sys/types.h>
+
+#include "tunnel.h"
+
+//When a tunnel has a second instance of itself standing by.
+enum
+	{
+	STANDBY_OFF = 0, //Never. A condemned process is stopped, and relaunched after the backoff delay.
+	STANDBY_WARM, //Always. The standby is kept running, and takes over as soon as the instance in use is condemned or degraded.
+	STANDBY_DEGRADED //Only once the instance in use is condemned or degraded. It keeps running until the standby has come up.
+	};
+
+#define STANDBY_DEFAULT STANDBY_OFF
+#define STANDBY_HANDOFF_TIMEOUT 30 //Seconds a condemned process is kept waiting for the standby to take over.
+#define STANDBY_INSTANCE_VARIABLE "SSHTUNNELS_INSTANCE" //Set to 1 or 2 in each instance's environment, so they can keep out of each other's way.
+
+//A StandbyHandoff program which is still running.
+struct standby_hook
+	{
+	pid_t pid;
+	struct tunnel *tun;
+	};
+
+int standby_mode(const char *name);
+void standby_pair(struct tunnel *tun, struct tunnel *standby);
+int standby_wanted(struct tunnel *tun);
+int standby_ready(struct tunnel *tun);
+int standby_takeover(struct tunnel *tun);
+int standby_degraded(struct tunnel *tun);
+int standby_wait(struct tunnel *tun);
+void standby_promote(struct tunnel *tun);
+void standby_up(struct tunnel *tun);
+void standby_exited(struct tunnel *tun);
+int standby_handoff_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+void standby_handoff(struct tunnel *tun);
+struct tunnel *standby_hook_reaped(pid_t pid);
+int standby_hook_exited_call(struct event_loop *loop, void *data, int64_t value);
+void standby_destroy(void);
+
+#define __SSHTUNNELS_STANDBY_H
+#endif
+
@@ -26,29 +26,86 @@
 #include "main.h"
 #include "log.h"
 #include "util.h"
+#include "uptoken.h"
+#include "launch.h"
+#include "standby.h"
 
-#define TUNNEL_MODULE "Tunnel %d: "
+//Children are reaped on the main thread, but launched from whichever thread runs the tunnel's loop, so the PID table has a lock.
+struct tunnel **tunnel_pid_table = NULL;
+int tunnel_pid_table_len = 0, tunnel_pid_table_count = 0;
+pthread_mutex_t tunnel_pid_lock = PTHREAD_MUTEX_INITIALIZER;
 
-struct tunnel *tunnel_create(char **argv, char **envp, int uptoken_enabled, time_t uptoken_interval)
+//Every tunnel lives in the tunnel table. Tunnels are allocated in slabs rather than one by one, and a tunnel never moves once it has been
+//allocated, since timers and event handlers point straight at it. A tunnel's id is its position in the table, plus one.
+struct tunnel **tunnel_slabs = NULL;
+int tunnel_slabs_len = 0, tunnel_table_count = 0;
+
+void tunnel_options_default(struct tunnel_options *options)
+	{
+	options->uptoken_enabled = UPTOKEN_ENABLED_DEFAULT;
+	options->uptoken_interval = (int64_t)UPTOKEN_INTERVAL_DEFAULT * 1000;
+	options->uptoken_protocol = UPTOKEN_PROTOCOL_DEFAULT;
+	options->uptoken_timeout = 0; //Depends on the interval and protocol. Filled in by tunnel_create().
+	options->uptoken_loss_threshold = UPTOKEN_LOSS_THRESHOLD_DEFAULT;
+	options->uptoken_max_latency = 0; //Disabled.
+	options->uptoken_adaptive = UPTOKEN_ADAPTIVE_DEFAULT;
+	options->uptoken_timeout_min = (int64_t)UPTOKEN_TIMEOUT_MIN_DEFAULT * 1000;
+	options->uptoken_timeout_max = 0; //As long as the in-flight probes allow. Filled in by tunnel_create().
+	options->magic_words = NULL;
+	options->output_collapse = TRUE;
+	options->output_rate = 0; //Unlimited.
+	options->output_burst = TUNNEL_OUTPUT_BURST_DEFAULT;
+	options->output_file = NULL;
+	options->output_scan = TRUE;
+	options->launch_priority = 0;
+	backoff_options_default(&options->backoff);
+	options->standby = STANDBY_DEFAULT;
+	options->standby_latency = 0; //Disabled.
+	options->standby_handoff = NULL;
+	options->shutdown_grace = (int64_t)TUNNEL_SHUTDOWN_GRACE_DEFAULT * 1000;
+	}
+
+struct tunnel *tunnel_create(char **argv, char **env, struct env_base *env_base, struct tunnel_options *options, struct event_loop *loop)
 	{
-	static int nextid = 1;
-	struct tunnel *newtun = NULL;
+	int nextid = tunnel_table_count + 1, slab = tunnel_table_count / TUNNEL_SLAB_SIZE, new_len;
+	struct tunnel *newtun = NULL, **slabs;
+	
+	if(nextid == 1)
+		srand((unsigned int)time(NULL));
 	
 	stl(STL_INFO, TUNNEL_MODULE "Creating tunnel object...", nextid);
 	
-	if(!uptoken_enabled)
+	if(!options->uptoken_enabled)
 		stl(STL_WARNING, TUNNEL_MODULE "Tunnel UpToken is disabled. We will not be able to properly detect if the tunnel goes down.", nextid);
 	
-	if((newtun = (struct tunnel *)calloc(1, sizeof(struct tunnel))) == NULL)
+	//The last slab is full. Start another.
+	if(tunnel_table_count % TUNNEL_SLAB_SIZE == 0)
 		{
-		stl(STL_ERROR, TUNNEL_MODULE "out of memory!", nextid);
-		return NULL;
+		if(slab >= tunnel_slabs_len)
+			{
+			new_len = tunnel_slabs_len ? tunnel_slabs_len * 2 : LIST_GROW_STEP;
+			if((slabs = (struct tunnel **)realloc(tunnel_slabs, new_len * sizeof(struct tunnel *))) == NULL)
+				{
+				stl(STL_ERROR, TUNNEL_MODULE "out of memory!", nextid);
+				return NULL;
+				}
+			tunnel_slabs = slabs;
+			tunnel_slabs_len = new_len;
+			}
+		if((tunnel_slabs[slab] = (struct tunnel *)calloc(TUNNEL_SLAB_SIZE, sizeof(struct tunnel))) == NULL)
+			{
+			stl(STL_ERROR, TUNNEL_MODULE "out of memory!", nextid);
+			return NULL;
+			}
 		}
+	newtun = &tunnel_slabs[slab][tunnel_table_count % TUNNEL_SLAB_SIZE];
 	
 	//Initialize variables.
 	newtun->id = nextid;
 	newtun->argv = argv;
-	newtun->envp = envp;
+	newtun->env = env;
+	newtun->env_base = env_base;
+	newtun->envp = NULL;
 	newtun->pid = 0;
 	newtun->pid_launched = 0;
 	newtun->pipe_stdin[PIPE_READ] = -1;
@@ -57,176 +114,547 @@ struct tunnel *tunnel_create(char **argv, char **envp, int uptoken_enabled, time
 	newtun->pipe_stdout[PIPE_WRITE] = -1;
 	newtun->pipe_stderr[PIPE_READ] = -1;
 	newtun->pipe_stderr[PIPE_WRITE] = -1;
-	newtun->uptoken_enabled = uptoken_enabled;
-	newtun->uptoken_interval = uptoken_interval;
+	newtun->options = *options;
 	newtun->uptoken = -1;
 	newtun->uptoken_sent = 0;
 	newtun->trouble = 0;
-	newtun->trouble_launchnext = 0;
 	newtun->condemned = FALSE;
+	newtun->loop = loop;
+	newtun->launch_heap_index = -1;
+	newtun->launch_starting = FALSE;
+	newtun->launch_unconfirmed = FALSE;
+	newtun->partner = NULL; //See standby_pair().
+	newtun->standby = FALSE;
+	newtun->handoff_waiting = FALSE;
+	newtun->handoff_pending = FALSE;
+	newtun->handoff_from = 0;
+	
+	//Protocol 1 only has one uptoken in flight, so it has to come back within the interval.
+	//Protocol 2 pipelines probes, so by default each one gets two intervals, but never so long that we run out of probe slots.
+	if(newtun->options.uptoken_protocol < 2)
+		newtun->options.uptoken_timeout = newtun->options.uptoken_interval;
+	else if(newtun->options.uptoken_timeout == 0)
+		newtun->options.uptoken_timeout = newtun->options.uptoken_interval * 2;
+	if(newtun->options.uptoken_timeout > newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1))
+		{
+		newtun->options.uptoken_timeout = newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1);
+		stl(STL_WARNING, TUNNEL_MODULE "UpTokenTimeout is too long for the UpTokenInterval. Using %d ms instead.", nextid, (int)newtun->options.uptoken_timeout);
+		}
+	
+	//The adaptive timeout runs out of probe slots at the same point. Within its bounds, it starts out at UpTokenTimeout.
+	if(newtun->options.uptoken_protocol < 2)
+		newtun->options.uptoken_adaptive = FALSE;
+	if(newtun->options.uptoken_timeout_max > newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1))
+		stl(STL_WARNING, TUNNEL_MODULE "UpTokenTimeoutMax is too long for the UpTokenInterval. Using %d ms instead.", nextid, (int)(newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1)));
+	if(newtun->options.uptoken_timeout_max == 0 || newtun->options.uptoken_timeout_max > newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1))
+		newtun->options.uptoken_timeout_max = newtun->options.uptoken_interval * (UPTOKEN_PROBES_INFLIGHT - 1);
+	if(newtun->options.uptoken_timeout_min > newtun->options.uptoken_timeout_max)
+		{
+		newtun->options.uptoken_timeout_min = newtun->options.uptoken_timeout_max;
+		if(newtun->options.uptoken_adaptive)
+			stl(STL_WARNING, TUNNEL_MODULE "UpTokenTimeoutMin is more than UpTokenTimeoutMax. Using %d ms instead.", nextid, (int)newtun->options.uptoken_timeout_min);
+		}
+	if(newtun->options.uptoken_adaptive && newtun->options.uptoken_timeout < newtun->options.uptoken_timeout_min)
+		newtun->options.uptoken_timeout = newtun->options.uptoken_timeout_min;
+	rto_reset(&newtun->uptoken_rto, newtun->options.uptoken_timeout);
+	if(newtun->options.backoff.max < newtun->options.backoff.min)
+		{
+		newtun->options.backoff.max = newtun->options.backoff.min;
+		stl(STL_WARNING, TUNNEL_MODULE "BackoffMax is less than BackoffMin. Using %d ms instead.", nextid, (int)newtun->options.backoff.max);
+		}
+	backoff_reset(&newtun->backoff, &newtun->options.backoff);
+	tunnel_table_count++;
+	event_timer_init(&newtun->launch_timer, tunnel_launch_timer, newtun);
+	event_timer_init(&newtun->uptoken_timer, uptoken_timer, newtun);
+	event_timer_init(&newtun->trouble_timer, tunnel_trouble_timer, newtun);
+	event_timer_init(&newtun->report_timer, tunnel_report_timer, newtun);
+	event_timer_init(&newtun->confirm_timer, launch_confirm_timer, newtun);
+	event_timer_init(&newtun->handoff_timer, standby_handoff_timer, newtun);
+	histogram_reset(&newtun->uptoken_rtt);
+	newtun->output_tokens = newtun->options.output_burst;
+	capture_init(&newtun->capture);
+	linebuf_init(&newtun->stdout_lines);
+	linebuf_init(&newtun->stderr_lines);
 	
-	nextid++;
 	return newtun;
 	}
 
-int tunnel_maintenance(struct tunnel *tun)
+//Kicks off the tunnel's first launch. Everything after that is driven by the event loop.
+//Returns TRUE on success or FALSE on error.
+int tunnel_start(struct tunnel *tun)
 	{
-	static int srand_seeded = FALSE;
-	int tunnel_status;
-	pid_t waitpid_return;
-	char logline_prefix[128], uptoken_string[UPTOKEN_BUFFER_SIZE];
-	time_t now, launchdelay_seconds;
-	float rnum;
-	ssize_t ioret;
+	return event_timer_schedule(tun->loop, &tun->launch_timer, time_monotonic_ms());
+	}
+
+//Timer handler: the launch delay has passed, so get in line to (re)launch the child process.
+int tunnel_launch_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(tun->pid || !standby_wanted(tun))
+		return TRUE;
+	
+	return launch_request(tun);
+	}
+
+//Launches the child process, once the launch queue lets us through.
+//Returns TRUE on success or FALSE on error.
+int tunnel_launch(struct tunnel *tun)
+	{
+	struct event_loop *loop = tun->loop;
+	int64_t now = time_monotonic_ms();
+	
+	if(tun->pid)
+		return TRUE;
+	
+	//A standby which was on its way up when it stopped being needed.
+	if(!standby_wanted(tun))
+		return launch_release(tun);
+	
+	if(!tunnel_process_launch(tun))
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "tunnel_process_launch() failed!", tun->id);
+		return FALSE;
+		}
+	
+	//The spawn itself failed, and the relaunch has already been scheduled.
+	if(!tun->pid)
+		return TRUE;
+	tun->pid_launched = now;
+	tun->launch_unconfirmed = TRUE;
+	
+	//Reset trouble counter if the process runs for at least BackoffDecay.
+	if(tun->trouble > 0)
+		{
+		if(!event_timer_schedule(loop, &tun->trouble_timer, now + tun->options.backoff.decay))
+			return FALSE;
+		}
+	
+	//Start sending uptokens, and measuring this process's round trip times.
+	if(tun->options.uptoken_enabled)
+		{
+		if(!uptoken_start(tun))
+			return FALSE;
+		}
 	
-	now = time(NULL);
+	return event_timer_schedule(loop, &tun->report_timer, now + ((int64_t)TUNNEL_RTT_REPORT_INTERVAL * 1000));
+	}
+
+//Runs on the tunnel's thread once the launch queue has let it through.
+int tunnel_launch_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	return tunnel_launch((struct tunnel *)data);
+	}
+
+//Timer handler: the process has run for long enough that its earlier trouble can be forgiven.
+int tunnel_trouble_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
 	
-	if(!srand_seeded)
+	if(tun->pid && tun->trouble > 0)
 		{
-		srand((unsigned int)now);
-		srand_seeded = TRUE;
+		stl(STL_INFO, TUNNEL_MODULE "Resetting trouble counter.", tun->id);
+		tun->trouble = 0;
+		backoff_stable(&tun->backoff, &tun->options.backoff);
 		}
+	return TRUE;
+	}
+
+//Timer handler: log the round trip times and magic word counts we've collected so far.
+int tunnel_report_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
 	
-	//stl(STL_INFO, TUNNEL_MODULE "Maintenance loop.", tun->id);
+	uptoken_report(tun);
+	tunnel_magic_report(tun);
+	tunnel_output_flush(tun);
+	tunnel_capture_report(tun);
+	return event_timer_schedule(loop, &tun->report_timer, time_monotonic_ms() + ((int64_t)TUNNEL_RTT_REPORT_INTERVAL * 1000));
+	}
+
+//We ran into trouble that requires us to send a signal to the child process.
+void tunnel_condemn(struct tunnel *tun)
+	{
+	if(!tun->pid || tun->condemned)
+		return;
 	
-	//No PID? (yet?)
+	tun->condemned = TRUE;
+	event_timer_cancel(tun->loop, &tun->uptoken_timer);
+	
+	//With a standby instance, the condemned process may hang on until the standby has taken over.
+	if(standby_takeover(tun))
+		return;
+	
+	stl(STL_WARNING, TUNNEL_MODULE "Tunnel process %d condemned. Sending SIGTERM...", tun->id, tun->pid);
+	tunnel_terminate(tun);
+	}
+
+//Sends SIGTERM to the child process. We'll hear about the exit through SIGCHLD.
+void tunnel_terminate(struct tunnel *tun)
+	{
+	if(kill(tun->pid, SIGTERM) == -1)
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "kill(%d, SIGTERM) failed! (%s)", tun->id, tun->pid, strerror(errno));
+		}
+	}
+
+//Called on the network watcher's thread. Passes the news on to the tunnel's own thread.
+//Returns TRUE on success or FALSE on error.
+int tunnel_notify_network_changed(struct tunnel *tun, int condemn, int64_t timeout)
+	{
+	return event_call(tun->loop, tunnel_network_changed_call, tun, condemn ? -1 : timeout);
+	}
+
+//Runs on the tunnel's thread. A negative value means condemn, and anything else is the probe timeout.
+int tunnel_network_changed_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	return tunnel_network_changed((struct tunnel *)data, value < 0, value < 0 ? 0 : value);
+	}
+
+//The network changed, so whatever trouble we had before says nothing about how things will go now.
+//Running tunnels are either condemned outright, or sent an uptoken which has to come back within "timeout" milliseconds.
+//Returns TRUE on success or FALSE on error.
+int tunnel_network_changed(struct tunnel *tun, int condemn, int64_t timeout)
+	{
+	int64_t now = time_monotonic_ms();
+	
+	if(tun->trouble > 0)
+		{
+		stl(STL_INFO, TUNNEL_MODULE "Resetting trouble counter.", tun->id);
+		tun->trouble = 0;
+		}
+	backoff_reset(&tun->backoff, &tun->options.backoff);
+	
+	//The round trip times we measured were for the old path.
+	rto_reset(&tun->uptoken_rto, tun->options.uptoken_timeout);
+	
+	//Waiting out a relaunch delay? Don't.
 	if(!tun->pid)
 		{
-		//Make sure we're not launching too quickly.
-		if(now >= (tun->trouble_launchnext))
+		if(event_timer_pending(&tun->launch_timer))
+			return event_timer_schedule(tun->loop, &tun->launch_timer, now);
+		return TRUE;
+		}
+	
+	//If this process goes down now, it's because of the network, so it gets relaunched right away.
+	tun->network_changed = now;
+	if(condemn)
+		tunnel_condemn(tun);
+	else if(tun->options.uptoken_enabled)
+		return uptoken_probe_now(tun, timeout);
+	return TRUE;
+	}
+
+//Reaps every child process that has exited. Called whenever SIGCHLD arrives, so the cost is proportional to the number of exited children rather than the number of tunnels.
+//The rest of the cleanup happens on the tunnel's own thread.
+//Returns TRUE on success or FALSE on error.
+int tunnel_reap_children(void)
+	{
+	int tunnel_status;
+	pid_t pid;
+	struct tunnel *tun;
+	
+	while((pid = waitpid(-1, &tunnel_status, WNOHANG)) > 0)
+		{
+		//A child which exits straight away may be reaped before it has even been added to the table. The lock makes us wait until it has.
+		pthread_mutex_lock(&tunnel_pid_lock);
+		if((tun = tunnel_find_by_pid(pid)) != NULL)
+			tunnel_pid_remove(tun);
+		pthread_mutex_unlock(&tunnel_pid_lock);
+		if(tun == NULL && (tun = standby_hook_reaped(pid)) != NULL)
 			{
-			if(!tunnel_process_launch(tun))
-				{
-				stl(STL_ERROR, TUNNEL_MODULE "tunnel_process_launch() failed!", tun->id);
+			if(!event_call(tun->loop, standby_hook_exited_call, tun, tunnel_status))
 				return FALSE;
-				}
-			tun->pid_launched = now;
+			continue;
+			}
+		if(tun == NULL)
+			{
+			stl(STL_WARNING, "Reaped unknown child process %d.", pid);
+			continue;
 			}
+		if(!event_call(tun->loop, tunnel_exited_call, tun, tunnel_status))
+			return FALSE;
+		}
+	if(pid < 0 && errno != ECHILD)
+		{
+		stl(STL_ERROR, "waitpid() returned an error! (%s)", strerror(errno));
+		return FALSE;
 		}
 	
-	//Check STDERR for any messages from the child we need to report.
-	if(tun->pipe_stderr[PIPE_READ] != -1)
+	return TRUE;
+	}
+
+int tunnel_exited_call(struct event_loop *loop, void *data, int64_t value)
+	{
+	return tunnel_exited((struct tunnel *)data, (int)value);
+	}
+
+//Cleans up after a child process which has exited and schedules the relaunch.
+//Returns TRUE on success or FALSE on error.
+int tunnel_exited(struct tunnel *tun, int tunnel_status)
+	{
+	if(WIFSIGNALED(tunnel_status))
+		stl(STL_WARNING, TUNNEL_MODULE "Child process was killed by signal %d!", tun->id, WTERMSIG(tunnel_status));
+	else
+		stl(STL_WARNING, TUNNEL_MODULE "Child process exited with status %d!", tun->id, WEXITSTATUS(tunnel_status));
+	if(!tunnel_schedule_relaunch(tun))
+		return FALSE;
+	standby_exited(tun);
+	return TRUE;
+	}
+
+//The child process is gone (or never started), so tidy up and try again after a delay chosen by the backoff policy.
+//Returns TRUE on success or FALSE on error.
+int tunnel_schedule_relaunch(struct tunnel *tun)
+	{
+	int64_t launchdelay;
+	
+	pthread_mutex_lock(&tunnel_pid_lock);
+	tunnel_pid_remove(tun);
+	pthread_mutex_unlock(&tunnel_pid_lock);
+	tun->pid = 0; //No more PID.
+	tun->uptoken = -1; //Clear uptoken too.
+	tun->launch_unconfirmed = FALSE;
+	event_timer_cancel(tun->loop, &tun->uptoken_timer);
+	event_timer_cancel(tun->loop, &tun->trouble_timer);
+	event_timer_cancel(tun->loop, &tun->report_timer);
+	uptoken_report(tun);
+	tunnel_magic_report(tun);
+	tunnel_output_flush(tun);
+	if(!launch_release(tun))
+		return FALSE;
+	//A standby which isn't needed waits until it is. (See standby_wait().)
+	if(!standby_wanted(tun))
 		{
-		sprintf(logline_prefix, TUNNEL_MODULE "STDERR: ", tun->id);
-		tunnel_check_stderr(tun->pipe_stderr[PIPE_READ], logline_prefix, tun);
+		launchdelay = -1;
+		stl(STL_INFO, TUNNEL_MODULE "Standing by for tunnel %d.", tun->id, tun->partner->id);
+		}
+	//A tunnel which went down because the network changed isn't in trouble, it just needs to reconnect. Right away.
+	else if(tun->network_changed && time_monotonic_ms() - tun->network_changed < (int64_t)TUNNEL_NETWORK_CHANGE_WINDOW * 1000)
+		{
+		launchdelay = 0;
+		stl(STL_INFO, TUNNEL_MODULE "The network changed. Relaunching right away.", tun->id);
+		}
+	else
+		{
+		//If the child process dies for any reason, the trouble level goes up, and the backoff policy picks a launch delay.
+		tun->trouble = tun->trouble + 1;
+		launchdelay = backoff_failure(&tun->backoff, &tun->options.backoff, time_monotonic_ms());
+		if(tun->backoff.suppressed)
+			stl(STL_WARNING, TUNNEL_MODULE "Tunnel is flapping. (Penalty %d.) Will wait at least %.1f seconds before relaunching.", tun->id, (int)tun->backoff.penalty, (double)launchdelay / 1000.0);
+		else
+			stl(STL_INFO, TUNNEL_MODULE "Will wait at least %.1f seconds before relaunching.", tun->id, (double)launchdelay / 1000.0);
 		}
+	tun->network_changed = 0;
+	if(launchdelay >= 0 && !event_timer_schedule(tun->loop, &tun->launch_timer, time_monotonic_ms() + launchdelay))
+		return FALSE;
+	tunnel_unwatch(tun);
+	if(!stdpipes_close_remaining(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "stdpipes_close_remaining() returned an error!", tun->id);
+		return FALSE;
+		}
+	
+	return TRUE;
+	}
+
+//The PID table maps running child processes back to their tunnels. (Open addressing with linear probing.)
+//Callers must hold tunnel_pid_lock.
+//Returns TRUE on success or FALSE on error.
+int tunnel_pid_insert(struct tunnel *tun)
+	{
+	struct tunnel **old_table = tunnel_pid_table;
+	int old_len = tunnel_pid_table_len, i, slot;
 	
-	//If we're not using STDOUT for UpToken, we should check that for messages we need to report.
-	if(!tun->uptoken_enabled && tun->pipe_stdout[PIPE_READ] != -1)
+	//Keep the table at most half full.
+	if((tunnel_pid_table_count + 1) * 2 > tunnel_pid_table_len)
 		{
-		sprintf(logline_prefix, TUNNEL_MODULE "STDOUT: ", tun->id);
-		tunnel_check_stderr(tun->pipe_stdout[PIPE_READ], logline_prefix, tun);
+		tunnel_pid_table_len = old_len ? old_len * 2 : TUNNEL_PIDTABLE_INITIAL;
+		if((tunnel_pid_table = (struct tunnel **)calloc(tunnel_pid_table_len, sizeof(struct tunnel *))) == NULL)
+			{
+			stl(STL_ERROR, TUNNEL_MODULE "out of memory!", tun->id);
+			tunnel_pid_table = old_table;
+			tunnel_pid_table_len = old_len;
+			return FALSE;
+			}
+		for(i = 0; i < old_len; i++)
+			{
+			if(old_table[i] == NULL)
+				continue;
+			slot = old_table[i]->pid & (tunnel_pid_table_len - 1);
+			while(tunnel_pid_table[slot] != NULL)
+				slot = (slot + 1) & (tunnel_pid_table_len - 1);
+			tunnel_pid_table[slot] = old_table[i];
+			}
+		free(old_table);
 		}
 	
-	//We DO have a PID. Child process should be running.
-	if(tun->pid)
+	slot = tun->pid & (tunnel_pid_table_len - 1);
+	while(tunnel_pid_table[slot] != NULL)
+		slot = (slot + 1) & (tunnel_pid_table_len - 1);
+	tunnel_pid_table[slot] = tun;
+	tunnel_pid_table_count++;
+	return TRUE;
+	}
+
+struct tunnel *tunnel_find_by_pid(pid_t pid)
+	{
+	int slot;
+	
+	if(tunnel_pid_table_len == 0)
+		return NULL;
+	
+	for(slot = pid & (tunnel_pid_table_len - 1); tunnel_pid_table[slot] != NULL; slot = (slot + 1) & (tunnel_pid_table_len - 1))
+		{
+		if(tunnel_pid_table[slot]->pid == pid)
+			return tunnel_pid_table[slot];
+		}
+	return NULL;
+	}
+
+void tunnel_pid_remove(struct tunnel *tun)
+	{
+	int slot, next, home, mask = tunnel_pid_table_len - 1;
+	
+	if(tunnel_pid_table_len == 0 || tun->pid <= 0)
+		return;
+	
+	for(slot = tun->pid & mask; tunnel_pid_table[slot] != NULL && tunnel_pid_table[slot] != tun; slot = (slot + 1) & mask);
+	if(tunnel_pid_table[slot] == NULL)
+		return;
+	
+	//Shift any following entries of the same probe run back so that lookups never hit a hole.
+	tunnel_pid_table[slot] = NULL;
+	for(next = (slot + 1) & mask; tunnel_pid_table[next] != NULL; next = (next + 1) & mask)
 		{
-		//Reset trouble counter if the process has run for at least TUNNEL_TROUBLERESETTIME seconds.
-		if(tun->trouble > 0 && now > (tun->pid_launched + TUNNEL_TROUBLERESETTIME))
+		home = tunnel_pid_table[next]->pid & mask;
+		if(((next - home) & mask) >= ((next - slot) & mask))
 			{
-			stl(STL_INFO, TUNNEL_MODULE "Resetting trouble counter.", tun->id);
-			tun->trouble = 0;
+			tunnel_pid_table[slot] = tunnel_pid_table[next];
+			tunnel_pid_table[next] = NULL;
+			slot = next;
 			}
-		
-		//Uptoken stuff gets handled here too.
-		if(tun->uptoken_enabled && !tun->condemned && tun->pipe_stdin[PIPE_WRITE] >= 0 && tun->pipe_stdout[PIPE_READ] >= 0)
+		}
+	tunnel_pid_table_count--;
+	}
+
+//Stops every running child process at shutdown. They are all sent SIGTERM at once and reaped as they exit, and any process still
+//running when its ShutdownGrace is up gets SIGKILL, so shutting down takes about as long as the slowest process rather than all of
+//them added together. fd_wake is the read end of the signal pipe, which wakes us up whenever SIGCHLD arrives. (If it's -1, we just
+//check every so often.) The worker threads must already have been stopped.
+void tunnel_stop_all(int fd_wake)
+	{
+	struct tunnel_stopping *stopping;
+	struct tunnel *tun;
+	struct pollfd wake_poll;
+	unsigned char drain[64];
+	int stopping_pos = 0, running, status, i;
+	int64_t started = time_monotonic_ms(), now, next;
+	pid_t pid;
+	
+	if((stopping = (struct tunnel_stopping *)calloc(tunnel_count() + 1, sizeof(struct tunnel_stopping))) == NULL)
+		{
+		stl(STL_ERROR, "Out of memory! Tunnel processes will be left running.");
+		return;
+		}
+	
+	for(i = 1; i <= tunnel_count(); i++)
+		{
+		tun = tunnel_by_id(i);
+		if(tun->pid <= 0)
+			continue;
+		uptoken_report(tun);
+		tunnel_magic_report(tun);
+		tunnel_output_flush(tun);
+		tunnel_capture_report(tun);
+		stl(STL_INFO, TUNNEL_MODULE "Process %d still running. Sending SIGTERM...", tun->id, tun->pid);
+		tunnel_terminate(tun);
+		stopping[stopping_pos].tun = tun;
+		stopping[stopping_pos].pid = tun->pid;
+		stopping[stopping_pos].deadline = started + tun->options.shutdown_grace;
+		stopping[stopping_pos].killed = FALSE;
+		stopping_pos++;
+		}
+	running = stopping_pos;
+	next = started;
+	
+	while(running > 0)
+		{
+		//Reap whatever has exited. Every tunnel which still has a PID is on the list.
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0)
 			{
-			//stl(STL_INFO, TUNNEL_MODULE "uptoken: %d; now: %ld; sent: %ld; interval: %ld", tun->id, (int)tun->uptoken, now, tun->uptoken_sent, tun->uptoken_interval);
-			if(tun->uptoken > 0 && now >= (tun->uptoken_sent + tun->uptoken_interval)) //We have previously sent an uptoken. Has the uptoken wait time elapsed?
+			pthread_mutex_lock(&tunnel_pid_lock);
+			if((tun = tunnel_find_by_pid(pid)) != NULL)
+				tunnel_pid_remove(tun);
+			pthread_mutex_unlock(&tunnel_pid_lock);
+			if(tun == NULL)
 				{
-				//Check the pipe for a reply from the far end. The first byte should exactly match our uptoken.
-				memset(uptoken_string, 0, UPTOKEN_BUFFER_SIZE);
-				ioret = read_all(tun->pipe_stdout[PIPE_READ], uptoken_string, (UPTOKEN_BUFFER_SIZE - 1));
-				if(ioret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
-					{
-					stl(STL_ERROR, TUNNEL_MODULE "uptoken read() failed! (%s)", tun->id, strerror(errno));
-					tun->condemned = TRUE; //Mark this tunnel process as condemned by the uptoken system.
-					}
-				else if(strlen(uptoken_string) < 2) //No error reported by read(), but still didn't get enough bytes.
-					{
-					stl(STL_WARNING, TUNNEL_MODULE "uptoken read() didn't return enough bytes! uptoken did not come back.", tun->id);
-					//stl(STL_INFO, TUNNEL_MODULE "Details: (%d, %d, \"%s\")", tun->id, ioret, strlen(uptoken_string), uptoken_string);
-					tun->condemned = TRUE; //Mark this tunnel process as condemned by the uptoken system.
-					}
-				else //We did get enough bytes.
-					{
-					//Does the uptoken match?
-					if(uptoken_string[0] == (char)tun->uptoken)
-						{
-						//stl(STL_INFO, TUNNEL_MODULE "uptoken (%c) received from far end.", tun->id, (char)tun->uptoken);
-						//Okay! Forget this uptoken so we can pick a new one next round.
-						tun->uptoken = -1;
-						}
-					else
-						{
-						//Oh dear! We got something unexpected back from the far end.
-						stl(STL_WARNING, TUNNEL_MODULE "uptoken does not match! The far end sent something strange.", tun->id);
-						tun->condemned = TRUE; //Mark this tunnel process as condemned by the uptoken system.
-						}
-					}
-				}
-			
-			if(tun->uptoken < 0) //We have not yet sent an uptoken. (Or uptoken just came back.)
-				{
-				//Choose an uptoken. (ASCII 33-126)
-				rnum = (float)rand() / (float)RAND_MAX;
-				rnum = roundf(rnum * 93.0);
-				tun->uptoken = (signed char)rnum + (signed char)33;
-				sprintf(uptoken_string, "%c\n", (char)tun->uptoken);
-				if((ioret = write_all(tun->pipe_stdin[PIPE_WRITE], uptoken_string, strlen(uptoken_string))) != strlen(uptoken_string))
-					{
-					if(ioret == -1)
-						stl(STL_ERROR, TUNNEL_MODULE "uptoken write() failed! (%s)", tun->id, strerror(errno));
-					else //Couldn't write enough bytes, but no reported error.
-						stl(STL_ERROR, TUNNEL_MODULE "uptoken write() failed for unknown reason!", tun->id);
-					tun->condemned = TRUE; //Mark this tunnel process as condemned by the uptoken system.
-					}
-				else //Uptoken sent!
-					{
-					//stl(STL_INFO, TUNNEL_MODULE "uptoken (%c) sent to far end.", tun->id, (char)tun->uptoken);
-					tun->uptoken_sent = now;
-					}
+				//A StandbyHandoff program, most likely. Nobody is waiting for it any more.
+				standby_hook_reaped(pid);
+				continue;
 				}
+			tun->pid = 0;
+			running--;
+			}
+		if(pid < 0)
+			{
+			if(errno != ECHILD)
+				stl(STL_ERROR, "waitpid() returned an error! (%s)", strerror(errno));
+			break;
 			}
+		if(running <= 0)
+			break;
 		
-		//Did we run into trouble that would require us to send a signal to the child process?
-		if(tun->condemned)
+		//Send SIGKILL to anything which has used up its grace period, and give up on anything which has outlived SIGKILL.
+		now = time_monotonic_ms();
+		if(now >= next)
 			{
-			stl(STL_WARNING, TUNNEL_MODULE "Tunnel process %d condemned. Sending SIGTERM...", tun->id, tun->pid);
-			if(kill(tun->pid, SIGTERM) == -1)
+			next = INT64_MAX;
+			for(i = 0; i < stopping_pos; i++)
 				{
-				stl(STL_WARNING, TUNNEL_MODULE "kill(%d, SIGTERM) failed! (%s)", tun->id, tun->pid, strerror(errno));
+				if(stopping[i].tun->pid != stopping[i].pid)
+					continue;
+				if(now >= stopping[i].deadline)
+					{
+					if(stopping[i].killed)
+						{
+						stl(STL_WARNING, TUNNEL_MODULE "Process %d didn't go away after SIGKILL. Leaving it behind.", stopping[i].tun->id, stopping[i].pid);
+						pthread_mutex_lock(&tunnel_pid_lock);
+						tunnel_pid_remove(stopping[i].tun);
+						pthread_mutex_unlock(&tunnel_pid_lock);
+						stopping[i].tun->pid = 0;
+						running--;
+						continue;
+						}
+					stl(STL_WARNING, TUNNEL_MODULE "Process %d is still running after %.1f seconds. Sending SIGKILL...", stopping[i].tun->id, stopping[i].pid, (double)(now - started) / 1000.0);
+					if(kill(stopping[i].pid, SIGKILL) == -1)
+						stl(STL_WARNING, TUNNEL_MODULE "kill(%d, SIGKILL) failed! (%s)", stopping[i].tun->id, stopping[i].pid, strerror(errno));
+					stopping[i].killed = TRUE;
+					stopping[i].deadline = now + (int64_t)TUNNEL_SHUTDOWN_KILL_WAIT * 1000;
+					}
+				if(stopping[i].deadline < next)
+					next = stopping[i].deadline;
 				}
+			if(running <= 0)
+				break;
 			}
 		
-		//Poll (non-blocking) for this tunnel's child process exit status.
-		waitpid_return = waitpid(tun->pid, &tunnel_status, WNOHANG);
-		if(waitpid_return < 0)
+		//Sleep until SIGCHLD arrives or the next deadline is up.
+		wake_poll.fd = fd_wake;
+		wake_poll.events = POLLIN;
+		wake_poll.revents = 0;
+		if(fd_wake < 0)
+			poll(NULL, 0, (int)(next - now < TUNNEL_SHUTDOWN_POLL_INTERVAL ? next - now : TUNNEL_SHUTDOWN_POLL_INTERVAL));
+		else if(poll(&wake_poll, 1, (int)(next - now)) > 0)
 			{
-			stl(STL_ERROR, TUNNEL_MODULE "waitpid() returned an error!", tun->id);
-			return FALSE;
-			}
-		else if(waitpid_return == tun->pid)
-			{
-			stl(STL_WARNING, TUNNEL_MODULE "Child process exited with status %d!", tun->id, WEXITSTATUS(tunnel_status));
-			tun->pid = 0; //No more PID.
-			tun->uptoken = -1; //Clear uptoken too.
-			//If the child process dies for any reason, the trouble level goes up. (Up to TUNNEL_TROUBLEMAX)
-			if(tun->trouble < TUNNEL_TROUBLEMAX)
-				tun->trouble = tun->trouble + 1;
-			//With the calculated trouble level comes a launch delay.
-			launchdelay_seconds = (time_t)powf((float)2.0, (float)tun->trouble);
-			tun->trouble_launchnext = now + launchdelay_seconds;
-			stl(STL_INFO, TUNNEL_MODULE "Will wait at least %d seconds before relaunching.", tun->id, launchdelay_seconds);
-			if(!stdpipes_close_remaining(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
-				{
-				stl(STL_ERROR, TUNNEL_MODULE "stdpipes_close_remaining() returned an error!", tun->id);
-				return FALSE;
-				}
+			//Whatever else was in the pipe doesn't matter any more. We're already on our way out.
+			while(read(fd_wake, drain, sizeof(drain)) > 0);
 			}
 		}
 	
-	return TRUE;
+	if(stopping_pos > 0)
+		stl(STL_INFO, "Stopped %d tunnel processes in %.1f seconds.", stopping_pos - running, (double)(time_monotonic_ms() - started) / 1000.0);
+	free(stopping);
 	}
 
 void tunnel_destroy(struct tunnel *tun)
@@ -236,34 +664,73 @@ void tunnel_destroy(struct tunnel *tun)
 	
 	stl(STL_INFO, TUNNEL_MODULE "Destroying tunnel object...", tun->id);
 	
-	//Let's make sure the child process is dead.
+	event_timer_cancel(tun->loop, &tun->launch_timer);
+	event_timer_cancel(tun->loop, &tun->uptoken_timer);
+	event_timer_cancel(tun->loop, &tun->trouble_timer);
+	event_timer_cancel(tun->loop, &tun->report_timer);
+	event_timer_cancel(tun->loop, &tun->handoff_timer);
+	launch_cancel(tun);
+	launch_release(tun);
+	
+	//tunnel_stop_all() should have stopped the child process already. If it couldn't, we don't hang around waiting for it.
 	if(tun->pid > 0)
 		{
-		stl(STL_INFO, TUNNEL_MODULE "Process %d still running. Sending SIGTERM...", tun->id, tun->pid);
-		if(kill(tun->pid, SIGTERM) == -1)
-			{
-			stl(STL_WARNING, TUNNEL_MODULE "kill(%d, SIGTERM) failed! (%s)", tun->id, tun->pid, strerror(errno));
-			}
-		else
-			{
-			//Since we successfully sent a signal we now need to waitpid() until the child process dies.
-			waitpid(tun->pid, NULL, 0);
-			}
+		stl(STL_WARNING, TUNNEL_MODULE "Process %d still running. Sending SIGTERM and leaving it behind...", tun->id, tun->pid);
+		tunnel_terminate(tun);
+		pthread_mutex_lock(&tunnel_pid_lock);
+		tunnel_pid_remove(tun);
+		pthread_mutex_unlock(&tunnel_pid_lock);
+		tun->pid = 0;
 		}
 	
 	//Let's make sure any remaining pipes are closed.
+	tunnel_unwatch(tun);
 	if(!stdpipes_close_remaining(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
 		stl(STL_WARNING, TUNNEL_MODULE "stdpipes_close_remaining() returned an error!", tun->id);
 	
-	free(tun);
+	magic_destroy(tun->options.magic_words);
+	tun->options.magic_words = NULL;
+	if(tun->envp != tun->env_base->vars)
+		free(tun->envp); //Just the array. The strings belong to env and env_base.
+	tun->envp = NULL;
+	//The memory itself belongs to the tunnel table. (See tunnel_table_free().)
+	}
+
+int tunnel_count(void)
+	{
+	return tunnel_table_count;
+	}
+
+//Returns the tunnel with the given id, or NULL if there isn't one.
+struct tunnel *tunnel_by_id(int id)
+	{
+	if(id < 1 || id > tunnel_table_count)
+		return NULL;
+	return &tunnel_slabs[(id - 1) / TUNNEL_SLAB_SIZE][(id - 1) % TUNNEL_SLAB_SIZE];
+	}
+
+//Frees every tunnel. They must all have been through tunnel_destroy() first.
+void tunnel_table_free(void)
+	{
+	int i;
+	
+	for(i = 0; i * TUNNEL_SLAB_SIZE < tunnel_table_count; i++)
+		free(tunnel_slabs[i]);
+	free(tunnel_slabs);
+	tunnel_slabs = NULL;
+	tunnel_slabs_len = 0;
+	tunnel_table_count = 0;
+	free(tunnel_pid_table);
+	tunnel_pid_table = NULL;
+	tunnel_pid_table_len = 0;
+	tunnel_pid_table_count = 0;
 	}
 
 int tunnel_process_launch(struct tunnel *tun)
 	{
-	int i = 0, wrote, uptoken_header_len;
+	int i = 0, wrote;
 	size_t launchstring_len = 0;
 	char *launchstring = NULL, *launchstring_tmp;
-	char uptoken_header[UPTOKEN_HEADER_BUFFER_SIZE];
 	
 	//Make sure newly-created process is not condemned out of the gate.
 	tun->condemned = FALSE;
@@ -291,44 +758,44 @@ int tunnel_process_launch(struct tunnel *tun)
 	stl(STL_INFO, TUNNEL_MODULE "Launching child process:%s", tun->id, launchstring);
 	free(launchstring);
 	
+	//Put the environment together the first time we need it, and keep it for every relaunch after that.
+	//A tunnel without environment variables of its own just uses the base as it is.
+	if(tun->envp == NULL && (tun->env == NULL || tun->env[0] == NULL))
+		tun->envp = tun->env_base->vars;
+	if(tun->envp == NULL && (tun->envp = env_materialize(tun->env_base, tun->env)) == NULL)
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "env_materialize() failed!", tun->id);
+		return FALSE;
+		}
+	
 	//Tunnel requires pipes to be set up for tunnel monitoring.
+	//With enough tunnels we can run out of descriptors. That's no reason to give up on the rest, so just try again later.
 	if(!stdpipes_create(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
 		{
 		stl(STL_ERROR, TUNNEL_MODULE "Couldn't create pipes.", tun->id);
-		return FALSE;
+		stdpipes_close_remaining(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr);
+		return tunnel_schedule_relaunch(tun);
 		}
 	
-	//Fork to generate tunnel child process.
-	if((tun->pid = fork()) < 0)
+	//Spawn the tunnel child process. Unlike fork(), this doesn't have to copy our page tables, so the cost doesn't grow with the number of tunnels.
+	//Hold the PID table from the spawn until the new PID is in it, so the main thread can't reap the child before it knows whose it is.
+	pthread_mutex_lock(&tunnel_pid_lock);
+	if(!tunnel_process_spawn(tun))
 		{
-		stl(STL_ERROR, TUNNEL_MODULE "Call to fork() failed!", tun->id);
-		return FALSE;
+		pthread_mutex_unlock(&tunnel_pid_lock);
+		stdpipes_close_remaining(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr);
+		tun->pid = 0;
+		return tunnel_schedule_relaunch(tun);
 		}
 	
-	//Child?
-	if(tun->pid == 0)
+	//Remember which tunnel this PID belongs to so that we can find it when the child exits.
+	if(!tunnel_pid_insert(tun))
 		{
-		//Close the "far" ends of the pipe between the parent and the child.
-		if(!stdpipes_close_far_end_child(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
-			{
-			stl(STL_ERROR, TUNNEL_MODULE "stdpipes_close_far_end_child() returned an error!", tun->id);
-			exit(1); //Child process must exit instead of returning.
-			}
-		
-		//In the child process we need to replace the standard pipes.
-		if(!stdpipes_replace(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
-			{
-			stl(STL_ERROR, TUNNEL_MODULE "stdpipes_replace() returned an error!", tun->id);
-			exit(1); //Child process must exit instead of returning.
-			}
-		
-		//Exec!
-		execve(tun->argv[0], tun->argv, tun->envp);
-		
-		//execve() only returns on error.
-		stl(STL_ERROR, TUNNEL_MODULE "Call to execve() failed!", tun->id);
-		exit(1); //Child process must exit instead of returning.
-		}	
+		pthread_mutex_unlock(&tunnel_pid_lock);
+		stl(STL_ERROR, TUNNEL_MODULE "tunnel_pid_insert() failed!", tun->id);
+		return FALSE;
+		}
+	pthread_mutex_unlock(&tunnel_pid_lock);
 	
 	//Close the "far" ends of the pipe between the parent and the child.
 	if(!stdpipes_close_far_end_parent(tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
@@ -338,133 +805,328 @@ int tunnel_process_launch(struct tunnel *tun)
 		}
 	
 	//On the parent we must set O_NONBLOCK so we can query the pipes from the child without locking up ourselves.
-	if(!fd_set_nonblock(tun->pipe_stdout[PIPE_READ]) || !fd_set_nonblock(tun->pipe_stderr[PIPE_READ]))
+	//The same goes for the uptoken side of STDIN, in case the child stops reading.
+	if(!fd_set_nonblock(tun->pipe_stdout[PIPE_READ]) || !fd_set_nonblock(tun->pipe_stderr[PIPE_READ]) || !fd_set_nonblock(tun->pipe_stdin[PIPE_WRITE]))
 		{
 		stl(STL_ERROR, TUNNEL_MODULE "fd_set_nonblock() returned an error!", tun->id);
 		return FALSE;
 		}
 	
+	//Let the event loop tell us as soon as the child has something to say.
+	if(!tunnel_watch(tun))
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "tunnel_watch() returned an error!", tun->id);
+		return FALSE;
+		}
+	
 	stl(STL_INFO, TUNNEL_MODULE "Child process launched with PID %d", tun->id, tun->pid);
 	
-	//If uptoken_enabled, we should send the uptoken header.
-	if(tun->uptoken_enabled)
+	return TRUE;
+	}
+
+//Starts the child process with its standard I/O connected to our pipes.
+//Returns TRUE on success or FALSE on error.
+int tunnel_process_spawn(struct tunnel *tun)
+	{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	sigset_t sigmask;
+	short flags = POSIX_SPAWN_SETSIGMASK;
+	int error, ok = FALSE;
+	
+	if((error = posix_spawn_file_actions_init(&actions)) != 0)
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "posix_spawn_file_actions_init() failed! (%s)", tun->id, strerror(error));
+		return FALSE;
+		}
+	if((error = posix_spawnattr_init(&attributes)) != 0)
 		{
-		snprintf(uptoken_header, UPTOKEN_HEADER_BUFFER_SIZE, UPTOKEN_HEADER_FORMAT, UPTOKEN_HEADER_VERSION, (int)tun->uptoken_interval);
-		uptoken_header_len = strlen(uptoken_header);
-		wrote = write_all(tun->pipe_stdin[PIPE_WRITE], uptoken_header, uptoken_header_len);
-		if(wrote < uptoken_header_len)
+		stl(STL_ERROR, TUNNEL_MODULE "posix_spawnattr_init() failed! (%s)", tun->id, strerror(error));
+		posix_spawn_file_actions_destroy(&actions);
+		return FALSE;
+		}
+	
+	if(stdpipes_spawn_actions(&actions, tun->pipe_stdin, tun->pipe_stdout, tun->pipe_stderr))
+		{
+		ok = TRUE;
+		
+		//Every descriptor is close-on-exec, including any we inherited. (See fd_cloexec_inherited().) Only the pipes above get through.
+		
+		//Worker threads block every signal, and the child would inherit that. It has to be able to hear SIGTERM.
+		sigemptyset(&sigmask);
+		if((error = posix_spawnattr_setsigmask(&attributes, &sigmask)) != 0)
+			stl(STL_WARNING, TUNNEL_MODULE "posix_spawnattr_setsigmask() failed! (%s)", tun->id, strerror(error));
+		if((error = posix_spawnattr_setflags(&attributes, flags)) != 0)
+			stl(STL_WARNING, TUNNEL_MODULE "posix_spawnattr_setflags() failed! (%s)", tun->id, strerror(error));
+		
+		if((error = posix_spawn(&tun->pid, tun->argv[0], &actions, &attributes, tun->argv, tun->envp)) != 0)
 			{
-			stl(STL_ERROR, TUNNEL_MODULE "failed writing uptoken header!", tun->id);
-			return FALSE;
+			stl(STL_ERROR, TUNNEL_MODULE "Couldn't launch %s! (%s)", tun->id, tun->argv[0], strerror(error));
+			ok = FALSE;
 			}
-		//stl(STL_INFO, "Sent header: %s", uptoken_header);
 		}
 	
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+	return ok;
+	}
+
+//Registers the child's output pipes with the event loop.
+//STDOUT carries uptoken replies if UpToken is enabled, or more messages to report if it isn't.
+//Returns TRUE on success or FALSE on error.
+int tunnel_watch(struct tunnel *tun)
+	{
+	event_handler output_handler = tunnel_output_event;
+	
+	//Don't let a partial line from the last child get glued onto the first line from this one.
+	linebuf_reset(&tun->stdout_lines);
+	linebuf_reset(&tun->stderr_lines);
+	
+	//The file is opened afresh for every process, so it can be rotated in between. If it can't be opened, the output is logged as usual.
+	if(tun->options.output_file != NULL)
+		{
+		if(capture_open(&tun->capture, tun->options.output_file, tun->options.output_scan && tun->options.magic_words != NULL && tun->options.magic_words->words_len > 0))
+			output_handler = tunnel_capture_event;
+		else
+			stl(STL_WARNING, TUNNEL_MODULE "Couldn't open %s! (%s) Logging output instead.", tun->id, tun->options.output_file, strerror(errno));
+		}
+	
+	if(tun->pipe_stderr[PIPE_READ] != -1)
+		{
+		if(!event_add(tun->loop, tun->pipe_stderr[PIPE_READ], output_handler, tun))
+			return FALSE;
+		}
+	if(tun->pipe_stdout[PIPE_READ] != -1)
+		{
+		if(!event_add(tun->loop, tun->pipe_stdout[PIPE_READ], tun->options.uptoken_enabled ? uptoken_event : output_handler, tun))
+			return FALSE;
+		}
 	return TRUE;
 	}
 
-int tunnel_check_stderr(int fd, char *logline_prefix, struct tunnel *tun)
+//Removes the child's output pipes from the event loop, and lets go of the output buffers. Must be called before the pipes are closed.
+void tunnel_unwatch(struct tunnel *tun)
+	{
+	if(tun->loop != NULL)
+		{
+		event_remove(tun->loop, tun->pipe_stderr[PIPE_READ]);
+		event_remove(tun->loop, tun->pipe_stdout[PIPE_READ]);
+		}
+	capture_close(&tun->capture);
+	linebuf_free(&tun->stdout_lines);
+	linebuf_free(&tun->stderr_lines);
+	}
+
+//Event loop handler for the child's STDERR (and STDOUT, when UpToken is disabled).
+int tunnel_output_event(struct event_loop *loop, int fd, int events, void *data)
 	{
-	char *buf = NULL, *buf_temp, *buf_sub;
-	size_t buf_len = 0, buf_pos = 0;
+	struct tunnel *tun = (struct tunnel *)data;
+	struct linebuf *lb;
 	ssize_t readret;
-	int done = FALSE, i = 0, j = 0;
+	char *stream, *line;
 	
-	while(!done)
+	if(fd == tun->pipe_stderr[PIPE_READ])
 		{
-		if((buf_pos + 1) >= buf_len)
-			{
-			//We need to increase the size of the buffer.
-			buf_len = buf_len + STRING_BUFFER_ALLOCSTEP;
-			if((buf = realloc(buf, buf_len * sizeof(char))) == NULL)
-				{
-				stl(STL_ERROR, "out of memory!");
-				free(buf);
-				return -1;
-				}
-			}
-		buf_temp = buf + buf_pos;
-		readret = read_all(fd, buf_temp, buf_len - buf_pos);
-		if(readret > 0)
-			{
-			buf_pos = buf_pos + readret;
-			}
-		else if(readret < 0)
-			{
-			//Because read() returned an error code, we need to check errno.
-			if(errno != EAGAIN && errno != EWOULDBLOCK)
-				{
-				stl(STL_ERROR, "failed reading pipe! (%s)", strerror(errno));
-				free(buf);
-				return -1;
-				}
-			//If read() returned zero bytes, we are done.
-			done = TRUE;
-			}
-		else //readret is 0
-			done = TRUE;
+		lb = &tun->stderr_lines;
+		stream = "STDERR";
+		}
+	else
+		{
+		lb = &tun->stdout_lines;
+		stream = "STDOUT";
 		}
 	
-	//Did we get anything in the buffer at all?
-	if(buf_pos == 0)
+	//Report any messages from the child, one complete line at a time.
+	while((readret = linebuf_fill(lb, fd)) > 0)
 		{
-		free(buf);
-		return FALSE;
+		while((line = linebuf_line(lb, FALSE)) != NULL)
+			tunnel_output_line(tun, stream, line);
 		}
+	if(readret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		stl(STL_ERROR, TUNNEL_MODULE "failed reading %s pipe! (%s)", tun->id, stream, strerror(errno));
 	
-	//We need moar memories!
-	if((buf_sub = malloc(buf_len + 1)) == NULL)
+	//The child closed its end of the pipe. Whatever is left is the last line. We'll hear about the exit itself through SIGCHLD.
+	if(readret == 0 || (events & (EVENT_HANGUP | EVENT_ERROR)))
 		{
-		stl(STL_ERROR, "out of memory!");
-		free(buf);
-		return -1;
+		while((line = linebuf_line(lb, TRUE)) != NULL)
+			tunnel_output_line(tun, stream, line);
+		event_remove(loop, fd);
 		}
 	
-	//Scan through the buffer, outputting each line and scanning for "magic words".
-	for(i = 0; i < buf_pos; i++)
+	return TRUE;
+	}
+
+//Event loop handler for the child's STDERR (and STDOUT, when UpToken is disabled) when it goes to an OutputFile. The output never
+//passes through our own buffers, except for the copy which is checked for magic words.
+int tunnel_capture_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	struct linebuf *lb;
+	int stream, scan_fd, copy;
+	ssize_t moved, readret;
+	char *line;
+	
+	//Writing to the file failed, so the rest of the output is logged.
+	if(tun->capture.fd < 0)
+		return tunnel_output_event(loop, fd, events, data);
+	
+	if(fd == tun->pipe_stderr[PIPE_READ])
 		{
-		//Copy the character over.
-		buf_sub[j] = buf[i];
-		j++;
-		
-		//Check for a new line character.
-		if(buf[i] == '\n')
+		lb = &tun->stderr_lines;
+		stream = CAPTURE_STDERR;
+		}
+	else
+		{
+		lb = &tun->stdout_lines;
+		stream = CAPTURE_STDOUT;
+		}
+	scan_fd = tun->capture.scan_pipes[stream][PIPE_READ];
+	copy = tun->capture.copy;
+	
+	while((moved = capture_move(&tun->capture, stream, fd)) > 0)
+		{
+		//Everything that was moved is waiting in the scan pipe. It has to be read back out before the next move.
+		if(scan_fd < 0)
+			continue;
+		while((readret = linebuf_fill(lb, scan_fd)) > 0)
 			{
-			buf_sub[j] = '\0'; //Null-terminate the string.
-			stl(STL_INFO, "%s%s", logline_prefix, buf_sub);
-			tunnel_check_magic_words(buf_sub, tun);
-			j = 0;
+			while((line = linebuf_line(lb, FALSE)) != NULL)
+				tunnel_check_magic_words(line, tun);
 			}
 		}
-	if(j > 0)
+	if(moved < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
 		{
-		buf_sub[j] = '\0'; //Null-terminate the string.
-		stl(STL_INFO, "%s%s", logline_prefix, buf_sub);
-		tunnel_check_magic_words(buf_sub, tun);
+		stl(STL_ERROR, TUNNEL_MODULE "Writing to %s failed! (%s) Logging output instead.", tun->id, tun->options.output_file, strerror(errno));
+		tunnel_capture_report(tun);
+		capture_close(&tun->capture);
+		return tunnel_output_event(loop, fd, events, data);
+		}
+	if(tun->capture.copy && !copy)
+		stl(STL_WARNING, TUNNEL_MODULE "%s can't take splice(), so output is being copied into it instead.", tun->id, tun->options.output_file);
+	
+	//The child closed its end of the pipe. We'll hear about the exit itself through SIGCHLD.
+	if(moved == 0 || (events & (EVENT_HANGUP | EVENT_ERROR)))
+		{
+		while((line = linebuf_line(lb, TRUE)) != NULL)
+			tunnel_check_magic_words(line, tun);
+		event_remove(loop, fd);
 		}
 	
-	free(buf);
-	free(buf_sub);
 	return TRUE;
 	}
 
-void tunnel_check_magic_words(char *line, struct tunnel *tun)
+void tunnel_capture_report(struct tunnel *tun)
 	{
-	int i, j, len;
-	char *magic_words[] = { "port forwarding failed", "combat check failed", NULL };
+	if(tun->capture.bytes == 0)
+		return;
+	stl(STL_INFO, TUNNEL_MODULE "Wrote %llu byte(s) of output to %s.", tun->id, (unsigned long long)tun->capture.bytes, tun->options.output_file);
+	tun->capture.bytes = 0;
+	}
+
+void tunnel_output_line(struct tunnel *tun, char *stream, char *line)
+	{
+	if(tunnel_output_allowed(tun, stream, line))
+		stl(STL_INFO, TUNNEL_MODULE "%s: %s", tun->id, stream, line);
 	
-	//Now search for magic words.
-	for(i = 0; magic_words[i]; i++)
+	//Even a line which isn't worth logging again might be the one that tells us the tunnel is broken.
+	tunnel_check_magic_words(line, tun);
+	}
+
+//Decides whether a line of output should be logged. Repeats of the previous line are only counted,
+//and once the rate limit's token bucket is empty, lines are dropped until it refills.
+int tunnel_output_allowed(struct tunnel *tun, char *stream, char *line)
+	{
+	uint64_t hash = 14695981039346656037ULL; //FNV-1a
+	unsigned char *p;
+	int64_t now;
+	
+	if(tun->options.output_collapse)
 		{
-		len = strlen(magic_words[i]);
-		for(j = 0; line[j]; j++)
+		for(p = (unsigned char *)stream; *p; p++)
+			hash = (hash ^ *p) * 1099511628211ULL;
+		for(p = (unsigned char *)line; *p; p++)
+			hash = (hash ^ *p) * 1099511628211ULL;
+		if(tun->output_last_valid && hash == tun->output_last_hash)
 			{
-			if(strlen(line + j) >= len && strncasecmp(line + j, magic_words[i], len) == 0)
-				{
-				stl(STL_ERROR, TUNNEL_MODULE "Magic words \"%s\" discovered in tunnel output!", tun->id, magic_words[i]);
-				tun->condemned = TRUE;
-				}
+			tun->output_repeats++;
+			return FALSE;
+			}
+		if(tun->output_repeats > 0)
+			{
+			stl(STL_INFO, TUNNEL_MODULE "Last line of output repeated %u more time(s).", tun->id, tun->output_repeats);
+			tun->output_repeats = 0;
+			}
+		tun->output_last_hash = hash;
+		tun->output_last_valid = TRUE;
+		}
+	
+	if(tun->options.output_rate > 0)
+		{
+		now = time_monotonic_ms();
+		tun->output_tokens = tun->output_tokens + ((double)(now - tun->output_refilled) * tun->options.output_rate / 1000.0);
+		if(tun->output_tokens > tun->options.output_burst)
+			tun->output_tokens = tun->options.output_burst;
+		tun->output_refilled = now;
+		if(tun->output_tokens < 1.0)
+			{
+			tun->output_suppressed++;
+			return FALSE;
+			}
+		tun->output_tokens = tun->output_tokens - 1.0;
+		if(tun->output_suppressed > 0)
+			{
+			stl(STL_WARNING, TUNNEL_MODULE "%u line(s) of output were not logged because of the output rate limit.", tun->id, tun->output_suppressed);
+			tun->output_suppressed = 0;
 			}
 		}
+	
+	return TRUE;
+	}
+
+//Logs anything tunnel_output_allowed() is still sitting on, and forgets the previous line.
+void tunnel_output_flush(struct tunnel *tun)
+	{
+	if(tun->output_repeats > 0)
+		stl(STL_INFO, TUNNEL_MODULE "Last line of output repeated %u more time(s).", tun->id, tun->output_repeats);
+	if(tun->output_suppressed > 0)
+		stl(STL_WARNING, TUNNEL_MODULE "%u line(s) of output were not logged because of the output rate limit.", tun->id, tun->output_suppressed);
+	tun->output_repeats = 0;
+	tun->output_suppressed = 0;
+	tun->output_last_valid = FALSE;
 	}
 
+void tunnel_check_magic_words(char *line, struct tunnel *tun)
+	{
+	magic_scan(tun->options.magic_words, line, tunnel_magic_word, tun);
+	}
+
+//magic_scan() handler: a magic word turned up in this tunnel's output.
+void tunnel_magic_word(struct magic_word *word, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	word->count++;
+	if(word->action == MAGIC_ACTION_COUNT)
+		return;
+	
+	stl(word->severity, TUNNEL_MODULE "Magic words \"%s\" discovered in tunnel output!", tun->id, word->pattern);
+	if(word->action == MAGIC_ACTION_CONDEMN)
+		tunnel_condemn(tun);
+	}
+
+//Logs (and resets) the number of times each magic word has turned up.
+void tunnel_magic_report(struct tunnel *tun)
+	{
+	struct magic_matcher *m = tun->options.magic_words;
+	int i;
+	
+	if(m == NULL)
+		return;
+	for(i = 0; i < m->words_len; i++)
+		{
+		if(m->words[i].count == 0)
+			continue;
+		stl(STL_INFO, TUNNEL_MODULE "Magic words \"%s\" turned up %u time(s).", tun->id, m->words[i].pattern, m->words[i].count);
+		m->words[i].count = 0;
+		}
+	}
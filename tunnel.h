@@ -29,28 +29,150 @@
 #include <math.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "backoff.h"
+#include "capture.h"
+#include "env.h"
+#include "event.h"
+#include "histogram.h"
+#include "linebuf.h"
+#include "magic.h"
+#include "main.h"
+#include "rto.h"
+
+//Per-tunnel settings from the configuration file.
+struct tunnel_options
+	{
+	int uptoken_enabled, uptoken_protocol, uptoken_loss_threshold;
+	int64_t uptoken_interval, uptoken_timeout, uptoken_max_latency; //Milliseconds.
+	int uptoken_adaptive; //Protocol 2 only. If TRUE, uptoken_timeout is just where the timeout starts out, and it follows the measured round trip times from there.
+	int64_t uptoken_timeout_min, uptoken_timeout_max; //Milliseconds. Bounds for the adaptive timeout.
+	struct magic_matcher *magic_words; //The tunnel takes ownership of this when it's created.
+	int output_collapse; //Collapse consecutive identical lines of output into a "repeated" count?
+	double output_rate, output_burst; //Lines of output logged per second (0 for no limit), and how many may be logged at once.
+	char *output_file; //Output goes straight to this file instead of the log, or NULL.
+	int output_scan; //With output_file, still check the output for magic words?
+	int launch_priority; //Tunnels with higher priority are launched first when several are waiting.
+	struct backoff_options backoff;
+	int standby; //STANDBY_* (See standby.h.)
+	int64_t standby_latency; //Milliseconds. An uptoken slower than this counts as degraded. (0 for no limit.)
+	char *standby_handoff; //Program run when a standby instance takes over, or NULL.
+	int64_t shutdown_grace; //Milliseconds the process has to exit after SIGTERM when we're shutting down, before it gets SIGKILL.
+	};
+
+//A v2 uptoken probe which has been sent to the far end.
+struct uptoken_probe
+	{
+	uint32_t seq;
+	int64_t sent, deadline;
+	int outstanding, urgent; //Urgent probes were sent out of cycle, and condemn the tunnel on their own if they're lost.
+	};
+
+//A tunnel process which was sent SIGTERM at shutdown, and hasn't been reaped yet.
+struct tunnel_stopping
+	{
+	struct tunnel *tun;
+	pid_t pid;
+	int64_t deadline; //Milliseconds. (Monotonic clock.) When it gets SIGKILL, or after that, when we give up on it.
+	int killed;
+	};
+
+#define UPTOKEN_PROBES_INFLIGHT 8 //Most v2 probes that can be waiting for a reply at once.
+#define UPTOKEN_LOSS_WINDOW 16 //The loss threshold applies to this many of the most recent v2 probes.
 
 struct tunnel
 	{
 	int id;
-	char **argv, **envp;
+	char **argv, **env; //The tunnel's own <ProgramEnvironment> variables. (Overlaid on env_base.)
+	struct env_base *env_base;
+	char **envp; //The merged environment, built when the tunnel is first launched.
+	struct tunnel_options options;
 	pid_t pid;
 	int pipe_stdin[2], pipe_stdout[2], pipe_stderr[2];
-	int uptoken_enabled;
 	signed char uptoken;
-	time_t pid_launched, uptoken_sent, uptoken_interval, trouble_launchnext;
-	int trouble, condemned;
+	int64_t pid_launched, uptoken_sent, uptoken_next_send; //Milliseconds. (Monotonic clock.)
+	int trouble, condemned; //Trouble is the number of times the process has gone down since it was last stable.
+	struct backoff backoff;
+	int64_t network_changed; //Milliseconds. (Monotonic clock.) When the network last changed under this tunnel, or 0.
+	struct event_loop *loop;
+	struct event_timer launch_timer, uptoken_timer, trouble_timer, report_timer;
+	struct histogram uptoken_rtt;
+	struct rto uptoken_rto; //Kept across relaunches, since the next process will most likely take the same path.
+	struct uptoken_probe probes[UPTOKEN_PROBES_INFLIGHT];
+	uint32_t probe_seq, probe_history, probes_sent, probes_lost, probes_late, probes_stray;
+	int uptoken_protocol_acked;
+	struct linebuf stdout_lines, stderr_lines; //The child's output. Only holds any memory while there's a child process to read from.
+	uint64_t output_last_hash;
+	int output_last_valid;
+	uint32_t output_repeats, output_suppressed;
+	double output_tokens;
+	int64_t output_refilled; //Milliseconds. (Monotonic clock.)
+	struct capture capture;
+	//The launch_* fields and confirm_timer belong to the launch queue's thread. Everything else belongs to the thread running tunnel->loop.
+	int launch_heap_index, launch_starting; //Position in the launch queue (-1 while not queued), and whether we count against its concurrency limit.
+	uint32_t launch_sequence;
+	int64_t launch_granted; //Milliseconds. (Monotonic clock.) When the launch queue last let the tunnel through.
+	struct event_timer confirm_timer;
+	int launch_unconfirmed; //The tunnel's own copy of launch_starting: the launch queue still has to hear that it's up.
+	//With Standby, the tunnel's other instance. The two take turns being in use, and both run on the same loop.
+	struct tunnel *partner;
+	int standby; //TRUE while this is the instance which isn't in use.
+	int handoff_waiting, handoff_pending; //Waiting for the partner to take over, and taken over from while the process was still running.
+	pid_t handoff_from; //The process the partner was running when this instance took over from it.
+	struct event_timer handoff_timer;
 	};
 
-#define TUNNEL_TROUBLEMAX 8
-#define TUNNEL_TROUBLERESETTIME 300
+#define TUNNEL_MODULE "Tunnel %d: "
+#define TUNNEL_PIDTABLE_INITIAL 64 //Must be a power of two.
+#define TUNNEL_SLAB_SIZE 64 //Tunnels are allocated this many at a time.
+#define TUNNEL_RTT_REPORT_INTERVAL 300
+#define TUNNEL_OUTPUT_BURST_DEFAULT 100
+#define TUNNEL_NETWORK_CHANGE_WINDOW 30 //Seconds after a network change during which an exit doesn't count as trouble.
+#define TUNNEL_SHUTDOWN_GRACE_DEFAULT 5 //Seconds.
+#define TUNNEL_SHUTDOWN_GRACE_MAXIMUM 3600 //Seconds.
+#define TUNNEL_SHUTDOWN_KILL_WAIT 1 //Seconds we wait for a process to go away after SIGKILL, before leaving it behind.
+#define TUNNEL_SHUTDOWN_POLL_INTERVAL 50 //Milliseconds between checks for exited processes at shutdown, when there's no signal pipe to wake us.
 
-struct tunnel *tunnel_create(char **argv, char **envp, int uptoken_enabled, time_t uptoken_interval);
-int tunnel_maintenance(struct tunnel *tun);
+void tunnel_options_default(struct tunnel_options *options);
+struct tunnel *tunnel_create(char **argv, char **env, struct env_base *env_base, struct tunnel_options *options, struct event_loop *loop);
+int tunnel_start(struct tunnel *tun);
+int tunnel_launch_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int tunnel_launch(struct tunnel *tun);
+int tunnel_launch_call(struct event_loop *loop, void *data, int64_t value);
+int tunnel_trouble_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int tunnel_report_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+void tunnel_condemn(struct tunnel *tun);
+void tunnel_terminate(struct tunnel *tun);
+int tunnel_notify_network_changed(struct tunnel *tun, int condemn, int64_t timeout);
+int tunnel_network_changed_call(struct event_loop *loop, void *data, int64_t value);
+int tunnel_network_changed(struct tunnel *tun, int condemn, int64_t timeout);
+int tunnel_reap_children(void);
+int tunnel_exited_call(struct event_loop *loop, void *data, int64_t value);
+int tunnel_exited(struct tunnel *tun, int tunnel_status);
+int tunnel_schedule_relaunch(struct tunnel *tun);
+int tunnel_pid_insert(struct tunnel *tun);
+struct tunnel *tunnel_find_by_pid(pid_t pid);
+void tunnel_pid_remove(struct tunnel *tun);
+void tunnel_stop_all(int fd_wake);
 void tunnel_destroy(struct tunnel *tun);
+int tunnel_count(void);
+struct tunnel *tunnel_by_id(int id);
+void tunnel_table_free(void);
 int tunnel_process_launch(struct tunnel *tun);
-int tunnel_check_stderr(int fd, char *logline_prefix, struct tunnel *tun);
+int tunnel_process_spawn(struct tunnel *tun);
+int tunnel_watch(struct tunnel *tun);
+void tunnel_unwatch(struct tunnel *tun);
+int tunnel_output_event(struct event_loop *loop, int fd, int events, void *data);
+int tunnel_capture_event(struct event_loop *loop, int fd, int events, void *data);
+void tunnel_capture_report(struct tunnel *tun);
+void tunnel_output_line(struct tunnel *tun, char *stream, char *line);
+int tunnel_output_allowed(struct tunnel *tun, char *stream, char *line);
+void tunnel_output_flush(struct tunnel *tun);
 void tunnel_check_magic_words(char *line, struct tunnel *tun);
+void tunnel_magic_word(struct magic_word *word, void *data);
+void tunnel_magic_report(struct tunnel *tun);
 
 #define __SSHTUNNELS_TUNNEL_H
 #endif
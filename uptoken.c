@@ -0,0 +1,438 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * uptoken.c
+ *     - UpToken sender. Checks that tunnels are really up by bouncing tokens off of UpTokenReceiver.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+#include "uptoken.h"
+#include "main.h"
+#include "log.h"
+#include "util.h"
+#include "launch.h"
+#include "standby.h"
+
+//Resets the uptoken state for a freshly launched child process, sends the header, and schedules the first uptoken.
+//Returns TRUE on success or FALSE on error.
+int uptoken_start(struct tunnel *tun)
+	{
+	int64_t now = time_monotonic_ms();
+	
+	tun->uptoken = -1;
+	tun->uptoken_sent = 0;
+	tun->uptoken_next_send = now;
+	tun->uptoken_protocol_acked = 0;
+	memset(tun->probes, 0, sizeof(tun->probes));
+	tun->probe_history = 0;
+	tun->probes_sent = 0;
+	tun->probes_lost = 0;
+	tun->probes_late = 0;
+	tun->probes_stray = 0;
+	histogram_reset(&tun->uptoken_rtt);
+	
+	//Start from what the last process measured, within the bounds we have now.
+	rto_settle(&tun->uptoken_rto, tun->options.uptoken_timeout_min, tun->options.uptoken_timeout_max);
+	
+	if(!uptoken_send_header(tun))
+		return FALSE;
+	
+	//Send the first uptoken right away.
+	return event_timer_schedule(tun->loop, &tun->uptoken_timer, now);
+	}
+
+//Returns TRUE on success or FALSE on error.
+int uptoken_send_header(struct tunnel *tun)
+	{
+	char uptoken_header[UPTOKEN_HEADER_BUFFER_SIZE];
+	int interval_seconds, receiver_timeout, receiver_grace;
+	
+	//The header carries the interval in whole seconds. Round up so the far end is never stricter than we are.
+	interval_seconds = (int)((tun->options.uptoken_interval + 999) / 1000);
+	if(tun->options.uptoken_protocol >= 2)
+		{
+		//The receiver should hang on for as long as we would before condemning the tunnel.
+		//Once we've measured the link, its slack for a late probe can follow the link too, instead of the usual grace period.
+		receiver_timeout = (int)((tun->options.uptoken_interval * tun->options.uptoken_loss_threshold) + uptoken_current_timeout(tun));
+		if(tun->options.uptoken_adaptive && tun->uptoken_rto.samples > 0)
+			receiver_grace = (int)tun->uptoken_rto.timeout;
+		else
+			receiver_grace = UPTOKEN_INTERVAL_GRACEPERIOD * 1000;
+		snprintf(uptoken_header, UPTOKEN_HEADER_BUFFER_SIZE, UPTOKEN_HEADER_FORMAT_V2, UPTOKEN_HEADER_VERSION, interval_seconds, tun->options.uptoken_protocol, receiver_timeout, receiver_grace);
+		}
+	else
+		snprintf(uptoken_header, UPTOKEN_HEADER_BUFFER_SIZE, UPTOKEN_HEADER_FORMAT, UPTOKEN_HEADER_VERSION, interval_seconds);
+	
+	if(!uptoken_write(tun, uptoken_header))
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "failed writing uptoken header!", tun->id);
+		return FALSE;
+		}
+	//stl(STL_INFO, "Sent header: %s", uptoken_header);
+	return TRUE;
+	}
+
+//How long a v2 probe sent now has to come back, in milliseconds.
+int64_t uptoken_current_timeout(struct tunnel *tun)
+	{
+	if(tun->options.uptoken_adaptive)
+		return tun->uptoken_rto.timeout;
+	return tun->options.uptoken_timeout;
+	}
+
+//The adaptive timeout has grown. Probes already in flight are on the same link, so they get the extra time too.
+void uptoken_extend_deadlines(struct tunnel *tun)
+	{
+	int i;
+	
+	for(i = 0; i < UPTOKEN_PROBES_INFLIGHT; i++)
+		{
+		if(tun->probes[i].outstanding && !tun->probes[i].urgent && tun->probes[i].deadline < tun->probes[i].sent + tun->uptoken_rto.timeout)
+			tun->probes[i].deadline = tun->probes[i].sent + tun->uptoken_rto.timeout;
+		}
+	}
+
+//Timer handler: check on the uptokens we've sent, then send the next one.
+int uptoken_timer(struct event_loop *loop, struct event_timer *timer, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	
+	if(!tun->pid || tun->condemned || tun->pipe_stdin[PIPE_WRITE] < 0 || tun->pipe_stdout[PIPE_READ] < 0)
+		return TRUE;
+	
+	if(tun->options.uptoken_protocol >= 2)
+		return uptoken_timer_v2(tun, time_monotonic_ms());
+	return uptoken_timer_v1(tun, time_monotonic_ms());
+	}
+
+//Protocol 1: A single random printable character is in flight at a time, and it must come back before the next one is sent.
+//Returns TRUE on success or FALSE on error.
+int uptoken_timer_v1(struct tunnel *tun, int64_t now)
+	{
+	char uptoken_string[UPTOKEN_BUFFER_SIZE];
+	float rnum;
+	
+	//Replies are picked up by uptoken_event() as soon as they arrive. If the last uptoken is still outstanding, the far end is too late.
+	if(tun->uptoken > 0)
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "uptoken did not come back within %d ms!", tun->id, (int)tun->options.uptoken_interval);
+		tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+		return TRUE;
+		}
+	
+	//Choose an uptoken. (ASCII 33-126)
+	rnum = (float)rand() / (float)RAND_MAX;
+	rnum = roundf(rnum * 93.0);
+	tun->uptoken = (signed char)rnum + (signed char)33;
+	sprintf(uptoken_string, "%c\n", (char)tun->uptoken);
+	if(!uptoken_write(tun, uptoken_string))
+		{
+		tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+		return TRUE;
+		}
+	
+	//Uptoken sent!
+	//stl(STL_INFO, TUNNEL_MODULE "uptoken (%c) sent to far end.", tun->id, (char)tun->uptoken);
+	tun->uptoken_sent = now;
+	
+	//Come back when the far end has had uptoken_interval milliseconds to reply.
+	return event_timer_schedule(tun->loop, &tun->uptoken_timer, tun->uptoken_sent + tun->options.uptoken_interval);
+	}
+
+//Protocol 2: Sequence-numbered probes go out every interval whether or not earlier ones have come back.
+//A probe is lost if it isn't answered within the timeout (or uptoken_max_latency), and the tunnel is only condemned
+//once uptoken_loss_threshold of the last UPTOKEN_LOSS_WINDOW probes have been lost.
+//Returns TRUE on success or FALSE on error.
+int uptoken_timer_v2(struct tunnel *tun, int64_t now)
+	{
+	char probe[UPTOKEN_HEADER_BUFFER_SIZE];
+	struct uptoken_probe *slot;
+	int64_t wake;
+	int i;
+	
+	//Any probe which has gone unanswered for too long counts as lost.
+	for(i = 0; i < UPTOKEN_PROBES_INFLIGHT; i++)
+		{
+		if(tun->probes[i].outstanding && now >= tun->probes[i].deadline)
+			{
+			tun->probes[i].outstanding = FALSE;
+			stl(STL_WARNING, TUNNEL_MODULE "uptoken #%u did not come back within %d ms!", tun->id, tun->probes[i].seq, (int)(tun->probes[i].deadline - tun->probes[i].sent));
+			if(tun->probes[i].urgent)
+				{
+				tun->probes_lost++;
+				tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+				return TRUE;
+				}
+			if(!uptoken_probe_resolved(tun, TRUE))
+				return TRUE;
+			}
+		}
+	
+	if(now >= tun->uptoken_next_send)
+		{
+		slot = &tun->probes[tun->probe_seq % UPTOKEN_PROBES_INFLIGHT];
+		snprintf(probe, sizeof(probe), UPTOKEN_PROBE_FORMAT, tun->probe_seq, (long long)now);
+		if(!uptoken_write(tun, probe))
+			{
+			tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+			return TRUE;
+			}
+		slot->seq = tun->probe_seq;
+		slot->sent = now;
+		slot->deadline = now + uptoken_current_timeout(tun);
+		slot->outstanding = TRUE;
+		slot->urgent = FALSE;
+		tun->probe_seq++;
+		tun->probes_sent++;
+		tun->uptoken_sent = now;
+		tun->uptoken_next_send = now + tun->options.uptoken_interval;
+		}
+	
+	//Come back for the next probe, or the next deadline, whichever is sooner.
+	wake = tun->uptoken_next_send;
+	for(i = 0; i < UPTOKEN_PROBES_INFLIGHT; i++)
+		{
+		if(tun->probes[i].outstanding && tun->probes[i].deadline < wake)
+			wake = tun->probes[i].deadline;
+		}
+	return event_timer_schedule(tun->loop, &tun->uptoken_timer, wake);
+	}
+
+//Sends an uptoken right away, out of cycle, and condemns the tunnel unless it comes back within "timeout" milliseconds.
+//Returns TRUE on success or FALSE on error.
+int uptoken_probe_now(struct tunnel *tun, int64_t timeout)
+	{
+	int64_t now = time_monotonic_ms();
+	struct uptoken_probe *slot;
+	
+	if(!tun->pid || tun->condemned || tun->pipe_stdin[PIPE_WRITE] < 0 || tun->pipe_stdout[PIPE_READ] < 0)
+		return TRUE;
+	
+	if(tun->options.uptoken_protocol >= 2)
+		{
+		tun->uptoken_next_send = now;
+		if(!uptoken_timer_v2(tun, now))
+			return FALSE;
+		if(tun->condemned)
+			return TRUE;
+		slot = &tun->probes[(tun->probe_seq - 1) % UPTOKEN_PROBES_INFLIGHT];
+		if(slot->deadline > now + timeout)
+			slot->deadline = now + timeout;
+		slot->urgent = TRUE;
+		}
+	else if(tun->uptoken <= 0)
+		{
+		if(!uptoken_timer_v1(tun, now))
+			return FALSE;
+		}
+	
+	//Protocol 1 condemns the tunnel if its one uptoken is still outstanding when the timer goes off, whether or not we just sent it.
+	if(tun->uptoken_timer.when > now + timeout)
+		return event_timer_schedule(tun->loop, &tun->uptoken_timer, now + timeout);
+	return TRUE;
+	}
+
+//Event loop handler for the child's STDOUT when it's carrying uptoken replies.
+int uptoken_event(struct event_loop *loop, int fd, int events, void *data)
+	{
+	struct tunnel *tun = (struct tunnel *)data;
+	struct linebuf *lb = &tun->stdout_lines;
+	ssize_t readret;
+	int64_t now;
+	char *line;
+	int i;
+	
+	while((readret = linebuf_fill(lb, fd)) > 0)
+		{
+		now = time_monotonic_ms();
+		
+		//Protocol 1 replies are single characters, so there's no need to wait for the end of the line.
+		if(tun->options.uptoken_protocol < 2)
+			{
+			for(i = lb->start; i < lb->end && !tun->condemned; i++)
+				uptoken_reply_v1(tun, lb->data[i], now);
+			lb->start = lb->end;
+			continue;
+			}
+		
+		//Protocol 2 is line-based.
+		while(!tun->condemned && (line = linebuf_line(lb, FALSE)) != NULL)
+			uptoken_line_v2(tun, line, now);
+		}
+	if(readret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+		stl(STL_ERROR, TUNNEL_MODULE "uptoken read() failed! (%s)", tun->id, strerror(errno));
+		tunnel_condemn(tun);
+		}
+	
+	//The first uptoken back means the tunnel is really up, so it no longer holds up other tunnels waiting to launch.
+	if(tun->launch_unconfirmed && tun->uptoken_rtt.count > 0)
+		{
+		tun->launch_unconfirmed = FALSE;
+		if(!launch_confirmed(tun))
+			return FALSE;
+		standby_up(tun);
+		}
+	
+	//End of file. This usually means the child is exiting, and we'll hear about that through SIGCHLD. If it isn't, the uptoken deadline will catch it.
+	if(readret == 0 || (events & (EVENT_HANGUP | EVENT_ERROR)))
+		event_remove(loop, fd);
+	
+	return TRUE;
+	}
+
+void uptoken_reply_v1(struct tunnel *tun, char c, int64_t now)
+	{
+	if(c == '\n')
+		return;
+	
+	//Does the uptoken match?
+	if(tun->uptoken > 0 && c == (char)tun->uptoken)
+		{
+		//stl(STL_INFO, TUNNEL_MODULE "uptoken (%c) received from far end.", tun->id, (char)tun->uptoken);
+		histogram_record(&tun->uptoken_rtt, (uint32_t)(now - tun->uptoken_sent));
+		//Okay! Forget this uptoken so we can pick a new one next round.
+		tun->uptoken = -1;
+		}
+	else
+		{
+		//Oh dear! We got something unexpected back from the far end.
+		stl(STL_WARNING, TUNNEL_MODULE "uptoken does not match! The far end sent something strange.", tun->id);
+		tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+		}
+	}
+
+void uptoken_line_v2(struct tunnel *tun, char *line, int64_t now)
+	{
+	unsigned int seq;
+	long long sent;
+	int protocol, rtt;
+	struct uptoken_probe *slot;
+	
+	//A probe coming back?
+	if(sscanf(line, "#%u %lld", &seq, &sent) == 2)
+		{
+		if(tun->uptoken_protocol_acked == 0)
+			{
+			stl(STL_INFO, TUNNEL_MODULE "Far end didn't acknowledge UpToken protocol %d. It's probably an older UpTokenReceiver, which is fine.", tun->id, tun->options.uptoken_protocol);
+			tun->uptoken_protocol_acked = 1;
+			}
+		
+		slot = &tun->probes[seq % UPTOKEN_PROBES_INFLIGHT];
+		if(!slot->outstanding || slot->seq != seq)
+			{
+			//Already written off as lost. At least we know the link isn't completely dead, and the probe carries its send time, so
+			//it still tells us how slow the link has become. Without that, a timeout which is too short would never find out.
+			tun->probes_late++;
+			if(tun->options.uptoken_adaptive && sent > 0 && sent <= now)
+				{
+				rto_sample(&tun->uptoken_rto, now - sent, tun->options.uptoken_timeout_min, tun->options.uptoken_timeout_max);
+				uptoken_extend_deadlines(tun);
+				}
+			return;
+			}
+		
+		slot->outstanding = FALSE;
+		rtt = (int)(now - slot->sent);
+		histogram_record(&tun->uptoken_rtt, (uint32_t)rtt);
+		if(tun->options.uptoken_adaptive)
+			{
+			rto_sample(&tun->uptoken_rto, rtt, tun->options.uptoken_timeout_min, tun->options.uptoken_timeout_max);
+			uptoken_extend_deadlines(tun);
+			}
+		if(tun->options.uptoken_max_latency > 0 && rtt > tun->options.uptoken_max_latency)
+			{
+			stl(STL_WARNING, TUNNEL_MODULE "uptoken #%u took %d ms to come back, which is more than the %d ms allowed!", tun->id, seq, rtt, (int)tun->options.uptoken_max_latency);
+			uptoken_probe_resolved(tun, TRUE);
+			}
+		else if(uptoken_probe_resolved(tun, FALSE) && tun->options.standby_latency > 0 && rtt > tun->options.standby_latency)
+			{
+			stl(STL_WARNING, TUNNEL_MODULE "uptoken #%u took %d ms to come back, which is more than the %d ms StandbyLatency.", tun->id, seq, rtt, (int)tun->options.standby_latency);
+			if(!standby_degraded(tun))
+				stl(STL_ERROR, TUNNEL_MODULE "standby_degraded() failed!", tun->id);
+			}
+		return;
+		}
+	
+	//The receiver acknowledging the protocol?
+	if(sscanf(line, UPTOKEN_PROTOCOL_FIELD, &protocol) == 1)
+		{
+		stl(STL_INFO, TUNNEL_MODULE "Far end acknowledged UpToken protocol %d.", tun->id, protocol);
+		tun->uptoken_protocol_acked = protocol;
+		return;
+		}
+	
+	//Something else entirely. Protocol 1 would have condemned the tunnel for this, but one stray line doesn't mean the link is down.
+	tun->probes_stray++;
+	stl(STL_WARNING, TUNNEL_MODULE "Ignoring unexpected output from the far end: %s", tun->id, line);
+	}
+
+//Records the outcome of a v2 probe, and condemns the tunnel if too many recent probes have been lost.
+//Returns FALSE if the tunnel was condemned, TRUE otherwise.
+int uptoken_probe_resolved(struct tunnel *tun, int lost)
+	{
+	uint32_t recent;
+	int lost_count = 0;
+	
+	tun->probe_history = (tun->probe_history << 1) | (lost ? 1 : 0);
+	if(!lost)
+		return TRUE;
+	
+	tun->probes_lost++;
+	if(!standby_degraded(tun))
+		stl(STL_ERROR, TUNNEL_MODULE "standby_degraded() failed!", tun->id);
+	if(tun->condemned) //The standby took over.
+		return FALSE;
+	for(recent = tun->probe_history & ((1U << UPTOKEN_LOSS_WINDOW) - 1); recent; recent = recent & (recent - 1))
+		lost_count++;
+	if(lost_count >= tun->options.uptoken_loss_threshold)
+		{
+		stl(STL_WARNING, TUNNEL_MODULE "%d of the last %d uptokens were lost!", tun->id, lost_count, UPTOKEN_LOSS_WINDOW);
+		tunnel_condemn(tun); //Mark this tunnel process as condemned by the uptoken system.
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Writes a complete uptoken line to the child. The pipe is non-blocking, so a child which has stopped reading can't stall us.
+//Returns TRUE on success or FALSE on error.
+int uptoken_write(struct tunnel *tun, char *buf)
+	{
+	ssize_t ioret;
+	
+	if((ioret = write_all(tun->pipe_stdin[PIPE_WRITE], buf, strlen(buf))) != strlen(buf))
+		{
+		if(ioret == -1)
+			stl(STL_ERROR, TUNNEL_MODULE "uptoken write() failed! (%s)", tun->id, strerror(errno));
+		else //Couldn't write enough bytes, but no reported error.
+			stl(STL_ERROR, TUNNEL_MODULE "uptoken write() failed for unknown reason!", tun->id);
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+void uptoken_report(struct tunnel *tun)
+	{
+	if(tun->uptoken_rtt.count > 0)
+		stl(STL_INFO, TUNNEL_MODULE "uptoken round trip times over %u uptokens: p50 %u ms, p99 %u ms, max %u ms.", tun->id, tun->uptoken_rtt.count, histogram_percentile(&tun->uptoken_rtt, 50), histogram_percentile(&tun->uptoken_rtt, 99), tun->uptoken_rtt.max);
+	if(tun->options.uptoken_protocol >= 2 && tun->probes_sent > 0)
+		stl(STL_INFO, TUNNEL_MODULE "%u uptokens sent, %u lost, %u came back late, %u lines of unexpected output.", tun->id, tun->probes_sent, tun->probes_lost, tun->probes_late, tun->probes_stray);
+	if(tun->options.uptoken_adaptive && tun->uptoken_rto.samples > 0)
+		stl(STL_INFO, TUNNEL_MODULE "uptoken timeout is %d ms. (Smoothed round trip time %d ms, deviation %d ms.)", tun->id, (int)tun->uptoken_rto.timeout, (int)rto_srtt(&tun->uptoken_rto), (int)rto_rttvar(&tun->uptoken_rto));
+	}
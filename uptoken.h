@@ -0,0 +1,47 @@
+/*
+ * SSHTunnels - A program for generating and maintaining SSH Tunnels
+ *
+ * uptoken.h
+ *     - UpToken sender. Checks that tunnels are really up by bouncing tokens off of UpTokenReceiver.
+ *
+ * Copyright (C) 2015 Alex Markley
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ */
+
+//Only process this header once.
+#ifndef __SSHTUNNELS_UPTOKEN_H
+
+#include "tunnel.h"
+
+int uptoken_start(struct tunnel *tun);
+int uptoken_send_header(struct tunnel *tun);
+int64_t uptoken_current_timeout(struct tunnel *tun);
+void uptoken_extend_deadlines(struct tunnel *tun);
+int uptoken_timer(struct event_loop *loop, struct event_timer *timer, void *data);
+int uptoken_timer_v1(struct tunnel *tun, int64_t now);
+int uptoken_timer_v2(struct tunnel *tun, int64_t now);
+int uptoken_probe_now(struct tunnel *tun, int64_t timeout);
+int uptoken_event(struct event_loop *loop, int fd, int events, void *data);
+void uptoken_reply_v1(struct tunnel *tun, char c, int64_t now);
+void uptoken_line_v2(struct tunnel *tun, char *line, int64_t now);
+int uptoken_probe_resolved(struct tunnel *tun, int lost);
+int uptoken_write(struct tunnel *tun, char *buf);
+void uptoken_report(struct tunnel *tun);
+
+#define __SSHTUNNELS_UPTOKEN_H
+#endif
+
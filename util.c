@@ -22,10 +22,22 @@
  * 
  */
 
+//For pipe2() and close_range().
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "util.h"
 #include "main.h"
 #include "log.h"
 
+#include <dirent.h>
+#include <sys/socket.h>
+
+#ifdef __APPLE__
+mach_timebase_info_data_t time_monotonic_timebase = { 0, 0 }; //Filled in by the first call to time_monotonic_ms().
+#endif
+
 //Behavior identical to the write() function, except that it will try very hard to write count bytes.
 ssize_t write_all(int fd, const void *buf, size_t count)
 	{
@@ -82,20 +94,21 @@ ssize_t read_all(int fd, void *buf, size_t count)
 
 //Sets up a total of three pipes for STDIN, STDOUT, and STDERR.
 //This is so that a new child process's standard I/O can be captured by the parent process.
+//All of the pipes are close-on-exec, so that a child process only ends up with its own three and not every other tunnel's.
 //Returns TRUE on success or FALSE on error.
 int stdpipes_create(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
 	{
-	if(pipe(pipe_stdin) < 0)
+	if(pipe_cloexec(pipe_stdin) < 0)
 		{
 		stl(STL_ERROR, "stdpipes_create: Call to pipe() for stdin failed! (%s)", strerror(errno));
 		return FALSE;
 		}
-	if(pipe(pipe_stdout) < 0)
+	if(pipe_cloexec(pipe_stdout) < 0)
 		{
 		stl(STL_ERROR, "stdpipes_create: Call to pipe() for stdout failed! (%s)", strerror(errno));
 		return FALSE;
 		}
-	if(pipe(pipe_stderr) < 0)
+	if(pipe_cloexec(pipe_stderr) < 0)
 		{
 		stl(STL_ERROR, "stdpipes_create: Call to pipe() for stderr failed! (%s)", strerror(errno));
 		return FALSE;
@@ -103,6 +116,42 @@ int stdpipes_create(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
 	return TRUE;
 	}
 
+//Behavior identical to the pipe() function, except that both ends are close-on-exec and never take the place of STDIN, STDOUT or STDERR.
+//(If we were started without those, a pipe landing on one of them would get clobbered when a child process sets up its own.)
+int pipe_cloexec(int *fds)
+	{
+	int i, fd;
+	
+	#ifdef __linux__
+	if(pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	#else
+	if(pipe(fds) < 0)
+		return -1;
+	if(!fd_set_cloexec(fds[PIPE_READ]) || !fd_set_cloexec(fds[PIPE_WRITE]))
+		{
+		close(fds[PIPE_READ]);
+		close(fds[PIPE_WRITE]);
+		return -1;
+		}
+	#endif
+	
+	for(i = 0; i < 2; i++)
+		{
+		if(fds[i] > STDERR_FILENO)
+			continue;
+		if((fd = fcntl(fds[i], F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) < 0)
+			{
+			close(fds[PIPE_READ]);
+			close(fds[PIPE_WRITE]);
+			return -1;
+			}
+		close(fds[i]);
+		fds[i] = fd;
+		}
+	return 0;
+	}
+
 //Closes the far ends of the standard pipes. For parent process.
 //Returns TRUE on success or FALSE on error.
 int stdpipes_close_far_end_parent(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
@@ -128,49 +177,25 @@ int stdpipes_close_far_end_parent(int *pipe_stdin, int *pipe_stdout, int *pipe_s
 	return TRUE;
 	}
 
-//Closes the far ends of the standard pipes. For child process.
-//Returns TRUE on success or FALSE on error.
-int stdpipes_close_far_end_child(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
-	{
-	if(close(pipe_stdin[PIPE_WRITE]) < 0)
-		{
-		stl(STL_ERROR, "stdpipes_close_far_end_child: Call to close() for stdin write failed! (%s)", strerror(errno));
-		return FALSE;
-		}
-	pipe_stdin[PIPE_WRITE] = -1;
-	if(close(pipe_stdout[PIPE_READ]) < 0)
-		{
-		stl(STL_ERROR, "stdpipes_close_far_end_child: Call to close() for stdout read failed! (%s)", strerror(errno));
-		return FALSE;
-		}
-	pipe_stdout[PIPE_READ] = -1;
-	if(close(pipe_stderr[PIPE_READ]) < 0)
-		{
-		stl(STL_ERROR, "stdpipes_close_far_end_child: Call to close() for stderr read failed! (%s)", strerror(errno));
-		return FALSE;
-		}
-	pipe_stderr[PIPE_READ] = -1;
-	return TRUE;
-	}
-
-//Closes original STDIN, STDOUT, and STDERR and replaces them with the previously opened pipes.
-//It might go without saying, but this should only be called in the child process, usually before a call to execve()
+//Adds the file actions which replace a new child process's STDIN, STDOUT, and STDERR with the previously opened pipes.
+//Everything else we have open is close-on-exec, so the child won't see any of the other pipe ends.
 //Returns TRUE on success or FALSE on error.
-int stdpipes_replace(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
+int stdpipes_spawn_actions(posix_spawn_file_actions_t *actions, int *pipe_stdin, int *pipe_stdout, int *pipe_stderr)
 	{
-	if(dup2(pipe_stdin[PIPE_READ], STDIN_FILENO) < 0)
+	int error;
+	if((error = posix_spawn_file_actions_adddup2(actions, pipe_stdin[PIPE_READ], STDIN_FILENO)) != 0)
 		{
-		stl(STL_ERROR, "stdpipes_replace: Call to dup2() for stdin failed! (%s)", strerror(errno));
+		stl(STL_ERROR, "stdpipes_spawn_actions: Call to posix_spawn_file_actions_adddup2() for stdin failed! (%s)", strerror(error));
 		return FALSE;
 		}
-	if(dup2(pipe_stdout[PIPE_WRITE], STDOUT_FILENO) < 0)
+	if((error = posix_spawn_file_actions_adddup2(actions, pipe_stdout[PIPE_WRITE], STDOUT_FILENO)) != 0)
 		{
-		stl(STL_ERROR, "stdpipes_replace: Call to dup2() for stdout failed! (%s)", strerror(errno));
+		stl(STL_ERROR, "stdpipes_spawn_actions: Call to posix_spawn_file_actions_adddup2() for stdout failed! (%s)", strerror(error));
 		return FALSE;
 		}
-	if(dup2(pipe_stderr[PIPE_WRITE], STDERR_FILENO) < 0)
+	if((error = posix_spawn_file_actions_adddup2(actions, pipe_stderr[PIPE_WRITE], STDERR_FILENO)) != 0)
 		{
-		stl(STL_ERROR, "stdpipes_replace: Call to dup2() for stderr failed! (%s)", strerror(errno));
+		stl(STL_ERROR, "stdpipes_spawn_actions: Call to posix_spawn_file_actions_adddup2() for stderr failed! (%s)", strerror(error));
 		return FALSE;
 		}
 	return TRUE;
@@ -204,6 +229,53 @@ int stdpipes_close_remaining(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr
 	return TRUE;
 	}
 
+//Sets a file descriptor's close-on-exec flag.
+//Returns TRUE on success or FALSE on error.
+int fd_set_cloexec(int fd)
+	{
+	int fd_flags;
+	fd_flags = fcntl(fd, F_GETFD, 0);
+	if(fd_flags < 0 || fcntl(fd, F_SETFD, fd_flags | FD_CLOEXEC) < 0)
+		{
+		stl(STL_ERROR, "fd_set_cloexec: Call to fcntl() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	return TRUE;
+	}
+
+//Marks every descriptor above STDERR close-on-exec, so that tunnel processes don't inherit whatever our own parent left open.
+//Everything we open ourselves is close-on-exec already, so this only has to happen once, at startup, rather than in every spawn.
+//Returns TRUE on success or FALSE on error.
+int fd_cloexec_inherited(void)
+	{
+	struct dirent *entry;
+	int fd, ok = TRUE;
+	DIR *fds;
+	
+	#ifdef CLOSE_RANGE_CLOEXEC
+	//One call, where the kernel supports it. (Linux 5.11 and up.)
+	if(close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC) == 0)
+		return TRUE;
+	#endif
+	
+	//Otherwise go through the descriptors which are actually open, rather than every number up to the (possibly huge) limit.
+	if((fds = opendir("/dev/fd")) == NULL)
+		{
+		stl(STL_WARNING, "fd_cloexec_inherited: Call to opendir() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	while((entry = readdir(fds)) != NULL)
+		{
+		if(entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+		fd = atoi(entry->d_name);
+		if(fd > STDERR_FILENO && fd != dirfd(fds) && !fd_set_cloexec(fd))
+			ok = FALSE;
+		}
+	closedir(fds);
+	return ok;
+	}
+
 //Sets a file descriptor's non-blocking flag.
 //Returns TRUE on success or FALSE on error.
 int fd_set_nonblock(int fd)
@@ -218,6 +290,32 @@ int fd_set_nonblock(int fd)
 	return TRUE;
 	}
 
+//Raises our soft limit on open file descriptors as far as the hard limit allows.
+//Returns TRUE on success or FALSE on error.
+int fd_limit_raise(void)
+	{
+	struct rlimit limit;
+	rlim_t old_limit;
+	
+	if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+		{
+		stl(STL_WARNING, "fd_limit_raise: Call to getrlimit() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	if(limit.rlim_cur == limit.rlim_max)
+		return TRUE;
+	
+	old_limit = limit.rlim_cur;
+	limit.rlim_cur = limit.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &limit) != 0)
+		{
+		stl(STL_WARNING, "fd_limit_raise: Call to setrlimit() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	stl(STL_INFO, "Raised open file limit from %llu to %llu.", (unsigned long long)old_limit, (unsigned long long)limit.rlim_cur);
+	return TRUE;
+	}
+
 void *list_grow_insert(void *ptr, void *new_member, size_t member_size, int *list_len, int *list_pos)
 	{
 	size_t old_len;
@@ -226,7 +324,8 @@ void *list_grow_insert(void *ptr, void *new_member, size_t member_size, int *lis
 	while((*list_pos + 1) >= *list_len)
 		{
 		old_len = *list_len;
-		*list_len = *list_len + LIST_GROW_STEP;
+		//Double the list each time, so that long lists don't mean a realloc for every few members.
+		*list_len = *list_len ? *list_len * 2 : LIST_GROW_STEP;
 		if((ptr = realloc(ptr, member_size * (*list_len))) == NULL)
 			{
 			return ptr;
@@ -241,3 +340,158 @@ void *list_grow_insert(void *ptr, void *new_member, size_t member_size, int *lis
 	return ptr;
 	}
 
+
+//Returns the current time in milliseconds according to the monotonic clock.
+//This clock doesn't jump when the wall clock is changed, so it's the one to use for timeouts.
+int64_t time_monotonic_ms(void)
+	{
+	#ifdef __APPLE__
+	//clock_gettime() only arrived in iOS 10, and we still build against older SDKs. mach_absolute_time() counts ticks of a fixed
+	//length, and like CLOCK_MONOTONIC on Linux, it stands still while the device is asleep.
+	if(time_monotonic_timebase.denom == 0 && mach_timebase_info(&time_monotonic_timebase) != KERN_SUCCESS)
+		{
+		stl(STL_ERROR, "time_monotonic_ms: Call to mach_timebase_info() failed!");
+		return 0;
+		}
+	return (int64_t)((mach_absolute_time() * time_monotonic_timebase.numer / time_monotonic_timebase.denom) / 1000000);
+	#else
+	struct timespec ts;
+	if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		{
+		stl(STL_ERROR, "time_monotonic_ms: Call to clock_gettime() failed! (%s)", strerror(errno));
+		return 0;
+		}
+	return ((int64_t)ts.tv_sec * 1000) + ((int64_t)ts.tv_nsec / 1000000);
+	#endif
+	}
+
+//Sends count bytes over a Unix domain socket, along with fds_count file descriptors. (SCM_RIGHTS)
+//The receiving process gets its own copies of the file descriptors.
+//Returns the number of bytes sent, or -1 on error.
+ssize_t fd_pass_send(int sock, const void *buf, size_t count, const int *fds, int fds_count)
+	{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+		{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * FD_PASS_MAXIMUM)];
+		} control;
+	ssize_t sent;
+	
+	if(fds_count < 1 || fds_count > FD_PASS_MAXIMUM)
+		{
+		errno = EINVAL;
+		return -1;
+		}
+	
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = (void *)buf;
+	iov.iov_len = count;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds_count);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds_count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fds_count);
+	
+	while((sent = sendmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+	return sent;
+	}
+
+//Receives up to count bytes from a Unix domain socket, along with up to *fds_count file descriptors. (SCM_RIGHTS)
+//*fds_count is set to the number of file descriptors actually received. They're close-on-exec.
+//Returns the number of bytes received, 0 at end of file, or -1 on error.
+ssize_t fd_pass_recv(int sock, void *buf, size_t count, int *fds, int *fds_count)
+	{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union
+		{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * FD_PASS_MAXIMUM)];
+		} control;
+	ssize_t readret;
+	int received = 0, flags = 0, i, n, fd;
+	
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = count;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	
+	#ifdef MSG_CMSG_CLOEXEC
+	flags = MSG_CMSG_CLOEXEC;
+	#endif
+	while((readret = recvmsg(sock, &msg, flags)) < 0 && errno == EINTR);
+	if(readret < 0)
+		return readret;
+	
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+		for(i = 0; i < n; i++)
+			{
+			memcpy(&fd, CMSG_DATA(cmsg) + (sizeof(int) * i), sizeof(int));
+			//Whatever doesn't fit in the caller's array can't be used, so it's closed right away.
+			if(received < *fds_count)
+				{
+				fds[received++] = fd;
+				#ifndef MSG_CMSG_CLOEXEC
+				fd_set_cloexec(fd);
+				#endif
+				}
+			else
+				close(fd);
+			}
+		}
+	
+	//A truncated control message may have lost file descriptors the sender was counting on.
+	if(msg.msg_flags & MSG_CTRUNC)
+		{
+		for(i = 0; i < received; i++)
+			close(fds[i]);
+		*fds_count = 0;
+		errno = EMSGSIZE;
+		return -1;
+		}
+	
+	*fds_count = received;
+	return readret;
+	}
+
+//Looks up the user id of the process at the other end of a connected Unix domain socket.
+//Returns TRUE on success or FALSE on error.
+int socket_peer_uid(int sock, uid_t *uid)
+	{
+	#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	
+	if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		{
+		stl(STL_ERROR, "socket_peer_uid: Call to getsockopt(SO_PEERCRED) failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	*uid = cred.uid;
+	#else
+	gid_t gid;
+	
+	if(getpeereid(sock, uid, &gid) != 0)
+		{
+		stl(STL_ERROR, "socket_peer_uid: Call to getpeereid() failed! (%s)", strerror(errno));
+		return FALSE;
+		}
+	#endif
+	return TRUE;
+	}
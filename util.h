@@ -30,22 +30,37 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <time.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
 #define STRING_BUFFER_ALLOCSTEP 1024
+#define FD_PASS_MAXIMUM 4 //Most file descriptors passed in one message. (See fd_pass_send())
 #define LIST_GROW_STEP 8
 
 ssize_t write_all(int fd, const void *buf, size_t count);
 ssize_t read_all(int fd, void *buf, size_t count);
 int stdpipes_create(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
+int pipe_cloexec(int *fds);
 int stdpipes_close_far_end_parent(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
-int stdpipes_close_far_end_child(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
-int stdpipes_replace(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
+int stdpipes_spawn_actions(posix_spawn_file_actions_t *actions, int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
 int stdpipes_close_remaining(int *pipe_stdin, int *pipe_stdout, int *pipe_stderr);
+int fd_set_cloexec(int fd);
+int fd_cloexec_inherited(void);
 int fd_set_nonblock(int fd);
+int fd_limit_raise(void);
 void *list_grow_insert(void *ptr, void *new_member, size_t member_size, int *list_len, int *list_pos);
+int64_t time_monotonic_ms(void);
+ssize_t fd_pass_send(int sock, const void *buf, size_t count, const int *fds, int fds_count);
+ssize_t fd_pass_recv(int sock, void *buf, size_t count, int *fds, int *fds_count);
+int socket_peer_uid(int sock, uid_t *uid);
 
 #define __SSHTUNNELS_UTIL_H
 #endif